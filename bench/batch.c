@@ -0,0 +1,117 @@
+#include "bench.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <batch.h>
+#include <wire.h>
+#include <registry.h>
+#include <timer.h>
+#include <error.h>
+
+#define AGENTS 200
+#define ROUNDS 50 // per batch
+#define BATCHES 200
+#define PACKETS (AGENTS * ROUNDS)
+
+static agent_t agents[AGENTS];
+static uint32_t ids[AGENTS];
+static char names[AGENTS][32];
+static packet_t packets[PACKETS];
+static wirePacket_t decoded[PACKETS];
+
+static uint64_t state = 0x2545F4914F6CDD1Dull;
+
+static uint64_t nextRandom() {
+	state ^= state << 13;
+	state ^= state >> 7;
+	state ^= state << 17;
+	return state;
+}
+
+/*
+ * Every agent sends once per 10 s with a few ms of jitter: half of them
+ * counters (INT), half gauges with two decimals that mostly stay the same
+ * (DOUBLE), like load averages or temperatures.
+ */
+static void makePackets() {
+	for (int i = 0; i < AGENTS; i++) {
+		snprintf(names[i], sizeof(names[i]), "host-%03d.load", i);
+		memset(&(agents[i]), 0, sizeof(agent_t));
+		agents[i].name = names[i];
+		agents[i].data = DATA_VALUE;
+		agents[i].type = i % 2 == 0 ? INT : DOUBLE;
+		ids[i] = registerAgent(&(agents[i]));
+	}
+	int32_t counters[AGENTS] = {0};
+	double gauges[AGENTS] = {0};
+	for (int round = 0; round < ROUNDS; round++) {
+		for (int i = 0; i < AGENTS; i++) {
+			packet_t* packet = &(packets[round * AGENTS + i]);
+			memset(packet, 0, sizeof(packet_t));
+			packet->agent = ids[i];
+			packet->data = DATA_VALUE;
+			packet->type = agents[i].type;
+			packet->class = INFO;
+			packet->time = 1700000000000ull + round * 10000ull + i * 3 + nextRandom() % 3;
+			if (packet->type == INT) {
+				counters[i] += nextRandom() % 1000;
+				packet->value.integer = counters[i];
+				packet->size = sizeof(int32_t);
+			} else {
+				if (nextRandom() % 4 == 0)
+					gauges[i] = (int) (nextRandom() % 400) / 100.0;
+				packet->value.real = gauges[i];
+				packet->size = sizeof(double);
+			}
+		}
+	}
+}
+
+bool batchBenchmark() {
+	makePackets();
+	printf("%s%d batches of %d samples (%d agents).\n", SUBSPACING, BATCHES, PACKETS, AGENTS);
+
+	size_t bytes = 0;
+	wireFrame_t frame;
+	unsigned long long start = getRelativeTime();
+	for (int i = 0; i < BATCHES; i++)
+		for (int j = 0; j < PACKETS; j++)
+			bytes += wireEncode(&(packets[j]), &frame);
+	double wire = (getRelativeTime() - start) / 1e9;
+	double wireBytes = (double) bytes / BATCHES / PACKETS;
+
+	batch_t batch;
+	batchInit(&batch);
+	bytes = 0;
+	start = getRelativeTime();
+	for (int i = 0; i < BATCHES; i++) {
+		if (batchEncode(&batch, packets, PACKETS) < 0) {
+			printf("%s%sError: %s\n", SUBSPACING, SUBSPACING, error);
+			batchDestroy(&batch);
+			return false;
+		}
+		bytes += batch.length;
+	}
+	double columnar = (getRelativeTime() - start) / 1e9;
+	double columnarBytes = (double) bytes / BATCHES / PACKETS;
+
+	start = getRelativeTime();
+	for (int i = 0; i < BATCHES; i++) {
+		if (batchDecode(batch.buffer, batch.length, decoded, PACKETS) != PACKETS) {
+			printf("%s%sError: %s\n", SUBSPACING, SUBSPACING, error);
+			batchDestroy(&batch);
+			return false;
+		}
+	}
+	double decoding = (getRelativeTime() - start) / 1e9;
+	batchDestroy(&batch);
+
+	printf("%swire     %6.1f bytes/sample %6.1f ns/sample to encode\n", SUBSPACING,
+		wireBytes, wire * 1e9 / BATCHES / PACKETS);
+	printf("%scolumnar %6.1f bytes/sample %6.1f ns/sample to encode, %.1f ns/sample to decode\n", SUBSPACING,
+		columnarBytes, columnar * 1e9 / BATCHES / PACKETS, decoding * 1e9 / BATCHES / PACKETS);
+	return true;
+}
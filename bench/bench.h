@@ -0,0 +1,19 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdbool.h>
+
+#define SUBSPACING "  "
+
+bool transportBenchmark(void);
+bool ingestBenchmark(void);
+bool slabBenchmark(void);
+bool queueBenchmark(void);
+bool parserBenchmark(void);
+bool templateBenchmark(void);
+bool batchBenchmark(void);
+bool storageBenchmark(void);
+bool timerBenchmark(void);
+bool clockBenchmark(void);
+
+#endif
@@ -0,0 +1,97 @@
+#include "bench.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <clock.h>
+#include <timer.h>
+#include <error.h>
+
+#define CALLS (10 * 1000 * 1000)
+#define SAMPLES 1000 // comparisons against the precise clock
+#define SAMPLE_INTERVAL 100 // us between comparisons
+
+static volatile unsigned long long sink;
+
+// what newPacket used before the clock sources
+static unsigned long long legacyTime() {
+	return getRealTime() / (1*1000*1000) * (1*1000*1000);
+}
+
+static unsigned long long sourceTime(clockSource_t source) {
+	return getClockTime(source);
+}
+
+static void idle() {
+}
+
+static double measure(unsigned long long (*f)(clockSource_t), clockSource_t source) {
+	unsigned long long sum = 0;
+	unsigned long long start = getRelativeTime();
+	for (int i = 0; i < CALLS; i++)
+		sum += f(source);
+	unsigned long long duration = getRelativeTime() - start;
+	sink = sum;
+	return (double) duration / CALLS;
+}
+
+// the largest distance to the precise clock, ns
+static unsigned long long deviation(unsigned long long (*f)(clockSource_t), clockSource_t source) {
+	unsigned long long max = 0;
+	for (int i = 0; i < SAMPLES; i++) {
+		unsigned long long precise = getClockTime(CLOCK_SOURCE_PRECISE);
+		unsigned long long value = f(source);
+		unsigned long long distance = value > precise ? value - precise : precise - value;
+		if (distance > max)
+			max = distance;
+		usleep(SAMPLE_INTERVAL);
+	}
+	return max;
+}
+
+static void report(const char* name, unsigned long long (*f)(clockSource_t), clockSource_t source) {
+	double ns = measure(f, source);
+	unsigned long long distance = deviation(f, source);
+	printf("%s%-8s %6.1f ns per call, up to %.3f ms off the precise clock\n", SUBSPACING, name, ns, distance / 1e6);
+}
+
+static unsigned long long legacy(clockSource_t source) {
+	(void) source;
+	return legacyTime();
+}
+
+/*
+ * ns per call of every clock source, single threaded, and how far its
+ * values stray from CLOCK_REALTIME. The cached clock is measured while a
+ * timer keeps the wheel ticking, as in the transmitter.
+ */
+bool clockBenchmark() {
+	report("legacy", legacy, CLOCK_SOURCE_PRECISE);
+	report("precise", sourceTime, CLOCK_SOURCE_PRECISE);
+	if (hasClockSource(CLOCK_SOURCE_COARSE))
+		report("coarse", sourceTime, CLOCK_SOURCE_COARSE);
+	else
+		printf("%scoarse   not available\n", SUBSPACING);
+	if (hasClockSource(CLOCK_SOURCE_TSC))
+		report("tsc", sourceTime, CLOCK_SOURCE_TSC);
+	else
+		printf("%stsc      not available\n", SUBSPACING);
+
+	timerid_t timer = createTimer(idle);
+	if (timer == NO_TIMER || startInterval(timer, 1000) < 0) {
+		printf("%s%sError: %s\n", SUBSPACING, SUBSPACING, error);
+		if (timer != NO_TIMER)
+			(void) deleteTimer(timer);
+		return false;
+	}
+	usleep(10 * 1000);
+	bool result = hasClockSource(CLOCK_SOURCE_CACHED);
+	if (result)
+		report("cached", sourceTime, CLOCK_SOURCE_CACHED);
+	else
+		printf("%s%sError: the cache is not updated.\n", SUBSPACING, SUBSPACING);
+	(void) deleteTimer(timer);
+	return result;
+}
@@ -0,0 +1,161 @@
+#include "bench.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include <reactor.h>
+#include <transport.h>
+#include <histogram.h>
+#include <packet.h>
+#include <registry.h>
+#include <timer.h>
+#include <error.h>
+
+#define CONNECTIONS 2000
+#define CLIENTS 4
+#define ROUNDS 50
+#define ROUND_PAUSE 2000 // us
+#define HEARTBEAT_ROUNDS 10
+
+static histogram_t latency;
+static atomic_ullong received;
+static unsigned short port;
+
+// the benchmark puts the relative send time into the packet time
+static void record(const wirePacket_t* decoded, void* context) {
+	(void) context;
+	histogramRecord(&latency, getRelativeTime() - decoded->packet.time);
+	atomic_fetch_add_explicit(&received, 1, memory_order_relaxed);
+}
+
+static int openConnection() {
+	struct sockaddr_in address = {.sin_family = AF_INET, .sin_port = htons(port)};
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0 || connect(fd, (struct sockaddr*) &address, sizeof(address)) < 0) {
+		libfail();
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	return fd;
+}
+
+typedef struct {
+	int fds[CONNECTIONS / CLIENTS];
+	agent_t agents[CONNECTIONS / CLIENTS];
+	uint32_t ids[CONNECTIONS / CLIENTS];
+	char names[CONNECTIONS / CLIENTS][32];
+	size_t count;
+	unsigned long long sent;
+	bool failed;
+} client_t;
+
+static void* fakeTransmitters(void* argument) {
+	client_t* client = argument;
+	transport_t* transport = malloc(sizeof(transport_t));
+	transportInit(transport, -1, STREAM, 0, 0);
+
+	// one agent per connection
+	for (size_t i = 0; i < client->count; i++) {
+		snprintf(client->names[i], sizeof(client->names[i]), "load.%d", client->fds[i]);
+		memset(&(client->agents[i]), 0, sizeof(agent_t));
+		client->agents[i].name = client->names[i];
+		client->agents[i].data = DATA_VALUE;
+		client->agents[i].type = DOUBLE;
+		client->ids[i] = registerAgent(&(client->agents[i]));
+		if (client->ids[i] == NO_AGENT)
+			client->failed = true;
+	}
+
+	for (int round = 0; round < ROUNDS && !client->failed; round++) {
+		for (size_t i = 0; i < client->count; i++) {
+			double value = round;
+			packet_t packet = newPacket(client->ids[i], &value, INFO, NULL);
+			packet.time = getRelativeTime();
+			transport->fd = client->fds[i];
+			if (transportSendPackets(transport, &packet, 1) < 1)
+				client->failed = true;
+			destroyPacket(&packet);
+			if (round % HEARTBEAT_ROUNDS == 0 && sendHeartbeat(client->fds[i]) < 0)
+				client->failed = true;
+			client->sent++;
+		}
+		usleep(ROUND_PAUSE);
+	}
+	for (size_t i = 0; i < client->count; i++)
+		unregisterAgent(client->ids[i]);
+	free(transport);
+	return NULL;
+}
+
+bool ingestBenchmark() {
+	histogramReset(&latency);
+	atomic_init(&received, 0);
+
+	reactorConfig_t config = {
+		.port = 0,
+		.threads = 0,
+		.heartbeatTimeout = 5000,
+		.handler = record
+	};
+	if (reactorsStart(&config) < 0) {
+		printf("%s%sError: %s\n", SUBSPACING, SUBSPACING, error);
+		return false;
+	}
+	port = config.port;
+
+	static client_t clients[CLIENTS];
+	memset(clients, 0, sizeof(clients));
+	for (int i = 0; i < CONNECTIONS; i++) {
+		int fd = openConnection();
+		if (fd < 0) {
+			printf("%s%sError: %s\n", SUBSPACING, SUBSPACING, error);
+			reactorsStop();
+			return false;
+		}
+		client_t* client = &(clients[i % CLIENTS]);
+		client->fds[client->count++] = fd;
+	}
+	for (int i = 0; i < 1000 && getOpenConnections() < CONNECTIONS; i++)
+		usleep(1000);
+	printf("%s%zu transmitters connected on port %d.\n", SUBSPACING, getOpenConnections(), port);
+
+	unsigned long long start = getRelativeTime();
+	pthread_t threads[CLIENTS];
+	for (int i = 0; i < CLIENTS; i++)
+		pthread_create(&threads[i], NULL, fakeTransmitters, &(clients[i]));
+	unsigned long long sent = 0;
+	bool result = true;
+	for (int i = 0; i < CLIENTS; i++) {
+		pthread_join(threads[i], NULL);
+		sent += clients[i].sent;
+		result = result && !clients[i].failed;
+	}
+	for (int i = 0; i < 5000 && atomic_load(&received) < sent; i++)
+		usleep(1000);
+	double seconds = (getRelativeTime() - start) / 1e9;
+
+	printf("%s%llu of %llu packets in %.2fs (%.0f packets/s).\n", SUBSPACING,
+		(unsigned long long) atomic_load(&received), sent, seconds, atomic_load(&received) / seconds);
+	printf("%singest latency: p50 %.1fus, p99 %.1fus, max %.1fus\n", SUBSPACING,
+		histogramPercentile(&latency, 50) / 1e3, histogramPercentile(&latency, 99) / 1e3,
+		histogramMax(&latency) / 1e3);
+	printReactorStats(stdout);
+
+	for (int i = 0; i < CLIENTS; i++)
+		for (size_t j = 0; j < clients[i].count; j++)
+			close(clients[i].fds[j]);
+	reactorsStop();
+	return result && atomic_load(&received) == sent;
+}
@@ -0,0 +1,46 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <error.h>
+
+#include "bench.h"
+
+static int argumentCount;
+static char** arguments;
+
+// without arguments every benchmark runs, otherwise only the named ones
+void bench(const char* name, bool (*f)()) {
+	if (argumentCount > 1) {
+		bool selected = false;
+		for (int i = 1; i < argumentCount; i++)
+			selected |= strcmp(arguments[i], name) == 0;
+		if (!selected)
+			return;
+	}
+	printf("Benchmarking %s...\n", name);
+	bool tmp = f();
+	if (tmp) {
+		printf("Benchmark \033[32mdone\033[0m\n");
+	} else {
+		printf("Benchmark \033[31mfailed\033[0m\n");
+	}
+}
+
+int main(int argc, char** argv) {
+	argumentCount = argc;
+	arguments = argv;
+	errorInit();
+
+	bench("transport", transportBenchmark);
+	bench("ingest", ingestBenchmark);
+	bench("slab", slabBenchmark);
+	bench("queue", queueBenchmark);
+	bench("parser", parserBenchmark);
+	bench("template", templateBenchmark);
+	bench("batch", batchBenchmark);
+	bench("storage", storageBenchmark);
+	bench("timer", timerBenchmark);
+	bench("clock", clockBenchmark);
+
+	return 0;
+}
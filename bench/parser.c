@@ -0,0 +1,158 @@
+#include "bench.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <conf.h>
+#include <arena.h>
+#include <timer.h>
+#include <error.h>
+
+#define FILES 10000
+
+static char directory[] = "/tmp/fetcher-parser-XXXXXX";
+
+/*
+ * Every allocation of the benchmark binary goes through these, so the
+ * allocations of the parser can be counted.
+ */
+extern void* __libc_malloc(size_t);
+extern void* __libc_calloc(size_t, size_t);
+extern void* __libc_realloc(void*, size_t);
+
+static atomic_ullong allocations;
+
+void* malloc(size_t size) {
+	atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+	return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size) {
+	atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+	return __libc_calloc(count, size);
+}
+
+void* realloc(void* pointer, size_t size) {
+	atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+	return __libc_realloc(pointer, size);
+}
+
+static bool writeFiles() {
+	char path[PATH_MAX];
+	for (int i = 0; i < FILES; i++) {
+		snprintf(path, sizeof(path), "%s/agent%05d", directory, i);
+		FILE* file = fopen(path, "w");
+		if (file == NULL)
+			return false;
+		fprintf(file,
+			"# generated agent %d\n"
+			"name = \"disk %d\"\n"
+			"script = \"df --output=pcent /dev/disk%d | tail -1 | tr -d \\\"%% \\\"\"\n"
+			"data = datavalue\n"
+			"type = int\n"
+			"timing = interval\n"
+			"timing.value = %d\n"
+			"\n"
+			"messages.warning.1 = \"Disk is filling up (%%v%%).\" # same text for all agents\n"
+			"messages.alarm.2 = \"Disk is almost full (%%v%%).\"\n"
+			"messages.error.10 = \"%%m\"\n",
+			i, i, i % 16, 10 + i % 50);
+		fclose(file);
+	}
+	return true;
+}
+
+static void removeFiles() {
+	char path[PATH_MAX];
+	for (int i = 0; i < FILES; i++) {
+		snprintf(path, sizeof(path), "%s/agent%05d", directory, i);
+		unlink(path);
+	}
+	rmdir(directory);
+}
+
+typedef struct {
+	const char* map;
+	size_t size;
+} mapped_t;
+
+static bool run(const char* name, mapped_t* files, agent_t* agents, arena_t* arena) {
+	size_t bytes = 0;
+	unsigned long long before = atomic_load(&allocations);
+	unsigned long long start = getRelativeTime();
+	for (int i = 0; i < FILES; i++) {
+		memset(&(agents[i]), 0, sizeof(agent_t));
+		if (parseAgentBuffer(files[i].map, files[i].size, &(agents[i]), arena) < 0) {
+			printf("%s%sError: agent %d: %s\n", SUBSPACING, SUBSPACING, i, error);
+			return false;
+		}
+		bytes += files[i].size;
+	}
+	double seconds = (getRelativeTime() - start) / 1e9;
+	unsigned long long count = atomic_load(&allocations) - before;
+
+	arenaStats_t stats;
+	getArenaStats(arena, &stats);
+	printf("%s%-7s %9.0f files/s %8.1f MiB/s %6llu allocations (%.3f per file)\n", SUBSPACING, name,
+		FILES / seconds, bytes / seconds / (1 << 20), count, (double) count / FILES);
+	printf("%s        %llu lookups, %llu distinct strings, %llu bytes in %llu blocks (config: %zu bytes)\n", SUBSPACING,
+		stats.lookups, stats.strings, stats.bytes, stats.blocks, bytes);
+	return true;
+}
+
+bool parserBenchmark() {
+	if (mkdtemp(directory) == NULL || !writeFiles()) {
+		printf("%s%sError: could not write the agent files.\n", SUBSPACING, SUBSPACING);
+		return false;
+	}
+	printf("%sParsing %d agent files.\n", SUBSPACING, FILES);
+
+	mapped_t* files = calloc(FILES, sizeof(mapped_t));
+	agent_t* agents = malloc(FILES * sizeof(agent_t));
+	bool result = files != NULL && agents != NULL;
+
+	unsigned long long start = getRelativeTime();
+	char path[PATH_MAX];
+	for (int i = 0; i < FILES && result; i++) {
+		snprintf(path, sizeof(path), "%s/agent%05d", directory, i);
+		int fd = open(path, O_RDONLY);
+		struct stat info;
+		if (fd < 0 || fstat(fd, &info) < 0) {
+			result = false;
+		} else {
+			files[i].size = info.st_size;
+			files[i].map = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+			result = files[i].map != MAP_FAILED;
+		}
+		if (fd >= 0)
+			close(fd);
+	}
+	if (result)
+		printf("%smmap    %9.0f files/s\n", SUBSPACING, FILES / ((getRelativeTime() - start) / 1e9));
+
+	// a reload finds all strings in the arena already
+	arena_t arena;
+	if (result && arenaInit(&arena) < 0) {
+		result = false;
+	} else if (result) {
+		result = run("parse", files, agents, &arena) && run("reload", files, agents, &arena);
+		arenaDestroy(&arena);
+	}
+
+	for (int i = 0; files != NULL && i < FILES; i++)
+		if (files[i].map != NULL && files[i].map != MAP_FAILED)
+			munmap((void*) files[i].map, files[i].size);
+	free(files);
+	free(agents);
+	removeFiles();
+	return result;
+}
@@ -0,0 +1,171 @@
+#include "bench.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+
+#include <queue.h>
+#include <packet.h>
+#include <timer.h>
+#include <histogram.h>
+#include <error.h>
+
+#define PACKETS (1000 * 1000)
+#define CAPACITY 1024 // same as the packet queue
+#define PRODUCERS 4
+#define BATCH 256
+
+#define FLOODERS 2
+#define ALARMS 500
+#define ALARM_INTERVAL 1000 // us
+#define LINK_BATCH 64 // packets per send
+#define LINK_DELAY 50 // us per send, slower than the producers
+
+// the packet layout before the registry: a full copy of the agent
+typedef struct {
+	packetStatus_t status;
+	agent_t agent;
+	unsigned long long time;
+	class_t class;
+	size_t size;
+	void* data;
+	char* message;
+	size_t messageLength;
+} legacyPacket_t;
+
+typedef struct {
+	queue_t* queue;
+	size_t size;
+} producer_t;
+
+static void* produce(void* argument) {
+	producer_t* producer = argument;
+	char* element = calloc(1, producer->size);
+	for (size_t i = 0; i < PACKETS / PRODUCERS; i++) {
+		memcpy(element, &i, sizeof(size_t)); // the real producers build every packet
+		while (!queueTryPush(producer->queue, element))
+			sched_yield();
+	}
+	free(element);
+	return NULL;
+}
+
+static bool run(const char* name, size_t size) {
+	queue_t queue;
+	if (queueInit(&queue, CAPACITY, size) < 0) {
+		printf("%s%sError: %s\n", SUBSPACING, SUBSPACING, error);
+		return false;
+	}
+	char* batch = malloc(BATCH * size);
+	producer_t producer = {.queue = &queue, .size = size};
+	pthread_t threads[PRODUCERS];
+
+	unsigned long long start = getRelativeTime();
+	for (int i = 0; i < PRODUCERS; i++)
+		pthread_create(&threads[i], NULL, produce, &producer);
+	for (size_t received = 0; received < PACKETS / PRODUCERS * PRODUCERS;) {
+		size_t n = queuePopMany(&queue, batch, BATCH);
+		if (n == 0)
+			sched_yield();
+		received += n;
+	}
+	for (int i = 0; i < PRODUCERS; i++)
+		pthread_join(threads[i], NULL);
+	double seconds = (getRelativeTime() - start) / 1e9;
+
+	printf("%s%-8s %6zu bytes/packet %9.1f KiB queue %11.0f packets/s\n", SUBSPACING, name,
+		size, CAPACITY * queue.stride / 1024.0, PACKETS / seconds);
+	free(batch);
+	queueDestroy(&queue);
+	return true;
+}
+
+static lanes_t lanes;
+static atomic_bool flooding;
+
+static bool pushClass(class_t class) {
+	packet_t packet = {.class = class, .queued = getRelativeTime()};
+	return lanesTryPush(&lanes, lanes.count == 1 ? 0 : getLane(class), &packet);
+}
+
+// data values as fast as the queue takes them
+static void* flood(void* argument) {
+	(void) argument;
+	while (atomic_load_explicit(&flooding, memory_order_relaxed)) {
+		if (!pushClass(INFO))
+			sched_yield();
+	}
+	return NULL;
+}
+
+static void* raiseAlarms(void* argument) {
+	(void) argument;
+	for (int i = 0; i < ALARMS; i++) {
+		while (!pushClass(ALARM))
+			sched_yield();
+		usleep(ALARM_INTERVAL);
+	}
+	return NULL;
+}
+
+/*
+ * A link that cannot keep up with the data values, and an alarm every
+ * millisecond: with one FIFO the alarm waits behind a full queue.
+ */
+static bool saturate(const char* name, size_t count, const size_t* capacities, const unsigned* weights) {
+	if (lanesInit(&lanes, count, capacities, weights, LANES_WEIGHTED, sizeof(packet_t)) < 0) {
+		printf("%s%sError: %s\n", SUBSPACING, SUBSPACING, error);
+		return false;
+	}
+	static histogram_t latency;
+	histogramReset(&latency);
+	atomic_store(&flooding, true);
+	pthread_t threads[FLOODERS + 1];
+	for (int i = 0; i < FLOODERS; i++)
+		pthread_create(&threads[i], NULL, flood, NULL);
+	pthread_create(&threads[FLOODERS], NULL, raiseAlarms, NULL);
+
+	packet_t batch[LINK_BATCH];
+	size_t values = 0;
+	unsigned long long start = getRelativeTime();
+	while (histogramCount(&latency) < ALARMS) {
+		size_t n = lanesPopMany(&lanes, batch, LINK_BATCH);
+		unsigned long long now = getRelativeTime();
+		for (size_t i = 0; i < n; i++) {
+			if (batch[i].class == ALARM)
+				histogramRecordLocal(&latency, now - batch[i].queued);
+			else
+				values++;
+		}
+		usleep(LINK_DELAY);
+	}
+	double seconds = (getRelativeTime() - start) / 1e9;
+	atomic_store(&flooding, false);
+	for (int i = 0; i <= FLOODERS; i++)
+		pthread_join(threads[i], NULL);
+
+	printf("%s%-8s alarms p50 %7.3f ms, p99 %7.3f ms, max %7.3f ms, %9.0f data values/s\n", SUBSPACING, name,
+		histogramPercentile(&latency, 50) / 1e6, histogramPercentile(&latency, 99) / 1e6, histogramMax(&latency) / 1e6,
+		values / seconds);
+	lanesDestroy(&lanes);
+	return true;
+}
+
+bool queueBenchmark() {
+	printf("%s%d producers, %d packets through a queue of %d.\n", SUBSPACING, PRODUCERS, PACKETS, CAPACITY);
+	if (!run("legacy", sizeof(legacyPacket_t)) || !run("compact", sizeof(packet_t)))
+		return false;
+
+	printf("%s%d producers flooding a link of %d packets per %d us, %d alarms.\n", SUBSPACING, FLOODERS,
+		LINK_BATCH, LINK_DELAY, ALARMS);
+	const size_t capacities[PACKET_LANES] = {256, 1024, 256, 256, 128, 128};
+	const unsigned weights[PACKET_LANES] = {1, 4, 8, 16, 32, 64};
+	return saturate("fifo", 1, (size_t[]) {CAPACITY}, (unsigned[]) {1})
+		&& saturate("lanes", PACKET_LANES, capacities, weights);
+}
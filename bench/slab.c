@@ -0,0 +1,168 @@
+#include "bench.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include <slab.h>
+#include <packet.h>
+#include <registry.h>
+#include <queue.h>
+#include <timer.h>
+#include <error.h>
+
+#define PACKETS (2 * 1000 * 1000)
+#define WINDOW 256 // packets alive at once, like a full transport batch
+#define PRODUCERS 4
+
+typedef struct {
+	const char* name;
+	type_t type;
+	const char* value;
+	int messageEvery; // every nth packet has a message
+} workload_t;
+
+static const workload_t workloads[] = {
+	{"int", INT, NULL, 16},
+	{"double + message", DOUBLE, NULL, 1},
+	{"string", STRING, "eth0 up 1000Mb/s full duplex", 16},
+	{"string + message", STRING, "eth0 up 1000Mb/s full duplex", 1}
+};
+
+static const char* message = "Value is above the warning threshold.";
+
+/*
+ * The allocation pattern newPacket had before the slab allocator: one
+ * malloc for every value and a strdup for every message.
+ */
+static packet_t mallocPacket(uint32_t id, type_t type, void* data, const char* text) {
+	packet_t packet;
+	memset(&packet, 0, sizeof(packet_t));
+	packet.agent = id;
+	packet.type = type;
+	packet.status = CREATED;
+	packet.time = getRealTime() / (1*1000*1000);
+	if (text != NULL) {
+		packet.message = strdup(text);
+		packet.messageLength = strlen(text) + 1;
+	}
+	packet.size = type == STRING ? strlen(data) + 1 : type == INT ? sizeof(int) : sizeof(double);
+	packet.value.string = malloc(packet.size);
+	memcpy(packet.value.string, data, packet.size);
+	return packet;
+}
+
+static void mallocDestroy(packet_t* packet) {
+	free(packet->message);
+	free(packet->value.string);
+}
+
+static packet_t create(bool useSlab, const workload_t* workload, uint32_t id, size_t i) {
+	int integer = i;
+	double real = i;
+	void* data = workload->type == INT ? (void*) &integer : workload->type == DOUBLE ? (void*) &real : (void*) workload->value;
+	const char* text = i % workload->messageEvery == 0 ? message : NULL;
+	return useSlab ? newPacket(id, data, INFO, text) : mallocPacket(id, workload->type, data, text);
+}
+
+static void release(bool useSlab, packet_t* packet) {
+	if (useSlab)
+		markPacketSent(packet);
+	else
+		mallocDestroy(packet);
+}
+
+static double singleThread(bool useSlab, const workload_t* workload, uint32_t id) {
+	static packet_t window[WINDOW];
+	unsigned long long start = getRelativeTime();
+	for (size_t i = 0; i < PACKETS; i += WINDOW) {
+		for (size_t j = 0; j < WINDOW; j++)
+			window[j] = create(useSlab, workload, id, i + j);
+		for (size_t j = 0; j < WINDOW; j++)
+			release(useSlab, &(window[j]));
+	}
+	return (double) (getRelativeTime() - start) / PACKETS;
+}
+
+typedef struct {
+	bool useSlab;
+	const workload_t* workload;
+	uint32_t id;
+	queue_t* queue;
+} producer_t;
+
+static void* produce(void* argument) {
+	producer_t* producer = argument;
+	for (size_t i = 0; i < PACKETS / PRODUCERS; i++) {
+		packet_t packet = create(producer->useSlab, producer->workload, producer->id, i);
+		while (!queueTryPush(producer->queue, &packet))
+			sched_yield();
+	}
+	return NULL;
+}
+
+// workers allocate, the sender frees: the pattern of the transmitter
+static double crossThread(bool useSlab, const workload_t* workload, uint32_t id) {
+	queue_t queue;
+	if (queueInit(&queue, 4096, sizeof(packet_t)) < 0)
+		return -1;
+	producer_t producer = {.useSlab = useSlab, .workload = workload, .id = id, .queue = &queue};
+	pthread_t threads[PRODUCERS];
+
+	unsigned long long start = getRelativeTime();
+	for (int i = 0; i < PRODUCERS; i++)
+		pthread_create(&threads[i], NULL, produce, &producer);
+	packet_t packets[WINDOW];
+	for (size_t received = 0; received < PACKETS / PRODUCERS * PRODUCERS;) {
+		size_t n = queuePopMany(&queue, packets, WINDOW);
+		if (n == 0)
+			sched_yield();
+		for (size_t i = 0; i < n; i++)
+			release(useSlab, &(packets[i]));
+		received += n;
+	}
+	for (int i = 0; i < PRODUCERS; i++)
+		pthread_join(threads[i], NULL);
+	double result = (double) (getRelativeTime() - start) / PACKETS;
+	queueDestroy(&queue);
+	return result;
+}
+
+bool slabBenchmark() {
+	static agent_t agents[sizeof(workloads) / sizeof(workload_t)];
+
+	printf("%s%d packets per run, ns per packet (create + release).\n", SUBSPACING, PACKETS);
+	printf("%s%-18s %10s %10s %14s %14s\n", SUBSPACING, "", "malloc", "slab", "malloc x-thread", "slab x-thread");
+	for (size_t i = 0; i < sizeof(workloads) / sizeof(workload_t); i++) {
+		agents[i].name = workloads[i].name;
+		agents[i].data = DATA_VALUE;
+		agents[i].type = workloads[i].type;
+		uint32_t id = registerAgent(&(agents[i]));
+		if (id == NO_AGENT) {
+			printf("%s%sError: %s\n", SUBSPACING, SUBSPACING, error);
+			return false;
+		}
+		double results[4] = {
+			singleThread(false, &(workloads[i]), id),
+			singleThread(true, &(workloads[i]), id),
+			crossThread(false, &(workloads[i]), id),
+			crossThread(true, &(workloads[i]), id)
+		};
+		if (results[2] < 0 || results[3] < 0) {
+			printf("%s%sError: %s\n", SUBSPACING, SUBSPACING, error);
+			return false;
+		}
+		printf("%s%-18s %10.1f %10.1f %14.1f %14.1f\n", SUBSPACING, workloads[i].name,
+			results[0], results[1], results[2], results[3]);
+	}
+	printf("%s", SUBSPACING);
+	printSlabStats(stdout);
+
+	slabStats_t stats;
+	getSlabStats(&stats);
+	return stats.bytesInUse == 0;
+}
@@ -0,0 +1,166 @@
+#include "bench.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <limits.h>
+
+#include <storage.h>
+#include <timer.h>
+#include <error.h>
+
+#define AGENTS 1000
+#define DAYS 7
+#define INTERVAL 60000 // ms
+#define POINTS_PER_DAY (STORAGE_PARTITION / INTERVAL)
+#define START (20000ull * STORAGE_PARTITION)
+#define QUERIES 1000
+#define HOURS 6 // queried
+#define BUCKETS (DAYS * 24)
+
+static char directory[] = "/tmp/fetcher-bench-storage-XXXXXX";
+static char names[AGENTS][32];
+static point_t points[HOURS * 60 + 1];
+static rollup_t buckets[BUCKETS + 1];
+
+static uint64_t state = 0x2545F4914F6CDD1Dull;
+
+static uint64_t nextRandom() {
+	state ^= state << 13;
+	state ^= state >> 7;
+	state ^= state << 17;
+	return state;
+}
+
+static void removeDirectory() {
+	DIR* tmp = opendir(directory);
+	if (tmp == NULL)
+		return;
+	struct dirent* entry;
+	char path[PATH_MAX];
+	while ((entry = readdir(tmp)) != NULL) {
+		if (entry->d_name[0] == '.')
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", directory, entry->d_name);
+		unlink(path);
+	}
+	closedir(tmp);
+	rmdir(directory);
+}
+
+/*
+ * A week of samples of every agent once a minute with some jitter, half
+ * counters and half gauges like in the batch benchmark, flushed every
+ * minute like the receiver does. Then queries for the last hours of random
+ * agents, and for the hourly rollups of the whole week.
+ */
+static bool fill(storage_t* storage, double* seconds) {
+	int32_t counters[AGENTS] = {0};
+	double gauges[AGENTS] = {0};
+	wirePacket_t decoded;
+	memset(&decoded, 0, sizeof(wirePacket_t));
+	decoded.packet.class = INFO;
+	decoded.packet.data = DATA_VALUE;
+	*seconds = 0;
+	for (int day = 0; day < DAYS; day++) {
+		unsigned long long start = getRelativeTime();
+		for (uint64_t minute = 0; minute < POINTS_PER_DAY; minute++) {
+			for (int i = 0; i < AGENTS; i++) {
+				decoded.name = names[i];
+				decoded.packet.time = START + (day * POINTS_PER_DAY + minute) * INTERVAL + i * 7 + nextRandom() % 5;
+				if (i % 2 == 0) {
+					counters[i] += nextRandom() % 1000;
+					decoded.packet.type = INT;
+					decoded.packet.value.integer = counters[i];
+				} else {
+					if (nextRandom() % 4 == 0)
+						gauges[i] = (int) (nextRandom() % 400) / 100.0;
+					decoded.packet.type = DOUBLE;
+					decoded.packet.value.real = gauges[i];
+				}
+				if (storageAppend(storage, &decoded) < 0)
+					return false;
+			}
+			if ((minute + 1) * INTERVAL % (STORAGE_FLUSH_INTERVAL * 1000) == 0 && storageFlush(storage) < 0)
+				return false;
+		}
+		*seconds += (getRelativeTime() - start) / 1e9;
+	}
+	return true;
+}
+
+bool storageBenchmark() {
+	if (mkdtemp(directory) == NULL) {
+		printf("%sError: could not create %s.\n", SUBSPACING, directory);
+		return false;
+	}
+	for (int i = 0; i < AGENTS; i++)
+		snprintf(names[i], sizeof(names[i]), "host-%03d.load", i);
+
+	storage_t storage;
+	double seconds;
+	if (storageOpen(&storage, directory) < 0 || !fill(&storage, &seconds)) {
+		printf("%sError: %s\n", SUBSPACING, error);
+		storageClose(&storage);
+		removeDirectory();
+		return false;
+	}
+	storageStats_t stats;
+	getStorageStats(&storage, &stats);
+	printf("%s%d agents, %d days at one sample a minute: %llu samples in %llu flushes, %zu segments left of %llu\n",
+		SUBSPACING, AGENTS, DAYS, stats.flushed, stats.flushes, storage.segmentCount, stats.segments + stats.merges);
+	size_t bytes = 0, bucketBytes = 0;
+	for (size_t i = 0; i < storage.segmentCount; i++)
+		*(storage.segments[i].rollups ? &bucketBytes : &bytes) += storage.segments[i].size;
+	printf("%s%.2f bytes/sample on disk, %.2f flushed and %.2f rewritten by %llu merges\n", SUBSPACING,
+		(double) bytes / stats.flushed, (double) stats.written / stats.flushed, (double) stats.rewritten / stats.flushed,
+		stats.merges);
+	printf("%s%.0f ns/sample to append, roll up, flush and merge\n", SUBSPACING, seconds * 1e9 / stats.flushed);
+	printf("%s%llu partial buckets flushed in %.2f bytes each, %.2f bytes of rollups per sample on disk\n",
+		SUBSPACING, stats.buckets, (double) stats.bucketBytes / stats.buckets, (double) bucketBytes / stats.flushed);
+
+	uint64_t end = START + DAYS * STORAGE_PARTITION;
+	size_t found = 0;
+	unsigned long long start = getRelativeTime();
+	for (int i = 0; i < QUERIES; i++) {
+		ssize_t n = storageQuery(&storage, names[nextRandom() % AGENTS], end - HOURS * 3600000ull, end,
+			points, sizeof(points) / sizeof(points[0]));
+		if (n < 0) {
+			printf("%sError: %s\n", SUBSPACING, error);
+			storageClose(&storage);
+			removeDirectory();
+			return false;
+		}
+		found += n;
+	}
+	double querying = (getRelativeTime() - start) / 1e9;
+	getStorageStats(&storage, &stats);
+	printf("%slast %d hours of one agent: %.3f ms/query, %zu samples and %.1f blocks each\n", SUBSPACING,
+		HOURS, querying * 1e3 / QUERIES, found / QUERIES, (double) stats.blocks / QUERIES);
+
+	unsigned long long blocks = stats.blocks;
+	found = 0;
+	start = getRelativeTime();
+	for (int i = 0; i < QUERIES; i++) {
+		ssize_t n = storageRollups(&storage, names[nextRandom() % AGENTS], ROLLUP_1H, START, end, buckets, BUCKETS + 1);
+		if (n < 0) {
+			printf("%sError: %s\n", SUBSPACING, error);
+			storageClose(&storage);
+			removeDirectory();
+			return false;
+		}
+		found += n;
+	}
+	querying = (getRelativeTime() - start) / 1e9;
+	getStorageStats(&storage, &stats);
+	printf("%s%d days of hourly rollups of one agent: %.3f ms/query, %zu buckets and %.1f blocks each\n",
+		SUBSPACING, DAYS, querying * 1e3 / QUERIES, found / QUERIES, (double) (stats.blocks - blocks) / QUERIES);
+
+	storageClose(&storage);
+	removeDirectory();
+	return true;
+}
@@ -0,0 +1,72 @@
+#include "bench.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <template.h>
+#include <arena.h>
+#include <timer.h>
+#include <error.h>
+
+#define MESSAGES (2 * 1000 * 1000)
+
+static const char* text = "Load on %m is %v (limit 4.0), 100%% of cores busy.";
+static const char* output = "web-frontend-03";
+
+/*
+ * What expansion costs without compiling: scan the template for every
+ * message and format the value with snprintf.
+ */
+static size_t naiveExpand(const char* template, char* buffer, size_t size, double value, const char* output) {
+	size_t length = 0;
+	for (const char* c = template; *c != '\0' && length + 1 < size; c++) {
+		if (c[0] == '%' && c[1] == 'v') {
+			int tmp = snprintf(buffer + length, size - length, "%f", value);
+			length += tmp < 0 ? 0 : (size_t) tmp >= size - length ? size - length - 1 : (size_t) tmp;
+			c++;
+		} else if (c[0] == '%' && c[1] == 'm') {
+			int tmp = snprintf(buffer + length, size - length, "%s", output);
+			length += tmp < 0 ? 0 : (size_t) tmp >= size - length ? size - length - 1 : (size_t) tmp;
+			c++;
+		} else if (c[0] == '%' && c[1] == '%') {
+			buffer[length++] = '%';
+			c++;
+		} else {
+			buffer[length++] = *c;
+		}
+	}
+	buffer[length] = '\0';
+	return length;
+}
+
+bool templateBenchmark() {
+	arena_t arena;
+	const char* compiled;
+	if (arenaInit(&arena) < 0 || compileTemplate(text, strlen(text), &arena, &compiled) < 0) {
+		printf("%s%sError: %s\n", SUBSPACING, SUBSPACING, error);
+		return false;
+	}
+	printf("%sExpanding '%s' %d times.\n", SUBSPACING, text, MESSAGES);
+
+	char buffer[MAX_MESSAGE_LENGTH];
+	size_t total = 0;
+	unsigned long long start = getRelativeTime();
+	for (int i = 0; i < MESSAGES; i++)
+		total += naiveExpand(text, buffer, sizeof(buffer), i * 0.01, output);
+	double naive = (getRelativeTime() - start) / 1e9;
+
+	start = getRelativeTime();
+	for (int i = 0; i < MESSAGES; i++) {
+		double value = i * 0.01;
+		total += expandTemplate(compiled, buffer, sizeof(buffer), DOUBLE, &value, output);
+	}
+	double fast = (getRelativeTime() - start) / 1e9;
+
+	printf("%snaive    %11.0f messages/s %6.1f ns/message\n", SUBSPACING, MESSAGES / naive, naive * 1e9 / MESSAGES);
+	printf("%scompiled %11.0f messages/s %6.1f ns/message (%zu bytes)\n", SUBSPACING,
+		MESSAGES / fast, fast * 1e9 / MESSAGES, total);
+	arenaDestroy(&arena);
+	return true;
+}
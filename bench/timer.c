@@ -0,0 +1,193 @@
+#include "bench.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include <timer.h>
+#include <histogram.h>
+#include <error.h>
+
+#define DURATION 3000 // ms per run
+#define SAMPLE_INTERVAL 100 // ms between thread counts
+#define MAX_LEGACY_TIMERS 10000 // a thread per expiry does not scale further
+
+static const unsigned long intervals[] = {50, 100, 250, 500, 1000}; // ms
+static const size_t counts[] = {1000, 10000, 100000};
+
+/*
+ * The scheduled time of a firing is the first firing of its timer plus a
+ * whole number of periods; the wheel shifts the first expiry by a phase
+ * the benchmark does not know. A firing that comes early moves the anchor
+ * back, so lateness is never negative.
+ */
+typedef struct {
+	unsigned long long period; // ns
+	unsigned long long anchor; // ns, 0 before the first firing
+	unsigned long long last; // periods since the anchor
+	union {
+		timerid_t id;
+		timer_t timer;
+	};
+} benchTimer_t;
+
+static histogram_t lateness;
+static atomic_ullong fired;
+static atomic_ullong missed;
+static atomic_bool stopped;
+
+static void expired(void* context) {
+	if (atomic_load_explicit(&stopped, memory_order_relaxed))
+		return;
+	benchTimer_t* timer = context;
+	unsigned long long now = getRelativeTime();
+	atomic_fetch_add_explicit(&fired, 1, memory_order_relaxed);
+	if (timer->anchor == 0) {
+		timer->anchor = now;
+		return;
+	}
+	unsigned long long k = (now - timer->anchor + timer->period / 2) / timer->period;
+	unsigned long long scheduled = timer->anchor + k * timer->period;
+	if (now < scheduled) {
+		timer->anchor -= scheduled - now;
+		scheduled = now;
+	}
+	histogramRecord(&lateness, now - scheduled);
+	if (k > timer->last + 1)
+		atomic_fetch_add_explicit(&missed, k - timer->last - 1, memory_order_relaxed);
+	timer->last = k;
+}
+
+// the old timer.c: one POSIX timer per agent, every expiry on a new thread
+static void legacyHandler(union sigval value) {
+	expired(value.sival_ptr);
+}
+
+static int legacyStart(benchTimer_t* timer, unsigned long ms) {
+	struct sigevent event;
+	memset(&event, 0, sizeof(event));
+	event.sigev_notify = SIGEV_THREAD;
+	event.sigev_notify_function = legacyHandler;
+	event.sigev_value.sival_ptr = timer;
+	if (timer_create(CLOCK_BOOTTIME, &event, &(timer->timer)) < 0) {
+		libfail();
+		return -1;
+	}
+	struct itimerspec time;
+	time.it_value.tv_sec = ms / 1000;
+	time.it_value.tv_nsec = (ms % 1000) * 1000000;
+	time.it_interval = time.it_value;
+	if (timer_settime(timer->timer, 0, &time, NULL) < 0) {
+		libfail();
+		timer_delete(timer->timer);
+		return -1;
+	}
+	return 0;
+}
+
+static int wheelStart(benchTimer_t* timer, unsigned long ms) {
+	timer->id = createTimerWithContext(expired, timer);
+	if (timer->id == NO_TIMER)
+		return -1;
+	if (startInterval(timer->id, ms) < 0) {
+		(void) deleteTimer(timer->id);
+		return -1;
+	}
+	return 0;
+}
+
+static int countThreads() {
+	FILE* file = fopen("/proc/self/status", "r");
+	if (file == NULL)
+		return -1;
+	char line[256];
+	int threads = -1;
+	while (fgets(line, sizeof(line), file) != NULL) {
+		if (sscanf(line, "Threads: %d", &threads) == 1)
+			break;
+	}
+	fclose(file);
+	return threads;
+}
+
+static bool run(const char* name, size_t count, bool legacy) {
+	benchTimer_t* timers = calloc(count, sizeof(benchTimer_t));
+	if (timers == NULL) {
+		printf("%s%sError: out of memory.\n", SUBSPACING, SUBSPACING);
+		return false;
+	}
+	histogramReset(&lateness);
+	atomic_store(&fired, 0);
+	atomic_store(&missed, 0);
+	atomic_store(&stopped, false);
+
+	size_t started = 0;
+	int result = 0;
+	for (; started < count && result == 0; started++) {
+		unsigned long ms = intervals[started % (sizeof(intervals) / sizeof(intervals[0]))];
+		timers[started].period = ms * 1000000ull;
+		result = legacy ? legacyStart(&(timers[started]), ms) : wheelStart(&(timers[started]), ms);
+	}
+	if (result < 0) {
+		printf("%s%sError: timer %zu: %s\n", SUBSPACING, SUBSPACING, started, error);
+		started--;
+	}
+
+	unsigned long long start = getRelativeTime();
+	unsigned long long cpu = getProcessTime();
+	unsigned long long before = atomic_load(&fired);
+	int threads = 0;
+	if (result == 0) {
+		for (int i = 0; i < DURATION / SAMPLE_INTERVAL; i++) {
+			usleep(SAMPLE_INTERVAL * 1000);
+			int tmp = countThreads();
+			if (tmp > threads)
+				threads = tmp;
+		}
+	}
+	cpu = getProcessTime() - cpu;
+	unsigned long long window = atomic_load(&fired) - before;
+	double seconds = (getRelativeTime() - start) / 1e9;
+
+	atomic_store(&stopped, true);
+	for (size_t i = 0; i < started; i++) {
+		if (legacy)
+			(void) timer_delete(timers[i].timer);
+		else
+			(void) deleteTimer(timers[i].id);
+	}
+	if (legacy)
+		usleep(100 * 1000); // handler threads that already started
+	free(timers);
+	if (result < 0)
+		return false;
+
+	unsigned long long firings = atomic_load(&fired);
+	printf("%s%s, %zu timers: lateness p50 %.3f ms, p99 %.3f ms, max %.3f ms, %llu of %llu ticks missed\n",
+		SUBSPACING, name, count, histogramPercentile(&lateness, 50) / 1e6, histogramPercentile(&lateness, 99) / 1e6,
+		histogramMax(&lateness) / 1e6, atomic_load(&missed), firings + atomic_load(&missed));
+	printf("%s%s%.1f ms CPU per second, %.0f ns CPU per firing, up to %d threads\n", SUBSPACING, SUBSPACING,
+		cpu / 1e6 / seconds, window == 0 ? 0.0 : (double) cpu / window, threads);
+	return true;
+}
+
+/*
+ * Periodic timers at mixed intervals, like agents, on the timer wheel
+ * and on the SIGEV_THREAD timers timer.c used before. CPU is that of the
+ * whole process, which does nothing else but firing timers.
+ */
+bool timerBenchmark() {
+	bool result = true;
+	for (size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); i++)
+		result &= run("wheel", counts[i], false);
+	for (size_t i = 0; i < sizeof(counts) / sizeof(counts[0]) && counts[i] <= MAX_LEGACY_TIMERS; i++)
+		result &= run("SIGEV_THREAD", counts[i], true);
+	return result;
+}
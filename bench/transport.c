@@ -0,0 +1,190 @@
+#include "bench.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include <transport.h>
+#include <packet.h>
+#include <registry.h>
+#include <timer.h>
+#include <error.h>
+
+#define PACKETS (1000 * 1000)
+#define DISTINCT 1024
+#define DATAGRAM_IDLE 200 // ms without datagrams before the receiver gives up
+
+typedef struct {
+	int fd;
+	transportMode_t mode;
+	unsigned long long packets;
+	unsigned long long bytes;
+} receiver_t;
+
+static agent_t agent;
+static packet_t packets[DISTINCT];
+
+static void* receiveStream(void* argument) {
+	receiver_t* receiver = argument;
+	frameReader_t reader;
+	if (frameReaderInit(&reader, 1 << 20) < 0)
+		return NULL;
+	while (receiver->packets < PACKETS) {
+		ssize_t n = frameReaderFill(&reader, receiver->fd);
+		if (n <= 0)
+			break;
+		receiver->bytes += n;
+		frameHeader_t header;
+		const char* payload;
+		while (frameReaderNext(&reader, &header, &payload) > 0) {
+			size_t position = 0;
+			for (int i = 0; i < header.count; i++) {
+				wirePacket_t decoded;
+				ssize_t tmp = wireDecode(payload + position, header.length - position, &decoded);
+				if (tmp <= 0)
+					break;
+				position += tmp;
+				receiver->packets++;
+			}
+		}
+	}
+	frameReaderDestroy(&reader);
+	return NULL;
+}
+
+static void* receiveDatagramBatches(void* argument) {
+	receiver_t* receiver = argument;
+	size_t lengths[TRANSPORT_BATCH];
+	char* buffer = malloc(TRANSPORT_BATCH * 2048);
+	struct timeval timeout = {0, DATAGRAM_IDLE * 1000};
+	setsockopt(receiver->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	while (receiver->packets < PACKETS) {
+		ssize_t n = receiveDatagrams(receiver->fd, buffer, 2048, lengths, TRANSPORT_BATCH);
+		if (n <= 0)
+			break;
+		for (ssize_t i = 0; i < n; i++) {
+			frameHeader_t header;
+			wirePacket_t decoded;
+			receiver->bytes += lengths[i];
+			if (frameDecodeHeader(buffer + i * 2048, lengths[i], &header) > 0
+					&& wireDecode(buffer + i * 2048 + FRAME_HEADER_SIZE, header.length, &decoded) > 0)
+				receiver->packets++;
+		}
+	}
+	free(buffer);
+	return NULL;
+}
+
+static int connectedPair(transportMode_t mode, int* sender, int* receiver) {
+	struct sockaddr_in address = {.sin_family = AF_INET, .sin_port = 0};
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t length = sizeof(address);
+	int type = mode == STREAM ? SOCK_STREAM : SOCK_DGRAM;
+
+	int server = socket(AF_INET, type, 0);
+	if (server < 0 || bind(server, (struct sockaddr*) &address, length) < 0
+			|| getsockname(server, (struct sockaddr*) &address, &length) < 0) {
+		libfail();
+		return -1;
+	}
+	if (mode == STREAM && listen(server, 1) < 0) {
+		libfail();
+		return -1;
+	}
+	*sender = socket(AF_INET, type, 0);
+	if (*sender < 0 || connect(*sender, (struct sockaddr*) &address, length) < 0) {
+		libfail();
+		return -1;
+	}
+	if (mode == STREAM) {
+		*receiver = accept(server, NULL, NULL);
+		close(server);
+		if (*receiver < 0) {
+			libfail();
+			return -1;
+		}
+	} else {
+		*receiver = server;
+		int size = 16 << 20;
+		setsockopt(*receiver, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	}
+	return 0;
+}
+
+static bool run(const char* name, transportMode_t mode, size_t batch) {
+	int sender, receiverFd;
+	if (connectedPair(mode, &sender, &receiverFd) < 0) {
+		printf("%s%sError: %s\n", SUBSPACING, SUBSPACING, error);
+		return false;
+	}
+
+	transport_t* transport = malloc(sizeof(transport_t));
+	transportInit(transport, sender, mode, 0, 0);
+	receiver_t receiver = {.fd = receiverFd, .mode = mode};
+
+	pthread_t thread;
+	pthread_create(&thread, NULL, mode == STREAM ? receiveStream : receiveDatagramBatches, &receiver);
+
+	unsigned long long start = getRelativeTime();
+	bool result = true;
+	for (size_t sent = 0; sent < PACKETS;) {
+		size_t offset = sent % DISTINCT;
+		size_t count = batch;
+		if (offset + count > DISTINCT)
+			count = DISTINCT - offset;
+		if (sent + count > PACKETS)
+			count = PACKETS - sent;
+		if (transportSendPackets(transport, packets + offset, count) < count) {
+			printf("%s%sError: %s\n", SUBSPACING, SUBSPACING, error);
+			result = false;
+			break;
+		}
+		sent += count;
+	}
+	unsigned long long sendTime = getRelativeTime() - start;
+	if (mode == STREAM)
+		shutdown(sender, SHUT_WR);
+	pthread_join(thread, NULL);
+	unsigned long long receiveTime = getRelativeTime() - start;
+	if (mode == DATAGRAM && receiver.packets < PACKETS)
+		receiveTime -= DATAGRAM_IDLE * 1000ull * 1000ull;
+
+	double seconds = receiveTime / 1e9;
+	printf("%s%-22s %9.0f packets/s %8.1f MB/s  %5.2f syscalls/1k packets",
+		SUBSPACING, name, receiver.packets / seconds, receiver.bytes / seconds / 1e6,
+		transport->stats.syscalls * 1000.0 / transport->stats.packets);
+	if (receiver.packets < PACKETS)
+		printf("  (%llu lost, sender %.0f packets/s)", PACKETS - receiver.packets, PACKETS / (sendTime / 1e9));
+	printf("\n");
+
+	close(sender);
+	close(receiverFd);
+	free(transport);
+	return result;
+}
+
+bool transportBenchmark() {
+	memset(&agent, 0, sizeof(agent_t));
+	agent.name = "bench.agent";
+	agent.data = DATA_VALUE;
+	agent.type = INT;
+	uint32_t id = registerAgent(&agent);
+	for (int i = 0; i < DISTINCT; i++)
+		packets[i] = newPacket(id, &i, i % 16 == 0 ? WARNING : INFO, i % 16 == 0 ? "Value is too high." : NULL);
+
+	printf("%s%d packets of %zu bytes over loopback.\n", SUBSPACING, PACKETS, wireLength(&(packets[1])));
+	bool result = run("stream, 1 per frame", STREAM, 1)
+		&& run("stream, batched", STREAM, TRANSPORT_BATCH)
+		&& run("datagram, 1 per call", DATAGRAM, 1)
+		&& run("datagram, sendmmsg", DATAGRAM, TRANSPORT_BATCH);
+
+	for (int i = 0; i < DISTINCT; i++)
+		destroyPacket(&(packets[i]));
+	return result;
+}
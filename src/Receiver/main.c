@@ -1,9 +1,104 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdbool.h>
 
+#include "error.h"
+#include "reactor.h"
+#include "storage.h"
+#include "timer.h"
+#include "metrics.h"
+
+#define DEFAULT_PORT 4242
+#define HEARTBEAT_TIMEOUT 30000 // ms
+#define STATS_INTERVAL 60 // s
+#define STORAGE_DIRECTORY "storage.d"
+#define METRICS_SOCKET "receiver.metrics"
+
+// stdout is shared by all reactor threads, so this is for debugging only
+static bool verbose = false;
+
+static void printPacket(const wirePacket_t* decoded) {
+	const packet_t* packet = &(decoded->packet);
+	flockfile(stdout);
+	printf("%llu %s [%d]", packet->time, decoded->name, packet->class);
+	switch (packet->type) {
+		case INT:
+			printf(" %d", packet->value.integer);
+			break;
+		case DOUBLE:
+			printf(" %f", packet->value.real);
+			break;
+		case STRING:
+			printf(" %s", packet->value.string);
+			break;
+	}
+	if (packet->message != NULL)
+		printf(" - %s", packet->message);
+	printf("\n");
+	funlockfile(stdout);
+}
+
+static void handlePacket(const wirePacket_t* decoded, void* context) {
+	if (verbose)
+		printPacket(decoded);
+	if (storageAppend(context, decoded) < 0)
+		fprintf(stderr, "Could not store a sample of %s: %s\n", decoded->name, error);
+}
 
 int main(int argc, char** argv) {
 
 	printf("This is the receiver.\n");
 
+	// -v prints every packet
+	if (argc > 1 && strcmp(argv[1], "-v") == 0) {
+		verbose = true;
+		argc--;
+		argv++;
+	}
+
+	if (errorInit() < 0) {
+		fprintf(stderr, "Error: %s\n", error);
+		return 1;
+	}
+
+	static storage_t storage;
+	if (storageOpen(&storage, argc > 2 ? argv[2] : STORAGE_DIRECTORY) < 0) {
+		fprintf(stderr, "Error: %s\n", error);
+		return 1;
+	}
+
+	if (metricsServe(METRICS_SOCKET) < 0)
+		fprintf(stderr, "Could not serve metrics on %s: %s\n", METRICS_SOCKET, error);
+
+	reactorConfig_t config = {
+		.address = NULL,
+		.port = argc > 1 ? atoi(argv[1]) : DEFAULT_PORT,
+		.threads = 0,
+		.heartbeatTimeout = HEARTBEAT_TIMEOUT,
+		.handler = handlePacket,
+		.context = &storage
+	};
+	if (reactorsStart(&config) < 0) {
+		fprintf(stderr, "Error: %s\n", error);
+		return 1;
+	}
+	printf("Listening on port %d.\n", config.port);
+
+	for (unsigned long long seconds = 1;; seconds++) {
+		sleep(1);
+		if (seconds % STORAGE_FLUSH_INTERVAL == 0) {
+			if (storageFlush(&storage) < 0)
+				fprintf(stderr, "Could not flush the storage: %s\n", error);
+			storageExpire(&storage, getRealTime() / 1000000 - STORAGE_RETENTION);
+		}
+		if (seconds % STATS_INTERVAL == 0) {
+			printReactorStats(stderr);
+			printStorageStats(&storage, stderr);
+			printRecentErrors(stderr);
+		}
+	}
+
 	return 0;
 }
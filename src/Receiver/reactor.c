@@ -0,0 +1,385 @@
+#define _GNU_SOURCE
+
+#include "reactor.h"
+#include "wire.h"
+#include "timer.h"
+#include "worker.h"
+#include "metrics.h"
+#include "error.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define MAX_EVENTS 256
+#define READ_BUFFER 16384
+#define LIVENESS_INTERVAL 1000 // ms between heartbeat checks
+#define BACKLOG 4096
+
+static reactor_t* reactors = NULL;
+static size_t reactorCount = 0;
+
+static int openListener(reactorConfig_t* config) {
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		libfail();
+		return -1;
+	}
+	int one = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) {
+		libfail();
+		close(fd);
+		return -1;
+	}
+
+	struct sockaddr_in address = {.sin_family = AF_INET, .sin_port = htons(config->port)};
+	address.sin_addr.s_addr = htonl(INADDR_ANY);
+	if (config->address != NULL && inet_pton(AF_INET, config->address, &(address.sin_addr)) != 1) {
+		fail("Invalid listen address '%s'.", config->address);
+		close(fd);
+		return -1;
+	}
+	socklen_t length = sizeof(address);
+	if (bind(fd, (struct sockaddr*) &address, length) < 0 || listen(fd, BACKLOG) < 0
+			|| getsockname(fd, (struct sockaddr*) &address, &length) < 0) {
+		libfail();
+		close(fd);
+		return -1;
+	}
+	config->port = ntohs(address.sin_port);
+	return fd;
+}
+
+static int watch(reactor_t* reactor, int fd, uint32_t events) {
+	struct epoll_event event = {.events = events, .data.fd = fd};
+	if (epoll_ctl(reactor->epoll, EPOLL_CTL_ADD, fd, &event) < 0) {
+		libfail();
+		return -1;
+	}
+	return 0;
+}
+
+static void closeConnection(reactor_t* reactor, connection_t* connection) {
+	reactor->connections[connection->fd] = NULL;
+	close(connection->fd); // also removes it from the epoll set
+	frameReaderDestroy(&(connection->reader));
+	codecDestroy(&(connection->codec));
+	free(connection->inflated);
+	free(connection);
+	reactor->open--;
+	reactor->stats.closed++;
+}
+
+static void acceptConnections(reactor_t* reactor) {
+	for (;;) {
+		int fd = accept4(reactor->listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			return; // EAGAIN, or out of descriptors until a connection closes
+		}
+		if ((size_t) fd >= reactor->capacity) {
+			size_t capacity = reactor->capacity * 2;
+			while (capacity <= (size_t) fd)
+				capacity *= 2;
+			connection_t** tmp = realloc(reactor->connections, capacity * sizeof(connection_t*));
+			if (tmp == NULL) {
+				close(fd);
+				continue;
+			}
+			memset(tmp + reactor->capacity, 0, (capacity - reactor->capacity) * sizeof(connection_t*));
+			reactor->connections = tmp;
+			reactor->capacity = capacity;
+		}
+		connection_t* connection = malloc(sizeof(connection_t));
+		if (connection == NULL || frameReaderInit(&(connection->reader), READ_BUFFER) < 0) {
+			free(connection);
+			close(fd);
+			continue;
+		}
+		int one = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		connection->fd = fd;
+		connection->lastSeen = getRelativeTime();
+		connection->lastHeartbeat = 0;
+		memset(&(connection->codec), 0, sizeof(codec_t));
+		connection->inflated = NULL;
+		connection->inflatedCapacity = 0;
+		if (watch(reactor, fd, EPOLLIN | EPOLLRDHUP | EPOLLET) < 0) {
+			frameReaderDestroy(&(connection->reader));
+			free(connection);
+			close(fd);
+			continue;
+		}
+		reactor->connections[fd] = connection;
+		reactor->open++;
+		reactor->stats.accepted++;
+	}
+}
+
+static bool handleHeartbeat(connection_t* connection, const char* payload, size_t length) {
+	size_t preamble = strlen(HEARTBEAT_PREAMBLE);
+	size_t postamble = strlen(HEARTBEAT_POSTAMBLE);
+	if (length < preamble + postamble + 1 || length > 32)
+		return false;
+	if (memcmp(payload, HEARTBEAT_PREAMBLE, preamble) != 0
+			|| memcmp(payload + length - postamble, HEARTBEAT_POSTAMBLE, postamble) != 0)
+		return false;
+	unsigned long long time = 0;
+	for (size_t i = preamble; i < length - postamble; i++) {
+		if (payload[i] < '0' || payload[i] > '9')
+			return false;
+		time = time * 10 + (payload[i] - '0');
+	}
+	connection->lastHeartbeat = time;
+	return true;
+}
+
+static bool handleFrame(reactor_t* reactor, connection_t* connection, frameHeader_t* header, const char* payload) {
+	reactor->stats.frames++;
+	if (header->type == FRAME_HEARTBEAT) {
+		reactor->stats.heartbeats++;
+		return handleHeartbeat(connection, payload, header->length);
+	}
+	if (header->type == FRAME_HELLO) {
+		if (answerHello(connection->fd, payload, header->length, &(connection->codec)) < 0)
+			return false;
+		reactor->stats.links[connection->codec.compression]++;
+		return true;
+	}
+
+	size_t length = header->length;
+	if (header->flags & FRAME_COMPRESSED) {
+		ssize_t tmp = frameDecompress(&(connection->codec), payload, length,
+			&(connection->inflated), &(connection->inflatedCapacity));
+		if (tmp < 0)
+			return false;
+		payload = connection->inflated;
+		length = tmp;
+		reactor->stats.compressed++;
+		reactor->stats.inflated += length;
+	}
+
+	size_t position = 0;
+	for (int i = 0; i < header->count; i++) {
+		unsigned long long start = getRelativeTime();
+		wirePacket_t decoded;
+		ssize_t tmp = wireDecode(payload + position, length - position, &decoded);
+		if (tmp <= 0)
+			return false;
+		position += tmp;
+		if (header->flags & FRAME_DELAYED) {
+			decoded.packet.status = DELAYED;
+			reactor->stats.delayed++;
+		}
+		reactor->stats.packets++;
+		reactor->config->handler(&decoded, reactor->config->context);
+		recordStage(STAGE_INGEST, getRelativeTime() - start);
+	}
+	return position == length;
+}
+
+// edge triggered: read until the socket is drained
+static void readConnection(reactor_t* reactor, connection_t* connection) {
+	for (;;) {
+		ssize_t n = frameReaderFill(&(connection->reader), connection->fd);
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return;
+		if (n <= 0) {
+			closeConnection(reactor, connection);
+			return;
+		}
+		reactor->stats.bytes += n;
+		connection->lastSeen = getRelativeTime();
+
+		frameHeader_t header;
+		const char* payload;
+		int tmp;
+		while ((tmp = frameReaderNext(&(connection->reader), &header, &payload)) > 0) {
+			if (!handleFrame(reactor, connection, &header, payload))
+				tmp = -1;
+			if (tmp < 0)
+				break;
+		}
+		if (tmp < 0) {
+			reactor->stats.invalid++;
+			closeConnection(reactor, connection);
+			return;
+		}
+	}
+}
+
+static void checkLiveness(reactor_t* reactor) {
+	unsigned long long now = getRelativeTime();
+	unsigned long long timeout = reactor->config->heartbeatTimeout * 1000ull * 1000ull;
+	for (size_t fd = 0; fd < reactor->capacity; fd++) {
+		connection_t* connection = reactor->connections[fd];
+		if (connection != NULL && now - connection->lastSeen > timeout) {
+			reactor->stats.expired++;
+			closeConnection(reactor, connection);
+		}
+	}
+}
+
+static void* reactorThread(void* argument) {
+	reactor_t* reactor = argument;
+	struct epoll_event events[MAX_EVENTS];
+	unsigned long long lastCheck = getRelativeTime();
+
+	for (;;) {
+		int n = epoll_wait(reactor->epoll, events, MAX_EVENTS, LIVENESS_INTERVAL);
+		if (n < 0 && errno != EINTR)
+			break;
+		for (int i = 0; i < n; i++) {
+			int fd = events[i].data.fd;
+			if (fd == reactor->wakeup)
+				return NULL;
+			if (fd == reactor->listener) {
+				acceptConnections(reactor);
+				continue;
+			}
+			connection_t* connection = (size_t) fd < reactor->capacity ? reactor->connections[fd] : NULL;
+			if (connection == NULL)
+				continue;
+			if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+				readConnection(reactor, connection);
+		}
+
+		unsigned long long now = getRelativeTime();
+		if (reactor->config->heartbeatTimeout > 0 && now - lastCheck >= LIVENESS_INTERVAL * 1000ull * 1000ull) {
+			checkLiveness(reactor);
+			lastCheck = now;
+		}
+	}
+	return NULL;
+}
+
+static int setupReactor(reactor_t* reactor, reactorConfig_t* config) {
+	memset(reactor, 0, sizeof(reactor_t));
+	reactor->config = config;
+	reactor->epoll = -1;
+	reactor->listener = -1;
+	reactor->wakeup = -1;
+	reactor->capacity = 1024;
+	reactor->connections = calloc(reactor->capacity, sizeof(connection_t*));
+	if (reactor->connections == NULL) {
+		libfail();
+		return -1;
+	}
+	reactor->epoll = epoll_create1(EPOLL_CLOEXEC);
+	reactor->wakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (reactor->epoll < 0 || reactor->wakeup < 0) {
+		libfail();
+		return -1;
+	}
+	reactor->listener = openListener(config);
+	if (reactor->listener < 0)
+		return -1;
+	if (watch(reactor, reactor->listener, EPOLLIN | EPOLLET) < 0 || watch(reactor, reactor->wakeup, EPOLLIN) < 0)
+		return -1;
+	return 0;
+}
+
+int reactorsStart(reactorConfig_t* config) {
+	if (reactors != NULL) {
+		error = "Reactors already running.";
+		return -1;
+	}
+	size_t count = config->threads == 0 ? getCoreCount() : config->threads;
+	reactors = calloc(count, sizeof(reactor_t));
+	if (reactors == NULL) {
+		libfail();
+		return -1;
+	}
+	// the first listener picks the port if none is given, the others share it
+	for (size_t i = 0; i < count; i++) {
+		if (setupReactor(&(reactors[i]), config) < 0) {
+			reactorCount = i + 1;
+			reactorsStop();
+			return -1;
+		}
+	}
+	reactorCount = count;
+	for (size_t i = 0; i < count; i++) {
+		int tmp = pthread_create(&(reactors[i].thread), NULL, reactorThread, &(reactors[i]));
+		if (tmp != 0) {
+			error = strerror(tmp);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+void reactorsStop() {
+	for (size_t i = 0; i < reactorCount; i++) {
+		reactor_t* reactor = &(reactors[i]);
+		if (reactor->thread != 0) {
+			uint64_t one = 1;
+			(void) write(reactor->wakeup, &one, sizeof(one));
+			pthread_join(reactor->thread, NULL);
+		}
+		for (size_t fd = 0; fd < reactor->capacity && reactor->connections != NULL; fd++) {
+			if (reactor->connections[fd] != NULL)
+				closeConnection(reactor, reactor->connections[fd]);
+		}
+		free(reactor->connections);
+		if (reactor->listener >= 0)
+			close(reactor->listener);
+		if (reactor->wakeup >= 0)
+			close(reactor->wakeup);
+		if (reactor->epoll >= 0)
+			close(reactor->epoll);
+	}
+	free(reactors);
+	reactors = NULL;
+	reactorCount = 0;
+}
+
+size_t getOpenConnections() {
+	size_t open = 0;
+	for (size_t i = 0; i < reactorCount; i++)
+		open += reactors[i].open;
+	return open;
+}
+
+void getReactorStats(reactorStats_t* stats) {
+	memset(stats, 0, sizeof(reactorStats_t));
+	for (size_t i = 0; i < reactorCount; i++) {
+		reactorStats_t* tmp = &(reactors[i].stats);
+		stats->accepted += tmp->accepted;
+		stats->closed += tmp->closed;
+		stats->expired += tmp->expired;
+		stats->frames += tmp->frames;
+		stats->heartbeats += tmp->heartbeats;
+		stats->packets += tmp->packets;
+		stats->delayed += tmp->delayed;
+		stats->invalid += tmp->invalid;
+		stats->bytes += tmp->bytes;
+		for (compression_t c = COMPRESS_NONE; c <= COMPRESS_ZSTD; c++)
+			stats->links[c] += tmp->links[c];
+		stats->compressed += tmp->compressed;
+		stats->inflated += tmp->inflated;
+	}
+}
+
+void printReactorStats(FILE* file) {
+	reactorStats_t stats;
+	getReactorStats(&stats);
+	fprintf(file, "connections: %zu open, %llu accepted, %llu closed, %llu expired\n",
+		getOpenConnections(), stats.accepted, stats.closed, stats.expired);
+	fprintf(file, "traffic: %llu frames, %llu heartbeats, %llu packets (%llu delayed), %llu invalid, %llu bytes\n",
+		stats.frames, stats.heartbeats, stats.packets, stats.delayed, stats.invalid, stats.bytes);
+	fprintf(file, "compression: %llu links without, %llu with lz4, %llu with zstd; %llu frames inflated to %llu bytes\n",
+		stats.links[COMPRESS_NONE], stats.links[COMPRESS_LZ4], stats.links[COMPRESS_ZSTD],
+		stats.compressed, stats.inflated);
+}
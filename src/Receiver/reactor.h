@@ -0,0 +1,79 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include "packet.h"
+#include "transport.h"
+#include "wire.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+/*
+ * Edge-triggered epoll reactors for the receiver. Every reactor thread has
+ * its own SO_REUSEPORT listener on the same port, so the kernel spreads the
+ * transmitter connections across them. Connections are non-blocking and
+ * every one has its own frame reader, so frames are decoded as they arrive.
+ *
+ * A connection that sends neither frames nor heartbeats for the heartbeat
+ * timeout is considered dead and closed. The HELLO of a transmitter is
+ * answered right away, compressed frames are inflated before decoding.
+ */
+
+typedef void (*packetHandler_t)(const wirePacket_t*, void*);
+
+typedef struct {
+	const char* address; // NULL for all interfaces
+	unsigned short port; // 0 picks a free port, updated by reactorsStart
+	size_t threads; // 0 for one per core
+	unsigned long heartbeatTimeout; // ms
+	packetHandler_t handler;
+	void* context;
+} reactorConfig_t;
+
+typedef struct {
+	int fd;
+	frameReader_t reader;
+	unsigned long long lastSeen; // relative time of the last frame
+	unsigned long long lastHeartbeat; // transmitter time of the last heartbeat (ms)
+	codec_t codec; // from the HELLO
+	char* inflated; // payload of the last compressed frame
+	size_t inflatedCapacity;
+} connection_t;
+
+typedef struct {
+	unsigned long long accepted;
+	unsigned long long closed;
+	unsigned long long expired; // closed for missing heartbeats
+	unsigned long long frames;
+	unsigned long long heartbeats;
+	unsigned long long packets;
+	unsigned long long delayed; // replayed from a transmitter spool
+	unsigned long long invalid;
+	unsigned long long bytes;
+	unsigned long long links[COMPRESS_ZSTD + 1]; // handshakes by compression
+	unsigned long long compressed; // frames
+	unsigned long long inflated; // bytes of their payloads after decompression
+} reactorStats_t;
+
+typedef struct {
+	pthread_t thread;
+	int epoll;
+	int listener;
+	int wakeup;
+	connection_t** connections; // indexed by fd
+	size_t capacity;
+	size_t open;
+	reactorConfig_t* config;
+	reactorStats_t stats;
+} reactor_t;
+
+int reactorsStart(reactorConfig_t*);
+void reactorsStop(void);
+
+size_t getOpenConnections(void);
+void getReactorStats(reactorStats_t*);
+void printReactorStats(FILE*);
+
+#endif
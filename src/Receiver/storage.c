@@ -0,0 +1,1617 @@
+#define _GNU_SOURCE
+
+#include "storage.h"
+#include "column.h"
+#include "spool.h"
+#include "error.h"
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#define SERIES_FILE "series"
+#define SEGMENT_SUFFIX ".segment"
+#define ROLLUP_SUFFIX ".rollup"
+#define SUFFIX(rollups) ((rollups) ? ROLLUP_SUFFIX : SEGMENT_SUFFIX)
+#define SEGMENT_MAGIC 0x46545347454d4e54ull // "FTSGEMNT"
+#define SEGMENT_VERSION 2
+#define NO_SERIES UINT32_MAX
+#define LANES 4 // of the aggregation kernel
+
+static const uint64_t rollupWidths[ROLLUP_LEVELS] = {60 * 1000, 5 * 60 * 1000, 60 * 60 * 1000};
+
+typedef struct {
+	uint64_t magic;
+	uint64_t partition;
+} segmentHeader_t;
+
+typedef struct {
+	uint64_t indexOffset;
+	uint64_t entries;
+	uint64_t since; // see storageSegment_t
+	uint32_t crc; // of the index
+	uint32_t version;
+	uint64_t magic;
+} segmentFooter_t;
+
+// a segment being written by a flush or a merge
+typedef struct {
+	uint64_t partition;
+	uint64_t since;
+	bool rollups;
+	size_t buckets;
+	char* buffer;
+	size_t length;
+	size_t capacity;
+	storageEntry_t* index;
+	size_t entries;
+	size_t indexCapacity;
+	char path[PATH_MAX];
+} pendingSegment_t;
+
+static uint64_t hashOf(const char* name) {
+	uint64_t hash = 14695981039346656037ULL;
+	for (; *name != '\0'; name++) {
+		hash ^= (unsigned char) *name;
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+static void segmentPath(storage_t* storage, char* path, uint64_t partition, uint64_t sequence, const char* suffix) {
+	snprintf(path, PATH_MAX, "%s/%016llx-%016llx%s", storage->directory, (unsigned long long) partition,
+		(unsigned long long) sequence, suffix);
+}
+
+// makes new directory entries durable
+static void syncDirectory(storage_t* storage) {
+	int fd = open(storage->directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd >= 0) {
+		(void) fsync(fd);
+		close(fd);
+	}
+}
+
+static int grow(void** buffer, size_t* capacity, size_t size, size_t element) {
+	if (size <= *capacity)
+		return 0;
+	size_t tmp = *capacity == 0 ? 64 : *capacity;
+	while (tmp < size)
+		tmp *= 2;
+	void* resized = realloc(*buffer, tmp * element);
+	if (resized == NULL) {
+		libfail();
+		return -1;
+	}
+	*buffer = resized;
+	*capacity = tmp;
+	return 0;
+}
+
+static uint32_t findSeries(storage_t* storage, const char* name) {
+	if (storage->slotCount == 0)
+		return NO_SERIES;
+	size_t mask = storage->slotCount - 1;
+	for (size_t i = hashOf(name) & mask;; i = (i + 1) & mask) {
+		uint32_t id = storage->slots[i];
+		if (id == NO_SERIES || strcmp(storage->series[id]->name, name) == 0)
+			return id;
+	}
+}
+
+static void insertSlot(uint32_t* slots, size_t count, uint32_t id, const char* name) {
+	size_t mask = count - 1;
+	size_t i = hashOf(name) & mask;
+	while (slots[i] != NO_SERIES)
+		i = (i + 1) & mask;
+	slots[i] = id;
+}
+
+// adds a series to the table, the table stays at most half full
+static uint32_t addSeries(storage_t* storage, const char* name, size_t length) {
+	if (storage->seriesCount == STORAGE_MAX_SERIES) {
+		error = "Too many series.";
+		return NO_SERIES;
+	}
+	if (grow((void**) &(storage->series), &(storage->seriesCapacity), storage->seriesCount + 1, sizeof(series_t*)) < 0)
+		return NO_SERIES;
+	if (2 * (storage->seriesCount + 1) > storage->slotCount) {
+		size_t count = storage->slotCount == 0 ? 1024 : 2 * storage->slotCount;
+		uint32_t* slots = malloc(count * sizeof(uint32_t));
+		if (slots == NULL) {
+			libfail();
+			return NO_SERIES;
+		}
+		memset(slots, 0xff, count * sizeof(uint32_t));
+		for (size_t i = 0; i < storage->seriesCount; i++)
+			insertSlot(slots, count, i, storage->series[i]->name);
+		free(storage->slots);
+		storage->slots = slots;
+		storage->slotCount = count;
+	}
+	series_t* series = calloc(1, sizeof(series_t));
+	if (series == NULL || (series->name = strndup(name, length)) == NULL) {
+		libfail();
+		free(series);
+		return NO_SERIES;
+	}
+	uint32_t id = storage->seriesCount++;
+	storage->series[id] = series;
+	insertSlot(storage->slots, storage->slotCount, id, series->name);
+	return id;
+}
+
+// reads the series file, a partly written last record is cut off
+static int loadSeries(storage_t* storage) {
+	struct stat info;
+	if (fstat(storage->seriesFd, &info) < 0) {
+		libfail();
+		return -1;
+	}
+	char* content = malloc(info.st_size + 1);
+	if (content == NULL) {
+		libfail();
+		return -1;
+	}
+	size_t length = 0;
+	while (length < (size_t) info.st_size) {
+		ssize_t n = pread(storage->seriesFd, content + length, info.st_size - length, length);
+		if (n <= 0) {
+			if (n < 0 && errno == EINTR)
+				continue;
+			libfail();
+			free(content);
+			return -1;
+		}
+		length += n;
+	}
+	size_t offset = 0;
+	while (offset + sizeof(uint32_t) <= length) {
+		uint32_t size;
+		memcpy(&size, content + offset, sizeof(uint32_t));
+		if (size == 0 || size > length - offset - sizeof(uint32_t)
+				|| memchr(content + offset + sizeof(uint32_t), '\0', size) != NULL)
+			break;
+		if (addSeries(storage, content + offset + sizeof(uint32_t), size) == NO_SERIES) {
+			free(content);
+			return -1;
+		}
+		offset += sizeof(uint32_t) + size;
+	}
+	free(content);
+	if (offset < length && ftruncate(storage->seriesFd, offset) < 0) {
+		libfail();
+		return -1;
+	}
+	return 0;
+}
+
+static void closeSegment(storageSegment_t* segment) {
+	if (segment->map != NULL)
+		munmap(segment->map, segment->size);
+	segment->map = NULL;
+}
+
+// maps a segment and checks its footer and index, the file is closed again
+static int openSegment(storage_t* storage, storageSegment_t* segment, uint64_t partition, uint64_t sequence,
+		bool rollups) {
+	char path[PATH_MAX];
+	segmentPath(storage, path, partition, sequence, SUFFIX(rollups));
+	memset(segment, 0, sizeof(storageSegment_t));
+	segment->partition = partition;
+	segment->sequence = sequence;
+	segment->rollups = rollups;
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	struct stat info;
+	if (fd < 0 || fstat(fd, &info) < 0) {
+		libfail();
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	segment->size = info.st_size;
+	if (segment->size < sizeof(segmentHeader_t) + sizeof(segmentFooter_t)) {
+		error = "Segment too short.";
+		close(fd);
+		return -1;
+	}
+	segment->map = mmap(NULL, segment->size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (segment->map == MAP_FAILED) {
+		libfail();
+		segment->map = NULL;
+		return -1;
+	}
+
+	segmentHeader_t header;
+	segmentFooter_t footer;
+	memcpy(&header, segment->map, sizeof(segmentHeader_t));
+	memcpy(&footer, segment->map + segment->size - sizeof(segmentFooter_t), sizeof(segmentFooter_t));
+	size_t indexEnd = segment->size - sizeof(segmentFooter_t);
+	if (header.magic != SEGMENT_MAGIC || header.partition != partition || footer.magic != SEGMENT_MAGIC
+			|| footer.version != SEGMENT_VERSION || footer.indexOffset % sizeof(uint64_t) != 0
+			|| footer.indexOffset < sizeof(segmentHeader_t) || footer.indexOffset > indexEnd
+			|| footer.entries != (indexEnd - footer.indexOffset) / sizeof(storageEntry_t)
+			|| (indexEnd - footer.indexOffset) % sizeof(storageEntry_t) != 0
+			|| footer.since > sequence
+			|| crc32(segment->map + footer.indexOffset, indexEnd - footer.indexOffset) != footer.crc) {
+		error = "Invalid segment.";
+		closeSegment(segment);
+		return -1;
+	}
+	segment->index = (const storageEntry_t*) (segment->map + footer.indexOffset);
+	segment->entries = footer.entries;
+	segment->since = footer.since;
+	for (size_t i = 0; i < segment->entries; i++) {
+		const storageEntry_t* entry = &(segment->index[i]);
+		if (entry->offset < sizeof(segmentHeader_t) || entry->offset > footer.indexOffset
+				|| entry->length > footer.indexOffset - entry->offset || entry->series >= storage->seriesCount
+				|| entry->count == 0 || entry->count > STORAGE_BLOCK
+				|| (rollups ? entry->level == 0 || entry->level > ROLLUP_LEVELS : entry->level != 0)) {
+			error = "Invalid segment index.";
+			closeSegment(segment);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int compareSegments(const void* a, const void* b) {
+	const storageSegment_t* s1 = a;
+	const storageSegment_t* s2 = b;
+	if (s1->partition != s2->partition)
+		return s1->partition < s2->partition ? -1 : 1;
+	return s1->sequence < s2->sequence ? -1 : s1->sequence > s2->sequence;
+}
+
+// the first segment of the partition of time
+static size_t findSegment(const storage_t* storage, uint64_t time) {
+	uint64_t start = time / STORAGE_PARTITION * STORAGE_PARTITION;
+	size_t low = 0, high = storage->segmentCount;
+	while (low < high) {
+		size_t middle = low + (high - low) / 2;
+		if (storage->segments[middle].partition < start)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+	return low;
+}
+
+/*
+ * Deletes the segments that a newer one of the partition was merged from;
+ * a crash can leave them behind. Segments have to be sorted.
+ */
+static void dropMerged(storage_t* storage) {
+	char path[PATH_MAX];
+	size_t kept = storage->segmentCount;
+	for (size_t end = storage->segmentCount; end > 0;) {
+		uint64_t since[2] = {UINT64_MAX, UINT64_MAX}; // of samples and rollups
+		size_t i = end;
+		for (; i > 0 && storage->segments[i - 1].partition == storage->segments[end - 1].partition; i--) {
+			storageSegment_t* segment = &(storage->segments[i - 1]);
+			if (segment->sequence < since[segment->rollups]) {
+				if (segment->since < since[segment->rollups])
+					since[segment->rollups] = segment->since;
+				continue;
+			}
+			segmentPath(storage, path, segment->partition, segment->sequence, SUFFIX(segment->rollups));
+			(void) unlink(path);
+			closeSegment(segment);
+			kept--;
+		}
+		end = i;
+	}
+	if (kept == storage->segmentCount)
+		return;
+	kept = 0;
+	for (size_t i = 0; i < storage->segmentCount; i++) {
+		if (storage->segments[i].map != NULL)
+			storage->segments[kept++] = storage->segments[i];
+	}
+	storage->segmentCount = kept;
+	syncDirectory(storage);
+}
+
+// opens all segments in the directory, invalid ones are skipped
+static int loadSegments(storage_t* storage) {
+	DIR* directory = opendir(storage->directory);
+	if (directory == NULL) {
+		libfail();
+		return -1;
+	}
+	struct dirent* entry;
+	while ((entry = readdir(directory)) != NULL) {
+		unsigned long long partition, sequence;
+		int length = 0;
+		if (sscanf(entry->d_name, "%16llx-%16llx%n", &partition, &sequence, &length) != 2 || length == 0)
+			continue;
+		const char* suffix = entry->d_name + length;
+		if (strcmp(suffix, SEGMENT_SUFFIX ".tmp") == 0 || strcmp(suffix, ROLLUP_SUFFIX ".tmp") == 0) {
+			// a flush that did not finish
+			(void) unlinkat(dirfd(directory), entry->d_name, 0);
+			continue;
+		}
+		bool rollups = strcmp(suffix, ROLLUP_SUFFIX) == 0;
+		if (!rollups && strcmp(suffix, SEGMENT_SUFFIX) != 0)
+			continue;
+		if (sequence >= storage->sequence)
+			storage->sequence = sequence + 1;
+		if (grow((void**) &(storage->segments), &(storage->segmentCapacity), storage->segmentCount + 1,
+				sizeof(storageSegment_t)) < 0) {
+			closedir(directory);
+			return -1;
+		}
+		if (openSegment(storage, &(storage->segments[storage->segmentCount]), partition, sequence, rollups) < 0) {
+			storage->stats.invalid++;
+			continue;
+		}
+		storage->segmentCount++;
+	}
+	closedir(directory);
+	if (storage->segmentCount > 1)
+		qsort(storage->segments, storage->segmentCount, sizeof(storageSegment_t), compareSegments);
+	dropMerged(storage);
+	return 0;
+}
+
+int storageOpen(storage_t* storage, const char* directory) {
+	memset(storage, 0, sizeof(storage_t));
+	storage->seriesFd = -1;
+	pthread_mutex_init(&(storage->lock), NULL);
+	pthread_rwlock_init(&(storage->segmentLock), NULL);
+	if (mkdir(directory, 0750) < 0 && errno != EEXIST) {
+		libfail();
+		storageClose(storage);
+		return -1;
+	}
+	storage->directory = strdup(directory);
+	if (storage->directory == NULL) {
+		libfail();
+		storageClose(storage);
+		return -1;
+	}
+	char path[PATH_MAX];
+	snprintf(path, PATH_MAX, "%s/" SERIES_FILE, directory);
+	storage->seriesFd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (storage->seriesFd < 0) {
+		libfail();
+		storageClose(storage);
+		return -1;
+	}
+	if (loadSeries(storage) < 0 || loadSegments(storage) < 0) {
+		storageClose(storage);
+		return -1;
+	}
+	return 0;
+}
+
+static int flush(storage_t*, bool);
+static int mergeSegments(storage_t*, uint64_t, bool);
+
+// flushes the write buffers and the open buckets first
+void storageClose(storage_t* storage) {
+	if (storage->seriesFd >= 0)
+		(void) flush(storage, true);
+	for (size_t i = 0; i < storage->segmentCount; i++)
+		closeSegment(&(storage->segments[i]));
+	free(storage->segments);
+	for (size_t i = 0; i < storage->seriesCount; i++) {
+		free(storage->series[i]->name);
+		free(storage->series[i]->points);
+		free(storage->series[i]);
+	}
+	free(storage->series);
+	free(storage->slots);
+	free(storage->directory);
+	if (storage->seriesFd >= 0)
+		close(storage->seriesFd);
+	pthread_mutex_destroy(&(storage->lock));
+	pthread_rwlock_destroy(&(storage->segmentLock));
+	memset(storage, 0, sizeof(storage_t));
+	storage->seriesFd = -1;
+}
+
+// writes the record first, so ids in memory always match the series file
+static uint32_t createSeries(storage_t* storage, const char* name) {
+	size_t length = strlen(name);
+	uint32_t size = length;
+	struct iovec record[2] = {{&size, sizeof(uint32_t)}, {(void*) name, length}};
+	if (length == 0 || length > WIRE_MAX_FIELD) {
+		error = "Invalid series name.";
+		return NO_SERIES;
+	}
+	if (storage->seriesCount == STORAGE_MAX_SERIES) {
+		error = "Too many series.";
+		return NO_SERIES;
+	}
+	off_t end = lseek(storage->seriesFd, 0, SEEK_END);
+	if (end < 0 || writev(storage->seriesFd, record, 2) != (ssize_t) (sizeof(uint32_t) + length)) {
+		libfail();
+		if (end >= 0)
+			(void) ftruncate(storage->seriesFd, end);
+		return NO_SERIES;
+	}
+	uint32_t id = addSeries(storage, name, length);
+	if (id == NO_SERIES)
+		(void) ftruncate(storage->seriesFd, end);
+	return id;
+}
+
+/*
+ * New series are written to the series file right away; flushes sync it
+ * before any segment refers to them. META packets are reports about the
+ * agent, not samples of it.
+ */
+int storageAppend(storage_t* storage, const wirePacket_t* decoded) {
+	const packet_t* packet = &(decoded->packet);
+	if ((packet->type != INT && packet->type != DOUBLE) || packet->class == META) {
+		__atomic_fetch_add(&(storage->stats.ignored), 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+	point_t point = {packet->time, packet->type == INT ? packet->value.integer : packet->value.real};
+
+	pthread_mutex_lock(&(storage->lock));
+	uint32_t id = findSeries(storage, decoded->name);
+	if (id == NO_SERIES && (id = createSeries(storage, decoded->name)) == NO_SERIES) {
+		pthread_mutex_unlock(&(storage->lock));
+		return -1;
+	}
+	series_t* series = storage->series[id];
+	if (grow((void**) &(series->points), &(series->capacity), series->count + 1, sizeof(point_t)) < 0) {
+		pthread_mutex_unlock(&(storage->lock));
+		return -1;
+	}
+	series->points[series->count++] = point;
+	series->rollups = series->rollups || packet->data == DATA_VALUE;
+	storage->stats.appended++;
+	pthread_mutex_unlock(&(storage->lock));
+	return 0;
+}
+
+static int comparePoints(const void* a, const void* b) {
+	const point_t* p1 = a;
+	const point_t* p2 = b;
+	return p1->time < p2->time ? -1 : p1->time > p2->time;
+}
+
+static void sortPoints(point_t* points, size_t count) {
+	for (size_t i = 1; i < count; i++) {
+		if (points[i].time < points[i - 1].time) {
+			qsort(points, count, sizeof(point_t), comparePoints);
+			return;
+		}
+	}
+}
+
+// first point at or after time
+static size_t lowerBound(const point_t* points, size_t count, uint64_t time) {
+	size_t low = 0, high = count;
+	while (low < high) {
+		size_t middle = low + (high - low) / 2;
+		if (points[middle].time < time)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+	return low;
+}
+
+// first bucket starting at or after start
+static size_t lowerBucket(const rollup_t* buckets, size_t count, uint64_t start) {
+	size_t low = 0, high = count;
+	while (low < high) {
+		size_t middle = low + (high - low) / 2;
+		if (buckets[middle].start < start)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+	return low;
+}
+
+uint64_t getRollupWidth(rollupLevel_t level) {
+	return rollupWidths[level];
+}
+
+/*
+ * Minimum, maximum and sum of values. The lanes are independent, so the
+ * compiler keeps them in vector registers without reordering the sum.
+ */
+static void aggregate(const double* values, size_t count, double* min, double* max, double* sum) {
+	double lowest[LANES], highest[LANES], total[LANES];
+	for (int lane = 0; lane < LANES; lane++) {
+		lowest[lane] = highest[lane] = values[0];
+		total[lane] = 0;
+	}
+	size_t i = 0;
+	for (; i + LANES <= count; i += LANES) {
+		for (int lane = 0; lane < LANES; lane++) {
+			double value = values[i + lane];
+			lowest[lane] = value < lowest[lane] ? value : lowest[lane];
+			highest[lane] = value > highest[lane] ? value : highest[lane];
+			total[lane] += value;
+		}
+	}
+	for (; i < count; i++) {
+		lowest[0] = values[i] < lowest[0] ? values[i] : lowest[0];
+		highest[0] = values[i] > highest[0] ? values[i] : highest[0];
+		total[0] += values[i];
+	}
+	*min = lowest[0];
+	*max = highest[0];
+	*sum = total[0];
+	for (int lane = 1; lane < LANES; lane++) {
+		*min = lowest[lane] < *min ? lowest[lane] : *min;
+		*max = highest[lane] > *max ? highest[lane] : *max;
+		*sum += total[lane];
+	}
+}
+
+// buckets of sorted points, values are theirs; returns the number of buckets
+static size_t bucketPoints(const point_t* points, const double* values, size_t count, uint64_t width,
+		rollup_t* buckets) {
+	size_t n = 0;
+	for (size_t i = 0; i < count;) {
+		uint64_t start = points[i].time / width * width;
+		size_t end = i + lowerBound(points + i, count - i, start + width);
+		rollup_t* bucket = &(buckets[n++]);
+		bucket->start = start;
+		bucket->time = points[end - 1].time;
+		bucket->count = end - i;
+		bucket->last = values[end - 1];
+		aggregate(values + i, end - i, &(bucket->min), &(bucket->max), &(bucket->sum));
+		i = end;
+	}
+	return n;
+}
+
+// both of the same bucket
+static void mergeRollup(rollup_t* bucket, const rollup_t* other) {
+	bucket->min = other->min < bucket->min ? other->min : bucket->min;
+	bucket->max = other->max > bucket->max ? other->max : bucket->max;
+	bucket->sum += other->sum;
+	bucket->count += other->count;
+	if (other->time >= bucket->time) {
+		bucket->time = other->time;
+		bucket->last = other->last;
+	}
+}
+
+static int compareRollups(const void* a, const void* b) {
+	const rollup_t* r1 = a;
+	const rollup_t* r2 = b;
+	return r1->start < r2->start ? -1 : r1->start > r2->start;
+}
+
+// sorts the buckets and merges the ones of the same start, returns how many are left
+static size_t mergeRollups(rollup_t* buckets, size_t count) {
+	if (count > 1)
+		qsort(buckets, count, sizeof(rollup_t), compareRollups);
+	size_t merged = 0;
+	for (size_t i = 0; i < count; i++) {
+		if (merged > 0 && buckets[i].start == buckets[merged - 1].start)
+			mergeRollup(&(buckets[merged - 1]), &(buckets[i]));
+		else
+			buckets[merged++] = buckets[i];
+	}
+	return merged;
+}
+
+// the times of count structures, as deltas of deltas
+static char* putTimes(char* position, const char* times, size_t stride, size_t count) {
+	uint64_t previous = 0;
+	int64_t delta = 0;
+	for (size_t i = 0; i < count; i++, times += stride) {
+		uint64_t time;
+		memcpy(&time, times, sizeof(uint64_t));
+		int64_t tmp = (int64_t) (time - previous);
+		position = putVarint(position, i == 0 ? time : zigzag(i == 1 ? tmp : (int64_t) ((uint64_t) tmp - delta)));
+		delta = tmp;
+		previous = time;
+	}
+	return position;
+}
+
+static void putValues(bitWriter_t* writer, const char* values, size_t stride, size_t count) {
+	uint64_t previous = 0;
+	int leading = -1, trailing = 0;
+	for (size_t i = 0; i < count; i++, values += stride) {
+		double value;
+		memcpy(&value, values, sizeof(double));
+		putDouble(writer, value, &previous, &leading, &trailing);
+	}
+}
+
+static bool getTimes(columnReader_t* reader, char* times, size_t stride, size_t count) {
+	uint64_t previous = 0;
+	int64_t delta = 0;
+	for (size_t i = 0; i < count; i++, times += stride) {
+		uint64_t time;
+		if (!getVarint(reader, &time))
+			return false;
+		if (i > 0) {
+			int64_t current = (int64_t) ((uint64_t) unzigzag(time) + (i == 1 ? 0 : delta));
+			time = previous + (uint64_t) current;
+			delta = current;
+		}
+		previous = time;
+		memcpy(times, &time, sizeof(uint64_t));
+	}
+	return true;
+}
+
+static bool getValues(columnReader_t* reader, char* values, size_t stride, size_t count) {
+	uint64_t value = 0;
+	int leading = -1, trailing = 0;
+	for (size_t i = 0; i < count; i++, values += stride) {
+		if (!getDouble(reader, &value, &leading, &trailing))
+			return false;
+		memcpy(values, &value, sizeof(double));
+	}
+	return true;
+}
+
+// count, times, values
+static char* encodePoints(char* position, const point_t* points, size_t count) {
+	position = putVarint(position, count);
+	position = putTimes(position, (const char*) &(points->time), sizeof(point_t), count);
+	bitWriter_t writer = {position, 0, 0};
+	putValues(&writer, (const char*) &(points->value), sizeof(point_t), count);
+	return flushBits(&writer);
+}
+
+// a column of the buckets, without the ones of single samples unless all
+static void putColumn(bitWriter_t* writer, const rollup_t* buckets, size_t count, size_t offset, bool all) {
+	uint64_t previous = 0;
+	int leading = -1, trailing = 0;
+	for (size_t i = 0; i < count; i++) {
+		double value;
+		if (!all && buckets[i].count == 1)
+			continue;
+		memcpy(&value, (const char*) &(buckets[i]) + offset, sizeof(double));
+		putDouble(writer, value, &previous, &leading, &trailing);
+	}
+}
+
+/*
+ * count, times of the last samples, counts, then minima, maxima, sums and
+ * last values; a bucket of one sample only has its minimum
+ */
+static char* encodeRollups(char* position, const rollup_t* buckets, size_t count) {
+	position = putVarint(position, count);
+	position = putTimes(position, (const char*) &(buckets->time), sizeof(rollup_t), count);
+	for (size_t i = 0; i < count; i++)
+		position = putVarint(position, buckets[i].count);
+	bitWriter_t writer = {position, 0, 0};
+	putColumn(&writer, buckets, count, offsetof(rollup_t, min), true);
+	putColumn(&writer, buckets, count, offsetof(rollup_t, max), false);
+	putColumn(&writer, buckets, count, offsetof(rollup_t, sum), false);
+	putColumn(&writer, buckets, count, offsetof(rollup_t, last), false);
+	return flushBits(&writer);
+}
+
+// checks the crc and the count of the block, returns the count
+static ssize_t openBlock(const storageSegment_t* segment, const storageEntry_t* entry, columnReader_t* reader) {
+	const char* block = segment->map + entry->offset;
+	uint64_t count;
+	*reader = (columnReader_t) {block, block + entry->length, 0, 0};
+	if (crc32(block, entry->length) != entry->crc || !getLength(reader, STORAGE_BLOCK, &count)
+			|| count != entry->count) {
+		error = "Invalid block.";
+		return -1;
+	}
+	return count;
+}
+
+static ssize_t decodePoints(const storageSegment_t* segment, const storageEntry_t* entry, point_t* points) {
+	columnReader_t reader;
+	ssize_t count = openBlock(segment, entry, &reader);
+	if (count < 0)
+		return -1;
+	if (!getTimes(&reader, (char*) &(points->time), sizeof(point_t), count)
+			|| !getValues(&reader, (char*) &(points->value), sizeof(point_t), count)) {
+		error = "Invalid block.";
+		return -1;
+	}
+	return count;
+}
+
+static bool getColumn(columnReader_t* reader, rollup_t* buckets, size_t count, size_t offset, bool all) {
+	uint64_t value = 0;
+	int leading = -1, trailing = 0;
+	for (size_t i = 0; i < count; i++) {
+		if (!all && buckets[i].count == 1) {
+			memcpy((char*) &(buckets[i]) + offset, &(buckets[i].min), sizeof(double));
+			continue;
+		}
+		if (!getDouble(reader, &value, &leading, &trailing))
+			return false;
+		memcpy((char*) &(buckets[i]) + offset, &value, sizeof(double));
+	}
+	return true;
+}
+
+static ssize_t decodeRollups(const storageSegment_t* segment, const storageEntry_t* entry, rollup_t* buckets) {
+	columnReader_t reader;
+	ssize_t count = openBlock(segment, entry, &reader);
+	if (count < 0)
+		return -1;
+	bool valid = getTimes(&reader, (char*) &(buckets->time), sizeof(rollup_t), count);
+	for (ssize_t i = 0; valid && i < count; i++)
+		valid = getVarint(&reader, &(buckets[i].count)) && buckets[i].count > 0;
+	valid = valid && getColumn(&reader, buckets, count, offsetof(rollup_t, min), true)
+		&& getColumn(&reader, buckets, count, offsetof(rollup_t, max), false)
+		&& getColumn(&reader, buckets, count, offsetof(rollup_t, sum), false)
+		&& getColumn(&reader, buckets, count, offsetof(rollup_t, last), false);
+	if (!valid) {
+		error = "Invalid block.";
+		return -1;
+	}
+	uint64_t width = rollupWidths[entry->level - 1];
+	for (ssize_t i = 0; i < count; i++)
+		buckets[i].start = buckets[i].time / width * width;
+	return count;
+}
+
+// a series taken by a flush, the table of series may move meanwhile
+typedef struct {
+	uint32_t id;
+	series_t* series;
+	bool rollups;
+	rollup_t open[ROLLUP_LEVELS]; // after the flush
+	rollup_t* closed[ROLLUP_LEVELS]; // sorted by start
+	size_t closedCount[ROLLUP_LEVELS];
+} flushItem_t;
+
+/*
+ * Folds the flushing samples into the open buckets. A bucket closes when
+ * a later one starts; buckets of late samples close right away and merge
+ * with the stored ones when read.
+ */
+static int rollUp(flushItem_t* item, bool closing) {
+	const series_t* series = item->series;
+	size_t count = series->flushingCount;
+	double* values = malloc((count + 1) * sizeof(double));
+	rollup_t* buckets = malloc((count + 1) * sizeof(rollup_t));
+	if (values == NULL || buckets == NULL) {
+		libfail();
+		free(values);
+		free(buckets);
+		return -1;
+	}
+	for (size_t i = 0; i < count; i++)
+		values[i] = series->flushing[i].value;
+	for (int level = 0; level < ROLLUP_LEVELS; level++) {
+		size_t n = bucketPoints(series->flushing, values, count, rollupWidths[level], buckets);
+		rollup_t* closed = malloc((n + 1) * sizeof(rollup_t));
+		if (closed == NULL) {
+			libfail();
+			free(values);
+			free(buckets);
+			return -1;
+		}
+		size_t closedCount = 0;
+		rollup_t* open = &(item->open[level]);
+		for (size_t i = 0; i < n; i++) {
+			if (open->count == 0) {
+				*open = buckets[i];
+			} else if (buckets[i].start == open->start) {
+				mergeRollup(open, &(buckets[i]));
+			} else if (buckets[i].start > open->start) {
+				closed[closedCount++] = *open;
+				*open = buckets[i];
+			} else {
+				closed[closedCount++] = buckets[i];
+			}
+		}
+		if (closing && open->count > 0) {
+			closed[closedCount++] = *open;
+			open->count = 0;
+		}
+		item->closed[level] = closed;
+		item->closedCount[level] = closedCount;
+	}
+	free(values);
+	free(buckets);
+	return 0;
+}
+
+static int startSegment(pendingSegment_t* segment) {
+	segmentHeader_t header = {SEGMENT_MAGIC, segment->partition};
+	segment->length = 0;
+	segment->entries = 0;
+	segment->buckets = 0;
+	if (grow((void**) &(segment->buffer), &(segment->capacity), sizeof(segmentHeader_t), 1) < 0)
+		return -1;
+	memcpy(segment->buffer, &header, sizeof(segmentHeader_t));
+	segment->length = sizeof(segmentHeader_t);
+	return 0;
+}
+
+// sorted points of the series, or buckets of a level; blocks of up to STORAGE_BLOCK
+static int addBlocks(pendingSegment_t* segment, uint32_t id, int level, const void* data, size_t count) {
+	const point_t* points = data;
+	const rollup_t* buckets = data;
+	for (size_t j = 0; j < count; j += STORAGE_BLOCK) {
+		size_t n = count - j < STORAGE_BLOCK ? count - j : STORAGE_BLOCK;
+		size_t bound = segment->rollups ? MAX_VARINT * (2 * n + 1) + 4 * MAX_DOUBLE_BYTES * n + 1
+			: MAX_VARINT * (n + 1) + MAX_DOUBLE_BYTES * n + 1;
+		if (grow((void**) &(segment->buffer), &(segment->capacity), segment->length + bound, 1) < 0
+				|| grow((void**) &(segment->index), &(segment->indexCapacity), segment->entries + 1,
+					sizeof(storageEntry_t)) < 0)
+			return -1;
+		char* block = segment->buffer + segment->length;
+		size_t length = (segment->rollups ? encodeRollups(block, buckets + j, n) : encodePoints(block, points + j, n))
+			- block;
+		segment->index[segment->entries++] = (storageEntry_t) {
+			.series = id,
+			.count = n,
+			.level = level,
+			.first = segment->rollups ? buckets[j].start : points[j].time,
+			.last = segment->rollups ? buckets[j + n - 1].start : points[j + n - 1].time,
+			.offset = segment->length,
+			.length = length,
+			.crc = crc32(block, length)
+		};
+		segment->length += length;
+		segment->buckets += segment->rollups ? n : 0;
+	}
+	return 0;
+}
+
+// the index and the footer after the blocks
+static int finishSegment(pendingSegment_t* segment) {
+	size_t indexOffset = (segment->length + sizeof(uint64_t) - 1) / sizeof(uint64_t) * sizeof(uint64_t);
+	size_t indexSize = segment->entries * sizeof(storageEntry_t);
+	if (grow((void**) &(segment->buffer), &(segment->capacity), indexOffset + indexSize + sizeof(segmentFooter_t), 1) < 0)
+		return -1;
+	memset(segment->buffer + segment->length, 0, indexOffset - segment->length);
+	if (indexSize > 0)
+		memcpy(segment->buffer + indexOffset, segment->index, indexSize);
+	segmentFooter_t footer = {
+		.indexOffset = indexOffset,
+		.entries = segment->entries,
+		.since = segment->since,
+		.crc = crc32(segment->buffer + indexOffset, indexSize),
+		.version = SEGMENT_VERSION,
+		.magic = SEGMENT_MAGIC
+	};
+	memcpy(segment->buffer + indexOffset + indexSize, &footer, sizeof(segmentFooter_t));
+	segment->length = indexOffset + indexSize + sizeof(segmentFooter_t);
+	return 0;
+}
+
+static void freePending(pendingSegment_t* segment) {
+	free(segment->buffer);
+	free(segment->index);
+	segment->buffer = NULL;
+	segment->index = NULL;
+	segment->capacity = 0;
+	segment->indexCapacity = 0;
+}
+
+// the blocks of all flushing series in one partition
+static int buildSegment(pendingSegment_t* segment, const flushItem_t* items, size_t count) {
+	if (startSegment(segment) < 0)
+		return -1;
+	uint64_t end = segment->partition + STORAGE_PARTITION;
+	for (size_t i = 0; i < count; i++) {
+		const series_t* series = items[i].series;
+		if (!segment->rollups) {
+			size_t first = lowerBound(series->flushing, series->flushingCount, segment->partition);
+			size_t last = lowerBound(series->flushing, series->flushingCount, end);
+			if (addBlocks(segment, items[i].id, 0, series->flushing + first, last - first) < 0)
+				return -1;
+			continue;
+		}
+		for (int level = 0; level < ROLLUP_LEVELS; level++) {
+			const rollup_t* buckets = items[i].closed[level];
+			size_t first = lowerBucket(buckets, items[i].closedCount[level], segment->partition);
+			size_t last = lowerBucket(buckets, items[i].closedCount[level], end);
+			if (addBlocks(segment, items[i].id, level + 1, buckets + first, last - first) < 0)
+				return -1;
+		}
+	}
+	return finishSegment(segment);
+}
+
+static int writeSegment(pendingSegment_t* segment) {
+	int fd = open(segment->path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		libfail();
+		return -1;
+	}
+	size_t written = 0;
+	while (written < segment->length) {
+		ssize_t n = write(fd, segment->buffer + written, segment->length - written);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0) {
+			libfail();
+			close(fd);
+			return -1;
+		}
+		written += n;
+	}
+	if (fsync(fd) < 0) {
+		libfail();
+		close(fd);
+		return -1;
+	}
+	close(fd);
+	return 0;
+}
+
+// puts the flushing points back in front of what arrived since
+static void restorePoints(storage_t* storage, const flushItem_t* items, size_t count) {
+	pthread_mutex_lock(&(storage->lock));
+	for (size_t i = 0; i < count; i++) {
+		series_t* series = items[i].series;
+		size_t total = series->flushingCount + series->count;
+		size_t capacity = series->flushingCount;
+		if (grow((void**) &(series->flushing), &capacity, total, sizeof(point_t)) == 0) {
+			if (series->count > 0)
+				memcpy(series->flushing + series->flushingCount, series->points, series->count * sizeof(point_t));
+			free(series->points);
+			series->points = series->flushing;
+			series->count = total;
+			series->capacity = capacity;
+		} else {
+			free(series->flushing);
+		}
+		series->flushing = NULL;
+		series->flushingCount = 0;
+	}
+	pthread_mutex_unlock(&(storage->lock));
+}
+
+static int addPartition(pendingSegment_t** segments, size_t* count, size_t* capacity, uint64_t partition,
+		bool rollups) {
+	for (size_t i = 0; i < *count; i++) {
+		if ((*segments)[i].partition == partition && (*segments)[i].rollups == rollups)
+			return 0;
+	}
+	if (grow((void**) segments, capacity, *count + 1, sizeof(pendingSegment_t)) < 0)
+		return -1;
+	memset(&((*segments)[*count]), 0, sizeof(pendingSegment_t));
+	(*segments)[*count].partition = partition;
+	(*segments)[(*count)++].rollups = rollups;
+	return 0;
+}
+
+// a segment per partition of the flushing points and per partition of the closed buckets
+static ssize_t findPartitions(const flushItem_t* items, size_t count, pendingSegment_t** segments) {
+	size_t segmentCount = 0, capacity = 0;
+	*segments = NULL;
+	for (size_t i = 0; i < count; i++) {
+		const series_t* series = items[i].series;
+		for (size_t j = 0; j < series->flushingCount;) {
+			uint64_t partition = series->flushing[j].time / STORAGE_PARTITION * STORAGE_PARTITION;
+			if (addPartition(segments, &segmentCount, &capacity, partition, false) < 0) {
+				free(*segments);
+				return -1;
+			}
+			j = lowerBound(series->flushing, series->flushingCount, partition + STORAGE_PARTITION);
+		}
+		for (int level = 0; level < ROLLUP_LEVELS; level++) {
+			const rollup_t* closed = items[i].closed[level];
+			size_t closedCount = items[i].closedCount[level];
+			for (size_t j = 0; j < closedCount;) {
+				uint64_t partition = closed[j].start / STORAGE_PARTITION * STORAGE_PARTITION;
+				if (addPartition(segments, &segmentCount, &capacity, partition, true) < 0) {
+					free(*segments);
+					return -1;
+				}
+				j = lowerBucket(closed, closedCount, partition + STORAGE_PARTITION);
+			}
+		}
+	}
+	return segmentCount;
+}
+
+static void freeItems(flushItem_t* items, size_t count) {
+	for (size_t i = 0; i < count; i++) {
+		for (int level = 0; level < ROLLUP_LEVELS; level++)
+			free(items[i].closed[level]);
+	}
+	free(items);
+}
+
+static bool hasOpenBuckets(const series_t* series) {
+	for (int level = 0; level < ROLLUP_LEVELS; level++) {
+		if (series->open[level].count > 0)
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Writes the write buffers into one new segment per partition they cover,
+ * and the buckets they close into rollup segments. The segments are
+ * written under temporary names and only renamed once all of them are on
+ * disk. If writing, renaming or mapping any of them fails, none of them are
+ * kept: the samples go back into the write buffers and the buckets stay as
+ * they were. When closing, the open buckets are written
+ * too.
+ */
+static int flush(storage_t* storage, bool closing) {
+	pthread_mutex_lock(&(storage->lock));
+	flushItem_t* items = calloc(storage->seriesCount + 1, sizeof(flushItem_t));
+	if (items == NULL) {
+		libfail();
+		pthread_mutex_unlock(&(storage->lock));
+		return -1;
+	}
+	size_t count = 0, flushed = 0;
+	for (size_t i = 0; i < storage->seriesCount; i++) {
+		series_t* series = storage->series[i];
+		if (series->count == 0 && !(closing && hasOpenBuckets(series)))
+			continue;
+		// sorted here, queries read the flushing points too
+		sortPoints(series->points, series->count);
+		series->flushing = series->points;
+		series->flushingCount = series->count;
+		series->points = NULL;
+		series->count = 0;
+		series->capacity = 0;
+		flushed += series->flushingCount;
+		items[count].id = i;
+		items[count].series = series;
+		items[count].rollups = series->rollups;
+		memcpy(items[count++].open, series->open, sizeof(series->open));
+	}
+	uint64_t sequence = storage->sequence;
+	pthread_mutex_unlock(&(storage->lock));
+	if (count == 0) {
+		free(items);
+		return 0;
+	}
+
+	int result = 0;
+	for (size_t i = 0; i < count && result == 0; i++)
+		result = items[i].rollups ? rollUp(&(items[i]), closing) : 0;
+	pendingSegment_t* segments = NULL;
+	ssize_t segmentCount = result < 0 ? -1 : findPartitions(items, count, &segments);
+	if (segmentCount < 0 || fsync(storage->seriesFd) < 0) {
+		if (segmentCount >= 0)
+			libfail();
+		result = -1;
+	}
+	ssize_t written = 0;
+	for (; result == 0 && written < segmentCount; written++) {
+		pendingSegment_t* segment = &(segments[written]);
+		segmentPath(storage, segment->path, segment->partition, sequence + written,
+			segment->rollups ? ROLLUP_SUFFIX ".tmp" : SEGMENT_SUFFIX ".tmp");
+		segment->since = sequence + written;
+		result = buildSegment(segment, items, count) < 0 || writeSegment(segment) < 0 ? -1 : 0;
+		freePending(segment);
+	}
+
+	// renamed and mapped first, so the locks are only held to swap them in
+	storageSegment_t* opened = result < 0 ? NULL : calloc(segmentCount + 1, sizeof(storageSegment_t));
+	size_t openedCount = 0, bytes = 0, buckets = 0, bucketBytes = 0;
+	if (result == 0 && opened == NULL) {
+		libfail();
+		result = -1;
+	}
+	for (ssize_t i = 0; result == 0 && i < segmentCount; i++) {
+		char path[PATH_MAX];
+		segmentPath(storage, path, segments[i].partition, sequence + i, SUFFIX(segments[i].rollups));
+		if (rename(segments[i].path, path) < 0) {
+			libfail();
+			result = -1;
+			break;
+		}
+		memcpy(segments[i].path, path, PATH_MAX); // removed from there if the flush fails
+		if (openSegment(storage, &(opened[openedCount]), segments[i].partition, sequence + i, segments[i].rollups) < 0) {
+			result = -1;
+			break;
+		}
+		if (segments[i].rollups)
+			bucketBytes += opened[openedCount].size;
+		else
+			bytes += opened[openedCount].size;
+		openedCount++;
+		buckets += segments[i].buckets;
+	}
+	if (result == 0)
+		syncDirectory(storage);
+
+	// queries see either the flushing samples or the segments with them, never both
+	if (result == 0) {
+		pthread_rwlock_wrlock(&(storage->segmentLock));
+		pthread_mutex_lock(&(storage->lock));
+		if (grow((void**) &(storage->segments), &(storage->segmentCapacity), storage->segmentCount + openedCount,
+				sizeof(storageSegment_t)) < 0)
+			result = -1;
+		else {
+			memcpy(storage->segments + storage->segmentCount, opened, openedCount * sizeof(storageSegment_t));
+			storage->segmentCount += openedCount;
+			qsort(storage->segments, storage->segmentCount, sizeof(storageSegment_t), compareSegments);
+			for (size_t i = 0; i < count; i++) {
+				series_t* series = items[i].series;
+				free(series->flushing);
+				series->flushing = NULL;
+				series->flushingCount = 0;
+				if (items[i].rollups)
+					memcpy(series->open, items[i].open, sizeof(series->open));
+			}
+			storage->sequence = sequence + segmentCount;
+			storage->stats.flushes++;
+			storage->stats.flushed += flushed;
+			storage->stats.written += bytes;
+			storage->stats.segments += openedCount;
+			storage->stats.buckets += buckets;
+			storage->stats.bucketBytes += bucketBytes;
+		}
+		pthread_mutex_unlock(&(storage->lock));
+		pthread_rwlock_unlock(&(storage->segmentLock));
+	}
+
+	// none of the segments are used, the samples go back
+	if (result < 0) {
+		for (size_t i = 0; i < openedCount; i++)
+			closeSegment(&(opened[i]));
+		for (ssize_t i = 0; i < written; i++)
+			unlink(segments[i].path);
+		free(opened);
+		free(segments);
+		restorePoints(storage, items, count);
+		freeItems(items, count);
+		return -1;
+	}
+	free(segments);
+	for (size_t i = 0; i < openedCount; i++) {
+		if (mergeSegments(storage, opened[i].partition, opened[i].rollups) < 0)
+			result = -1;
+	}
+	free(opened);
+	freeItems(items, count);
+	return result;
+}
+
+int storageFlush(storage_t* storage) {
+	return flush(storage, false);
+}
+
+/*
+ * The blocks of a series and level in all sources, sorted; partial buckets
+ * of the same start are merged. Returns the number of points or buckets.
+ */
+static ssize_t gatherBlocks(storageSegment_t** sources, size_t* positions, size_t count, uint32_t id, int level,
+		void** buffer, size_t* capacity) {
+	bool rollups = sources[0]->rollups;
+	size_t total = 0;
+	for (size_t i = 0; i < count; i++) {
+		for (; positions[i] < sources[i]->entries; positions[i]++) {
+			const storageEntry_t* entry = &(sources[i]->index[positions[i]]);
+			if (entry->series != id || entry->level != level)
+				break;
+			if (grow(buffer, capacity, total + entry->count, rollups ? sizeof(rollup_t) : sizeof(point_t)) < 0)
+				return -1;
+			// damaged blocks are left out, like in queries
+			ssize_t n = rollups ? decodeRollups(sources[i], entry, (rollup_t*) *buffer + total)
+				: decodePoints(sources[i], entry, (point_t*) *buffer + total);
+			total += n > 0 ? n : 0;
+		}
+	}
+	if (rollups)
+		return mergeRollups(*buffer, total);
+	sortPoints(*buffer, total);
+	return total;
+}
+
+// one segment with the blocks of all sources, they are in the same partition
+static int buildMerged(pendingSegment_t* segment, storageSegment_t** sources, size_t count) {
+	size_t* positions = calloc(count, sizeof(size_t));
+	void* buffer = NULL;
+	size_t capacity = 0;
+	int result = positions == NULL ? -1 : startSegment(segment);
+	if (positions == NULL)
+		libfail();
+	while (result == 0) {
+		// the smallest series and level left, the indices are sorted by them
+		const storageEntry_t* next = NULL;
+		for (size_t i = 0; i < count; i++) {
+			const storageEntry_t* entry = positions[i] < sources[i]->entries ? &(sources[i]->index[positions[i]]) : NULL;
+			if (entry != NULL && (next == NULL || entry->series < next->series
+					|| (entry->series == next->series && entry->level < next->level)))
+				next = entry;
+		}
+		if (next == NULL)
+			break;
+		uint32_t id = next->series;
+		int level = next->level;
+		ssize_t n = gatherBlocks(sources, positions, count, id, level, &buffer, &capacity);
+		result = n < 0 || addBlocks(segment, id, level, buffer, n) < 0 ? -1 : 0;
+	}
+	free(positions);
+	free(buffer);
+	return result < 0 ? -1 : finishSegment(segment);
+}
+
+/*
+ * Merges the newest segments of the partition while the one before them
+ * is no larger than they are together. The merged segment is mapped and
+ * swapped in before the others are deleted.
+ */
+static int mergeSegments(storage_t* storage, uint64_t partition, bool rollups) {
+	pthread_rwlock_rdlock(&(storage->segmentLock));
+	size_t first = findSegment(storage, partition), end = first;
+	while (end < storage->segmentCount && storage->segments[end].partition == partition)
+		end++;
+	storageSegment_t** sources = malloc((end - first + 1) * sizeof(storageSegment_t*));
+	if (sources == NULL) {
+		libfail();
+		pthread_rwlock_unlock(&(storage->segmentLock));
+		return -1;
+	}
+	size_t count = 0, size = 0;
+	pendingSegment_t merged = {.partition = partition, .since = UINT64_MAX, .rollups = rollups};
+	for (size_t i = end; i > first; i--) {
+		storageSegment_t* segment = &(storage->segments[i - 1]);
+		if (segment->rollups != rollups)
+			continue;
+		if (count > 0 && segment->size > size)
+			break;
+		sources[count++] = segment;
+		size += segment->size;
+		merged.since = segment->since < merged.since ? segment->since : merged.since;
+	}
+	if (count < 2) {
+		pthread_rwlock_unlock(&(storage->segmentLock));
+		free(sources);
+		return 0;
+	}
+
+	pthread_mutex_lock(&(storage->lock));
+	uint64_t sequence = storage->sequence++;
+	pthread_mutex_unlock(&(storage->lock));
+	segmentPath(storage, merged.path, partition, sequence, rollups ? ROLLUP_SUFFIX ".tmp" : SEGMENT_SUFFIX ".tmp");
+	int result = buildMerged(&merged, sources, count);
+	uint64_t* sequences = malloc(count * sizeof(uint64_t));
+	if (result == 0 && sequences == NULL) {
+		libfail();
+		result = -1;
+	}
+	for (size_t i = 0; result == 0 && i < count; i++)
+		sequences[i] = sources[i]->sequence;
+	pthread_rwlock_unlock(&(storage->segmentLock));
+	free(sources);
+	result = result < 0 || writeSegment(&merged) < 0 ? -1 : 0;
+	freePending(&merged);
+
+	char path[PATH_MAX];
+	storageSegment_t opened;
+	segmentPath(storage, path, partition, sequence, SUFFIX(rollups));
+	if (result < 0 || rename(merged.path, path) < 0) {
+		if (result == 0)
+			libfail();
+		unlink(merged.path);
+		free(sequences);
+		return -1;
+	}
+	syncDirectory(storage);
+	if (openSegment(storage, &opened, partition, sequence, rollups) < 0) {
+		// the sources are dropped when opening the storage again
+		free(sequences);
+		return -1;
+	}
+
+	pthread_rwlock_wrlock(&(storage->segmentLock));
+	pthread_mutex_lock(&(storage->lock));
+	size_t kept = 0;
+	for (size_t i = 0; i < storage->segmentCount; i++) {
+		storageSegment_t* segment = &(storage->segments[i]);
+		bool source = false;
+		for (size_t j = 0; j < count && segment->partition == partition && segment->rollups == rollups; j++)
+			source = source || segment->sequence == sequences[j];
+		if (source)
+			closeSegment(segment);
+		else
+			storage->segments[kept++] = *segment;
+	}
+	// the sources made room
+	storage->segments[kept++] = opened;
+	storage->segmentCount = kept;
+	qsort(storage->segments, storage->segmentCount, sizeof(storageSegment_t), compareSegments);
+	storage->stats.merges++;
+	storage->stats.merged += count;
+	storage->stats.rewritten += opened.size;
+	pthread_mutex_unlock(&(storage->lock));
+	pthread_rwlock_unlock(&(storage->segmentLock));
+
+	for (size_t i = 0; i < count; i++) {
+		segmentPath(storage, path, partition, sequences[i], SUFFIX(rollups));
+		(void) unlink(path);
+	}
+	syncDirectory(storage);
+	free(sequences);
+	return 0;
+}
+
+/*
+ * Deletes the segments of samples whose partition ends at or before the
+ * time (ms); the rollups stay. Returns the number of segments deleted.
+ */
+int storageExpire(storage_t* storage, uint64_t before) {
+	int expired = 0;
+	char path[PATH_MAX];
+	pthread_rwlock_wrlock(&(storage->segmentLock));
+	size_t kept = 0;
+	for (size_t i = 0; i < storage->segmentCount; i++) {
+		storageSegment_t* segment = &(storage->segments[i]);
+		if (segment->rollups || segment->partition + STORAGE_PARTITION > before) {
+			storage->segments[kept++] = *segment;
+			continue;
+		}
+		segmentPath(storage, path, segment->partition, segment->sequence, SEGMENT_SUFFIX);
+		closeSegment(segment);
+		if (unlink(path) < 0 && errno != ENOENT)
+			libfail();
+		expired++;
+	}
+	storage->segmentCount = kept;
+	pthread_mutex_lock(&(storage->lock));
+	storage->stats.expired += expired;
+	pthread_mutex_unlock(&(storage->lock));
+	pthread_rwlock_unlock(&(storage->segmentLock));
+	if (expired > 0)
+		syncDirectory(storage);
+	return expired;
+}
+
+// first entry of the series and level that ends at or after time
+static size_t findEntry(const storageSegment_t* segment, uint32_t id, int level, uint64_t time) {
+	size_t low = 0, high = segment->entries;
+	while (low < high) {
+		size_t middle = low + (high - low) / 2;
+		const storageEntry_t* entry = &(segment->index[middle]);
+		if (entry->series < id || (entry->series == id && (entry->level < level
+				|| (entry->level == level && entry->last < time))))
+			low = middle + 1;
+		else
+			high = middle;
+	}
+	return low;
+}
+
+// hands the points in [from, to] to the handler, damaged blocks are skipped
+static size_t scanBlock(const storageSegment_t* segment, const storageEntry_t* entry, uint64_t from, uint64_t to,
+		pointHandler_t handler, void* context) {
+	point_t points[STORAGE_BLOCK];
+	ssize_t count = decodePoints(segment, entry, points);
+	if (count <= 0)
+		return 0;
+	size_t first = lowerBound(points, count, from);
+	size_t last = to == UINT64_MAX ? (size_t) count : lowerBound(points, count, to + 1);
+	if (first < last)
+		handler(points + first, last - first, context);
+	return 1;
+}
+
+/*
+ * Calls the handler with the points of the series in [from, to] (ms), the
+ * stored ones in chunks sorted by time and in the order of the partitions,
+ * the buffered ones last. Late samples can make chunks overlap.
+ */
+int storageScan(storage_t* storage, const char* name, uint64_t from, uint64_t to, pointHandler_t handler, void* context) {
+	pthread_rwlock_rdlock(&(storage->segmentLock));
+	pthread_mutex_lock(&(storage->lock));
+	storage->stats.queries++;
+	uint32_t id = findSeries(storage, name);
+	if (id == NO_SERIES) {
+		pthread_mutex_unlock(&(storage->lock));
+		pthread_rwlock_unlock(&(storage->segmentLock));
+		return 0;
+	}
+	// copies, appends go on while the segments are read
+	series_t* series = storage->series[id];
+	size_t buffered = 0;
+	point_t* points = malloc((series->count + series->flushingCount + 1) * sizeof(point_t));
+	if (points == NULL) {
+		libfail();
+		pthread_mutex_unlock(&(storage->lock));
+		pthread_rwlock_unlock(&(storage->segmentLock));
+		return -1;
+	}
+	for (size_t i = 0; i < series->flushingCount; i++) {
+		if (series->flushing[i].time >= from && series->flushing[i].time <= to)
+			points[buffered++] = series->flushing[i];
+	}
+	for (size_t i = 0; i < series->count; i++) {
+		if (series->points[i].time >= from && series->points[i].time <= to)
+			points[buffered++] = series->points[i];
+	}
+	pthread_mutex_unlock(&(storage->lock));
+
+	size_t blocks = 0;
+	for (size_t i = findSegment(storage, from); i < storage->segmentCount && storage->segments[i].partition <= to; i++) {
+		const storageSegment_t* segment = &(storage->segments[i]);
+		if (segment->rollups)
+			continue;
+		for (size_t j = findEntry(segment, id, 0, from); j < segment->entries; j++) {
+			const storageEntry_t* entry = &(segment->index[j]);
+			if (entry->series != id || entry->level != 0 || entry->first > to)
+				break;
+			blocks += scanBlock(segment, entry, from, to, handler, context);
+		}
+	}
+
+	sortPoints(points, buffered);
+	if (buffered > 0)
+		handler(points, buffered, context);
+	pthread_rwlock_unlock(&(storage->segmentLock));
+	free(points);
+	__atomic_fetch_add(&(storage->stats.blocks), blocks, __ATOMIC_RELAXED);
+	return 0;
+}
+
+typedef struct {
+	point_t* points;
+	size_t count;
+	size_t max;
+} collector_t;
+
+static void collect(const point_t* points, size_t count, void* context) {
+	collector_t* collector = context;
+	size_t n = collector->count < collector->max ? collector->max - collector->count : 0;
+	memcpy(collector->points + collector->count, points, (count < n ? count : n) * sizeof(point_t));
+	collector->count += count;
+}
+
+/*
+ * The points of the series in [from, to] (ms) sorted by time. Returns
+ * their number, -1 if there are more than max.
+ */
+ssize_t storageQuery(storage_t* storage, const char* name, uint64_t from, uint64_t to, point_t* points, size_t max) {
+	collector_t collector = {points, 0, max};
+	if (storageScan(storage, name, from, to, collect, &collector) < 0)
+		return -1;
+	if (collector.count > max) {
+		error = "More points than space.";
+		return -1;
+	}
+	sortPoints(points, collector.count);
+	return collector.count;
+}
+
+typedef struct {
+	rollup_t* buckets;
+	size_t count;
+	size_t capacity;
+} bucketList_t;
+
+static int addBuckets(bucketList_t* list, const rollup_t* buckets, size_t count, uint64_t from, uint64_t to) {
+	if (grow((void**) &(list->buckets), &(list->capacity), list->count + count, sizeof(rollup_t)) < 0)
+		return -1;
+	for (size_t i = 0; i < count; i++) {
+		if (buckets[i].start >= from && buckets[i].start <= to)
+			list->buckets[list->count++] = buckets[i];
+	}
+	return 0;
+}
+
+// the buckets of the samples not flushed yet and the open one
+static int addMemoryBuckets(bucketList_t* list, const series_t* series, rollupLevel_t level, uint64_t from,
+		uint64_t to) {
+	uint64_t width = rollupWidths[level];
+	size_t count = 0;
+	point_t* points = malloc((series->count + series->flushingCount + 1) * sizeof(point_t));
+	double* values = malloc((series->count + series->flushingCount + 1) * sizeof(double));
+	rollup_t* buckets = malloc((series->count + series->flushingCount + 1) * sizeof(rollup_t));
+	int result = points == NULL || values == NULL || buckets == NULL ? -1 : 0;
+	if (result < 0)
+		libfail();
+	for (size_t i = 0; result == 0 && i < series->flushingCount + series->count; i++) {
+		const point_t* point = i < series->flushingCount ? &(series->flushing[i])
+			: &(series->points[i - series->flushingCount]);
+		uint64_t start = point->time / width * width;
+		if (start >= from && start <= to)
+			points[count++] = *point;
+	}
+	if (result == 0) {
+		sortPoints(points, count);
+		for (size_t i = 0; i < count; i++)
+			values[i] = points[i].value;
+		size_t n = bucketPoints(points, values, count, width, buckets);
+		if (series->open[level].count > 0)
+			buckets[n++] = series->open[level];
+		result = addBuckets(list, buckets, n, from, to);
+	}
+	free(points);
+	free(values);
+	free(buckets);
+	return result;
+}
+
+/*
+ * The buckets of a level of the series that start in [from, to] (ms),
+ * sorted by start. Only rollup segments are read, never samples on disk,
+ * so a query over months costs a few blocks. Returns the number of
+ * buckets, -1 if there are more than max.
+ */
+ssize_t storageRollups(storage_t* storage, const char* name, rollupLevel_t level, uint64_t from, uint64_t to,
+		rollup_t* rollups, size_t max) {
+	bucketList_t list = {NULL, 0, 0};
+	pthread_rwlock_rdlock(&(storage->segmentLock));
+	pthread_mutex_lock(&(storage->lock));
+	storage->stats.queries++;
+	uint32_t id = findSeries(storage, name);
+	if (id == NO_SERIES) {
+		pthread_mutex_unlock(&(storage->lock));
+		pthread_rwlock_unlock(&(storage->segmentLock));
+		return 0;
+	}
+	int result = addMemoryBuckets(&list, storage->series[id], level, from, to);
+	pthread_mutex_unlock(&(storage->lock));
+
+	size_t blocks = 0;
+	rollup_t buckets[STORAGE_BLOCK];
+	for (size_t i = findSegment(storage, from); result == 0 && i < storage->segmentCount
+			&& storage->segments[i].partition <= to; i++) {
+		const storageSegment_t* segment = &(storage->segments[i]);
+		if (!segment->rollups)
+			continue;
+		for (size_t j = findEntry(segment, id, level + 1, from); result == 0 && j < segment->entries; j++) {
+			const storageEntry_t* entry = &(segment->index[j]);
+			if (entry->series != id || entry->level != level + 1 || entry->first > to)
+				break;
+			ssize_t n = decodeRollups(segment, entry, buckets);
+			if (n > 0) {
+				result = addBuckets(&list, buckets, n, from, to);
+				blocks++;
+			}
+		}
+	}
+	pthread_rwlock_unlock(&(storage->segmentLock));
+	__atomic_fetch_add(&(storage->stats.blocks), blocks, __ATOMIC_RELAXED);
+	if (result < 0) {
+		free(list.buckets);
+		return -1;
+	}
+
+	size_t count = mergeRollups(list.buckets, list.count);
+	if (count > max) {
+		free(list.buckets);
+		error = "More buckets than space.";
+		return -1;
+	}
+	if (count > 0)
+		memcpy(rollups, list.buckets, count * sizeof(rollup_t));
+	free(list.buckets);
+	return count;
+}
+
+void getStorageStats(storage_t* storage, storageStats_t* stats) {
+	pthread_mutex_lock(&(storage->lock));
+	*stats = storage->stats;
+	stats->ignored = __atomic_load_n(&(storage->stats.ignored), __ATOMIC_RELAXED);
+	stats->blocks = __atomic_load_n(&(storage->stats.blocks), __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&(storage->lock));
+}
+
+void printStorageStats(storage_t* storage, FILE* file) {
+	storageStats_t stats;
+	getStorageStats(storage, &stats);
+	pthread_rwlock_rdlock(&(storage->segmentLock));
+	size_t segments = storage->segmentCount;
+	pthread_rwlock_unlock(&(storage->segmentLock));
+	fprintf(file, "storage: %zu series, %zu segments (%llu invalid, %llu expired, %llu merged in %llu merges "
+		"rewriting %llu bytes), %llu samples appended (%llu ignored), %llu flushed in %llu flushes, %llu bytes",
+		storage->seriesCount, segments, stats.invalid, stats.expired, stats.merged, stats.merges, stats.rewritten,
+		stats.appended, stats.ignored, stats.flushed, stats.flushes, stats.written);
+	if (stats.flushed > 0)
+		fprintf(file, " (%.1f per sample)", (double) stats.written / stats.flushed);
+	fprintf(file, ", %llu buckets in %llu bytes, %llu queries decoding %llu blocks\n", stats.buckets, stats.bucketBytes,
+		stats.queries, stats.blocks);
+}
@@ -0,0 +1,170 @@
+#ifndef STORAGE_H
+#define STORAGE_H
+
+#include "wire.h"
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+/*
+ * Embedded time-series storage of the receiver. Samples of INT and DOUBLE
+ * packets go into an in-memory write buffer per series (agent name) and
+ * are flushed into immutable segment files, every segment covering one
+ * partition of STORAGE_PARTITION ms:
+ *
+ *   series                          [length u32][name] per series, the id is the position
+ *   <partition>-<sequence>.segment  header, blocks, index, footer
+ *
+ * A block holds up to STORAGE_BLOCK samples of one series, times as deltas
+ * of deltas and values XOR'd like the batch format (column.h). The index
+ * at the end of a segment has an entry per block (series, first and last
+ * time, offset, length), sorted by series and time, so it is a sparse
+ * index from series and time to offset. Segments are mmap'd; a query only
+ * looks at the segments of the partitions it covers, binary searches their
+ * indices and decodes the blocks that overlap its range.
+ *
+ * Flushes keep adding small segments, so after each one the newest
+ * segments of a partition are merged while the one before them is no
+ * larger than they are together: like a binary counter, a partition keeps
+ * a few segments and a sample is rewritten a few times. The footer of a
+ * merged segment has the oldest sequence it replaces, so segments left
+ * over by a crash before they were deleted are dropped when opening.
+ *
+ * Samples of DATA_VALUE agents are also rolled up into buckets of 1 min,
+ * 5 min and 1 h (min, max, sum, count and last) whenever they are flushed.
+ * Closed buckets go into rollup segments next to the sample segments,
+ *
+ *   <partition>-<sequence>.rollup   same layout, blocks of buckets
+ *
+ * and the open ones stay in memory until a later bucket starts. Buckets
+ * of the same series and start merge, so late samples and restarts just
+ * add partial buckets; rollup segments are merged like sample segments,
+ * which combines those buckets on disk as well. Samples expire with
+ * storageExpire, the rollups stay: a partition of them is a few segments.
+ *
+ * Appends may come from any thread. Flushes and expiries come from one
+ * thread at a time.
+ */
+
+#define STORAGE_PARTITION (24ull * 60 * 60 * 1000) // ms
+#define STORAGE_BLOCK 256
+#define STORAGE_FLUSH_INTERVAL 60 // s
+#define STORAGE_MAX_SERIES (1 << 20)
+#define STORAGE_RETENTION (7 * STORAGE_PARTITION) // of the samples, ms
+
+typedef struct {
+	uint64_t time; // ms
+	double value;
+} point_t;
+
+typedef enum {
+	ROLLUP_1M,
+	ROLLUP_5M,
+	ROLLUP_1H,
+	ROLLUP_LEVELS
+} rollupLevel_t;
+
+typedef struct {
+	uint64_t start; // of the bucket
+	uint64_t time; // of the last sample
+	uint64_t count;
+	double min;
+	double max;
+	double sum;
+	double last;
+} rollup_t;
+
+typedef struct {
+	char* name;
+	point_t* points; // write buffer
+	size_t count;
+	size_t capacity;
+	point_t* flushing; // taken by the running flush, still visible to queries
+	size_t flushingCount;
+	bool rollups; // a DATA_VALUE agent
+	rollup_t open[ROLLUP_LEVELS]; // buckets with a count of 0 are unused
+} series_t;
+
+typedef struct {
+	uint32_t series;
+	uint16_t count;
+	uint8_t level; // 0 for samples, 1 + rollupLevel_t for buckets
+	uint8_t reserved;
+	uint64_t first; // time, or start of buckets
+	uint64_t last;
+	uint64_t offset;
+	uint32_t length;
+	uint32_t crc;
+} storageEntry_t;
+
+typedef struct {
+	uint64_t partition; // start time
+	uint64_t sequence;
+	uint64_t since; // oldest sequence merged into it, its own one for flushed segments
+	bool rollups;
+	char* map;
+	size_t size;
+	const storageEntry_t* index; // in the map
+	size_t entries;
+} storageSegment_t;
+
+typedef struct {
+	unsigned long long appended;
+	unsigned long long ignored; // not INT or DOUBLE, or META
+	unsigned long long flushes;
+	unsigned long long flushed; // samples
+	unsigned long long written; // bytes of samples
+	unsigned long long segments;
+	unsigned long long buckets; // written to rollup segments
+	unsigned long long bucketBytes;
+	unsigned long long expired; // segments
+	unsigned long long merges;
+	unsigned long long merged; // segments replaced by merges
+	unsigned long long rewritten; // bytes written by merges
+	unsigned long long invalid; // segments ignored when opening
+	unsigned long long queries;
+	unsigned long long blocks; // decoded by queries
+} storageStats_t;
+
+typedef struct storage {
+	char* directory;
+	int seriesFd;
+
+	pthread_mutex_t lock; // series and write buffers
+	series_t** series; // by id
+	size_t seriesCount;
+	size_t seriesCapacity;
+	uint32_t* slots; // hash table of ids by name, UINT32_MAX for free slots
+	size_t slotCount;
+
+	pthread_rwlock_t segmentLock;
+	storageSegment_t* segments; // sorted by partition and sequence, samples and rollups
+	size_t segmentCount;
+	size_t segmentCapacity;
+	uint64_t sequence; // of the next segment
+
+	storageStats_t stats;
+} storage_t;
+
+typedef void (*pointHandler_t)(const point_t*, size_t, void*);
+
+int storageOpen(storage_t*, const char*);
+void storageClose(storage_t*);
+
+int storageAppend(storage_t*, const wirePacket_t*);
+int storageFlush(storage_t*);
+int storageExpire(storage_t*, uint64_t);
+
+int storageScan(storage_t*, const char*, uint64_t, uint64_t, pointHandler_t, void*);
+ssize_t storageQuery(storage_t*, const char*, uint64_t, uint64_t, point_t*, size_t);
+ssize_t storageRollups(storage_t*, const char*, rollupLevel_t, uint64_t, uint64_t, rollup_t*, size_t);
+uint64_t getRollupWidth(rollupLevel_t);
+
+void getStorageStats(storage_t*, storageStats_t*);
+void printStorageStats(storage_t*, FILE*);
+
+#endif
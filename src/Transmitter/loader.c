@@ -0,0 +1,489 @@
+#define _GNU_SOURCE
+#include "loader.h"
+#include "worker.h"
+#include "registry.h"
+#include "error.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE)
+#define EVENT_BUFFER 4096
+
+typedef struct {
+	pthread_mutex_t lock;
+	pthread_cond_t done;
+	size_t remaining;
+} batch_t;
+
+typedef struct {
+	batch_t* batch;
+	arena_t* arena;
+	char* path;
+	bool exists;
+	uint64_t hash;
+	agent_t* agent; // NULL if the file could not be read or parsed
+	char* message; // copy of the error of the worker if so
+} parseJob_t;
+
+typedef struct {
+	char** names;
+	size_t count;
+	size_t capacity;
+} nameSet_t;
+
+// editor swap and backup files
+static bool isIgnored(const char* name) {
+	size_t length = strlen(name);
+	return name[0] == '.' || length == 0 || name[length - 1] == '~'
+		|| (length > 4 && strcmp(name + length - 4, ".swp") == 0);
+}
+
+static uint64_t hashOf(const char* content, size_t length) {
+	uint64_t hash = 14695981039346656037ULL;
+	for (size_t i = 0; i < length; i++) {
+		hash ^= (unsigned char) content[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+static char* readFile(const char* path, size_t* length) {
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		libfail();
+		return NULL;
+	}
+	struct stat info;
+	if (fstat(fd, &info) < 0) {
+		libfail();
+		close(fd);
+		return NULL;
+	}
+	if (!S_ISREG(info.st_mode)) {
+		close(fd);
+		errno = ENOENT;
+		libfail();
+		return NULL;
+	}
+	size_t capacity = info.st_size + 1;
+	char* content = malloc(capacity);
+	size_t used = 0;
+	while (content != NULL) {
+		if (used + 1 == capacity) {
+			// the file grew while we read it
+			char* tmp = realloc(content, capacity * 2);
+			if (tmp == NULL) {
+				free(content);
+				content = NULL;
+				break;
+			}
+			content = tmp;
+			capacity *= 2;
+		}
+		ssize_t tmp = read(fd, content + used, capacity - used - 1);
+		if (tmp < 0 && errno == EINTR)
+			continue;
+		if (tmp < 0) {
+			free(content);
+			content = NULL;
+			break;
+		}
+		if (tmp == 0)
+			break;
+		used += tmp;
+	}
+	if (content == NULL)
+		libfail();
+	else
+		content[used] = '\0';
+	close(fd);
+	*length = used;
+	return content;
+}
+
+/*
+ * Parses a file into a new agent. Returns -1 if the file can not be read,
+ * otherwise the hash is set and the agent is NULL if parsing failed.
+ */
+static int loadFile(const char* path, arena_t* arena, uint64_t* hash, agent_t** result) {
+	size_t length;
+	char* content = readFile(path, &length);
+	if (content == NULL)
+		return -1;
+	*hash = hashOf(content, length);
+
+	agent_t* agent = calloc(1, sizeof(agent_t));
+	if (agent == NULL) {
+		libfail();
+	} else if (parseAgentBuffer(content, length, agent, arena) < 0) {
+		free(agent);
+		agent = NULL;
+	} else if (agent->name == NULL) {
+		error = "Agent has no name.";
+		free(agent);
+		agent = NULL;
+	}
+	free(content);
+	*result = agent;
+	return 0;
+}
+
+static void parseJob(void* argument) {
+	parseJob_t* job = argument;
+	job->exists = loadFile(job->path, job->arena, &(job->hash), &(job->agent)) == 0 || errno != ENOENT;
+	if (job->exists && job->agent == NULL)
+		job->message = strdup(error);
+
+	batch_t* batch = job->batch;
+	pthread_mutex_lock(&(batch->lock));
+	if (--batch->remaining == 0)
+		pthread_cond_signal(&(batch->done));
+	pthread_mutex_unlock(&(batch->lock));
+}
+
+static bool addName(nameSet_t* set, const char* name) {
+	for (size_t i = 0; i < set->count; i++)
+		if (strcmp(set->names[i], name) == 0)
+			return true;
+	if (set->count == set->capacity) {
+		size_t capacity = set->capacity == 0 ? 16 : set->capacity * 2;
+		char** tmp = realloc(set->names, capacity * sizeof(char*));
+		if (tmp == NULL) {
+			libfail();
+			return false;
+		}
+		set->names = tmp;
+		set->capacity = capacity;
+	}
+	set->names[set->count] = strdup(name);
+	if (set->names[set->count] == NULL) {
+		libfail();
+		return false;
+	}
+	set->count++;
+	return true;
+}
+
+static void clearNames(nameSet_t* set) {
+	for (size_t i = 0; i < set->count; i++)
+		free(set->names[i]);
+	free(set->names);
+	set->names = NULL;
+	set->count = 0;
+	set->capacity = 0;
+}
+
+static int listDirectory(loader_t* loader, nameSet_t* set) {
+	DIR* directory = opendir(loader->directory);
+	if (directory == NULL) {
+		libfail();
+		return -1;
+	}
+	struct dirent* entry;
+	while ((entry = readdir(directory)) != NULL) {
+		if (isIgnored(entry->d_name))
+			continue;
+		if (!addName(set, entry->d_name)) {
+			closedir(directory);
+			return -1;
+		}
+	}
+	closedir(directory);
+	return 0;
+}
+
+static loadedAgent_t* findLoaded(loader_t* loader, const char* file) {
+	for (size_t i = 0; i < loader->count; i++)
+		if (strcmp(loader->agents[i].file, file) == 0)
+			return &(loader->agents[i]);
+	return NULL;
+}
+
+static loadedAgent_t* findNamed(loader_t* loader, const char* name) {
+	for (size_t i = 0; i < loader->count; i++)
+		if (strcmp(loader->agents[i].agent->name, name) == 0)
+			return &(loader->agents[i]);
+	return NULL;
+}
+
+static loadedAgent_t* addLoaded(loader_t* loader, const char* file) {
+	if (loader->count == loader->capacity) {
+		size_t capacity = loader->capacity == 0 ? 64 : loader->capacity * 2;
+		loadedAgent_t* tmp = realloc(loader->agents, capacity * sizeof(loadedAgent_t));
+		if (tmp == NULL) {
+			libfail();
+			return NULL;
+		}
+		loader->agents = tmp;
+		loader->capacity = capacity;
+	}
+	loadedAgent_t* loaded = &(loader->agents[loader->count]);
+	loaded->file = strdup(file);
+	if (loaded->file == NULL) {
+		libfail();
+		return NULL;
+	}
+	loader->count++;
+	return loaded;
+}
+
+static void freeAgent(agent_t* agent, void* context) {
+	(void) context;
+	free(agent);
+}
+
+// a job of the agent may still run, the agent is freed after it
+static void removeLoaded(loader_t* loader, loadedAgent_t* loaded) {
+	(void) retireAgent(loaded->runtime, freeAgent, NULL);
+	free(loaded->file);
+	*loaded = loader->agents[--loader->count];
+}
+
+/*
+ * Brings one file in line with the scheduled agents. The new version of a
+ * changed agent is scheduled before the old one is removed; with the same
+ * name it keeps its registry id, so queued packets stay valid. A name can
+ * only be used by one file, later files with it are rejected.
+ */
+static int apply(loader_t* loader, const char* file, agent_t* agent, uint64_t hash, bool exists) {
+	loadedAgent_t* loaded = findLoaded(loader, file);
+	if (!exists) {
+		if (loaded == NULL)
+			return 0;
+		removeLoaded(loader, loaded);
+		loader->stats.removed++;
+		return 1;
+	}
+	if (loaded != NULL && loaded->hash == hash) {
+		free(agent);
+		loader->stats.unchanged++;
+		return 0;
+	}
+	if (agent == NULL) {
+		fprintf(stderr, "%s/%s: %s\n", loader->directory, file, error);
+		loader->stats.failed++;
+		return 0;
+	}
+	loadedAgent_t* named = findNamed(loader, agent->name);
+	if (named != NULL && named != loaded) {
+		fprintf(stderr, "%s/%s: Agent '%s' is already defined in %s.\n", loader->directory, file, agent->name, named->file);
+		free(agent);
+		loader->stats.failed++;
+		return 0;
+	}
+
+	runtime_t* runtime = scheduleAgent(agent);
+	if (runtime == NULL) {
+		fprintf(stderr, "%s/%s: %s\n", loader->directory, file, error);
+		if (loaded != NULL)
+			(void) registerAgent(loaded->agent); // the failed schedule may have replaced it
+		free(agent);
+		loader->stats.failed++;
+		return 0;
+	}
+	if (loaded != NULL) {
+		(void) retireAgent(loaded->runtime, freeAgent, NULL);
+		loader->stats.rescheduled++;
+	} else {
+		loaded = addLoaded(loader, file);
+		if (loaded == NULL) {
+			(void) retireAgent(runtime, freeAgent, NULL);
+			return -1;
+		}
+		loader->stats.added++;
+	}
+	loaded->hash = hash;
+	loaded->agent = agent;
+	loaded->runtime = runtime;
+	return 1;
+}
+
+static bool isPresent(loader_t* loader, const char* file) {
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/%s", loader->directory, file);
+	return access(path, F_OK) == 0 || errno != ENOENT;
+}
+
+static int applyFile(loader_t* loader, const char* file) {
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/%s", loader->directory, file);
+	uint64_t hash = 0;
+	agent_t* agent = NULL;
+	bool exists = loadFile(path, &(loader->strings), &hash, &agent) == 0 || errno != ENOENT;
+	return apply(loader, file, agent, hash, exists);
+}
+
+// reads all files on a temporary pool and schedules them in directory order
+static int loadAll(loader_t* loader, nameSet_t* set, size_t threads) {
+	if (set->count == 0)
+		return 0;
+	parseJob_t* jobs = calloc(set->count, sizeof(parseJob_t));
+	if (jobs == NULL) {
+		libfail();
+		return -1;
+	}
+	batch_t batch = {.remaining = 0};
+	pthread_mutex_init(&(batch.lock), NULL);
+	pthread_cond_init(&(batch.done), NULL);
+
+	pool_t pool;
+	if (threads == 0)
+		threads = getCoreCount();
+	if (threads > set->count)
+		threads = set->count;
+	int result = poolInit(&pool, threads);
+	for (size_t i = 0; i < set->count && result == 0; i++) {
+		jobs[i].batch = &batch;
+		jobs[i].arena = &(loader->strings);
+		if (asprintf(&(jobs[i].path), "%s/%s", loader->directory, set->names[i]) < 0) {
+			jobs[i].path = NULL;
+			libfail();
+			result = -1;
+			break;
+		}
+		pthread_mutex_lock(&(batch.lock));
+		batch.remaining++;
+		pthread_mutex_unlock(&(batch.lock));
+		if (!poolSubmit(&pool, parseJob, &(jobs[i]))) {
+			pthread_mutex_lock(&(batch.lock));
+			batch.remaining--;
+			pthread_mutex_unlock(&(batch.lock));
+			result = -1;
+		}
+	}
+	pthread_mutex_lock(&(batch.lock));
+	while (batch.remaining > 0)
+		pthread_cond_wait(&(batch.done), &(batch.lock));
+	pthread_mutex_unlock(&(batch.lock));
+	if (pool.workers != NULL)
+		poolDestroy(&pool);
+
+	for (size_t i = 0; i < set->count; i++) {
+		if (result == 0 && jobs[i].agent == NULL) // the error of the worker, for apply to print
+			fail("%s", jobs[i].message != NULL ? jobs[i].message : "Out of memory.");
+		if (result == 0 && jobs[i].exists && apply(loader, set->names[i], jobs[i].agent, jobs[i].hash, true) < 0)
+			result = -1;
+		else if (result < 0)
+			free(jobs[i].agent);
+		free(jobs[i].message);
+		free(jobs[i].path);
+	}
+	free(jobs);
+	pthread_mutex_destroy(&(batch.lock));
+	pthread_cond_destroy(&(batch.done));
+	return result;
+}
+
+int loaderInit(loader_t* loader, const char* directory, size_t threads) {
+	memset(loader, 0, sizeof(loader_t));
+	if (arenaInit(&(loader->strings)) < 0)
+		return -1;
+	loader->directory = strdup(directory);
+	if (loader->directory == NULL) {
+		libfail();
+		arenaDestroy(&(loader->strings));
+		return -1;
+	}
+	// watch first, so nothing written during the initial load is missed
+	loader->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (loader->fd < 0 || inotify_add_watch(loader->fd, directory, WATCH_EVENTS) < 0) {
+		libfail();
+		loaderDestroy(loader);
+		return -1;
+	}
+
+	nameSet_t set = {0};
+	int result = listDirectory(loader, &set);
+	if (result == 0)
+		result = loadAll(loader, &set, threads);
+	clearNames(&set);
+	if (result < 0) {
+		loaderDestroy(loader);
+		return -1;
+	}
+	return 0;
+}
+
+void loaderDestroy(loader_t* loader) {
+	while (loader->count > 0)
+		removeLoaded(loader, &(loader->agents[loader->count - 1]));
+	waitForRetired(); // their strings are in the arena
+	free(loader->agents);
+	loader->agents = NULL;
+	loader->capacity = 0;
+	if (loader->fd >= 0)
+		close(loader->fd);
+	loader->fd = -1;
+	free(loader->directory);
+	loader->directory = NULL;
+	arenaDestroy(&(loader->strings));
+}
+
+int loaderUpdate(loader_t* loader) {
+	char buffer[EVENT_BUFFER] __attribute__((aligned(__alignof__(struct inotify_event))));
+	nameSet_t set = {0};
+	bool overflow = false;
+	int result = 0;
+
+	for (;;) {
+		ssize_t length = read(loader->fd, buffer, sizeof(buffer));
+		if (length < 0 && errno == EINTR)
+			continue;
+		if (length < 0 && errno == EAGAIN)
+			break;
+		if (length <= 0) {
+			libfail();
+			result = -1;
+			break;
+		}
+		for (char* position = buffer; position < buffer + length;) {
+			struct inotify_event* event = (struct inotify_event*) position;
+			position += sizeof(struct inotify_event) + event->len;
+			if (event->mask & IN_Q_OVERFLOW)
+				overflow = true;
+			else if (event->len > 0 && !isIgnored(event->name) && !addName(&set, event->name))
+				result = -1;
+		}
+	}
+
+	// events were lost, so compare everything we know with the directory
+	if (overflow && result == 0) {
+		for (size_t i = 0; i < loader->count && result == 0; i++)
+			if (!addName(&set, loader->agents[i].file))
+				result = -1;
+		if (result == 0)
+			result = listDirectory(loader, &set);
+	}
+
+	// removals first, so a name that moved to another file is free again
+	int changes = 0;
+	for (size_t i = 0; i < set.count && result == 0; i++) {
+		if (!isPresent(loader, set.names[i]))
+			changes += apply(loader, set.names[i], NULL, 0, false);
+	}
+	for (size_t i = 0; i < set.count && result == 0; i++) {
+		int tmp = applyFile(loader, set.names[i]);
+		if (tmp < 0)
+			result = -1;
+		else
+			changes += tmp;
+	}
+	clearNames(&set);
+	return result < 0 ? -1 : changes;
+}
+
+void printLoaderStats(loader_t* loader, FILE* file) {
+	fprintf(file, "%s: %zu agents, %llu added, %llu removed, %llu rescheduled, %llu unchanged, %llu failed\n",
+		loader->directory, loader->count, loader->stats.added, loader->stats.removed,
+		loader->stats.rescheduled, loader->stats.unchanged, loader->stats.failed);
+}
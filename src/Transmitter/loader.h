@@ -0,0 +1,53 @@
+#ifndef LOADER_H
+#define LOADER_H
+
+#include "conf.h"
+#include "runner.h"
+#include "arena.h"
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+
+/*
+ * Loads every agent file of a directory (in parallel at startup) and keeps
+ * the scheduled agents in sync with it. Changes are picked up with inotify
+ * and applied one file at a time: an agent is only rescheduled if the
+ * content of its file changed, all other agents keep their timers. A file
+ * that does not parse leaves the previous version of its agent running.
+ * Strings of replaced agents stay in the arena until the loader is
+ * destroyed, only distinct strings take up space.
+ */
+
+typedef struct {
+	char* file; // name inside the directory
+	uint64_t hash; // of the file content
+	agent_t* agent;
+	runtime_t* runtime;
+} loadedAgent_t;
+
+typedef struct {
+	unsigned long long added;
+	unsigned long long removed;
+	unsigned long long rescheduled;
+	unsigned long long unchanged; // events for files with the same content
+	unsigned long long failed; // files that did not parse
+} loaderStats_t;
+
+typedef struct {
+	char* directory;
+	int fd; // inotify
+	loadedAgent_t* agents;
+	size_t count;
+	size_t capacity;
+	arena_t strings; // of all loaded agents
+	loaderStats_t stats;
+} loader_t;
+
+int loaderInit(loader_t*, const char*, size_t);
+void loaderDestroy(loader_t*);
+int loaderUpdate(loader_t*);
+
+void printLoaderStats(loader_t*, FILE*);
+
+#endif
@@ -1,11 +1,187 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
 
-const char* configFile = "receiver.conf";
+#include "error.h"
+#include "packet.h"
+#include "timer.h"
+#include "spool.h"
+#include "transport.h"
+#include "runner.h"
+#include "loader.h"
+#include "metrics.h"
+
+#define DEFAULT_HOST "localhost"
+#define DEFAULT_PORT "4242"
+#define POLL_INTERVAL 10 // ms
+#define REPLAY_BATCHES 4 // per loop iteration
+#define RECONNECT_INTERVAL (5ull * 1000 * 1000 * 1000) // ns
+#define HEARTBEAT_INTERVAL (10ull * 1000 * 1000 * 1000) // ns
+#define STATS_INTERVAL (60ull * 1000 * 1000 * 1000) // ns
+
+const char* configFile = "transmitter.conf";
 const char* agentDirectory = "agents.d";
+const char* spoolDirectory = "spool.d";
+const char* metricsSocket = "transmitter.metrics";
+
+static int connectTo(const char* host, const char* port) {
+	struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+	struct addrinfo* addresses;
+	int tmp = getaddrinfo(host, port, &hints, &addresses);
+	if (tmp != 0) {
+		error = gai_strerror(tmp);
+		return -1;
+	}
+	int fd = -1;
+	for (struct addrinfo* address = addresses; address != NULL && fd < 0; address = address->ai_next) {
+		fd = socket(address->ai_family, address->ai_socktype | SOCK_CLOEXEC, address->ai_protocol);
+		if (fd >= 0 && connect(fd, address->ai_addr, address->ai_addrlen) < 0) {
+			libfail();
+			close(fd);
+			fd = -1;
+		}
+	}
+	freeaddrinfo(addresses);
+	return fd;
+}
+
+static int parseNumber(const char* text, unsigned long* value) {
+	char* end;
+	errno = 0;
+	unsigned long tmp = strtoul(text, &end, 10);
+	if (text[0] < '0' || text[0] > '9' || *end != '\0' || errno != 0) {
+		fail("Invalid number '%s'.", text);
+		return -1;
+	}
+	*value = tmp;
+	return 0;
+}
 
 int main(int argc, char** argv) {
 
-	printf("This is the receiver.\n");
+	printf("This is the transmitter.\n");
+
+	const char* host = argc > 1 ? argv[1] : DEFAULT_HOST;
+	const char* port = argc > 2 ? argv[2] : DEFAULT_PORT;
+	compression_t compression = getCompressions() & COMPRESS_MASK(COMPRESS_LZ4) ? COMPRESS_LZ4 : COMPRESS_NONE;
+	if (argc > 3 && parseCompression(argv[3], &compression) < 0) {
+		fprintf(stderr, "Error: %s\n", error);
+		return 1;
+	}
+	// the flush window: bytes and ms a batch may collect before it is sent
+	unsigned long flushBytes = TRANSPORT_FLUSH_BYTES, flushLatency = TRANSPORT_FLUSH_LATENCY;
+	if ((argc > 4 && parseNumber(argv[4], &flushBytes) < 0) || (argc > 5 && parseNumber(argv[5], &flushLatency) < 0)) {
+		fprintf(stderr, "Error: %s\n", error);
+		return 1;
+	}
+
+	if (errorInit() < 0 || packetInit() < 0 || runnerInit(0, 0) < 0) {
+		fprintf(stderr, "Error: %s\n", error);
+		return 1;
+	}
+	if (metricsServe(metricsSocket) < 0)
+		fprintf(stderr, "Could not serve metrics on %s: %s\n", metricsSocket, error);
+
+	spool_t spool;
+	if (mkdir(spoolDirectory, 0750) < 0 && errno != EEXIST) {
+		fprintf(stderr, "Error: %s: %s\n", spoolDirectory, strerror(errno));
+		return 1;
+	}
+	if (spoolOpen(&spool, spoolDirectory, SPOOL_SEGMENT_SIZE, SPOOL_MAX_SEGMENTS) < 0) {
+		fprintf(stderr, "Error: %s: %s\n", spoolDirectory, error);
+		return 1;
+	}
+	setPacketSpool(&spool);
+
+	loader_t loader;
+	if (loaderInit(&loader, agentDirectory, 0) < 0) {
+		fprintf(stderr, "Error: %s: %s\n", agentDirectory, error);
+		return 1;
+	}
+	printLoaderStats(&loader, stderr);
+
+	transport_t* transport = malloc(sizeof(transport_t));
+	if (transport == NULL) {
+		fprintf(stderr, "Error: %s\n", strerror(errno));
+		return 1;
+	}
+	transportInit(transport, -1, STREAM, flushBytes, flushLatency);
+
+	unsigned long long lastConnect = 0, lastHeartbeat = 0, lastStats = getRelativeTime();
+	for (;;) {
+		struct pollfd watch = {.fd = loader.fd, .events = POLLIN};
+		if (poll(&watch, 1, POLL_INTERVAL) > 0 && loaderUpdate(&loader) < 0)
+			fprintf(stderr, "Error: %s: %s\n", agentDirectory, error);
+
+		unsigned long long now = getRelativeTime();
+		if (transport->fd < 0 && now - lastConnect >= RECONNECT_INTERVAL) {
+			lastConnect = now;
+			int fd = connectTo(host, port);
+			if (fd < 0)
+				fprintf(stderr, "Could not connect to %s:%s: %s\n", host, port, error);
+			else {
+				transportConnect(transport, fd);
+				// the answer is taken below, without blocking the loop
+				if (transportOfferHello(transport, compression) < 0) {
+					fprintf(stderr, "Handshake with %s:%s failed: %s\n", host, port, error);
+					close(fd);
+					transport->fd = -1;
+					transportDestroy(transport);
+				}
+			}
+		}
+
+		if (transport->fd >= 0 && transport->hello != NULL) {
+			int tmp = transportAwaitHello(transport, 0);
+			if (tmp < 0) {
+				fprintf(stderr, "Handshake with %s:%s failed: %s\n", host, port, error);
+				close(transport->fd);
+				transport->fd = -1;
+				transportDestroy(transport);
+			}
+		}
+
+		if (transport->fd >= 0 && transport->hello == NULL) {
+			// live lanes first, so a long replay does not hold up alarms
+			ssize_t tmp = transportPump(transport);
+			for (int i = 0; i < REPLAY_BATCHES && tmp >= 0; i++) {
+				tmp = transportReplay(transport, &spool);
+				if (tmp == 0)
+					break;
+			}
+			if (tmp >= 0 && now - lastHeartbeat >= HEARTBEAT_INTERVAL) {
+				lastHeartbeat = now;
+				tmp = sendHeartbeat(transport->fd);
+			}
+			if (tmp < 0) {
+				fprintf(stderr, "Connection lost: %s\n", error);
+				close(transport->fd);
+				transport->fd = -1;
+				if (transportSpill(transport, &spool) < 0)
+					fprintf(stderr, "Error: %s: %s\n", spoolDirectory, error);
+				printTransportStats(transport, stderr);
+				transportDestroy(transport);
+			}
+		}
+		(void) spoolSync(&spool);
+
+		if (now - lastStats >= STATS_INTERVAL) {
+			lastStats = now;
+			printLoaderStats(&loader, stderr);
+			printRunnerStats(stderr);
+			printSpoolStats(&spool, stderr);
+			printLaneStats(stderr);
+			printRecentErrors(stderr);
+			if (transport->fd >= 0)
+				printTransportStats(transport, stderr);
+		}
+	}
 
 	return 0;
 }
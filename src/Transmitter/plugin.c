@@ -0,0 +1,134 @@
+#include "plugin.h"
+#include "procfs.h"
+#include "error.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <dlfcn.h>
+
+struct plugin {
+	char* name;
+	void* handle; // NULL for built-in plugins
+	int (*init)(void);
+	int (*collect)(agent_t*, void*);
+	void (*destroy)(void);
+	size_t users;
+	plugin_t* next;
+};
+
+static const struct {
+	const char* name;
+	int (*init)(void);
+	int (*collect)(agent_t*, void*);
+	void (*destroy)(void);
+} builtins[] = {
+	{"procstat", procstatInit, procstatCollect, procstatDestroy},
+	{"meminfo", meminfoInit, meminfoCollect, meminfoDestroy},
+	{"loadavg", loadavgInit, loadavgCollect, loadavgDestroy}
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static plugin_t* plugins = NULL;
+
+static int load(plugin_t* plugin) {
+	for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++) {
+		if (strcmp(builtins[i].name, plugin->name) == 0) {
+			plugin->init = builtins[i].init;
+			plugin->collect = builtins[i].collect;
+			plugin->destroy = builtins[i].destroy;
+			return 0;
+		}
+	}
+
+	plugin->handle = dlopen(plugin->name, RTLD_NOW | RTLD_LOCAL);
+	if (plugin->handle == NULL) {
+		fail("Could not load plugin: %s", dlerror());
+		return -1;
+	}
+	plugin->init = (int (*)(void)) dlsym(plugin->handle, "init");
+	plugin->collect = (int (*)(agent_t*, void*)) dlsym(plugin->handle, "collect");
+	plugin->destroy = (void (*)(void)) dlsym(plugin->handle, "destroy");
+	if (plugin->init == NULL || plugin->collect == NULL || plugin->destroy == NULL) {
+		fail("Plugin '%s' does not export init, collect and destroy.", plugin->name);
+		dlclose(plugin->handle);
+		return -1;
+	}
+	return 0;
+}
+
+// the same plugin is only loaded and initialized once, however many agents use it
+plugin_t* openPlugin(const char* name) {
+	pthread_mutex_lock(&lock);
+	plugin_t* plugin = plugins;
+	while (plugin != NULL && strcmp(plugin->name, name) != 0)
+		plugin = plugin->next;
+	if (plugin != NULL) {
+		plugin->users++;
+		pthread_mutex_unlock(&lock);
+		return plugin;
+	}
+
+	plugin = calloc(1, sizeof(plugin_t));
+	if (plugin == NULL || (plugin->name = strdup(name)) == NULL) {
+		pthread_mutex_unlock(&lock);
+		libfail();
+		free(plugin);
+		return NULL;
+	}
+	if (load(plugin) < 0) {
+		pthread_mutex_unlock(&lock);
+		free(plugin->name);
+		free(plugin);
+		return NULL;
+	}
+	error = "Plugin initialization failed.";
+	if (plugin->init() < 0) {
+		pthread_mutex_unlock(&lock);
+		if (plugin->handle != NULL)
+			dlclose(plugin->handle);
+		free(plugin->name);
+		free(plugin);
+		return NULL;
+	}
+	plugin->users = 1;
+	plugin->next = plugins;
+	plugins = plugin;
+	pthread_mutex_unlock(&lock);
+	return plugin;
+}
+
+void closePlugin(plugin_t* plugin) {
+	pthread_mutex_lock(&lock);
+	if (--plugin->users > 0) {
+		pthread_mutex_unlock(&lock);
+		return;
+	}
+	plugin_t** link = &plugins;
+	while (*link != plugin)
+		link = &((*link)->next);
+	*link = plugin->next;
+	// under the lock, an openPlugin of the same name has to wait until it is gone
+	plugin->destroy();
+	if (plugin->handle != NULL)
+		dlclose(plugin->handle);
+	pthread_mutex_unlock(&lock);
+	free(plugin->name);
+	free(plugin);
+}
+
+// output like runScript, state is that of the agent
+int collectPlugin(plugin_t* plugin, agent_t* agent, void** state, char* output, size_t size, size_t* length) {
+	pluginSample_t sample = {.output = output, .size = size, .length = 0, .state = *state};
+	output[0] = '\0';
+	// built-in plugins give a better reason
+	error = "Plugin failed.";
+	int status = plugin->collect(agent, &sample);
+	*state = sample.state;
+	if (sample.length >= size)
+		sample.length = size - 1;
+	output[sample.length] = '\0';
+	*length = sample.length;
+	return status;
+}
+
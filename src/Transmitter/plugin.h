@@ -0,0 +1,51 @@
+#ifndef PLUGIN_H
+#define PLUGIN_H
+
+#include "conf.h"
+
+#include <stddef.h>
+#include <stdarg.h>
+#include <stdio.h>
+
+/*
+ * Plugins take samples in process, without the fork and exec of a script.
+ * An agent selects one with plugin = <name> instead of a script: procstat,
+ * meminfo and loadavg are built in (see procfs.h), any other name is a
+ * shared object that is loaded with dlopen and has to export
+ *
+ *   int init(void)                       before the first agent, < 0 fails
+ *   int collect(agent_t*, void* out)     for every sample
+ *   void destroy(void)                   after the last agent
+ *
+ * out is a pluginSample_t. collect writes text to it like a script would
+ * write to its standard output and returns what would be the exit status,
+ * or -1 on failure. It runs on worker threads, for different agents at the
+ * same time, but never twice at once for the same agent.
+ */
+
+typedef struct {
+	char* output; // null terminated
+	size_t size;
+	size_t length;
+	void* state; // of the agent, NULL before the first sample, released with free
+} pluginSample_t;
+
+typedef struct plugin plugin_t;
+
+plugin_t* openPlugin(const char*);
+void closePlugin(plugin_t*);
+int collectPlugin(plugin_t*, agent_t*, void**, char*, size_t, size_t*);
+
+// replaces the output, inline so plugins do not need symbols of the transmitter
+static inline __attribute__((format(printf, 2, 3))) int writeSample(pluginSample_t* sample, const char* format, ...) {
+	va_list arguments;
+	va_start(arguments, format);
+	int tmp = vsnprintf(sample->output, sample->size, format, arguments);
+	va_end(arguments);
+	if (tmp < 0)
+		return -1;
+	sample->length = (size_t) tmp < sample->size ? (size_t) tmp : sample->size - 1;
+	return 0;
+}
+
+#endif
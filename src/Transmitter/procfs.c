@@ -0,0 +1,171 @@
+#include "procfs.h"
+#include "plugin.h"
+#include "error.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define STAT_BUFFER (64 * 1024) // the cpu lines come first, the rest may be cut off
+#define MEMINFO_BUFFER 4096
+#define LOADAVG_BUFFER 128
+
+typedef struct {
+	unsigned long long busy;
+	unsigned long long total;
+} cpuTimes_t;
+
+static int statFd = -1;
+static int meminfoFd = -1;
+static int loadavgFd = -1;
+
+static int openProc(const char* path, int* fd) {
+	*fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (*fd < 0) {
+		libfail();
+		return -1;
+	}
+	return 0;
+}
+
+static void closeProc(int* fd) {
+	if (*fd >= 0)
+		close(*fd);
+	*fd = -1;
+}
+
+// the start of the file, null terminated; pread does not move the offset, so threads can share the fd
+static ssize_t readProc(int fd, char* buffer, size_t size) {
+	size_t position = 0;
+	while (position + 1 < size) {
+		ssize_t n = pread(fd, buffer + position, size - 1 - position, position);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0) {
+			libfail();
+			return -1;
+		}
+		if (n == 0)
+			break;
+		position += n;
+	}
+	buffer[position] = '\0';
+	return position;
+}
+
+// the rest of the line that starts with key followed by a separator
+static const char* findLine(const char* buffer, const char* key, char separator) {
+	size_t length = strlen(key);
+	const char* line = buffer;
+	while (line != NULL) {
+		if (strncmp(line, key, length) == 0 && line[length] == separator)
+			return line + length + 1;
+		line = strchr(line, '\n');
+		if (line != NULL)
+			line++;
+	}
+	return NULL;
+}
+
+int procstatInit() {
+	return openProc("/proc/stat", &statFd);
+}
+
+int procstatCollect(agent_t* agent, void* out) {
+	pluginSample_t* sample = out;
+	const char* cpu = agent->argument != NULL ? agent->argument : "cpu";
+	char* buffer = malloc(STAT_BUFFER);
+	if (buffer == NULL) {
+		libfail();
+		return -1;
+	}
+	if (readProc(statFd, buffer, STAT_BUFFER) < 0) {
+		free(buffer);
+		return -1;
+	}
+	// user nice system idle iowait irq softirq steal
+	unsigned long long values[8] = {0};
+	const char* line = findLine(buffer, cpu, ' ');
+	int count = line == NULL ? 0 : sscanf(line, "%llu %llu %llu %llu %llu %llu %llu %llu", &values[0], &values[1],
+		&values[2], &values[3], &values[4], &values[5], &values[6], &values[7]);
+	free(buffer);
+	if (count < 4) {
+		fail("No line '%s' in /proc/stat.", cpu);
+		return -1;
+	}
+
+	cpuTimes_t times = {0, 0};
+	for (int i = 0; i < 8; i++)
+		times.total += values[i];
+	times.busy = times.total - values[3] - values[4];
+
+	// since boot for the first sample
+	cpuTimes_t* last = sample->state;
+	if (last == NULL) {
+		last = calloc(1, sizeof(cpuTimes_t));
+		if (last == NULL) {
+			libfail();
+			return -1;
+		}
+		sample->state = last;
+	}
+	unsigned long long total = times.total > last->total ? times.total - last->total : 0;
+	unsigned long long busy = times.busy > last->busy ? times.busy - last->busy : 0;
+	*last = times;
+	return writeSample(sample, "%.1f", total == 0 ? 0.0 : 100.0 * busy / total);
+}
+
+void procstatDestroy() {
+	closeProc(&statFd);
+}
+
+int meminfoInit() {
+	return openProc("/proc/meminfo", &meminfoFd);
+}
+
+int meminfoCollect(agent_t* agent, void* out) {
+	const char* key = agent->argument != NULL ? agent->argument : "MemAvailable";
+	char buffer[MEMINFO_BUFFER];
+	if (readProc(meminfoFd, buffer, sizeof(buffer)) < 0)
+		return -1;
+	const char* line = findLine(buffer, key, ':');
+	unsigned long long value;
+	if (line == NULL || sscanf(line, "%llu", &value) != 1) {
+		fail("No value '%s' in /proc/meminfo.", key);
+		return -1;
+	}
+	return writeSample(out, "%llu", value);
+}
+
+void meminfoDestroy() {
+	closeProc(&meminfoFd);
+}
+
+int loadavgInit() {
+	return openProc("/proc/loadavg", &loadavgFd);
+}
+
+int loadavgCollect(agent_t* agent, void* out) {
+	const char* minutes = agent->argument != NULL ? agent->argument : "1";
+	int index = strcmp(minutes, "1") == 0 ? 0 : strcmp(minutes, "5") == 0 ? 1 : strcmp(minutes, "15") == 0 ? 2 : -1;
+	if (index < 0) {
+		fail("No load average over %s minutes.", minutes);
+		return -1;
+	}
+	char buffer[LOADAVG_BUFFER];
+	if (readProc(loadavgFd, buffer, sizeof(buffer)) < 0)
+		return -1;
+	double loads[3];
+	if (sscanf(buffer, "%lf %lf %lf", &loads[0], &loads[1], &loads[2]) != 3) {
+		error = "Unexpected format of /proc/loadavg.";
+		return -1;
+	}
+	return writeSample(out, "%.2f", loads[index]);
+}
+
+void loadavgDestroy() {
+	closeProc(&loadavgFd);
+}
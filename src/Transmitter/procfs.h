@@ -0,0 +1,29 @@
+#ifndef PROCFS_H
+#define PROCFS_H
+
+#include "conf.h"
+
+/*
+ * Built-in plugins, see plugin.h. Each keeps its file open between samples
+ * and reads it with pread. The argument of the agent (plugin.argument)
+ * selects what is sampled:
+ *
+ *   procstat  busy % of a line of /proc/stat since the last sample
+ *             (cpu by default, cpu0, cpu1, ...)
+ *   meminfo   a value of /proc/meminfo in kB (MemAvailable by default)
+ *   loadavg   the 1, 5 or 15 minute load average (1 by default)
+ */
+
+int procstatInit(void);
+int procstatCollect(agent_t*, void*);
+void procstatDestroy(void);
+
+int meminfoInit(void);
+int meminfoCollect(agent_t*, void*);
+void meminfoDestroy(void);
+
+int loadavgInit(void);
+int loadavgCollect(agent_t*, void*);
+void loadavgDestroy(void);
+
+#endif
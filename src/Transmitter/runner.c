@@ -0,0 +1,618 @@
+#include "runner.h"
+#include "script.h"
+#include "worker.h"
+#include "packet.h"
+#include "registry.h"
+#include "template.h"
+#include "metrics.h"
+#include "error.h"
+
+#include <stdlib.h>
+#include <limits.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+static pool_t pool;
+static sem_t concurrency;
+static bool initialized = false;
+
+static atomic_size_t retiring; // runtimes retired but not yet freed
+
+static pthread_mutex_t runtimesLock = PTHREAD_MUTEX_INITIALIZER;
+static runtime_t** runtimes = NULL;
+static size_t runtimesLength = 0;
+static size_t runtimesCapacity = 0;
+
+struct group {
+	char* script; // NULL in the group of a plugin agent
+	timestamp_t interval; // s
+	timestamp_t ttl; // s
+	timestamp_t timeout; // s
+	timerid_t timer;
+	atomic_bool running;
+	atomic_uint references; // the timer and the job in flight
+	unsigned long long fired; // relative time of the expiry being handled
+	pthread_mutex_t lock; // members
+	runtime_t** members;
+	size_t count;
+	size_t capacity;
+	group_t* next;
+};
+
+static pthread_mutex_t groupsLock = PTHREAD_MUTEX_INITIALIZER;
+static group_t* groups = NULL;
+
+typedef struct {
+	int status;
+	bool cached; // output of another run
+	unsigned long long wait; // expiry to script start
+	unsigned long long run;
+	size_t length;
+	char output[MAX_SCRIPT_OUTPUT];
+} sample_t;
+
+int runnerInit(size_t workers, size_t limit) {
+	if (initialized)
+		return 0;
+	if (workers == 0)
+		workers = getCoreCount();
+	if (limit == 0)
+		limit = workers;
+	if (sem_init(&concurrency, 0, limit) < 0) {
+		libfail();
+		return -1;
+	}
+	if (poolInit(&pool, workers) < 0)
+		return -1;
+	if (addCollector(writeRunnerMetrics, NULL) < 0)
+		return -1;
+	initialized = true;
+	return 0;
+}
+
+static bool parseValue(agent_t* agent, const char* output, void* value) {
+	char* end;
+	errno = 0;
+	switch (agent->type) {
+		case INT: {
+			long tmp = strtol(output, &end, 10);
+			if (errno == 0 && (tmp < INT_MIN || tmp > INT_MAX))
+				errno = ERANGE;
+			*((int*) value) = tmp;
+			break;
+		}
+		case DOUBLE:
+			*((double*) value) = strtod(output, &end);
+			break;
+		default:
+			return true;
+	}
+	if (errno == ERANGE) {
+		fail("Output of agent '%s' is out of range: '%s'.", agent->name, output);
+		return false;
+	}
+	if (errno != 0 || end == output || *end != '\0') {
+		fail("Output of agent '%s' is not a number: '%s'.", agent->name, output);
+		return false;
+	}
+	return true;
+}
+
+static bool emit(runtime_t* runtime, char* output, size_t length, int status) {
+	agent_t* agent = runtime->agent;
+
+	while (length > 0 && (output[length - 1] == '\n' || output[length - 1] == '\r'))
+		output[--length] = '\0';
+
+	union {
+		int integer;
+		double real;
+	} value;
+	void* data = NULL;
+	if (agent->type == STRING)
+		data = output;
+	else if (agent->type != VOID) {
+		if (!parseValue(agent, output, &value))
+			return false;
+		data = &value;
+	}
+
+	int code = status;
+	unsigned long long now = getRelativeTime();
+	bool filtered = status == 0 && (agent->rules.count > 0 || agent->deadband.enabled);
+	if (filtered) {
+		double sample = agent->type == INT ? value.integer : value.real;
+		double rate = updateReading(&(runtime->last), sample, now);
+		bool changed;
+		if (agent->rules.count > 0) {
+			code = evaluateRules(&(agent->rules), sample, rate);
+			changed = code != runtime->state;
+		} else
+			changed = isOutsideDeadband(&(agent->deadband), &(runtime->sent), sample);
+		unsigned long long silence = agent->deadband.maxSilence * 1000ull * 1000 * 1000;
+		if (!changed && (silence == 0 || now - runtime->sent.time < silence)) {
+			atomic_fetch_add_explicit(&(runtime->suppressed), 1, memory_order_relaxed);
+			runtime->pending++;
+			return true;
+		}
+	}
+
+	if (runtime->pending > 0) {
+		packet_t meta = newMetaPacket(runtime->id, runtime->pending > INT32_MAX ? INT32_MAX : (int32_t) runtime->pending,
+			"suppressed samples");
+		if (pushPacket(&meta))
+			runtime->pending = 0;
+		else
+			destroyPacket(&meta);
+	}
+
+	class_t class = INFO;
+	const char* message = NULL;
+	char text[MAX_MESSAGE_LENGTH];
+	if (code < MAX_MESSAGES && agent->messages[code].text != NULL) {
+		class = agent->messages[code].class;
+		message = agent->messages[code].text;
+		if (agent->messages[code].compiled != NULL) {
+			(void) expandTemplate(agent->messages[code].compiled, text, sizeof(text), agent->type, data, output);
+			message = text;
+		}
+	} else if (status != 0 || agent->data == MESSAGE) {
+		class = status != 0 ? ERROR : INFO;
+		message = output;
+	}
+
+	packet_t packet = newAgentPacket(agent, runtime->id, data, class, message);
+	if (!pushPacket(&packet)) {
+		destroyPacket(&packet);
+		atomic_fetch_add_explicit(&(runtime->dropped), 1, memory_order_relaxed);
+		return false;
+	}
+	// a dropped transition or reading is sent again with the next sample
+	if (filtered) {
+		runtime->state = code;
+		runtime->sent = runtime->last;
+	}
+	return true;
+}
+
+// the plugin of runtime, or the script
+static void takeSample(sample_t* sample, runtime_t* runtime, const char* script, timestamp_t ttl,
+		unsigned long long fired) {
+	sample->cached = false;
+	sample->length = 0;
+	sample->output[0] = '\0';
+
+	if (runtime->plugin != NULL) {
+		unsigned long long start = getRelativeTime();
+		sample->wait = start - fired;
+		recordStage(STAGE_FIRE, sample->wait);
+		sample->status = collectPlugin(runtime->plugin, runtime->agent, &(runtime->pluginState), sample->output,
+			sizeof(sample->output), &(sample->length));
+		sample->run = getRelativeTime() - start;
+		recordStage(STAGE_SCRIPT, sample->run);
+		return;
+	}
+
+	// members of a group have the same timeout
+	unsigned long timeout = (runtime->agent->timeout > 0 ? runtime->agent->timeout : SCRIPT_TIMEOUT) * 1000;
+	unsigned long long start;
+	if (ttl > 0) {
+		// takes a slot only for a run of its own, the wait for it counts as run
+		start = getRelativeTime();
+		sample->status = runCachedScript(script, ttl * 1000ull * 1000 * 1000, timeout, &concurrency, sample->output,
+			sizeof(sample->output), &(sample->length), &(sample->cached));
+	} else {
+		sem_wait(&concurrency);
+		start = getRelativeTime();
+		sample->status = runScript(script, timeout, sample->output, sizeof(sample->output), &(sample->length));
+		sem_post(&concurrency);
+	}
+	sample->wait = start - fired;
+	recordStage(STAGE_FIRE, sample->wait);
+
+	sample->run = getRelativeTime() - start;
+	if (!sample->cached)
+		recordStage(STAGE_SCRIPT, sample->run);
+}
+
+// the nth whitespace separated field, empty if the output has less
+static size_t selectField(const sample_t* sample, unsigned int field, char* output) {
+	if (field == 0) {
+		memcpy(output, sample->output, sample->length + 1);
+		return sample->length;
+	}
+	const char* position = sample->output;
+	const char* end = sample->output + sample->length;
+	const char* start = position;
+	for (unsigned int i = 0; i < field; i++) {
+		while (position < end && isspace((unsigned char) *position))
+			position++;
+		start = position;
+		while (position < end && !isspace((unsigned char) *position))
+			position++;
+	}
+	size_t length = position - start;
+	memmove(output, start, length);
+	output[length] = '\0';
+	return length;
+}
+
+// the last reference frees the runtime and hands the agent back
+static void releaseRuntime(runtime_t* runtime) {
+	if (atomic_fetch_sub_explicit(&(runtime->references), 1, memory_order_acq_rel) != 1)
+		return;
+	agent_t* agent = runtime->agent;
+	if (getAgent(runtime->id) == agent)
+		unregisterAgent(runtime->id);
+	if (agent->lastValue == &(runtime->last))
+		agent->lastValue = NULL;
+
+	pthread_mutex_lock(&runtimesLock);
+	for (size_t i = 0; i < runtimesLength; i++) {
+		if (runtimes[i] == runtime) {
+			runtimes[i] = runtimes[--runtimesLength];
+			break;
+		}
+	}
+	pthread_mutex_unlock(&runtimesLock);
+	if (runtime->plugin != NULL)
+		closePlugin(runtime->plugin);
+	free(runtime->pluginState);
+	retired_t retired = runtime->retired;
+	void* context = runtime->retiredContext;
+	free(runtime);
+	if (retired != NULL) {
+		retired(agent, context);
+		atomic_fetch_sub_explicit(&retiring, 1, memory_order_release);
+	}
+}
+
+// a job for the agent may start, it holds a reference until it is done
+static bool claim(runtime_t* runtime) {
+	if (atomic_exchange_explicit(&(runtime->running), true, memory_order_acq_rel)) {
+		atomic_fetch_add_explicit(&(runtime->skipped), 1, memory_order_relaxed);
+		return false;
+	}
+	atomic_fetch_add_explicit(&(runtime->references), 1, memory_order_relaxed);
+	return true;
+}
+
+static void unclaim(runtime_t* runtime) {
+	atomic_store_explicit(&(runtime->running), false, memory_order_release);
+	releaseRuntime(runtime);
+}
+
+// the agent has to be claimed, it is not anymore afterwards
+static void deliver(runtime_t* runtime, const sample_t* sample, bool shared) {
+	histogramRecord(&(runtime->wait), sample->wait);
+	histogramRecord(&(runtime->run), sample->run);
+	atomic_fetch_add_explicit(&(runtime->runs), 1, memory_order_relaxed);
+	if (shared || sample->cached)
+		atomic_fetch_add_explicit(&(runtime->shared), 1, memory_order_relaxed);
+
+	char output[MAX_SCRIPT_OUTPUT];
+	size_t length = selectField(sample, runtime->agent->field, output);
+	if (sample->status < 0 || !emit(runtime, output, length, sample->status))
+		atomic_fetch_add_explicit(&(runtime->failures), 1, memory_order_relaxed);
+	unclaim(runtime);
+}
+
+static void execute(void* argument) {
+	runtime_t* runtime = argument;
+	sample_t sample;
+	takeSample(&sample, runtime, runtime->agent->script, runtime->agent->ttl, runtime->fired);
+	deliver(runtime, &sample, false);
+}
+
+// the last reference frees the group, the timer is gone by then
+static void releaseGroup(group_t* group) {
+	if (atomic_fetch_sub_explicit(&(group->references), 1, memory_order_acq_rel) != 1)
+		return;
+	pthread_mutex_destroy(&(group->lock));
+	free(group->members);
+	free(group->script);
+	free(group);
+}
+
+// one script run for all members that are not still busy with the last one
+static void executeGroup(void* argument) {
+	group_t* group = argument;
+
+	pthread_mutex_lock(&(group->lock));
+	runtime_t** batch = malloc(group->count * sizeof(runtime_t*));
+	size_t count = 0;
+	for (size_t i = 0; i < group->count; i++) {
+		runtime_t* runtime = group->members[i];
+		if (batch == NULL)
+			atomic_fetch_add_explicit(&(runtime->failures), 1, memory_order_relaxed);
+		else if (claim(runtime))
+			batch[count++] = runtime;
+	}
+	pthread_mutex_unlock(&(group->lock));
+
+	if (count > 0) {
+		sample_t sample;
+		// a plugin agent is the only member of its group
+		takeSample(&sample, batch[0], group->script, group->ttl, group->fired);
+		for (size_t i = 0; i < count; i++)
+			deliver(batch[i], &sample, i > 0);
+	}
+	free(batch);
+	atomic_store_explicit(&(group->running), false, memory_order_release);
+	releaseGroup(group);
+}
+
+// not at the same time as unscheduleAgent or retireAgent for the same agent
+bool triggerAgent(runtime_t* runtime) {
+	if (!claim(runtime))
+		return false;
+	runtime->fired = getRelativeTime();
+	if (!poolSubmit(&pool, execute, runtime)) {
+		atomic_fetch_add_explicit(&(runtime->failures), 1, memory_order_relaxed);
+		unclaim(runtime);
+		return false;
+	}
+	return true;
+}
+
+static void expired(void* argument) {
+	group_t* group = argument;
+	if (atomic_exchange_explicit(&(group->running), true, memory_order_acq_rel)) {
+		pthread_mutex_lock(&(group->lock));
+		for (size_t i = 0; i < group->count; i++)
+			atomic_fetch_add_explicit(&(group->members[i]->skipped), 1, memory_order_relaxed);
+		pthread_mutex_unlock(&(group->lock));
+		return;
+	}
+	group->fired = getRelativeTime();
+	atomic_fetch_add_explicit(&(group->references), 1, memory_order_relaxed);
+	if (!poolSubmit(&pool, executeGroup, group)) {
+		atomic_store_explicit(&(group->running), false, memory_order_release);
+		pthread_mutex_lock(&(group->lock));
+		for (size_t i = 0; i < group->count; i++)
+			atomic_fetch_add_explicit(&(group->members[i]->failures), 1, memory_order_relaxed);
+		pthread_mutex_unlock(&(group->lock));
+		releaseGroup(group); // not the last one, the timer is still there
+	}
+}
+
+// groupsLock has to be held, groups of plugin agents have no script
+static group_t* createGroup(agent_t* agent) {
+	group_t* group = calloc(1, sizeof(group_t));
+	if (group == NULL || (agent->plugin == NULL && (group->script = strdup(agent->script)) == NULL)) {
+		libfail();
+		free(group);
+		return NULL;
+	}
+	group->interval = agent->timing.value;
+	group->ttl = agent->ttl;
+	group->timeout = agent->timeout;
+	atomic_init(&(group->running), false);
+	atomic_init(&(group->references), 1);
+	pthread_mutex_init(&(group->lock), NULL);
+	group->timer = createTimerWithContext(expired, group);
+	if (group->timer == NO_TIMER || startInterval(group->timer, group->interval * 1000) < 0) {
+		if (group->timer != NO_TIMER)
+			(void) deleteTimer(group->timer);
+		pthread_mutex_destroy(&(group->lock));
+		free(group->script);
+		free(group);
+		return NULL;
+	}
+	group->next = groups;
+	groups = group;
+	return group;
+}
+
+static int joinGroup(runtime_t* runtime) {
+	agent_t* agent = runtime->agent;
+	pthread_mutex_lock(&groupsLock);
+	group_t* group = agent->plugin != NULL ? NULL : groups;
+	while (group != NULL && (group->script == NULL || group->interval != agent->timing.value
+			|| group->ttl != agent->ttl || group->timeout != agent->timeout || strcmp(group->script, agent->script) != 0))
+		group = group->next;
+	if (group == NULL && (group = createGroup(agent)) == NULL) {
+		pthread_mutex_unlock(&groupsLock);
+		return -1;
+	}
+
+	pthread_mutex_lock(&(group->lock));
+	if (group->count == group->capacity) {
+		size_t capacity = group->capacity == 0 ? 4 : group->capacity * 2;
+		runtime_t** tmp = realloc(group->members, capacity * sizeof(runtime_t*));
+		if (tmp == NULL) {
+			pthread_mutex_unlock(&(group->lock));
+			pthread_mutex_unlock(&groupsLock);
+			libfail();
+			return -1;
+		}
+		group->members = tmp;
+		group->capacity = capacity;
+	}
+	group->members[group->count++] = runtime;
+	runtime->group = group;
+	pthread_mutex_unlock(&(group->lock));
+	pthread_mutex_unlock(&groupsLock);
+	return 0;
+}
+
+// the last member takes the timer with it, a job still queued or running frees the group
+static int leaveGroup(runtime_t* runtime) {
+	group_t* group = runtime->group;
+	pthread_mutex_lock(&groupsLock);
+	pthread_mutex_lock(&(group->lock));
+	for (size_t i = 0; i < group->count; i++) {
+		if (group->members[i] == runtime) {
+			group->members[i] = group->members[--group->count];
+			break;
+		}
+	}
+	size_t count = group->count;
+	pthread_mutex_unlock(&(group->lock));
+	runtime->group = NULL;
+	// the handler takes the member lock, so the timer is deleted without it
+	if (count > 0 || deleteTimer(group->timer) < 0) {
+		pthread_mutex_unlock(&groupsLock);
+		return count > 0 ? 0 : -1;
+	}
+
+	group_t** link = &groups;
+	while (*link != group)
+		link = &((*link)->next);
+	*link = group->next;
+	pthread_mutex_unlock(&groupsLock);
+	releaseGroup(group);
+	return 0;
+}
+
+runtime_t* scheduleAgent(agent_t* agent) {
+	if (!initialized) {
+		error = "Runner not initialized.";
+		return NULL;
+	}
+	if (agent->script == NULL && agent->plugin == NULL) {
+		fail("Agent '%s' has no script or plugin.", agent->name);
+		return NULL;
+	}
+
+	runtime_t* runtime = calloc(1, sizeof(runtime_t));
+	if (runtime == NULL) {
+		libfail();
+		return NULL;
+	}
+	runtime->agent = agent;
+	if (agent->plugin != NULL && (runtime->plugin = openPlugin(agent->plugin)) == NULL) {
+		free(runtime);
+		return NULL;
+	}
+	runtime->id = registerAgent(agent);
+	if (runtime->id == NO_AGENT) {
+		if (runtime->plugin != NULL)
+			closePlugin(runtime->plugin);
+		free(runtime);
+		return NULL;
+	}
+	atomic_init(&(runtime->running), false);
+	atomic_init(&(runtime->references), 1);
+	atomic_init(&(runtime->runs), 0);
+	atomic_init(&(runtime->skipped), 0);
+	atomic_init(&(runtime->failures), 0);
+	atomic_init(&(runtime->dropped), 0);
+	atomic_init(&(runtime->suppressed), 0);
+	atomic_init(&(runtime->shared), 0);
+	runtime->state = NO_STATE;
+	agent->lastValue = &(runtime->last);
+	histogramReset(&(runtime->wait));
+	histogramReset(&(runtime->run));
+
+	pthread_mutex_lock(&runtimesLock);
+	if (runtimesLength == runtimesCapacity) {
+		size_t capacity = runtimesCapacity == 0 ? 64 : runtimesCapacity * 2;
+		runtime_t** tmp = realloc(runtimes, capacity * sizeof(runtime_t*));
+		if (tmp == NULL) {
+			pthread_mutex_unlock(&runtimesLock);
+			libfail();
+			releaseRuntime(runtime); // unregisters it and closes the plugin
+			return NULL;
+		}
+		runtimes = tmp;
+		runtimesCapacity = capacity;
+	}
+	runtimes[runtimesLength++] = runtime;
+	pthread_mutex_unlock(&runtimesLock);
+
+	runtime->group = NULL;
+	if (agent->timing.type == Interval && agent->timing.value > 0 && joinGroup(runtime) < 0) {
+		(void) unscheduleAgent(runtime);
+		return NULL;
+	}
+	return runtime;
+}
+
+/*
+ * Stops the agent without waiting for a job that is still queued or
+ * running: the runtime is freed after it, and retired gets the agent then.
+ * Until that the agent has to stay valid.
+ */
+int retireAgent(runtime_t* runtime, retired_t retired, void* context) {
+	if (runtime->group != NULL && leaveGroup(runtime) < 0)
+		return -1;
+	runtime->retired = retired;
+	runtime->retiredContext = context;
+	if (retired != NULL)
+		atomic_fetch_add_explicit(&retiring, 1, memory_order_relaxed);
+	releaseRuntime(runtime);
+	return 0;
+}
+
+static void signalRetired(agent_t* agent, void* context) {
+	(void) agent;
+	atomic_store_explicit((atomic_bool*) context, true, memory_order_release);
+}
+
+// like retireAgent, but waits for the job
+int unscheduleAgent(runtime_t* runtime) {
+	atomic_bool done = false;
+	if (retireAgent(runtime, signalRetired, &done) < 0)
+		return -1;
+	while (!atomic_load_explicit(&done, memory_order_acquire))
+		usleep(1000);
+	return 0;
+}
+
+// until the jobs of all retired agents are done
+void waitForRetired() {
+	while (atomic_load_explicit(&retiring, memory_order_acquire) > 0)
+		usleep(1000);
+}
+
+void printRunnerStats(FILE* file) {
+	pthread_mutex_lock(&runtimesLock);
+	for (size_t i = 0; i < runtimesLength; i++) {
+		runtime_t* runtime = runtimes[i];
+		fprintf(file, "%s: runs %llu, shared %llu, skipped %llu, failures %llu, dropped %llu, suppressed %llu\n",
+			runtime->agent->name,
+			atomic_load_explicit(&(runtime->runs), memory_order_relaxed),
+			atomic_load_explicit(&(runtime->shared), memory_order_relaxed),
+			atomic_load_explicit(&(runtime->skipped), memory_order_relaxed),
+			atomic_load_explicit(&(runtime->failures), memory_order_relaxed),
+			atomic_load_explicit(&(runtime->dropped), memory_order_relaxed),
+			atomic_load_explicit(&(runtime->suppressed), memory_order_relaxed));
+		printHistogram(file, "  queue wait", &(runtime->wait));
+		printHistogram(file, "  run time", &(runtime->run));
+	}
+	pthread_mutex_unlock(&runtimesLock);
+}
+
+static void writeSummary(FILE* file, const char* name, const char* stage, histogram_t* histogram) {
+	static const double quantiles[] = {0.5, 0.9, 0.99};
+	for (size_t i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i++) {
+		fputs("fetcher_agent_seconds{agent=", file);
+		writeLabel(file, name);
+		fprintf(file, ",stage=\"%s\",quantile=\"%g\"} %.9f\n", stage, quantiles[i],
+			histogramPercentile(histogram, quantiles[i] * 100) / 1e9);
+	}
+	fputs("fetcher_agent_seconds_sum{agent=", file);
+	writeLabel(file, name);
+	fprintf(file, ",stage=\"%s\"} %.9f\n", stage, histogramSum(histogram) / 1e9);
+	fputs("fetcher_agent_seconds_count{agent=", file);
+	writeLabel(file, name);
+	fprintf(file, ",stage=\"%s\"} %llu\n", stage, histogramCount(histogram));
+}
+
+// per agent fire and script latencies as summaries
+void writeRunnerMetrics(FILE* file, void* context) {
+	(void) context;
+	fputs("# HELP fetcher_agent_seconds Time from the timer to the script, and of the script, per agent.\n", file);
+	fputs("# TYPE fetcher_agent_seconds summary\n", file);
+	pthread_mutex_lock(&runtimesLock);
+	for (size_t i = 0; i < runtimesLength; i++) {
+		writeSummary(file, runtimes[i]->agent->name, getStageName(STAGE_FIRE), &(runtimes[i]->wait));
+		writeSummary(file, runtimes[i]->agent->name, getStageName(STAGE_SCRIPT), &(runtimes[i]->run));
+	}
+	pthread_mutex_unlock(&runtimesLock);
+}
@@ -0,0 +1,76 @@
+#ifndef RUNNER_H
+#define RUNNER_H
+
+#include "conf.h"
+#include "timer.h"
+#include "histogram.h"
+#include "plugin.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdatomic.h>
+
+/*
+ * Executes agents: every timer expiry becomes a job on the worker pool that
+ * runs the agent script or plugin and pushes the result as a packet. An agent is never
+ * run twice at the same time (expiries while it runs are skipped), and the
+ * number of scripts running at once is limited globally.
+ *
+ * Agents with rules only send a packet when the sample moves them to
+ * another message code, agents with a deadband when the value left it.
+ * Other samples are counted as suppressed and the count since the last
+ * packet goes to the receiver as a META packet before the next one.
+ *
+ * Agents with the same script, interval, TTL and timeout share a timer:
+ * the script runs once per tick and every agent of the group gets the
+ * output. An agent with a TTL (script.ttl) also takes output of its script
+ * from other runs that are younger, so agents with close intervals share
+ * samples as well. Scripts that run longer than script.timeout (or
+ * SCRIPT_TIMEOUT) are killed. With field set, an agent only sees that
+ * field of the output. Plugin
+ * agents always have a timer of their own and are not limited by the
+ * number of running scripts.
+ */
+
+typedef struct group group_t;
+
+typedef void (*retired_t)(agent_t*, void*);
+
+typedef struct {
+	agent_t* agent;
+	uint32_t id; // registry id of the agent
+	plugin_t* plugin; // NULL for script agents
+	void* pluginState;
+	group_t* group; // NULL for agents without a timer
+	atomic_bool running;
+	atomic_uint references; // the schedule and the job in flight
+	retired_t retired;
+	void* retiredContext;
+	unsigned long long fired; // relative time of the expiry being handled
+	atomic_ullong runs;
+	atomic_ullong skipped; // expiries while the agent was still running
+	atomic_ullong failures;
+	atomic_ullong dropped; // packets the queue did not accept
+	atomic_ullong suppressed; // samples that did not change the state
+	atomic_ullong shared; // samples from the script run of another agent
+	reading_t last; // the agent points lastValue here
+	reading_t sent; // sample of the last packet
+	unsigned long long pending; // suppressed since the last packet
+	uint8_t state; // message code of the last packet, NO_STATE before the first
+	histogram_t wait; // expiry to script start
+	histogram_t run; // script run time, or the wait for a shared run
+} runtime_t;
+
+int runnerInit(size_t, size_t);
+
+runtime_t* scheduleAgent(agent_t*);
+int unscheduleAgent(runtime_t*);
+int retireAgent(runtime_t*, retired_t, void*);
+void waitForRetired(void);
+bool triggerAgent(runtime_t*);
+
+void printRunnerStats(FILE*);
+void writeRunnerMetrics(FILE*, void*);
+
+#endif
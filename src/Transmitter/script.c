@@ -0,0 +1,250 @@
+#define _GNU_SOURCE
+
+#include "script.h"
+#include "timer.h"
+#include "error.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <spawn.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/wait.h>
+
+extern char** environ;
+
+// ms until the deadline, rounded up, -1 without one
+static int remaining(unsigned long long deadline) {
+	if (deadline == 0)
+		return -1;
+	unsigned long long now = getRelativeTime();
+	return now >= deadline ? 0 : (int) ((deadline - now + 999999) / 1000000);
+}
+
+int runScript(const char* script, unsigned long timeout, char* output, size_t size, size_t* length) {
+	int fds[2];
+	// close-on-exec, so concurrently spawned scripts do not inherit our pipe
+	if (pipe2(fds, O_CLOEXEC) < 0) {
+		libfail();
+		return -1;
+	}
+
+	posix_spawn_file_actions_t actions;
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+	posix_spawn_file_actions_adddup2(&actions, fds[1], STDOUT_FILENO);
+	// a process group of its own, so a timeout also kills what the script started
+	posix_spawnattr_t attributes;
+	posix_spawnattr_init(&attributes);
+	posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETPGROUP);
+	posix_spawnattr_setpgroup(&attributes, 0);
+
+	char* argv[] = {"sh", "-c", (char*) script, NULL};
+	pid_t pid;
+	int tmp = posix_spawn(&pid, "/bin/sh", &actions, &attributes, argv, environ);
+	posix_spawn_file_actions_destroy(&actions);
+	posix_spawnattr_destroy(&attributes);
+	close(fds[1]);
+	if (tmp != 0) {
+		close(fds[0]);
+		error = strerror(tmp);
+		return -1;
+	}
+
+	unsigned long long deadline = timeout == 0 ? 0 : getRelativeTime() + timeout * 1000000ull;
+	bool killed = false;
+	size_t position = 0;
+	for (;;) {
+		struct pollfd readable = {.fd = fds[0], .events = POLLIN};
+		int n = poll(&readable, 1, remaining(deadline));
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n == 0) {
+			(void) kill(-pid, SIGKILL);
+			killed = true;
+			break;
+		}
+		if (n < 0)
+			break;
+
+		char discard[256];
+		char* target = discard;
+		size_t space = sizeof(discard);
+		if (position + 1 < size) {
+			target = output + position;
+			space = size - 1 - position;
+		}
+		ssize_t count = read(fds[0], target, space);
+		if (count < 0 && errno == EINTR)
+			continue;
+		if (count <= 0)
+			break;
+		if (target != discard)
+			position += count;
+	}
+	close(fds[0]);
+	if (size > 0)
+		output[position] = '\0';
+	if (length != NULL)
+		*length = position;
+
+	// the script may have closed its output and still be running
+	int status;
+	for (useconds_t delay = 1000;;) {
+		pid_t tmp = waitpid(pid, &status, killed || deadline == 0 ? 0 : WNOHANG);
+		if (tmp == pid)
+			break;
+		if (tmp < 0 && errno == EINTR)
+			continue;
+		if (tmp < 0) {
+			libfail();
+			return -1;
+		}
+		if (remaining(deadline) == 0) {
+			(void) kill(-pid, SIGKILL);
+			killed = true;
+			continue;
+		}
+		usleep(delay);
+		if (delay < 10000)
+			delay += 1000;
+	}
+	if (killed) {
+		fail("Script killed after %lu ms.", timeout);
+		return -1;
+	}
+	if (!WIFEXITED(status)) {
+		fail("Script terminated by signal %d.", WTERMSIG(status));
+		return -1;
+	}
+	return WEXITSTATUS(status);
+}
+
+#define CACHE_BUCKETS 256
+
+typedef struct entry {
+	char* script;
+	uint64_t hash;
+	bool running;
+	unsigned long long time; // relative ns the run ended
+	unsigned long long ttl; // the longest one it was looked up with
+	int status;
+	size_t length;
+	char output[MAX_SCRIPT_OUTPUT];
+	struct entry* next;
+} entry_t;
+
+static pthread_mutex_t cacheLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cacheDone = PTHREAD_COND_INITIALIZER;
+static entry_t* cache[CACHE_BUCKETS];
+
+static uint64_t hashOf(const char* script) {
+	uint64_t hash = 14695981039346656037ULL;
+	for (; *script != '\0'; script++) {
+		hash ^= (unsigned char) *script;
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+static void copyOutput(entry_t* entry, char* output, size_t size, size_t* length) {
+	size_t tmp = entry->length < size ? entry->length : (size > 0 ? size - 1 : 0);
+	memcpy(output, entry->output, tmp);
+	if (size > 0)
+		output[tmp] = '\0';
+	if (length != NULL)
+		*length = tmp;
+}
+
+// cacheLock has to be held, drops entries nobody would use anymore on the way
+static entry_t* lookup(const char* script, uint64_t hash, unsigned long long now) {
+	entry_t** link = &(cache[hash % CACHE_BUCKETS]);
+	while (*link != NULL) {
+		entry_t* entry = *link;
+		if (entry->hash == hash && strcmp(entry->script, script) == 0)
+			return entry;
+		if (!entry->running && now - entry->time > entry->ttl) {
+			*link = entry->next;
+			free(entry->script);
+			free(entry);
+			continue;
+		}
+		link = &(entry->next);
+	}
+	return NULL;
+}
+
+// cacheLock has to be held
+static void removeEntry(entry_t* entry) {
+	entry_t** link = &(cache[entry->hash % CACHE_BUCKETS]);
+	while (*link != entry)
+		link = &((*link)->next);
+	*link = entry->next;
+	free(entry->script);
+	free(entry);
+}
+
+int runCachedScript(const char* script, unsigned long long ttl, unsigned long timeout, sem_t* slots, char* output,
+		size_t size, size_t* length, bool* cached) {
+	uint64_t hash = hashOf(script);
+	*cached = false;
+	pthread_mutex_lock(&cacheLock);
+	entry_t* entry;
+	for (;;) {
+		entry = lookup(script, hash, getRelativeTime());
+		if (entry == NULL || !entry->running)
+			break;
+		// a failed run leaves no entry, then this one tries itself
+		pthread_cond_wait(&cacheDone, &cacheLock);
+	}
+	if (entry != NULL && getRelativeTime() - entry->time <= ttl) {
+		if (ttl > entry->ttl)
+			entry->ttl = ttl;
+		copyOutput(entry, output, size, length);
+		int status = entry->status;
+		pthread_mutex_unlock(&cacheLock);
+		*cached = true;
+		return status;
+	}
+	if (entry == NULL) {
+		entry = malloc(sizeof(entry_t));
+		if (entry == NULL || (entry->script = strdup(script)) == NULL) {
+			pthread_mutex_unlock(&cacheLock);
+			free(entry);
+			libfail();
+			return -1;
+		}
+		entry->hash = hash;
+		entry->ttl = 0;
+		entry->next = cache[hash % CACHE_BUCKETS];
+		cache[hash % CACHE_BUCKETS] = entry;
+	}
+	if (ttl > entry->ttl)
+		entry->ttl = ttl;
+	entry->running = true;
+	pthread_mutex_unlock(&cacheLock);
+
+	if (slots != NULL)
+		sem_wait(slots);
+	int status = runScript(script, timeout, entry->output, sizeof(entry->output), &(entry->length));
+	if (slots != NULL)
+		sem_post(slots);
+
+	pthread_mutex_lock(&cacheLock);
+	entry->running = false;
+	if (status < 0)
+		removeEntry(entry);
+	else {
+		entry->time = getRelativeTime();
+		entry->status = status;
+		copyOutput(entry, output, size, length);
+	}
+	pthread_cond_broadcast(&cacheDone);
+	pthread_mutex_unlock(&cacheLock);
+	return status;
+}
@@ -0,0 +1,30 @@
+#ifndef SCRIPT_H
+#define SCRIPT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <semaphore.h>
+
+#define MAX_SCRIPT_OUTPUT 4096
+#define SCRIPT_TIMEOUT 60 // s, for agents without script.timeout
+
+/*
+ * Runs the script with /bin/sh -c and captures up to size - 1 bytes of its
+ * standard output (always null terminated, the rest is discarded).
+ * A script that runs longer than timeout (ms, 0 for none) is killed with
+ * its whole process group and the run fails.
+ * Returns the exit status of the script or -1 on failure.
+ */
+int runScript(const char*, unsigned long, char*, size_t, size_t*);
+
+/*
+ * Like runScript, but reuses the output of the same script if it is younger
+ * than ttl (ns), and waits for a run of the same script that is already in
+ * progress instead of starting another one. Failed runs are not cached.
+ * A slot of slots (NULL for no limit) is only taken for a run of its own,
+ * not while waiting for the run of another caller.
+ * cached is set if the output came from another run.
+ */
+int runCachedScript(const char*, unsigned long long, unsigned long, sem_t*, char*, size_t, size_t*, bool*);
+
+#endif
@@ -0,0 +1,145 @@
+#include "arena.h"
+#include "error.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define INITIAL_CAPACITY 256
+
+typedef struct arenaBlock {
+	struct arenaBlock* next;
+	size_t size;
+	size_t used;
+	char data[];
+} arenaBlock_t;
+
+static uint32_t hashOf(const char* string, size_t length) {
+	uint32_t hash = 2166136261u;
+	for (size_t i = 0; i < length; i++) {
+		hash ^= (unsigned char) string[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+int arenaInit(arena_t* arena) {
+	memset(arena, 0, sizeof(arena_t));
+	arena->slots = calloc(INITIAL_CAPACITY, sizeof(arenaSlot_t));
+	if (arena->slots == NULL) {
+		libfail();
+		return -1;
+	}
+	arena->capacity = INITIAL_CAPACITY;
+	pthread_mutex_init(&(arena->lock), NULL);
+	return 0;
+}
+
+void arenaDestroy(arena_t* arena) {
+	arenaBlock_t* block = arena->blocks;
+	while (block != NULL) {
+		arenaBlock_t* next = block->next;
+		free(block);
+		block = next;
+	}
+	arena->blocks = NULL;
+	free(arena->slots);
+	arena->slots = NULL;
+	arena->capacity = 0;
+	arena->count = 0;
+	pthread_mutex_destroy(&(arena->lock));
+}
+
+// lock has to be held
+static int grow(arena_t* arena) {
+	size_t capacity = arena->capacity * 2;
+	arenaSlot_t* slots = calloc(capacity, sizeof(arenaSlot_t));
+	if (slots == NULL) {
+		libfail();
+		return -1;
+	}
+	for (size_t i = 0; i < arena->capacity; i++) {
+		if (arena->slots[i].string == NULL)
+			continue;
+		size_t slot = arena->slots[i].hash & (capacity - 1);
+		while (slots[slot].string != NULL)
+			slot = (slot + 1) & (capacity - 1);
+		slots[slot] = arena->slots[i];
+	}
+	free(arena->slots);
+	arena->slots = slots;
+	arena->capacity = capacity;
+	return 0;
+}
+
+// lock has to be held
+static char* allocate(arena_t* arena, size_t size) {
+	arenaBlock_t* block = arena->blocks;
+	if (block == NULL || block->size - block->used < size) {
+		size_t blockSize = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+		block = malloc(sizeof(arenaBlock_t) + blockSize);
+		if (block == NULL) {
+			libfail();
+			return NULL;
+		}
+		block->size = blockSize;
+		block->used = 0;
+		// a block for one large string goes behind the current one
+		if (size > ARENA_BLOCK_SIZE && arena->blocks != NULL) {
+			block->next = arena->blocks->next;
+			arena->blocks->next = block;
+		} else {
+			block->next = arena->blocks;
+			arena->blocks = block;
+		}
+		arena->stats.blocks++;
+	}
+	char* result = block->data + block->used;
+	block->used += size;
+	return result;
+}
+
+/*
+ * Returns the interned copy of the length bytes at string (which do not
+ * have to be terminated). The copy is terminated and stays valid until the
+ * arena is destroyed.
+ */
+const char* arenaIntern(arena_t* arena, const char* string, size_t length) {
+	uint32_t hash = hashOf(string, length);
+	pthread_mutex_lock(&(arena->lock));
+	arena->stats.lookups++;
+
+	// at most half full, so probes stay short
+	if ((arena->count + 1) * 2 > arena->capacity && grow(arena) < 0) {
+		pthread_mutex_unlock(&(arena->lock));
+		return NULL;
+	}
+
+	size_t slot = hash & (arena->capacity - 1);
+	for (; arena->slots[slot].string != NULL; slot = (slot + 1) & (arena->capacity - 1)) {
+		arenaSlot_t* tmp = &(arena->slots[slot]);
+		if (tmp->hash == hash && tmp->length == length && memcmp(tmp->string, string, length) == 0) {
+			pthread_mutex_unlock(&(arena->lock));
+			return tmp->string;
+		}
+	}
+
+	char* copy = allocate(arena, length + 1);
+	if (copy == NULL) {
+		pthread_mutex_unlock(&(arena->lock));
+		return NULL;
+	}
+	memcpy(copy, string, length);
+	copy[length] = '\0';
+	arena->slots[slot] = (arenaSlot_t) {.string = copy, .length = length, .hash = hash};
+	arena->count++;
+	arena->stats.strings++;
+	arena->stats.bytes += length + 1;
+	pthread_mutex_unlock(&(arena->lock));
+	return copy;
+}
+
+void getArenaStats(arena_t* arena, arenaStats_t* stats) {
+	pthread_mutex_lock(&(arena->lock));
+	*stats = arena->stats;
+	pthread_mutex_unlock(&(arena->lock));
+}
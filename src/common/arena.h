@@ -0,0 +1,48 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+/*
+ * Interned, immutable strings for a set of agents. Every distinct string is
+ * stored once in large blocks and lives until the arena is destroyed, so
+ * agents of the same set can share names and message texts and are freed
+ * all at once. Interning is thread safe.
+ */
+
+#define ARENA_BLOCK_SIZE (64 << 10)
+
+typedef struct {
+	unsigned long long lookups;
+	unsigned long long strings; // distinct strings stored
+	unsigned long long bytes; // used by strings
+	unsigned long long blocks;
+} arenaStats_t;
+
+struct arenaBlock;
+
+typedef struct {
+	const char* string;
+	size_t length;
+	uint32_t hash;
+} arenaSlot_t;
+
+typedef struct {
+	pthread_mutex_t lock;
+	struct arenaBlock* blocks;
+	arenaSlot_t* slots;
+	size_t capacity; // power of two
+	size_t count;
+	arenaStats_t stats;
+} arena_t;
+
+int arenaInit(arena_t*);
+void arenaDestroy(arena_t*);
+
+const char* arenaIntern(arena_t*, const char*, size_t);
+
+void getArenaStats(arena_t*, arenaStats_t*);
+
+#endif
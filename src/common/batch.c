@@ -0,0 +1,318 @@
+#define _GNU_SOURCE
+
+#include "batch.h"
+#include "error.h"
+#include "registry.h"
+#include "column.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+void batchInit(batch_t* batch) {
+	memset(batch, 0, sizeof(batch_t));
+}
+
+void batchDestroy(batch_t* batch) {
+	free(batch->buffer);
+	free(batch->order);
+	batchInit(batch);
+}
+
+static int compareIndices(const void* a, const void* b, void* packets) {
+	const packet_t* p1 = &(((const packet_t*) packets)[*(const uint32_t*) a]);
+	const packet_t* p2 = &(((const packet_t*) packets)[*(const uint32_t*) b]);
+	if (p1->agent != p2->agent)
+		return p1->agent < p2->agent ? -1 : 1;
+	if (p1->data != p2->data)
+		return (int) p1->data - (int) p2->data;
+	if (p1->type != p2->type)
+		return (int) p1->type - (int) p2->type;
+	return *(const uint32_t*) a < *(const uint32_t*) b ? -1 : 1;
+}
+
+static int reserve(void** buffer, size_t* capacity, size_t size) {
+	if (size <= *capacity)
+		return 0;
+	size_t tmp = *capacity == 0 ? 4096 : *capacity;
+	while (tmp < size)
+		tmp *= 2;
+	void* resized = realloc(*buffer, tmp);
+	if (resized == NULL) {
+		libfail();
+		return -1;
+	}
+	*buffer = resized;
+	*capacity = tmp;
+	return 0;
+}
+
+static inline bool sameGroup(const packet_t* a, const packet_t* b) {
+	return a->agent == b->agent && a->data == b->data && a->type == b->type;
+}
+
+static char* encodeGroup(char* position, const packet_t* packets, const uint32_t* order, size_t count) {
+	const packet_t* first = &(packets[order[0]]);
+	const char* name = getAgentName(first->agent);
+	name = name != NULL ? name : "";
+	size_t nameLength = strlen(name) + 1;
+	position = putVarint(position, nameLength);
+	memcpy(position, name, nameLength);
+	position += nameLength;
+	*(position++) = (char) first->data;
+	*(position++) = (char) first->type;
+	position = putVarint(position, count);
+
+	uint64_t time = 0;
+	int64_t delta = 0;
+	for (size_t i = 0; i < count; i++) {
+		uint64_t current = packets[order[i]].time;
+		int64_t tmp = (int64_t) (current - time);
+		position = putVarint(position, i == 0 ? current : zigzag(i == 1 ? tmp : (int64_t) ((uint64_t) tmp - delta)));
+		delta = tmp;
+		time = current;
+	}
+
+	for (size_t i = 0; i < count;) {
+		class_t class = packets[order[i]].class;
+		size_t run = 1;
+		while (i + run < count && packets[order[i + run]].class == class)
+			run++;
+		position = putVarint(position, run);
+		*(position++) = (char) class;
+		i += run;
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		const packet_t* packet = &(packets[order[i]]);
+		position = putVarint(position, packet->messageLength);
+		if (packet->messageLength > 0) {
+			memcpy(position, packet->message, packet->messageLength);
+			position += packet->messageLength;
+		}
+	}
+
+	switch (first->type) {
+		case INT: {
+			uint32_t previous = 0;
+			for (size_t i = 0; i < count; i++) {
+				uint32_t current = (uint32_t) packets[order[i]].value.integer;
+				position = putVarint(position, zigzag((int32_t) (current - previous)));
+				previous = current;
+			}
+			break;
+		}
+		case DOUBLE: {
+			bitWriter_t writer = {position, 0, 0};
+			uint64_t previous = 0;
+			int leading = -1, trailing = 0;
+			for (size_t i = 0; i < count; i++)
+				putDouble(&writer, packets[order[i]].value.real, &previous, &leading, &trailing);
+			position = flushBits(&writer);
+			break;
+		}
+		case STRING:
+			for (size_t i = 0; i < count; i++) {
+				const packet_t* packet = &(packets[order[i]]);
+				position = putVarint(position, packet->size);
+				memcpy(position, packet->value.string, packet->size);
+				position += packet->size;
+			}
+			break;
+	}
+	return position;
+}
+
+/*
+ * Encodes the packets into batch->buffer. The buffers of the batch are
+ * kept, so encoding batches of similar size does not allocate.
+ */
+int batchEncode(batch_t* batch, const packet_t* packets, size_t count) {
+	if (count > UINT32_MAX) {
+		error = "Too many packets for a batch.";
+		return -1;
+	}
+	if (reserve((void**) &(batch->order), &(batch->orderCapacity), count * sizeof(uint32_t)) < 0)
+		return -1;
+	for (size_t i = 0; i < count; i++)
+		batch->order[i] = i;
+	if (count > 1)
+		qsort_r(batch->order, count, sizeof(uint32_t), compareIndices, (void*) packets);
+
+	// upper bound: every varint at full length, every double without a window
+	size_t groups = 0;
+	size_t size = 1 + 2 * MAX_VARINT;
+	for (size_t i = 0; i < count; i++) {
+		const packet_t* packet = &(packets[batch->order[i]]);
+		if (i == 0 || !sameGroup(packet, &(packets[batch->order[i - 1]]))) {
+			const char* name = getAgentName(packet->agent);
+			size += 2 * MAX_VARINT + 2 + (name != NULL ? strlen(name) : 0) + 1;
+			groups++;
+		}
+		size += 5 * MAX_VARINT + packet->messageLength + packet->size + 1;
+	}
+	if (reserve((void**) &(batch->buffer), &(batch->capacity), size) < 0)
+		return -1;
+
+	char* position = batch->buffer;
+	*(position++) = (char) BATCH_VERSION;
+	position = putVarint(position, groups);
+	position = putVarint(position, count);
+	for (size_t i = 0; i < count;) {
+		size_t length = 1;
+		while (i + length < count && sameGroup(&(packets[batch->order[i + length]]), &(packets[batch->order[i]])))
+			length++;
+		position = encodeGroup(position, packets, batch->order + i, length);
+		i += length;
+	}
+	batch->length = position - batch->buffer;
+	return 0;
+}
+
+static bool decodeGroup(columnReader_t* reader, wirePacket_t* packets, size_t space, size_t* decoded) {
+	uint64_t nameLength, count;
+	if (!getLength(reader, WIRE_MAX_FIELD, &nameLength) || nameLength > (size_t) (reader->end - reader->position)) {
+		error = "Invalid agent name.";
+		return false;
+	}
+	const char* name = reader->position;
+	reader->position += nameLength;
+	if (!isTerminated(name, nameLength) || reader->end - reader->position < 2) {
+		error = "Invalid agent name.";
+		return false;
+	}
+	data_t data = *(reader->position++);
+	type_t type = *(reader->position++);
+	if (data > PROPERTY || type > STRING || !getLength(reader, space, &count) || count == 0) {
+		error = "Invalid group header.";
+		return false;
+	}
+
+	uint64_t time = 0;
+	int64_t delta = 0;
+	for (size_t i = 0; i < count; i++) {
+		uint64_t tmp;
+		if (!getVarint(reader, &tmp)) {
+			error = "Truncated times.";
+			return false;
+		}
+		if (i > 0) {
+			int64_t current = (int64_t) ((uint64_t) unzigzag(tmp) + (i == 1 ? 0 : delta));
+			tmp = time + (uint64_t) current;
+			delta = current;
+		}
+		time = tmp;
+
+		packet_t* packet = &(packets[i].packet);
+		packets[i].name = name;
+		packet->agent = NO_AGENT;
+		packet->status = CREATED;
+		packet->data = data;
+		packet->type = type;
+		packet->time = time;
+		packet->size = type == INT ? sizeof(int32_t) : type == DOUBLE ? sizeof(double) : 0;
+		packet->value.string = NULL;
+	}
+
+	for (size_t i = 0; i < count;) {
+		uint64_t run;
+		if (!getLength(reader, count - i, &run) || run == 0 || reader->position == reader->end
+				|| !isValidClass(*(reader->position))) {
+			error = "Invalid classes.";
+			return false;
+		}
+		class_t class = *(reader->position++);
+		for (; run > 0; run--)
+			packets[i++].packet.class = class;
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		uint64_t length;
+		if (!getLength(reader, WIRE_MAX_FIELD, &length) || length > (size_t) (reader->end - reader->position)
+				|| (length > 0 && !isTerminated(reader->position, length))) {
+			error = "Invalid message.";
+			return false;
+		}
+		packets[i].packet.messageLength = length;
+		packets[i].packet.message = length > 0 ? (char*) reader->position : NULL;
+		reader->position += length;
+	}
+
+	switch (type) {
+		case INT: {
+			uint32_t value = 0;
+			for (size_t i = 0; i < count; i++) {
+				uint64_t tmp;
+				if (!getLength(reader, UINT32_MAX, &tmp)) {
+					error = "Invalid int.";
+					return false;
+				}
+				value += (uint32_t) unzigzag(tmp);
+				packets[i].packet.value.integer = (int32_t) value;
+			}
+			break;
+		}
+		case DOUBLE: {
+			uint64_t value = 0;
+			int leading = -1, trailing = 0;
+			reader->count = 0;
+			for (size_t i = 0; i < count; i++) {
+				if (!getDouble(reader, &value, &leading, &trailing)) {
+					error = "Invalid double.";
+					return false;
+				}
+				memcpy(&(packets[i].packet.value.real), &value, sizeof(double));
+			}
+			break;
+		}
+		case STRING:
+			for (size_t i = 0; i < count; i++) {
+				uint64_t length;
+				if (!getLength(reader, WIRE_MAX_FIELD, &length) || length > (size_t) (reader->end - reader->position)
+						|| !isTerminated(reader->position, length)) {
+					error = "Invalid string data.";
+					return false;
+				}
+				packets[i].packet.size = length;
+				packets[i].packet.value.string = (char*) reader->position;
+				reader->position += length;
+			}
+			break;
+	}
+	*decoded = count;
+	return true;
+}
+
+/*
+ * Returns the number of packets or -1 if the batch is malformed or has
+ * more than the given number of packets.
+ */
+ssize_t batchDecode(const char* buffer, size_t length, wirePacket_t* packets, size_t max) {
+	columnReader_t reader = {buffer, buffer + length, 0, 0};
+	uint64_t groups, count;
+	if (length == 0 || (uint8_t) buffer[0] != BATCH_VERSION) {
+		error = "Unsupported batch version.";
+		return -1;
+	}
+	reader.position++;
+	if (!getVarint(&reader, &groups) || !getVarint(&reader, &count) || groups > count) {
+		error = "Invalid batch header.";
+		return -1;
+	}
+	if (count > max) {
+		error = "Batch has more packets than space.";
+		return -1;
+	}
+	size_t decoded = 0;
+	for (uint64_t i = 0; i < groups; i++) {
+		size_t tmp;
+		if (!decodeGroup(&reader, packets + decoded, count - decoded, &tmp))
+			return -1;
+		decoded += tmp;
+	}
+	if (decoded != count || reader.position != reader.end) {
+		error = "Invalid batch length.";
+		return -1;
+	}
+	return decoded;
+}
@@ -0,0 +1,49 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "packet.h"
+#include "wire.h"
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * Columnar wire format for many packets at once. Packets are grouped by
+ * agent (and data kind and type, META packets of an agent are a group of
+ * their own), so the name is sent once per group, and every group stores
+ * its samples column by column:
+ *
+ *   version (1 byte), group count, packet count
+ *   per group:
+ *     name length, name (including '\0'), data, type (1 byte each), count
+ *     times      first time, then the first delta, then deltas of deltas
+ *     classes    runs of (length, class byte)
+ *     messages   length (including '\0', 0 for none) and bytes per packet
+ *     values     INT: deltas, DOUBLE: XOR with the previous value in bits
+ *                (as in Facebook's Gorilla), STRING: length and bytes
+ *
+ * All numbers are LEB128 varints, signed ones zigzag encoded first. For
+ * periodic samples a time costs one byte and an unchanged double one bit.
+ * Within a group the packets keep their order.
+ *
+ * A batch is decoded as a whole; like wireDecode the decoded packets point
+ * into the buffer.
+ */
+
+#define BATCH_VERSION 0x81 // never a valid WIRE_VERSION
+
+typedef struct {
+	char* buffer;
+	size_t length; // of the encoded batch
+	size_t capacity;
+	uint32_t* order; // packet indices sorted by group
+	size_t orderCapacity;
+} batch_t;
+
+void batchInit(batch_t*);
+void batchDestroy(batch_t*);
+int batchEncode(batch_t*, const packet_t*, size_t);
+ssize_t batchDecode(const char*, size_t, wirePacket_t*, size_t);
+
+#endif
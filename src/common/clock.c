@@ -0,0 +1,118 @@
+#include "clock.h"
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+	#include <x86intrin.h>
+	#include <cpuid.h>
+	#define HAVE_TSC
+#endif
+
+#define CALIBRATION_NS (10 * 1000 * 1000)
+
+static const char* names[] = {"precise", "coarse", "cached", "tsc"};
+
+static atomic_ullong cached; // 0 while nobody keeps it up to date
+
+static struct {
+	bool available;
+	unsigned long long ns; // at calibration
+	unsigned long long tsc; // at calibration
+	unsigned long long scale; // ns per cycle << 32
+} tsc;
+static pthread_once_t calibrated = PTHREAD_ONCE_INIT;
+
+static inline unsigned long long getTimeOf(clockid_t clock) {
+	struct timespec time;
+	clock_gettime(clock, &time);
+	return time.tv_sec * 1000000000ull + time.tv_nsec;
+}
+
+static inline unsigned long long getCoarseTime() {
+#ifdef CLOCK_REALTIME_COARSE
+	return getTimeOf(CLOCK_REALTIME_COARSE);
+#else
+	return getTimeOf(CLOCK_REALTIME);
+#endif
+}
+
+// only with an invariant TSC, which ticks at the same rate on all cores and in all power states
+static void calibrate() {
+#ifdef HAVE_TSC
+	unsigned int eax, ebx, ecx, edx;
+	if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) || !(edx & (1u << 8)))
+		return;
+	unsigned long long ns = getTimeOf(CLOCK_REALTIME);
+	unsigned long long cycles = __rdtsc();
+	struct timespec wait = {0, CALIBRATION_NS};
+	while (nanosleep(&wait, &wait) < 0);
+	tsc.ns = getTimeOf(CLOCK_REALTIME);
+	tsc.tsc = __rdtsc();
+	if (tsc.tsc <= cycles || tsc.ns <= ns)
+		return;
+	tsc.scale = ((tsc.ns - ns) << 32) / (tsc.tsc - cycles);
+	tsc.available = true;
+#endif
+}
+
+static inline unsigned long long getTscTime() {
+#ifdef HAVE_TSC
+	pthread_once(&calibrated, calibrate);
+	if (tsc.available)
+		return tsc.ns + (unsigned long long) (((unsigned __int128) (__rdtsc() - tsc.tsc) * tsc.scale) >> 32);
+#endif
+	return getTimeOf(CLOCK_REALTIME);
+}
+
+unsigned long long getClockTime(clockSource_t source) {
+	switch (source) {
+		case CLOCK_SOURCE_COARSE:
+			return getCoarseTime();
+		case CLOCK_SOURCE_CACHED: {
+			unsigned long long time = atomic_load_explicit(&cached, memory_order_relaxed);
+			return time != 0 ? time : getCoarseTime();
+		}
+		case CLOCK_SOURCE_TSC:
+			return getTscTime();
+		default:
+			return getTimeOf(CLOCK_REALTIME);
+	}
+}
+
+// whether the source is what it says, and not a fallback
+bool hasClockSource(clockSource_t source) {
+	switch (source) {
+		case CLOCK_SOURCE_PRECISE:
+			return true;
+		case CLOCK_SOURCE_COARSE:
+#ifdef CLOCK_REALTIME_COARSE
+			return true;
+#else
+			return false;
+#endif
+		case CLOCK_SOURCE_CACHED:
+			return atomic_load_explicit(&cached, memory_order_relaxed) != 0;
+		case CLOCK_SOURCE_TSC:
+			pthread_once(&calibrated, calibrate);
+			return tsc.available;
+		default:
+			return false;
+	}
+}
+
+const char* getClockSourceName(clockSource_t source) {
+	return source < CLOCK_SOURCES ? names[source] : "unknown";
+}
+
+// by the timer thread on every tick
+void updateClockCache() {
+	atomic_store_explicit(&cached, getTimeOf(CLOCK_REALTIME), memory_order_relaxed);
+}
+
+// when the timer thread stops ticking
+void invalidateClockCache() {
+	atomic_store_explicit(&cached, 0, memory_order_relaxed);
+}
@@ -0,0 +1,41 @@
+#ifndef CLOCK_H
+#define CLOCK_H
+
+#include <stdbool.h>
+
+/*
+ * Wall clock time in ns since the epoch, from a source picked by how much
+ * precision a timestamp needs:
+ *
+ *   CLOCK_SOURCE_PRECISE  clock_gettime(CLOCK_REALTIME), through the vDSO
+ *   CLOCK_SOURCE_COARSE   CLOCK_REALTIME_COARSE, as of the last kernel tick
+ *   CLOCK_SOURCE_CACHED   stored by the timer thread every tick (1 ms) while
+ *                         a timer is armed, COARSE otherwise
+ *   CLOCK_SOURCE_TSC      the time stamp counter, calibrated against PRECISE
+ *                         once; PRECISE without an invariant TSC
+ *
+ * TSC does not follow adjustments of the system clock after calibration,
+ * use it for durations rather than for timestamps that leave the process.
+ */
+
+typedef enum {
+	CLOCK_SOURCE_PRECISE,
+	CLOCK_SOURCE_COARSE,
+	CLOCK_SOURCE_CACHED,
+	CLOCK_SOURCE_TSC,
+	CLOCK_SOURCES
+} clockSource_t;
+
+unsigned long long getClockTime(clockSource_t);
+bool hasClockSource(clockSource_t);
+const char* getClockSourceName(clockSource_t);
+
+// ms since the epoch, what packets carry
+static inline unsigned long long getClockTimeMs(clockSource_t source) {
+	return getClockTime(source) / 1000000;
+}
+
+void updateClockCache(void);
+void invalidateClockCache(void);
+
+#endif
@@ -0,0 +1,158 @@
+#ifndef COLUMN_H
+#define COLUMN_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+/*
+ * Building blocks of the columnar encodings (batch.h, storage.h): LEB128
+ * varints with zigzag for signed values, and Gorilla-style XOR encoding of
+ * doubles in a bit stream (most significant bit first, the last byte
+ * padded with zeros). Writers do not check for space, the caller reserves
+ * the worst case; readers check every byte.
+ */
+
+#define MAX_VARINT 10
+#define MAX_DOUBLE_BYTES 10 // 2 + 5 + 6 + 64 bits, rounded up
+
+static inline uint64_t zigzag(int64_t value) {
+	return ((uint64_t) value << 1) ^ (uint64_t) (value >> 63);
+}
+
+static inline int64_t unzigzag(uint64_t value) {
+	return (int64_t) (value >> 1) ^ -(int64_t) (value & 1);
+}
+
+static inline char* putVarint(char* position, uint64_t value) {
+	while (value >= 0x80) {
+		*(position++) = (char) (value | 0x80);
+		value >>= 7;
+	}
+	*(position++) = (char) value;
+	return position;
+}
+
+// most significant bit first, the last byte is padded with zeros
+typedef struct {
+	char* position;
+	uint64_t bits;
+	int count; // less than 8 between calls
+} bitWriter_t;
+
+static inline void putBits(bitWriter_t* writer, uint64_t value, int count) {
+	if (count > 32) {
+		putBits(writer, value >> 32, count - 32);
+		count = 32;
+	}
+	writer->bits = (writer->bits << count) | (value & ((1ull << count) - 1));
+	writer->count += count;
+	while (writer->count >= 8) {
+		writer->count -= 8;
+		*(writer->position++) = (char) (writer->bits >> writer->count);
+	}
+}
+
+static inline char* flushBits(bitWriter_t* writer) {
+	if (writer->count > 0)
+		*(writer->position++) = (char) (writer->bits << (8 - writer->count));
+	return writer->position;
+}
+
+static inline void putDouble(bitWriter_t* writer, double value, uint64_t* previous, int* leading, int* trailing) {
+	uint64_t bits;
+	memcpy(&bits, &value, sizeof(uint64_t));
+	uint64_t x = bits ^ *previous;
+	*previous = bits;
+	if (x == 0) {
+		putBits(writer, 0, 1);
+		return;
+	}
+	int lz = __builtin_clzll(x);
+	int tz = __builtin_ctzll(x);
+	lz = lz > 31 ? 31 : lz;
+	if (*leading >= 0 && lz >= *leading && tz >= *trailing) {
+		putBits(writer, 2, 2);
+		putBits(writer, x >> *trailing, 64 - *leading - *trailing);
+		return;
+	}
+	int meaningful = 64 - lz - tz;
+	putBits(writer, 3, 2);
+	putBits(writer, lz, 5);
+	putBits(writer, meaningful & 63, 6); // 64 becomes 0
+	putBits(writer, x >> tz, meaningful);
+	*leading = lz;
+	*trailing = tz;
+}
+
+typedef struct {
+	const char* position;
+	const char* end;
+	uint64_t bits;
+	int count;
+} columnReader_t;
+
+static inline bool getVarint(columnReader_t* reader, uint64_t* value) {
+	*value = 0;
+	for (int shift = 0; shift < 64; shift += 7) {
+		if (reader->position == reader->end)
+			return false;
+		uint8_t byte = *(reader->position++);
+		*value |= (uint64_t) (byte & 0x7f) << shift;
+		if (byte < 0x80)
+			return true;
+	}
+	return false;
+}
+
+// like getVarint, but at most limit
+static inline bool getLength(columnReader_t* reader, uint64_t limit, uint64_t* value) {
+	return getVarint(reader, value) && *value <= limit;
+}
+
+static inline bool getBits(columnReader_t* reader, int count, uint64_t* value) {
+	if (count > 32) {
+		uint64_t high;
+		if (!getBits(reader, count - 32, &high) || !getBits(reader, 32, value))
+			return false;
+		*value |= high << 32;
+		return true;
+	}
+	while (reader->count < count) {
+		if (reader->position == reader->end)
+			return false;
+		reader->bits = (reader->bits << 8) | (uint8_t) *(reader->position++);
+		reader->count += 8;
+	}
+	reader->count -= count;
+	*value = (reader->bits >> reader->count) & ((1ull << count) - 1);
+	return true;
+}
+
+static inline bool getDouble(columnReader_t* reader, uint64_t* previous, int* leading, int* trailing) {
+	uint64_t control, x;
+	if (!getBits(reader, 1, &control))
+		return false;
+	if (control == 0)
+		return true;
+	if (!getBits(reader, 1, &control))
+		return false;
+	if (control == 0) {
+		if (*leading < 0 || !getBits(reader, 64 - *leading - *trailing, &x))
+			return false;
+		*previous ^= x << *trailing;
+		return true;
+	}
+	uint64_t lz, meaningful;
+	if (!getBits(reader, 5, &lz) || !getBits(reader, 6, &meaningful))
+		return false;
+	meaningful = meaningful == 0 ? 64 : meaningful;
+	if (lz + meaningful > 64 || !getBits(reader, meaningful, &x))
+		return false;
+	*leading = lz;
+	*trailing = 64 - lz - meaningful;
+	*previous ^= x << *trailing;
+	return true;
+}
+
+#endif
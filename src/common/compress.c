@@ -0,0 +1,258 @@
+#include "config.h"
+
+// before error.h, zstd.h has a field called error
+#ifdef HAVE_LZ4
+	#include <lz4.h>
+#endif
+#ifdef HAVE_ZSTD
+	#include <zstd.h>
+#endif
+
+#include "compress.h"
+#include "registry.h"
+#include "error.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define ZSTD_LEVEL 3
+
+static const char* names[] = {"none", "lz4", "zstd"};
+
+// the compressions this build supports, as a mask
+int getCompressions() {
+	int mask = COMPRESS_MASK(COMPRESS_NONE);
+#ifdef HAVE_LZ4
+	mask |= COMPRESS_MASK(COMPRESS_LZ4);
+#endif
+#ifdef HAVE_ZSTD
+	mask |= COMPRESS_MASK(COMPRESS_ZSTD);
+#endif
+	return mask;
+}
+
+const char* getCompressionName(compression_t compression) {
+	return compression <= COMPRESS_ZSTD ? names[compression] : "unknown";
+}
+
+int parseCompression(const char* name, compression_t* compression) {
+	for (compression_t i = COMPRESS_NONE; i <= COMPRESS_ZSTD; i++) {
+		if (strcmp(name, names[i]) != 0)
+			continue;
+		if (!(getCompressions() & COMPRESS_MASK(i))) {
+			fail("Compression '%s' is not supported by this build.", name);
+			return -1;
+		}
+		*compression = i;
+		return 0;
+	}
+	fail("Unknown compression '%s'.", name);
+	return -1;
+}
+
+static size_t append(char* buffer, size_t length, size_t size, const char* text) {
+	size_t tmp = strlen(text);
+	if (length + tmp > size)
+		return length;
+	memcpy(buffer + length, text, tmp);
+	return length + tmp;
+}
+
+/*
+ * Names and message texts of the registered agents, as long as they fit.
+ * Both libraries take any content as a dictionary, no training needed.
+ * Returns the size of the dictionary.
+ */
+size_t buildDictionary(char* buffer, size_t size) {
+	size_t length = 0;
+	size_t count = getAgentCount();
+	for (uint32_t id = 0; id < count && length < size; id++) {
+		agent_t* agent = getAgent(id);
+		if (agent == NULL)
+			continue;
+		length = append(buffer, length, size, getAgentName(id));
+		for (int i = 0; i < MAX_MESSAGES; i++) {
+			if (agent->messages[i].text != NULL)
+				length = append(buffer, length, size, agent->messages[i].text);
+		}
+	}
+	return length;
+}
+
+int codecInit(codec_t* codec, compression_t compression, const char* dictionary, size_t size) {
+	memset(codec, 0, sizeof(codec_t));
+	if (!(getCompressions() & COMPRESS_MASK(compression))) {
+		error = "Compression not supported by this build.";
+		return -1;
+	}
+	if (size > COMPRESS_DICTIONARY_SIZE) {
+		error = "Dictionary too large.";
+		return -1;
+	}
+	codec->compression = compression;
+	if (size > 0) {
+		codec->dictionary = malloc(size);
+		if (codec->dictionary == NULL) {
+			libfail();
+			return -1;
+		}
+		memcpy(codec->dictionary, dictionary, size);
+		codec->dictionarySize = size;
+	}
+	return 0;
+}
+
+void codecDestroy(codec_t* codec) {
+	switch (codec->compression) {
+		case COMPRESS_NONE:
+			break;
+		case COMPRESS_LZ4:
+#ifdef HAVE_LZ4
+			LZ4_freeStream(codec->compressor);
+#endif
+			break;
+		case COMPRESS_ZSTD:
+#ifdef HAVE_ZSTD
+			ZSTD_freeCCtx(codec->compressor);
+			ZSTD_freeDCtx(codec->decompressor);
+			ZSTD_freeCDict(codec->compressorDictionary);
+			ZSTD_freeDDict(codec->decompressorDictionary);
+#endif
+			break;
+	}
+	free(codec->dictionary);
+	memset(codec, 0, sizeof(codec_t));
+}
+
+// the largest compressed size of length bytes
+size_t codecBound(const codec_t* codec, size_t length) {
+	switch (codec->compression) {
+#ifdef HAVE_LZ4
+		case COMPRESS_LZ4:
+			return LZ4_compressBound(length);
+#endif
+#ifdef HAVE_ZSTD
+		case COMPRESS_ZSTD:
+			return ZSTD_compressBound(length);
+#endif
+		default:
+			return length;
+	}
+}
+
+#ifdef HAVE_LZ4
+static ssize_t compressLZ4(codec_t* codec, const char* input, size_t length, char* output, size_t size) {
+	if (codec->compressor == NULL && (codec->compressor = LZ4_createStream()) == NULL) {
+		error = "Could not create an LZ4 stream.";
+		return -1;
+	}
+	// loading resets the stream, so every batch starts from the dictionary alone
+	LZ4_loadDict(codec->compressor, codec->dictionary, codec->dictionarySize);
+	int tmp = LZ4_compress_fast_continue(codec->compressor, input, output, length, size, 1);
+	if (tmp <= 0) {
+		error = "LZ4 compression failed.";
+		return -1;
+	}
+	return tmp;
+}
+
+static ssize_t decompressLZ4(codec_t* codec, const char* input, size_t length, char* output, size_t size) {
+	int tmp = LZ4_decompress_safe_usingDict(input, output, length, size, codec->dictionary, codec->dictionarySize);
+	if (tmp < 0) {
+		error = "Invalid LZ4 data.";
+		return -1;
+	}
+	return tmp;
+}
+#endif
+
+#ifdef HAVE_ZSTD
+static ssize_t compressZstd(codec_t* codec, const char* input, size_t length, char* output, size_t size) {
+	if (codec->compressor == NULL && (codec->compressor = ZSTD_createCCtx()) == NULL) {
+		error = "Could not create a zstd context.";
+		return -1;
+	}
+	if (codec->dictionarySize > 0 && codec->compressorDictionary == NULL) {
+		codec->compressorDictionary = ZSTD_createCDict(codec->dictionary, codec->dictionarySize, ZSTD_LEVEL);
+		if (codec->compressorDictionary == NULL) {
+			error = "Could not load the zstd dictionary.";
+			return -1;
+		}
+	}
+	size_t tmp = codec->compressorDictionary != NULL ?
+		ZSTD_compress_usingCDict(codec->compressor, output, size, input, length, codec->compressorDictionary) :
+		ZSTD_compressCCtx(codec->compressor, output, size, input, length, ZSTD_LEVEL);
+	if (ZSTD_isError(tmp)) {
+		error = ZSTD_getErrorName(tmp);
+		return -1;
+	}
+	return tmp;
+}
+
+static ssize_t decompressZstd(codec_t* codec, const char* input, size_t length, char* output, size_t size) {
+	if (codec->decompressor == NULL && (codec->decompressor = ZSTD_createDCtx()) == NULL) {
+		error = "Could not create a zstd context.";
+		return -1;
+	}
+	if (codec->dictionarySize > 0 && codec->decompressorDictionary == NULL) {
+		codec->decompressorDictionary = ZSTD_createDDict(codec->dictionary, codec->dictionarySize);
+		if (codec->decompressorDictionary == NULL) {
+			error = "Could not load the zstd dictionary.";
+			return -1;
+		}
+	}
+	size_t tmp = codec->decompressorDictionary != NULL ?
+		ZSTD_decompress_usingDDict(codec->decompressor, output, size, input, length, codec->decompressorDictionary) :
+		ZSTD_decompressDCtx(codec->decompressor, output, size, input, length);
+	if (ZSTD_isError(tmp)) {
+		error = ZSTD_getErrorName(tmp);
+		return -1;
+	}
+	return tmp;
+}
+#endif
+
+/*
+ * Returns the compressed length; output needs codecBound bytes. Without a
+ * compression the input is copied.
+ */
+ssize_t codecCompress(codec_t* codec, const char* input, size_t length, char* output, size_t size) {
+	switch (codec->compression) {
+#ifdef HAVE_LZ4
+		case COMPRESS_LZ4:
+			return compressLZ4(codec, input, length, output, size);
+#endif
+#ifdef HAVE_ZSTD
+		case COMPRESS_ZSTD:
+			return compressZstd(codec, input, length, output, size);
+#endif
+		default:
+			if (length > size) {
+				error = "Output buffer too small.";
+				return -1;
+			}
+			memcpy(output, input, length);
+			return length;
+	}
+}
+
+// returns the decompressed length, -1 if the data is invalid or does not fit
+ssize_t codecDecompress(codec_t* codec, const char* input, size_t length, char* output, size_t size) {
+	switch (codec->compression) {
+#ifdef HAVE_LZ4
+		case COMPRESS_LZ4:
+			return decompressLZ4(codec, input, length, output, size);
+#endif
+#ifdef HAVE_ZSTD
+		case COMPRESS_ZSTD:
+			return decompressZstd(codec, input, length, output, size);
+#endif
+		default:
+			if (length > size) {
+				error = "Output buffer too small.";
+				return -1;
+			}
+			memcpy(output, input, length);
+			return length;
+	}
+}
@@ -0,0 +1,49 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * Compression of whole frame payloads. LZ4 is cheap enough for every link,
+ * zstd compresses better for slow ones; either is only available if
+ * configure found the library.
+ *
+ * Batches are small, so both sides load the same dictionary: the names and
+ * message texts of the agents, which make up most of the bytes of a
+ * batch. The transmitter builds it and sends it with the handshake.
+ */
+
+typedef enum {
+	COMPRESS_NONE,
+	COMPRESS_LZ4,
+	COMPRESS_ZSTD
+} compression_t;
+
+#define COMPRESS_MASK(c) (1 << (c))
+#define COMPRESS_DICTIONARY_SIZE (64 * 1024) // the window of LZ4
+
+typedef struct {
+	compression_t compression;
+	char* dictionary; // own copy
+	size_t dictionarySize;
+	void* compressor; // library contexts, NULL until first used
+	void* decompressor;
+	void* compressorDictionary;
+	void* decompressorDictionary;
+} codec_t;
+
+int getCompressions(void);
+const char* getCompressionName(compression_t);
+int parseCompression(const char*, compression_t*);
+
+size_t buildDictionary(char*, size_t);
+
+int codecInit(codec_t*, compression_t, const char*, size_t);
+void codecDestroy(codec_t*);
+size_t codecBound(const codec_t*, size_t);
+ssize_t codecCompress(codec_t*, const char*, size_t, char*, size_t);
+ssize_t codecDecompress(codec_t*, const char*, size_t, char*, size_t);
+
+#endif
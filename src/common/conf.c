@@ -1,18 +1,18 @@
 #include "conf.h"
 #include "error.h"
-#include "utils.h"
+#include "template.h"
 
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
 #include <stdbool.h>
-#include <assert.h>
-
-static int parseLine(int, char*, char**, char**);
+#include <pthread.h>
 
 /*
 # Example agent config
 
 name = "Agent1" 	# strings in quotes
+script = "uptime"	# run with /bin/sh -c
 data = datavalue 	# none, message, datavalue, property
 type = int 				# int, double, string
 timing = interval # no other timing mode at the moment
@@ -20,280 +20,553 @@ timing.value = 60 # seconds
 
 messages.warning.1 = "Value is too high (%v)." # %v for value, %m for output
 messages.error.10 = "%m"
+
+rules.above.1 = 80 # message code 1 from 80 on, see rules.h
+deadband.absolute = 0.5 # only without rules
+deadband.maxsilence = 300
 */
 
-int parseAgent(const char* config, agent_t* agent) {
-	char* copy = malloc(strlen(config) + 1);
-	if (copy == NULL) {
-		libfail();
+/*
+ * The config is read in one pass and never modified, so it can be an
+ * mmap'd file. Tokens point into the config; only tokens with a backslash
+ * are copied (without the backslashes) into a buffer of the parser. Strings
+ * that end up in the agent are interned in an arena.
+ */
+
+typedef struct {
+	const char* start;
+	size_t length;
+	bool escaped;
+} token_t;
+
+#define BUFFER_SIZE 256
+
+typedef struct {
+	char* text; // storage until a token needs more
+	size_t capacity;
+	char storage[BUFFER_SIZE];
+} buffer_t;
+
+typedef struct {
+	int line;
+	arena_t* arena;
+	buffer_t buffers[2]; // for escaped keys and values
+} parser_t;
+
+typedef struct {
+	const char* name;
+	int value;
+} keyword_t;
+
+static const keyword_t types[] = {
+	{"void", VOID}, {"int", INT}, {"double", DOUBLE}, {"string", STRING}, {NULL, 0}
+};
+static const keyword_t datas[] = {
+	{"none", NONE}, {"datavalue", DATA_VALUE}, {"message", MESSAGE}, {"property", PROPERTY}, {NULL, 0}
+};
+static const keyword_t timings[] = {
+	{"interval", Interval}, {NULL, 0}
+};
+static const keyword_t ruleTypes[] = {
+	{"above", RULE_ABOVE}, {"below", RULE_BELOW}, {"range", RULE_RANGE}, {"rise", RULE_RISE}, {"fall", RULE_FALL},
+	{NULL, 0}
+};
+static const keyword_t classes[] = {
+	{"info", INFO}, {"warning", WARNING}, {"alarm", ALARM}, {"error", ERROR}, {"emergency", EMERGENCY},
+	{"meta", META}, {NULL, 0}
+};
+
+static pthread_once_t defaultOnce = PTHREAD_ONCE_INIT;
+static arena_t defaultArena;
+static int defaultResult;
+
+static void initDefaultArena() {
+	defaultResult = arenaInit(&defaultArena);
+}
+
+static inline bool equals(token_t token, const char* string, size_t length) {
+	return token.length == length && memcmp(token.start, string, length) == 0;
+}
+
+#define EQUALS(token, literal) equals(token, literal, sizeof(literal) - 1)
+
+static bool lookup(const keyword_t* keywords, token_t token, int* value) {
+	for (; keywords->name != NULL; keywords++) {
+		if (equals(token, keywords->name, strlen(keywords->name))) {
+			*value = keywords->value;
+			return true;
+		}
+	}
+	return false;
+}
+
+static bool parseNumber(token_t token, unsigned long long* value) {
+	if (token.length == 0)
+		return false;
+	unsigned long long result = 0;
+	for (size_t i = 0; i < token.length; i++) {
+		char c = token.start[i];
+		if (c < '0' || c > '9' || result > (~0ull - 9) / 10)
+			return false;
+		result = result * 10 + (c - '0');
+	}
+	*value = result;
+	return true;
+}
+
+// drops the backslashes of an escaped token
+static int unescape(parser_t* parser, token_t* token, int index) {
+	if (!token->escaped)
+		return 0;
+	buffer_t* buffer = &(parser->buffers[index]);
+	if (buffer->capacity < token->length) {
+		char* tmp = realloc(buffer->text == buffer->storage ? NULL : buffer->text, token->length);
+		if (tmp == NULL) {
+			libfail();
+			return -1;
+		}
+		buffer->text = tmp;
+		buffer->capacity = token->length;
+	}
+	size_t length = 0;
+	for (size_t i = 0; i < token->length; i++) {
+		if (token->start[i] == '\\' && ++i == token->length)
+			break;
+		buffer->text[length++] = token->start[i];
+	}
+	token->start = buffer->text;
+	token->length = length;
+	return 0;
+}
+
+static const char* intern(parser_t* parser, token_t token) {
+	return arenaIntern(parser->arena, token.start, token.length);
+}
+
+// splits a key of the form <prefix>.<name>.<code>
+static int splitKey(parser_t* parser, token_t key, const char* prefix, token_t* name, uint8_t* code) {
+	token_t parts[3];
+	int count = 0;
+	size_t start = 0;
+	for (size_t i = 0; i <= key.length; i++) {
+		if (i < key.length && key.start[i] != '.')
+			continue;
+		if (count == 3) {
+			fail("Too many key components (line %d).", parser->line);
+			return -1;
+		}
+		parts[count++] = (token_t) {.start = key.start + start, .length = i - start};
+		start = i + 1;
+	}
+	if (!equals(parts[0], prefix, strlen(prefix))) {
+		fail("Unknown key '%.*s' (line %d).", (int) parts[0].length, parts[0].start, parser->line);
+		return -1;
+	}
+	if (count != 3) {
+		fail("Too few key components (line %d).", parser->line);
+		return -1;
+	}
+	unsigned long long number;
+	if (!parseNumber(parts[2], &number)) {
+		fail("Message code has to be a number (line %d).", parser->line);
+		return -1;
+	}
+	if (number >= MAX_MESSAGES) {
+		fail("Message code must be in the range of 0-%d (line %d).", MAX_MESSAGES - 1, parser->line);
 		return -1;
 	}
+	*name = parts[1];
+	*code = number;
+	return 0;
+}
 
-	(void) strcpy(copy, config);
+// parses up to two finite numbers separated by whitespace
+static int parseReals(token_t token, double* values, int count) {
+	char copy[64];
+	if (token.length >= sizeof(copy))
+		return -1;
+	memcpy(copy, token.start, token.length);
+	copy[token.length] = '\0';
+	char* position = copy;
+	for (int i = 0; i < count; i++) {
+		char* end;
+		values[i] = strtod(position, &end);
+		if (end == position || !isfinite(values[i]))
+			return -1;
+		position = end;
+	}
+	while (*position == ' ' || *position == '\t')
+		position++;
+	return *position == '\0' ? 0 : -1;
+}
 
-	int last = 0;
+static int parseRule(parser_t* parser, token_t key, token_t value, agent_t* agent) {
+	token_t name;
+	uint8_t code;
+	if (splitKey(parser, key, "rules", &name, &code) < 0)
+		return -1;
+	if (code == 0) {
+		fail("Rule code 0 is for samples that match no rule (line %d).", parser->line);
+		return -1;
+	}
+	int type;
+	if (!lookup(ruleTypes, name, &type)) {
+		fail("Unknown rule '%.*s' (line %d).", (int) name.length, name.start, parser->line);
+		return -1;
+	}
+	double values[2] = {0, 0};
+	if (parseReals(value, values, type == RULE_RANGE ? 2 : 1) < 0) {
+		fail("Rule %.*s needs %s (line %d).", (int) name.length, name.start,
+			type == RULE_RANGE ? "two numbers" : "a number", parser->line);
+		return -1;
+	}
+	if (addRule(&(agent->rules), type, values[0], values[1], code) < 0)
+		return -1;
+	return 0;
+}
 
-	int line = 0;
-	bool doNext = true;
-	for (size_t i = 0; doNext; i++) {
-		doNext = copy[i] != '\0';
-		if (copy[i] == '\n' || copy[i] == '\0') {
-			line++;
-			copy[i] = '\0';
+static int parseMessage(parser_t* parser, token_t key, token_t value, agent_t* agent) {
+	token_t name;
+	uint8_t code;
+	if (splitKey(parser, key, "messages", &name, &code) < 0)
+		return -1;
+	int class;
+	if (!lookup(classes, name, &class)) {
+		fail("Unknown message class '%.*s' (line %d).", (int) name.length, name.start, parser->line);
+		return -1;
+	}
+	if (class == META) {
+		fail("Message class meta can not be set by the agent (line %d).", parser->line);
+		return -1;
+	}
+	const char* text = intern(parser, value);
+	const char* compiled;
+	if (text == NULL || compileTemplate(text, value.length, parser->arena, &compiled) < 0)
+		return -1;
+	agent->messages[code].text = text;
+	agent->messages[code].compiled = compiled;
+	agent->messages[code].class = class;
+	return 0;
+}
 
-			char* key;
-			char* value;
+static int setKey(parser_t* parser, token_t key, token_t value, agent_t* agent) {
+	if (unescape(parser, &key, 0) < 0 || unescape(parser, &value, 1) < 0)
+		return -1;
 
-			int tmp = parseLine(line, copy + last, &key, &value);
-			//printf("'%s' - '%s'\n", key, value);
-			last = i + 1;
-			if (tmp < 0)
-				return -1;
-			if (tmp > 0)
-				continue;
-
-			if (strcmp("name", key) == 0)
-				agent->name = value;
-			else if (strcmp("type", key) == 0) {
-				if (strcmp(value, "void") == 0)
-					agent->type = VOID;
-				else if (strcmp(value, "int") == 0)
-					agent->type = INT;
-				else if (strcmp(value, "double") == 0)
-					agent->type = DOUBLE;
-				else if (strcmp(value, "string") == 0)
-					agent->type = STRING;
-				else {
-					fail("Unknown data type '%s' (line %d).", value, line);
+	int tmp;
+	const char* string;
+	switch (key.length) {
+		case 4:
+			if (EQUALS(key, "name")) {
+				if ((string = intern(parser, value)) == NULL)
 					return -1;
-				}
-			} else if (strcmp("data", key) == 0) {
-				if (strcmp(value, "none") == 0)
-					agent->data = NONE;
-				else if (strcmp(value, "datavalue") == 0)
-					agent->data = DATA_VALUE;
-				else if (strcmp(value, "message") == 0)
-					agent->data = MESSAGE;
-				else if (strcmp(value, "property") == 0)
-					agent->data = PROPERTY;
-				else {
-					fail("Unknown message type '%s' (line %d).", value, line);
+				agent->name = string;
+				return 0;
+			}
+			if (EQUALS(key, "type")) {
+				if (!lookup(types, value, &tmp)) {
+					fail("Unknown data type '%.*s' (line %d).", (int) value.length, value.start, parser->line);
 					return -1;
 				}
-			} else if (strcmp("timing", key) == 0) {
-				if (strcmp(value, "interval") == 0)
-					agent->timing.type = Interval;
-				else {
-					fail("Unknown timing type '%s' (line %d).", value, line);
+				agent->type = tmp;
+				return 0;
+			}
+			if (EQUALS(key, "data")) {
+				if (!lookup(datas, value, &tmp)) {
+					fail("Unknown message type '%.*s' (line %d).", (int) value.length, value.start, parser->line);
 					return -1;
 				}
-			} else if (strcmp("timing.value", key) == 0) {
-				char* tmp;
-				agent->timing.value = strtol(value, &tmp, 10);
-				if (*tmp != '\0') {
-					fail("Timing value has to be a number (line %d).", line);
+				agent->data = tmp;
+				return 0;
+			}
+			break;
+		case 6:
+			if (EQUALS(key, "script")) {
+				if ((string = intern(parser, value)) == NULL)
+					return -1;
+				agent->script = string;
+				return 0;
+			}
+			if (EQUALS(key, "plugin")) {
+				if ((string = intern(parser, value)) == NULL)
+					return -1;
+				agent->plugin = string;
+				return 0;
+			}
+			if (EQUALS(key, "timing")) {
+				if (!lookup(timings, value, &tmp)) {
+					fail("Unknown timing type '%.*s' (line %d).", (int) value.length, value.start, parser->line);
 					return -1;
 				}
-			} else if (strstr(key, "messages") == key) {
-				char* tmp;
-				int index = 0;
-				char* parts[3];
-				while((tmp = strsep(&key, ".")) != NULL) {
-					if (index >= 3)
-						break;
-					parts[index++] = tmp;
-				}
-				if (tmp != NULL) {
-						fail("Too many key components (line %d).", line);
-						return -1;
-				}
-				if (index != 3) {
-						fail("Too few key components (line %d).", line);
-						return -1;
+				agent->timing.type = tmp;
+				return 0;
+			}
+			break;
+		case 5:
+			if (EQUALS(key, "field")) {
+				unsigned long long field;
+				if (!parseNumber(value, &field) || field > MAX_FIELD) {
+					fail("Field has to be a number up to %d (line %d).", MAX_FIELD, parser->line);
+					return -1;
 				}
-				if (strcmp(parts[0], "messages") != 0) {
-					fail("Unknown key '%s' (line %d).", parts[0], line);
+				agent->field = field;
+				return 0;
+			}
+			break;
+		case 10:
+			if (EQUALS(key, "script.ttl")) {
+				if (!parseNumber(value, &(agent->ttl))) {
+					fail("Script TTL has to be a number (line %d).", parser->line);
 					return -1;
 				}
-				int code = strtol(parts[2], &tmp, 10);
-				if (*tmp != '\0') {
-					fail("Message code has to be a number (line %d).", line);
+				return 0;
+			}
+			break;
+		case 14:
+			if (EQUALS(key, "script.timeout")) {
+				if (!parseNumber(value, &(agent->timeout))) {
+					fail("Script timeout has to be a number (line %d).", parser->line);
 					return -1;
 				}
-				if (code < 0 || code > 255) {
-					fail("Message code musst be in the range of 0-255 (line %d).", line);
+				return 0;
+			}
+			break;
+		case 15:
+			if (EQUALS(key, "plugin.argument")) {
+				if ((string = intern(parser, value)) == NULL)
+					return -1;
+				agent->argument = string;
+				return 0;
+			}
+			break;
+		case 17:
+			if (EQUALS(key, "deadband.absolute") || EQUALS(key, "deadband.relative")) {
+				double threshold;
+				if (parseReals(value, &threshold, 1) < 0 || threshold < 0) {
+					fail("Deadband has to be a positive number (line %d).", parser->line);
 					return -1;
 				}
-				agent->messages[code].text = value;
-
-				if (strcmp(parts[1], "info") == 0)
-					agent->messages[code].class = INFO;
-				else if (strcmp(parts[1], "warning") == 0)
-					agent->messages[code].class = WARNING;
-				else if (strcmp(parts[1], "alarm") == 0)
-					agent->messages[code].class = ALARM;
-				else if (strcmp(parts[1], "error") == 0)
-					agent->messages[code].class = ERROR;
-				else if (strcmp(parts[1], "emergency") == 0)
-					agent->messages[code].class = EMERGENCY;
-				else if (strcmp(parts[1], "meta") == 0){
-					fail("Message class meta can not be set by the agent (line %d).", line);
+				if (!agent->deadband.enabled)
+					agent->deadband = (deadband_t) {.enabled = true, .absolute = -1, .relative = -1};
+				if (key.start[9] == 'a')
+					agent->deadband.absolute = threshold;
+				else
+					agent->deadband.relative = threshold;
+				return 0;
+			}
+			break;
+		case 19:
+			if (EQUALS(key, "deadband.maxsilence")) {
+				unsigned long long seconds;
+				if (!parseNumber(value, &seconds)) {
+					fail("Maximum silence has to be a number (line %d).", parser->line);
 					return -1;
-				} else {
-					fail("Unknown message class '%s' (line %d).", parts[1], line);
+				}
+				if (!agent->deadband.enabled)
+					agent->deadband = (deadband_t) {.enabled = true, .absolute = -1, .relative = -1};
+				agent->deadband.maxSilence = seconds;
+				return 0;
+			}
+			break;
+		case 12:
+			if (EQUALS(key, "timing.value")) {
+				if (!parseNumber(value, &(agent->timing.value))) {
+					fail("Timing value has to be a number (line %d).", parser->line);
 					return -1;
 				}
+				return 0;
 			}
-
-		}
+			break;
 	}
+	if (key.length >= 8 && memcmp(key.start, "messages", 8) == 0)
+		return parseMessage(parser, key, value, agent);
+	if (key.length >= 5 && memcmp(key.start, "rules", 5) == 0)
+		return parseRule(parser, key, value, agent);
+	// unknown keys are ignored
 	return 0;
 }
 
-int parseLine(int linenr, char* string, char** key, char** value) {
-	#define INIT 0
-	#define KEY_START_FOUND 1
-	#define KEY_STOP_FOUND 2
-	#define SEPERATOR_FOUND 3
-	#define VALUE_START_FOUND 4
-	#define VALUE_STOP_FOUND 5
-	int state = INIT;
-	bool isEnquoted = false;
-	bool isMasked = false;
-	bool willMasked = false;
-	char* sub = string;
-	for (size_t i = 0; string[i] != '\0'; i++) {
-		if ((string[i] == ' ' || string[i] == '\t') && !isEnquoted) {
-			switch(state) {
-				case INIT:
-				case KEY_STOP_FOUND:
-				case SEPERATOR_FOUND:
-				case VALUE_STOP_FOUND:
-					sub = string + i + 1;
-					break;
-				case KEY_START_FOUND:
-					state = KEY_STOP_FOUND;
-					string[i] = '\0';
-					*key = sub;
-					sub = string + i + 1;
-					break;
-				case VALUE_START_FOUND:
-					state = VALUE_STOP_FOUND;
-					string[i] = '\0';
-					*value = sub;
-					sub = string + i + 1;
-					break;
-				default:
-					assert(false);
-			}
-		} else if (string[i] == '=' && !isEnquoted) {
-			switch(state) {
-				case INIT:
-				case SEPERATOR_FOUND:
-				case VALUE_START_FOUND:
-				case VALUE_STOP_FOUND:
-					fail("Unexpected '=' on line %d:%lu.", linenr, i + 1);
-					return -1;
-				case KEY_STOP_FOUND:
-					state = SEPERATOR_FOUND;
-					break;
-				case KEY_START_FOUND:
-					string[i] = '\0';
-					*key = sub;
-					sub = string + i + 1;
-					state = SEPERATOR_FOUND;
-					break;
-				default:
-					assert(false);
+typedef enum {
+	INIT,
+	KEY,
+	KEY_END,
+	SEPARATOR,
+	VALUE,
+	VALUE_END,
+	COMMENT
+} state_t;
+
+static int parse(parser_t* parser, const char* config, size_t length, agent_t* agent) {
+	state_t state = INIT;
+	bool quoted = false;
+	bool masked = false;
+	size_t lineStart = 0;
+	token_t key = {0}, value = {0};
+	token_t* token = NULL; // the token being read
+
+	parser->line = 1;
+	for (size_t i = 0;; i++) {
+		char c = i < length ? config[i] : '\0';
+
+		if (c == '\n' || c == '\0') {
+			if (quoted) {
+				fail("Missing \" on line %d.", parser->line);
+				return -1;
 			}
-		} else if (string[i] == '#' && !isEnquoted) {
-			break;
-		} else if (string[i] == '"' && !isMasked && isEnquoted) {
-			isEnquoted = false;
+			if (state == VALUE)
+				value.length = config + i - value.start;
 			switch (state) {
-				case KEY_START_FOUND:
-					string[i] = '\0';
-					*key = sub;
-					sub = string + i + 1;
-					state = KEY_STOP_FOUND;
-					break;
-				case VALUE_START_FOUND:
-					string[i] = '\0';
-					*value = sub;
-					sub = string + i + 1;
-					state = VALUE_STOP_FOUND;
-					break;
-				default:
-					case INIT:
-					case KEY_STOP_FOUND:
-					case VALUE_STOP_FOUND:
-					case SEPERATOR_FOUND:
-					assert(false);
-			}
-		} else if (string[i] == '"' && !isMasked) {
-				isEnquoted = true;
-				switch (state) {
-					case INIT:
-						sub = string + i + 1;
-						state = KEY_START_FOUND;
-						break;
-					case SEPERATOR_FOUND:
-						sub = string + i + 1;
-						state = VALUE_START_FOUND;
+				case INIT:
+				case COMMENT:
+					if (key.start == NULL)
 						break;
-					case KEY_STOP_FOUND:
-					case VALUE_STOP_FOUND:
-						fail("Unexpected '\"' on line %d:%lu.", linenr, i + 1);
+					// the comment followed a value
+					// fall through
+				case VALUE:
+				case VALUE_END:
+					if (setKey(parser, key, value, agent) < 0)
 						return -1;
-					case KEY_START_FOUND:
-					case VALUE_START_FOUND:
-					default: assert(false);
-				}
-		} else if (string[i] == '\\' && !isMasked) {
-			willMasked = true;
-			memmove(sub + 1, sub, string + i - sub);
-			sub++;
-		} else {
-			switch (state) {
-				case INIT:
-					state = KEY_START_FOUND;
-					break;
-				case SEPERATOR_FOUND:
-					state = VALUE_START_FOUND;
-					break;
-				case KEY_START_FOUND:
-				case VALUE_START_FOUND:
 					break;
-				case KEY_STOP_FOUND:
-				case VALUE_STOP_FOUND:
-					fail("Unexpected string on line %d:%lu.", linenr, i + 1);
+				case KEY:
+				case KEY_END:
+					fail("Missing = on line %d.", parser->line);
 					return -1;
-				default:
-					assert(false);
+				case SEPARATOR:
+					fail("Missing value on line %d.", parser->line);
+					return -1;
+			}
+			if (c == '\0')
+				return 0;
+			parser->line++;
+			lineStart = i + 1;
+			state = INIT;
+			masked = false;
+			key = (token_t) {0};
+			value = (token_t) {0};
+			token = NULL;
+			continue;
+		}
+		if (state == COMMENT)
+			continue;
+
+		if (masked) {
+			masked = false;
+			continue;
+		}
+		if (quoted) {
+			if (c == '\\') {
+				masked = true;
+				token->escaped = true;
+			} else if (c == '"') {
+				quoted = false;
+				token->length = config + i - token->start;
+				state = state == KEY ? KEY_END : VALUE_END;
 			}
+			continue;
+		}
+
+		switch (c) {
+			case ' ':
+			case '\t':
+			case '\r':
+				if (state == KEY || state == VALUE) {
+					token->length = config + i - token->start;
+					state = state == KEY ? KEY_END : VALUE_END;
+				}
+				break;
+			case '=':
+				if (state == KEY) {
+					token->length = config + i - token->start;
+					state = SEPARATOR;
+				} else if (state == KEY_END) {
+					state = SEPARATOR;
+				} else {
+					fail("Unexpected '=' on line %d:%zu.", parser->line, i - lineStart + 1);
+					return -1;
+				}
+				break;
+			case '#':
+				if (state == KEY || state == KEY_END) {
+					fail("Missing = on line %d.", parser->line);
+					return -1;
+				}
+				if (state == SEPARATOR) {
+					fail("Missing value on line %d.", parser->line);
+					return -1;
+				}
+				if (state == VALUE)
+					token->length = config + i - token->start;
+				state = COMMENT;
+				break;
+			case '"':
+				if (state != INIT && state != SEPARATOR) {
+					fail("Unexpected '\"' on line %d:%zu.", parser->line, i - lineStart + 1);
+					return -1;
+				}
+				token = state == INIT ? &key : &value;
+				token->start = config + i + 1;
+				state = state == INIT ? KEY : VALUE;
+				quoted = true;
+				break;
+			default:
+				if (state == KEY_END || state == VALUE_END) {
+					fail("Unexpected string on line %d:%zu.", parser->line, i - lineStart + 1);
+					return -1;
+				}
+				if (state == INIT || state == SEPARATOR) {
+					token = state == INIT ? &key : &value;
+					token->start = config + i;
+					state = state == INIT ? KEY : VALUE;
+				}
+				if (c == '\\') {
+					masked = true;
+					token->escaped = true;
+				}
+				break;
 		}
-		isMasked = willMasked;
-		willMasked = false;
 	}
-	if (isEnquoted) {
-		fail("Missing \" on line %d.", linenr);
+}
+
+// checks the rules against the rest of the agent and orders them
+static int finishRules(agent_t* agent) {
+	rules_t* rules = &(agent->rules);
+	if ((rules->count > 0 || agent->deadband.enabled) && agent->type != INT && agent->type != DOUBLE) {
+		error = rules->count > 0 ? "Rules need an int or double agent." : "A deadband needs an int or double agent.";
 		return -1;
 	}
-	if (state == INIT) {
-		*key = NULL;
-		*value = NULL;
-		return 1;
+	if (rules->count == 0)
+		return 0;
+	for (uint8_t i = 0; i < rules->count; i++) {
+		const message_t* message = &(agent->messages[rules->list[i].code]);
+		if (message->text == NULL) {
+			fail("Rule for message code %d without a message.", rules->list[i].code);
+			return -1;
+		}
+		rules->list[i].class = message->class;
 	}
-	if (state == KEY_START_FOUND || state == KEY_STOP_FOUND) {
-		fail("Missing = on line %d.", linenr);
-		return -1;
+	sortRules(rules);
+	return 0;
+}
+
+int parseAgentBuffer(const char* config, size_t length, agent_t* agent, arena_t* arena) {
+	parser_t parser;
+	parser.arena = arena;
+	for (int i = 0; i < 2; i++) {
+		parser.buffers[i].text = parser.buffers[i].storage;
+		parser.buffers[i].capacity = BUFFER_SIZE;
 	}
-	if (state == SEPERATOR_FOUND) {
-		fail("Missing value on line %d.", linenr);
+	int result = parse(&parser, config, length, agent);
+	if (result == 0)
+		result = finishRules(agent);
+	for (int i = 0; i < 2; i++)
+		if (parser.buffers[i].text != parser.buffers[i].storage)
+			free(parser.buffers[i].text);
+	return result;
+}
+
+int parseAgent(const char* config, agent_t* agent) {
+	pthread_once(&defaultOnce, initDefaultArena);
+	if (defaultResult < 0)
 		return -1;
-	}
-	if (state == VALUE_START_FOUND) {
-		*value = sub;
-	}
-	return 0;
+	return parseAgentBuffer(config, strlen(config), agent, &defaultArena);
 }
@@ -2,9 +2,14 @@
 #define CONF_H
 
 #include "data.h"
+#include "arena.h"
+#include "rules.h"
+
+#include <stddef.h>
 
 typedef struct {
 	const char* text; // %v for datavalue, %m for message
+	const char* compiled; // see template.h, NULL if the text has no placeholders
 	class_t class;
 } message_t;
 
@@ -21,17 +26,26 @@ typedef struct {
 } timing_t;
 
 #define MAX_MESSAGES 255
+#define MAX_FIELD 1024
 
 typedef struct {
 	const char* name;
 	const char* script;
+	const char* plugin; // samples in process instead of the script, see plugin.h
+	const char* argument; // for the plugin
+	timestamp_t ttl; // s, output of the same script that is younger is reused
+	timestamp_t timeout; // s, the script is killed after it, 0 for the default
+	unsigned int field; // the value is this whitespace separated field of the output, 0 for all of it
 	data_t data;
 	type_t type;
-	void* lastValue;
+	void* lastValue; // reading_t of the running agent, see rules.h
 	timing_t timing;
 	message_t messages[MAX_MESSAGES];
+	rules_t rules;
+	deadband_t deadband;
 } agent_t;
 
 int parseAgent(const char*, agent_t*);
+int parseAgentBuffer(const char*, size_t, agent_t*, arena_t*);
 
 #endif
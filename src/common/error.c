@@ -2,42 +2,437 @@
 
 #include <stdarg.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
 #include <string.h>
 #include <errno.h>
-#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/syscall.h>
 
-const char* error;
+/*
+ * A failure keeps its format and a copy of every argument, strings
+ * included, so it can be formatted after the caller is gone. Every
+ * conversion takes exactly one argument: * widths are stored as numbers
+ * and integers are widened to long long. Formats that do not fit are
+ * formatted right away.
+ */
 
-#define MAX_ERROR_LENGTH 1024
-static char* errmsg = NULL;
+typedef enum {
+	ARGUMENT_SIGNED,
+	ARGUMENT_UNSIGNED,
+	ARGUMENT_DOUBLE,
+	ARGUMENT_LONG_DOUBLE,
+	ARGUMENT_STRING,
+	ARGUMENT_POINTER
+} argumentType_t;
 
-void fail(const char* format, ...) {
-	if (errmsg == NULL) {
-		error = "Dynamic error messages not initialized.";
+typedef struct {
+	uint8_t type; // argumentType_t
+	uint8_t widths; // * widths before the value
+	union {
+		long long integer;
+		unsigned long long natural;
+		double real;
+		long double longReal;
+		size_t string; // offset into strings
+		void* pointer;
+	};
+	int width[2];
+} argument_t;
+
+typedef struct {
+	atomic_uint sequence; // odd while written
+	int code;
+	unsigned long long time; // ns since the epoch
+	const char* format; // NULL if strings holds the message
+	int count;
+	argument_t arguments[ERROR_MAX_ARGUMENTS];
+	char strings[ERROR_MAX_STRINGS];
+} failure_t;
+
+typedef struct errorState {
+	failure_t ring[ERROR_RING];
+	atomic_ullong recorded; // failures so far
+	unsigned long long reported; // by printRecentErrors
+	pid_t thread;
+	atomic_bool owned; // by a running thread
+	struct errorState* next;
+	char message[MAX_ERROR_LENGTH];
+} errorState_t;
+
+static __thread const char* message;
+static __thread int code;
+static __thread bool pending; // message has to be formatted from the last failure
+static __thread errorState_t* local;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER; // the list
+static errorState_t* all;
+static pthread_key_t key;
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+// the next thread takes over the ring
+static void release(void* argument) {
+	errorState_t* state = argument;
+	atomic_store_explicit(&(state->owned), false, memory_order_release);
+}
+
+static void createKey() {
+	(void) pthread_key_create(&key, release);
+}
+
+static errorState_t* getState() {
+	if (local != NULL)
+		return local;
+	pthread_once(&once, createKey);
+	pthread_mutex_lock(&lock);
+	errorState_t* state = all;
+	while (state != NULL && atomic_load_explicit(&(state->owned), memory_order_acquire))
+		state = state->next;
+	if (state == NULL) {
+		state = calloc(1, sizeof(errorState_t));
+		if (state == NULL) {
+			pthread_mutex_unlock(&lock);
+			return NULL;
+		}
+		state->next = all;
+		all = state;
+	}
+	atomic_store_explicit(&(state->owned), true, memory_order_relaxed);
+	state->thread = syscall(SYS_gettid);
+	pthread_mutex_unlock(&lock);
+	(void) pthread_setspecific(key, state);
+	local = state;
+	return state;
+}
+
+static const char* skipFlags(const char* p) {
+	while (*p == '-' || *p == '+' || *p == ' ' || *p == '#' || *p == '0' || *p == '\'')
+		p++;
+	return p;
+}
+
+static const char* skipDigits(const char* p) {
+	while (*p >= '0' && *p <= '9')
+		p++;
+	return p;
+}
+
+// copies the arguments of format, false if they do not fit
+static bool capture(failure_t* failure, const char* format, va_list arguments) {
+	size_t used = 0;
+	failure->count = 0;
+	for (const char* p = format; *p != '\0'; p++) {
+		if (*p != '%')
+			continue;
+		if (*(++p) == '%')
+			continue;
+		if (failure->count == ERROR_MAX_ARGUMENTS)
+			return false;
+		argument_t* argument = &(failure->arguments[failure->count++]);
+		argument->widths = 0;
+		p = skipFlags(p);
+		if (*p == '*') {
+			argument->width[argument->widths++] = va_arg(arguments, int);
+			p++;
+		} else
+			p = skipDigits(p);
+		int precision = -1; // the most bytes read of a string, slices need not end with '\0'
+		if (*p == '.') {
+			p++;
+			if (*p == '*') {
+				precision = argument->width[argument->widths++] = va_arg(arguments, int);
+				p++;
+			} else {
+				precision = 0;
+				for (; *p >= '0' && *p <= '9'; p++)
+					precision = precision < ERROR_MAX_STRINGS ? 10 * precision + *p - '0' : precision;
+			}
+		}
+		char length = 0;
+		if (*p == 'h' || *p == 'l' || *p == 'L' || *p == 'z' || *p == 'j' || *p == 't') {
+			length = *(p++);
+			if ((length == 'h' || length == 'l') && *p == length) {
+				length = length == 'l' ? 'q' : 'H';
+				p++;
+			}
+		}
+		switch (*p) {
+			case 'd':
+			case 'i':
+				argument->type = ARGUMENT_SIGNED;
+				if (length == 'q')
+					argument->integer = va_arg(arguments, long long);
+				else if (length == 'l')
+					argument->integer = va_arg(arguments, long);
+				else if (length == 'z' || length == 't')
+					argument->integer = va_arg(arguments, ptrdiff_t);
+				else if (length == 'j')
+					argument->integer = va_arg(arguments, intmax_t);
+				else
+					argument->integer = va_arg(arguments, int);
+				break;
+			case 'u':
+			case 'o':
+			case 'x':
+			case 'X':
+			case 'c':
+				argument->type = ARGUMENT_UNSIGNED;
+				if (length == 'q')
+					argument->natural = va_arg(arguments, unsigned long long);
+				else if (length == 'l')
+					argument->natural = va_arg(arguments, unsigned long);
+				else if (length == 'z' || length == 't')
+					argument->natural = va_arg(arguments, size_t);
+				else if (length == 'j')
+					argument->natural = va_arg(arguments, uintmax_t);
+				else
+					argument->natural = va_arg(arguments, unsigned int);
+				break;
+			case 'e':
+			case 'E':
+			case 'f':
+			case 'F':
+			case 'g':
+			case 'G':
+			case 'a':
+			case 'A':
+				if (length == 'L') {
+					argument->type = ARGUMENT_LONG_DOUBLE;
+					argument->longReal = va_arg(arguments, long double);
+				} else {
+					argument->type = ARGUMENT_DOUBLE;
+					argument->real = va_arg(arguments, double);
+				}
+				break;
+			case 's': {
+				if (length != 0)
+					return false;
+				const char* string = va_arg(arguments, const char*);
+				if (string == NULL)
+					string = "(null)";
+				size_t size = strnlen(string, precision >= 0 && precision < ERROR_MAX_STRINGS ? precision
+					: ERROR_MAX_STRINGS) + 1;
+				if (used + size > ERROR_MAX_STRINGS)
+					return false;
+				memcpy(failure->strings + used, string, size - 1);
+				failure->strings[used + size - 1] = '\0';
+				argument->type = ARGUMENT_STRING;
+				argument->string = used;
+				used += size;
+				break;
+			}
+			case 'p':
+				argument->type = ARGUMENT_POINTER;
+				argument->pointer = va_arg(arguments, void*);
+				break;
+			default:
+				return false;
+		}
+	}
+	return true;
+}
+
+// one conversion at a time, with the widths written into the conversion
+static void format(const failure_t* failure, char* buffer, size_t size) {
+	if (failure->format == NULL) {
+		snprintf(buffer, size, "%s", failure->strings);
 		return;
 	}
-	va_list arguments;
+	size_t length = 0;
+	int index = 0;
+	char conversion[64];
+	for (const char* p = failure->format; *p != '\0' && length + 1 < size;) {
+		if (*p != '%') {
+			buffer[length++] = *(p++);
+			continue;
+		}
+		if (p[1] == '%') {
+			buffer[length++] = '%';
+			p += 2;
+			continue;
+		}
+		const argument_t* argument = &(failure->arguments[index++]);
+		size_t n = 0;
+		int widths = 0;
+		conversion[n++] = *(p++);
+		// the conversion ends with the first letter that is no length modifier
+		for (; *p != '\0' && n < sizeof(conversion) - 16; p++) {
+			if (*p == '*') {
+				n += snprintf(conversion + n, sizeof(conversion) - n, "%d", argument->width[widths++]);
+				continue;
+			}
+			if (*p == 'h' || *p == 'l' || *p == 'L' || *p == 'z' || *p == 'j' || *p == 't')
+				continue;
+			conversion[n++] = *p;
+			if ((*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z'))
+				break;
+		}
+		char type = conversion[n - 1];
+		p++;
+		if (argument->type == ARGUMENT_SIGNED || (argument->type == ARGUMENT_UNSIGNED && type != 'c')) {
+			// widened to long long
+			conversion[n - 1] = 'l';
+			conversion[n++] = 'l';
+			conversion[n++] = type;
+		} else if (argument->type == ARGUMENT_LONG_DOUBLE) {
+			conversion[n - 1] = 'L';
+			conversion[n++] = type;
+		}
+		conversion[n] = '\0';
 
-	va_start(arguments, format);
+		int written = 0;
+		switch (argument->type) {
+			case ARGUMENT_SIGNED:
+				written = snprintf(buffer + length, size - length, conversion, argument->integer);
+				break;
+			case ARGUMENT_UNSIGNED:
+				if (type == 'c')
+					written = snprintf(buffer + length, size - length, conversion, (int) argument->natural);
+				else
+					written = snprintf(buffer + length, size - length, conversion, argument->natural);
+				break;
+			case ARGUMENT_DOUBLE:
+				written = snprintf(buffer + length, size - length, conversion, argument->real);
+				break;
+			case ARGUMENT_LONG_DOUBLE:
+				written = snprintf(buffer + length, size - length, conversion, argument->longReal);
+				break;
+			case ARGUMENT_STRING:
+				written = snprintf(buffer + length, size - length, conversion, failure->strings + argument->string);
+				break;
+			case ARGUMENT_POINTER:
+				written = snprintf(buffer + length, size - length, conversion, argument->pointer);
+				break;
+		}
+		if (written > 0)
+			length += written;
+		if (length >= size)
+			length = size - 1;
+	}
+	buffer[length] = '\0';
+}
+
+// a static text, or a format and its arguments
+static void record(int tmp, const char* text, const char* format, va_list* arguments) {
+	errorState_t* state = getState();
+	code = tmp;
+	if (state == NULL) {
+		// the format is better than nothing
+		message = format != NULL ? format : text;
+		pending = false;
+		return;
+	}
+	unsigned long long recorded = atomic_load_explicit(&(state->recorded), memory_order_relaxed);
+	failure_t* failure = &(state->ring[recorded % ERROR_RING]);
+	unsigned sequence = atomic_load_explicit(&(failure->sequence), memory_order_relaxed);
+	atomic_store_explicit(&(failure->sequence), sequence + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	struct timespec time;
+	clock_gettime(CLOCK_REALTIME, &time);
+	failure->time = time.tv_sec * 1000000000ull + time.tv_nsec;
+	failure->code = tmp;
+	failure->format = format;
+	if (format == NULL)
+		snprintf(failure->strings, ERROR_MAX_STRINGS, "%s", text);
+	else {
+		va_list copy;
+		va_copy(copy, *arguments);
+		bool captured = capture(failure, format, copy);
+		va_end(copy);
+		if (!captured) {
+			failure->format = NULL;
+			vsnprintf(failure->strings, ERROR_MAX_STRINGS, format, *arguments);
+		}
+	}
 
-	if (vsnprintf(errmsg, MAX_ERROR_LENGTH, format, arguments) < 0)
-		libfail();
-	else
-		error = errmsg;
+	atomic_store_explicit(&(failure->sequence), sequence + 2, memory_order_release);
+	atomic_store_explicit(&(state->recorded), recorded + 1, memory_order_release);
+	if (format == NULL) {
+		message = text;
+		pending = false;
+	} else
+		pending = true;
+}
+
+const char** getErrorLocation() {
+	if (pending) {
+		pending = false;
+		unsigned long long recorded = atomic_load_explicit(&(local->recorded), memory_order_relaxed);
+		format(&(local->ring[(recorded - 1) % ERROR_RING]), local->message, MAX_ERROR_LENGTH);
+		message = local->message;
+	}
+	return &message;
+}
+
+// of the last fail, failCode or libfail of this thread, 0 for fail
+int getErrorCode() {
+	return code;
+}
 
+void fail(const char* format, ...) {
+	va_list arguments;
+	va_start(arguments, format);
+	record(0, NULL, format, &arguments);
+	va_end(arguments);
+}
+
+void failCode(int tmp, const char* format, ...) {
+	va_list arguments;
+	va_start(arguments, format);
+	record(tmp, NULL, format, &arguments);
 	va_end(arguments);
 }
 
 void libfail() {
-	error = strerror(errno);
+	int tmp = errno;
+	record(tmp, strerror(tmp), NULL, NULL);
 }
 
+// sets up the error state of this thread early, so the first fail does not allocate
 int errorInit() {
-	if (errmsg == NULL)
-		errmsg = malloc(MAX_ERROR_LENGTH);
-	if (errmsg == NULL) {
-		libfail();
+	if (getState() == NULL) {
+		error = "Out of memory.";
 		return -1;
 	}
 	return 0;
 }
+
+// failures of all threads since the last call, a failure that is just being overwritten is skipped
+void printRecentErrors(FILE* file) {
+	static failure_t copy;
+	char buffer[MAX_ERROR_LENGTH];
+	pthread_mutex_lock(&lock);
+	for (errorState_t* state = all; state != NULL; state = state->next) {
+		unsigned long long recorded = atomic_load_explicit(&(state->recorded), memory_order_acquire);
+		unsigned long long i = state->reported;
+		if (recorded - i > ERROR_RING)
+			i = recorded - ERROR_RING;
+		for (; i < recorded; i++) {
+			failure_t* failure = &(state->ring[i % ERROR_RING]);
+			unsigned sequence = atomic_load_explicit(&(failure->sequence), memory_order_acquire);
+			if (sequence & 1)
+				continue;
+			memcpy((char*) &copy + offsetof(failure_t, code), (char*) failure + offsetof(failure_t, code),
+				sizeof(failure_t) - offsetof(failure_t, code));
+			atomic_thread_fence(memory_order_acquire);
+			if (atomic_load_explicit(&(failure->sequence), memory_order_relaxed) != sequence)
+				continue;
+			format(&copy, buffer, sizeof(buffer));
+			time_t seconds = copy.time / 1000000000;
+			struct tm tm;
+			char timestamp[32];
+			strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", localtime_r(&seconds, &tm));
+			fprintf(file, "%s.%03llu [%d] %s", timestamp, copy.time / 1000000 % 1000, (int) state->thread, buffer);
+			if (copy.code != 0)
+				fprintf(file, " (code %d)", copy.code);
+			fputc('\n', file);
+		}
+		state->reported = recorded;
+	}
+	pthread_mutex_unlock(&lock);
+}
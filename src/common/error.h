@@ -1,11 +1,32 @@
 #ifndef ERROR_H
 #define ERROR_H
 
-extern const char* error;
+#include <stdio.h>
 
-void fail(const char*, ...);
+/*
+ * Every thread has an error of its own. Like errno, error is an lvalue:
+ * static messages are assigned directly, fail records a static format and
+ * a copy of its arguments, which are only formatted once error is read.
+ * The last ERROR_RING failures of every thread stay in a ring for
+ * diagnostics, see printRecentErrors. Headers of libraries that use the
+ * name error themselves have to come first.
+ */
+
+#define error (*getErrorLocation())
+
+#define ERROR_RING 16
+#define ERROR_MAX_ARGUMENTS 8
+#define ERROR_MAX_STRINGS 512 // bytes of string arguments kept per failure
+#define MAX_ERROR_LENGTH 1024
+
+const char** getErrorLocation(void);
+int getErrorCode(void);
+
+void fail(const char*, ...) __attribute__((format(printf, 1, 2)));
+void failCode(int, const char*, ...) __attribute__((format(printf, 2, 3)));
 void libfail(void);
 
 int errorInit(void);
+void printRecentErrors(FILE*);
 
 #endif
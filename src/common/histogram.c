@@ -0,0 +1,118 @@
+#include "histogram.h"
+
+#include <string.h>
+
+static inline int bucketOf(uint64_t value) {
+	if (value < HISTOGRAM_SUB_BUCKETS)
+		return value;
+	int exponent = 63 - __builtin_clzll(value); // >= HISTOGRAM_SUB_BITS
+	int shift = exponent - HISTOGRAM_SUB_BITS;
+	int sub = (value >> shift) & (HISTOGRAM_SUB_BUCKETS - 1);
+	return (shift + 1) * HISTOGRAM_SUB_BUCKETS + sub;
+}
+
+// upper bound of the values stored in a bucket
+static inline uint64_t valueOf(int bucket) {
+	if (bucket < HISTOGRAM_SUB_BUCKETS)
+		return bucket;
+	int shift = bucket / HISTOGRAM_SUB_BUCKETS - 1;
+	uint64_t sub = bucket % HISTOGRAM_SUB_BUCKETS;
+	return ((HISTOGRAM_SUB_BUCKETS + sub + 1) << shift) - 1;
+}
+
+void histogramReset(histogram_t* histogram) {
+	for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+		atomic_init(&(histogram->buckets[i]), 0);
+	atomic_init(&(histogram->count), 0);
+	atomic_init(&(histogram->sum), 0);
+	atomic_init(&(histogram->max), 0);
+}
+
+void histogramRecord(histogram_t* histogram, uint64_t value) {
+	atomic_fetch_add_explicit(&(histogram->buckets[bucketOf(value)]), 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&(histogram->count), 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&(histogram->sum), value, memory_order_relaxed);
+	unsigned long long max = atomic_load_explicit(&(histogram->max), memory_order_relaxed);
+	while (value > max) {
+		if (atomic_compare_exchange_weak_explicit(&(histogram->max), &max, value,
+				memory_order_relaxed, memory_order_relaxed))
+			break;
+	}
+}
+
+static inline void add(atomic_ullong* counter, unsigned long long value) {
+	atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + value, memory_order_relaxed);
+}
+
+void histogramRecordLocal(histogram_t* histogram, uint64_t value) {
+	add(&(histogram->buckets[bucketOf(value)]), 1);
+	add(&(histogram->count), 1);
+	add(&(histogram->sum), value);
+	if (value > atomic_load_explicit(&(histogram->max), memory_order_relaxed))
+		atomic_store_explicit(&(histogram->max), value, memory_order_relaxed);
+}
+
+// adds the values of from to histogram, which no other thread records into
+void histogramMerge(histogram_t* histogram, histogram_t* from) {
+	for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+		add(&(histogram->buckets[i]), atomic_load_explicit(&(from->buckets[i]), memory_order_relaxed));
+	add(&(histogram->count), atomic_load_explicit(&(from->count), memory_order_relaxed));
+	add(&(histogram->sum), atomic_load_explicit(&(from->sum), memory_order_relaxed));
+	unsigned long long max = atomic_load_explicit(&(from->max), memory_order_relaxed);
+	if (max > atomic_load_explicit(&(histogram->max), memory_order_relaxed))
+		atomic_store_explicit(&(histogram->max), max, memory_order_relaxed);
+}
+
+unsigned long long histogramCount(histogram_t* histogram) {
+	return atomic_load_explicit(&(histogram->count), memory_order_relaxed);
+}
+
+unsigned long long histogramMax(histogram_t* histogram) {
+	return atomic_load_explicit(&(histogram->max), memory_order_relaxed);
+}
+
+double histogramMean(histogram_t* histogram) {
+	unsigned long long count = histogramCount(histogram);
+	if (count == 0)
+		return 0;
+	return (double) atomic_load_explicit(&(histogram->sum), memory_order_relaxed) / count;
+}
+
+unsigned long long histogramPercentile(histogram_t* histogram, double percentile) {
+	unsigned long long count = histogramCount(histogram);
+	if (count == 0)
+		return 0;
+	unsigned long long rank = (unsigned long long) (percentile / 100 * count + 0.5);
+	if (rank < 1)
+		rank = 1;
+	unsigned long long seen = 0;
+	for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+		seen += atomic_load_explicit(&(histogram->buckets[i]), memory_order_relaxed);
+		if (seen >= rank) {
+			unsigned long long value = valueOf(i);
+			unsigned long long max = histogramMax(histogram);
+			return value > max ? max : value;
+		}
+	}
+	return histogramMax(histogram);
+}
+
+// values up to value, give or take the width of its bucket
+unsigned long long histogramCountBelow(histogram_t* histogram, uint64_t value) {
+	unsigned long long count = 0;
+	int last = bucketOf(value);
+	for (int i = 0; i <= last; i++)
+		count += atomic_load_explicit(&(histogram->buckets[i]), memory_order_relaxed);
+	return count;
+}
+
+unsigned long long histogramSum(histogram_t* histogram) {
+	return atomic_load_explicit(&(histogram->sum), memory_order_relaxed);
+}
+
+void printHistogram(FILE* file, const char* name, histogram_t* histogram) {
+	fprintf(file, "%s: count %llu, mean %.0fns, p50 %lluns, p99 %lluns, max %lluns\n",
+		name, histogramCount(histogram), histogramMean(histogram),
+		histogramPercentile(histogram, 50), histogramPercentile(histogram, 99),
+		histogramMax(histogram));
+}
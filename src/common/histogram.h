@@ -0,0 +1,41 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <stdio.h>
+
+/*
+ * Log-linear histogram of nanosecond values: every power of two is split into
+ * HISTOGRAM_SUB_BUCKETS linear buckets, so the relative error stays below
+ * 1/HISTOGRAM_SUB_BUCKETS. Recording is a single relaxed atomic increment.
+ * A histogram only one thread records into can use histogramRecordLocal,
+ * which gets by without locked instructions; readers still see whole values.
+ */
+
+#define HISTOGRAM_SUB_BITS 4
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+typedef struct {
+	atomic_ullong buckets[HISTOGRAM_BUCKETS];
+	atomic_ullong count;
+	atomic_ullong sum;
+	atomic_ullong max;
+} histogram_t;
+
+void histogramReset(histogram_t*);
+void histogramRecord(histogram_t*, uint64_t);
+void histogramRecordLocal(histogram_t*, uint64_t);
+void histogramMerge(histogram_t*, histogram_t*);
+
+unsigned long long histogramCount(histogram_t*);
+unsigned long long histogramMax(histogram_t*);
+double histogramMean(histogram_t*);
+unsigned long long histogramPercentile(histogram_t*, double);
+unsigned long long histogramCountBelow(histogram_t*, uint64_t);
+unsigned long long histogramSum(histogram_t*);
+
+void printHistogram(FILE*, const char*, histogram_t*);
+
+#endif
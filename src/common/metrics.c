@@ -0,0 +1,227 @@
+#define _GNU_SOURCE
+
+#include "metrics.h"
+#include "error.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+typedef struct stages {
+	histogram_t histograms[STAGES];
+	atomic_bool owned; // by a running thread
+	struct stages* next;
+} stages_t;
+
+static const char* names[] = {"fire", "script", "packet", "queue", "encode", "send", "ingest"};
+
+// upper bounds of the buckets in the dump, s
+static const double bounds[] = {
+	1e-6, 2.5e-6, 5e-6, 1e-5, 2.5e-5, 5e-5, 1e-4, 2.5e-4, 5e-4, 1e-3, 2.5e-3, 5e-3,
+	1e-2, 2.5e-2, 5e-2, 0.1, 0.25, 0.5, 1, 2.5, 5, 10
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER; // the list and the collectors
+static stages_t* all;
+static pthread_key_t key;
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static __thread stages_t* local;
+
+static struct {
+	collector_t collector;
+	void* context;
+} collectors[METRICS_MAX_COLLECTORS];
+static size_t collectorCount;
+
+static int listening = -1;
+static pthread_t server;
+static struct sockaddr_un address;
+
+const char* getStageName(stage_t stage) {
+	return stage < STAGES ? names[stage] : "unknown";
+}
+
+// the next thread takes over the histograms
+static void release(void* argument) {
+	stages_t* stages = argument;
+	atomic_store_explicit(&(stages->owned), false, memory_order_release);
+}
+
+static void createKey() {
+	(void) pthread_key_create(&key, release);
+}
+
+static stages_t* getLocal() {
+	if (local != NULL)
+		return local;
+	pthread_once(&once, createKey);
+	pthread_mutex_lock(&lock);
+	stages_t* stages = all;
+	while (stages != NULL && atomic_load_explicit(&(stages->owned), memory_order_acquire))
+		stages = stages->next;
+	if (stages == NULL) {
+		stages = malloc(sizeof(stages_t));
+		if (stages == NULL) {
+			pthread_mutex_unlock(&lock);
+			return NULL;
+		}
+		for (int i = 0; i < STAGES; i++)
+			histogramReset(&(stages->histograms[i]));
+		stages->next = all;
+		all = stages;
+	}
+	atomic_store_explicit(&(stages->owned), true, memory_order_relaxed);
+	pthread_mutex_unlock(&lock);
+	(void) pthread_setspecific(key, stages);
+	local = stages;
+	return stages;
+}
+
+// ns
+void recordStage(stage_t stage, uint64_t value) {
+	stages_t* stages = getLocal();
+	if (stages != NULL)
+		histogramRecordLocal(&(stages->histograms[stage]), value);
+}
+
+// adds the values of all threads to histogram
+void mergeStage(stage_t stage, histogram_t* histogram) {
+	pthread_mutex_lock(&lock);
+	for (stages_t* stages = all; stages != NULL; stages = stages->next)
+		histogramMerge(histogram, &(stages->histograms[stage]));
+	pthread_mutex_unlock(&lock);
+}
+
+// collectors add their own metrics to every dump
+int addCollector(collector_t collector, void* context) {
+	pthread_mutex_lock(&lock);
+	if (collectorCount == METRICS_MAX_COLLECTORS) {
+		pthread_mutex_unlock(&lock);
+		error = "Too many metric collectors.";
+		return -1;
+	}
+	collectors[collectorCount].collector = collector;
+	collectors[collectorCount++].context = context;
+	pthread_mutex_unlock(&lock);
+	return 0;
+}
+
+// a label value in quotes, escaped
+void writeLabel(FILE* file, const char* value) {
+	fputc('"', file);
+	for (; *value != '\0'; value++) {
+		if (*value == '\\' || *value == '"')
+			fputc('\\', file);
+		if (*value == '\n')
+			fputs("\\n", file);
+		else
+			fputc(*value, file);
+	}
+	fputc('"', file);
+}
+
+void writeMetrics(FILE* file) {
+	fputs("# HELP fetcher_stage_seconds Time spent in a stage of the pipeline.\n", file);
+	fputs("# TYPE fetcher_stage_seconds histogram\n", file);
+	histogram_t merged;
+	for (stage_t stage = 0; stage < STAGES; stage++) {
+		histogramReset(&merged);
+		mergeStage(stage, &merged);
+		for (size_t i = 0; i < sizeof(bounds) / sizeof(bounds[0]); i++)
+			fprintf(file, "fetcher_stage_seconds_bucket{stage=\"%s\",le=\"%g\"} %llu\n", names[stage], bounds[i],
+				histogramCountBelow(&merged, bounds[i] * 1e9));
+		fprintf(file, "fetcher_stage_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %llu\n", names[stage],
+			histogramCount(&merged));
+		fprintf(file, "fetcher_stage_seconds_sum{stage=\"%s\"} %.9f\n", names[stage], histogramSum(&merged) / 1e9);
+		fprintf(file, "fetcher_stage_seconds_count{stage=\"%s\"} %llu\n", names[stage], histogramCount(&merged));
+	}
+
+	pthread_mutex_lock(&lock);
+	size_t count = collectorCount;
+	pthread_mutex_unlock(&lock);
+	for (size_t i = 0; i < count; i++)
+		collectors[i].collector(file, collectors[i].context);
+}
+
+// one dump per connection; written at once, so a slow reader cannot block the others for long
+static void* serve(void* argument) {
+	(void) argument;
+	for (;;) {
+		int client = accept4(listening, NULL, NULL, SOCK_CLOEXEC);
+		if (client < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			return NULL;
+		}
+		char* buffer = NULL;
+		size_t length = 0;
+		FILE* file = open_memstream(&buffer, &length);
+		if (file != NULL) {
+			writeMetrics(file);
+			fclose(file);
+			for (size_t sent = 0; sent < length;) {
+				ssize_t n = send(client, buffer + sent, length - sent, MSG_NOSIGNAL);
+				if (n < 0 && errno == EINTR)
+					continue;
+				if (n <= 0)
+					break;
+				sent += n;
+			}
+			free(buffer);
+		}
+		close(client);
+	}
+}
+
+// serves the dump on a unix socket at path, replacing a stale one
+int metricsServe(const char* path) {
+	if (listening >= 0) {
+		error = "Metrics are already served.";
+		return -1;
+	}
+	if (strlen(path) >= sizeof(address.sun_path)) {
+		error = "Socket path too long.";
+		return -1;
+	}
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, path);
+	listening = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (listening < 0) {
+		libfail();
+		return -1;
+	}
+	(void) unlink(path);
+	if (bind(listening, (struct sockaddr*) &address, sizeof(address)) < 0 || listen(listening, 8) < 0) {
+		libfail();
+		close(listening);
+		listening = -1;
+		return -1;
+	}
+	int tmp = pthread_create(&server, NULL, serve, NULL);
+	if (tmp != 0) {
+		error = strerror(tmp);
+		close(listening);
+		listening = -1;
+		(void) unlink(path);
+		return -1;
+	}
+	return 0;
+}
+
+void metricsStop() {
+	if (listening < 0)
+		return;
+	// wakes up accept
+	(void) shutdown(listening, SHUT_RDWR);
+	pthread_join(server, NULL);
+	close(listening);
+	listening = -1;
+	(void) unlink(address.sun_path);
+}
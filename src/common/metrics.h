@@ -0,0 +1,49 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include "histogram.h"
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Latency of the stages of the pipeline, from the timer of an agent to
+ * the handler of the receiver. Every thread records into histograms of
+ * its own, so recording takes no lock and no locked instruction; a dump
+ * merges the histograms of all threads. Histograms of threads that ended
+ * go to the next new thread, their values stay in the totals.
+ *
+ * The dump is in the Prometheus text format and is served on a unix
+ * socket, every connection gets one dump:
+ *
+ *   socat - UNIX-CONNECT:transmitter.metrics
+ */
+
+typedef enum {
+	STAGE_FIRE, // timer expiry to script start
+	STAGE_SCRIPT, // script run time
+	STAGE_PACKET, // newPacket
+	STAGE_QUEUE, // push to pop of the packet queue
+	STAGE_ENCODE, // wire encoding of a batch
+	STAGE_SEND, // compressing and writing a frame
+	STAGE_INGEST, // decoding and handling a packet on the receiver
+	STAGES
+} stage_t;
+
+#define METRICS_MAX_COLLECTORS 8
+
+typedef void (*collector_t)(FILE*, void*);
+
+const char* getStageName(stage_t);
+
+void recordStage(stage_t, uint64_t);
+void mergeStage(stage_t, histogram_t*);
+
+int addCollector(collector_t, void*);
+void writeLabel(FILE*, const char*);
+void writeMetrics(FILE*);
+
+int metricsServe(const char*);
+void metricsStop(void);
+
+#endif
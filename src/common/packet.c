@@ -3,6 +3,14 @@
 #include "conf.h"
 #include "error.h"
 #include "timer.h"
+#include "clock.h"
+#include "queue.h"
+#include "wire.h"
+#include "transport.h"
+#include "slab.h"
+#include "registry.h"
+#include "spool.h"
+#include "metrics.h"
 
 #include <stdbool.h>
 #include <string.h>
@@ -11,102 +19,291 @@
 #include <assert.h>
 #include <errno.h>
 
-#ifdef __linux__
-	#include <endian.h>
-#endif
-#ifdef __MACH__
-	#include <machine/endian.h>
+static const char* laneNames[PACKET_LANES] = {"meta", "info", "warning", "alarm", "error", "emergency"};
 
-	#define htobe16(x) htons(x)
-	#define htobe32(x) htonl(x)
-	#define htobe64(x) htonll(x)
-#endif
+static struct {
+	size_t capacity;
+	unsigned weight; // packets per round in weighted mode
+	lanePolicy_t policy;
+} laneConfig[PACKET_LANES] = {
+	{256, 1, LANE_SPOOL}, // META
+	{1024, 4, LANE_SPOOL}, // INFO
+	{256, 8, LANE_SPOOL}, // WARNING
+	{256, 16, LANE_SPOOL}, // ALARM
+	{128, 32, LANE_SPOOL}, // ERROR
+	{128, 64, LANE_SPOOL} // EMERGENCY
+};
+static lanesMode_t laneMode = LANES_WEIGHTED;
 
-#define MAX_PACKET_QUEUE_LENGTH 1024
+static struct {
+	histogram_t latency; // push to pop, recorded by the consumer
+	atomic_ullong spooled;
+	atomic_ullong dropped;
+} laneMetrics[PACKET_LANES];
 
-#define HEARTBEAT_PREAMBLE "hb:"
-#define HEARTBEAT_POSTAMBLE ":hb"
+static lanes_t lanes = {.count = 0};
+static spool_t* spool = NULL;
 
-#define NEXT_POINTER(p) p = ((p + 1) % MAX_PACKET_QUEUE_LENGTH)
+static void writeLaneMetrics(FILE*, void*);
 
-packet_t packets[MAX_PACKET_QUEUE_LENGTH] = {{}};
-int startPointer = 0;
-int endPointer = 0;
+int packetInit() {
+	if (lanes.count != 0)
+		return 0;
+	size_t capacities[PACKET_LANES];
+	unsigned weights[PACKET_LANES];
+	for (int i = 0; i < PACKET_LANES; i++) {
+		capacities[i] = laneConfig[i].capacity;
+		weights[i] = laneConfig[i].weight;
+		histogramReset(&(laneMetrics[i].latency));
+		atomic_init(&(laneMetrics[i].spooled), 0);
+		atomic_init(&(laneMetrics[i].dropped), 0);
+	}
+	if (lanesInit(&lanes, PACKET_LANES, capacities, weights, laneMode, sizeof(packet_t)) < 0)
+		return -1;
+	if (addCollector(writeLaneMetrics, NULL) < 0) {
+		lanesDestroy(&lanes);
+		return -1;
+	}
+	return 0;
+}
+
+// before packetInit; capacity a power of two
+int setLane(class_t class, size_t capacity, unsigned weight, lanePolicy_t policy) {
+	if (lanes.count != 0) {
+		error = "Packet queue already initialized.";
+		return -1;
+	}
+	if (capacity < 2 || (capacity & (capacity - 1)) != 0) {
+		error = "Lane capacity has to be a power of two.";
+		return -1;
+	}
+	size_t lane = getLane(class);
+	laneConfig[lane].capacity = capacity;
+	laneConfig[lane].weight = weight;
+	laneConfig[lane].policy = policy;
+	return 0;
+}
+
+int setLaneMode(lanesMode_t mode) {
+	if (lanes.count != 0) {
+		error = "Packet queue already initialized.";
+		return -1;
+	}
+	laneMode = mode;
+	return 0;
+}
+
+// packets that do not fit into their lane go to the spool instead of getting lost
+void setPacketSpool(spool_t* tmp) {
+	spool = tmp;
+}
+
+const char* getLaneName(size_t lane) {
+	return lane < PACKET_LANES ? laneNames[lane] : "unknown";
+}
 
 int getQueueLength() {
-	int result = 0;
-	if (startPointer > endPointer) {
-		result += endPointer;
-		result += MAX_PACKET_QUEUE_LENGTH - startPointer;
-	} else {
-		result = endPointer - startPointer;
+	if (lanes.count == 0)
+		return 0;
+	return lanesDepth(&lanes);
+}
+
+// all lanes together
+void getQueueStats(queueStats_t* stats) {
+	*stats = (queueStats_t) {};
+	if (lanes.count == 0)
+		return;
+	for (int i = 0; i < PACKET_LANES; i++) {
+		queueStats_t lane;
+		queueGetStats(&(lanes.queues[i]), &lane);
+		stats->capacity += lane.capacity;
+		stats->depth += lane.depth;
+		stats->highWatermark += lane.highWatermark;
+		stats->pushed += lane.pushed;
+		stats->popped += lane.popped;
+		stats->rejected += lane.rejected;
+	}
+}
+
+void getLaneStats(class_t class, laneStats_t* stats) {
+	size_t lane = getLane(class);
+	if (lanes.count == 0)
+		stats->queue = (queueStats_t) {};
+	else
+		queueGetStats(&(lanes.queues[lane]), &(stats->queue));
+	stats->spooled = atomic_load_explicit(&(laneMetrics[lane].spooled), memory_order_relaxed);
+	stats->dropped = atomic_load_explicit(&(laneMetrics[lane].dropped), memory_order_relaxed);
+	stats->latency = &(laneMetrics[lane].latency);
+}
+
+void printLaneStats(FILE* file) {
+	for (int i = 0; i < PACKET_LANES; i++) {
+		laneStats_t stats;
+		getLaneStats(i * LANE_WIDTH, &stats);
+		fprintf(file, "lane %s: depth %zu/%zu, high watermark %zu, pushed %llu, spooled %llu, dropped %llu\n",
+			laneNames[i], stats.queue.depth, stats.queue.capacity, stats.queue.highWatermark, stats.queue.pushed,
+			stats.spooled, stats.dropped);
+		printHistogram(file, "  queue time", stats.latency);
 	}
-	return result;
 }
 
-packet_t newPacket(agent_t agent, void* data, class_t class, const char* message) {
+static void writeLaneMetrics(FILE* file, void* context) {
+	(void) context;
+	fputs("# HELP fetcher_lane_depth Packets waiting in a lane of the packet queue.\n", file);
+	fputs("# TYPE fetcher_lane_depth gauge\n", file);
+	laneStats_t stats[PACKET_LANES];
+	for (int i = 0; i < PACKET_LANES; i++) {
+		getLaneStats(i * LANE_WIDTH, &(stats[i]));
+		fprintf(file, "fetcher_lane_depth{lane=\"%s\"} %zu\n", laneNames[i], stats[i].queue.depth);
+	}
+	fputs("# HELP fetcher_lane_shed_total Packets that did not fit into their lane.\n", file);
+	fputs("# TYPE fetcher_lane_shed_total counter\n", file);
+	for (int i = 0; i < PACKET_LANES; i++) {
+		fprintf(file, "fetcher_lane_shed_total{lane=\"%s\",to=\"spool\"} %llu\n", laneNames[i], stats[i].spooled);
+		fprintf(file, "fetcher_lane_shed_total{lane=\"%s\",to=\"drop\"} %llu\n", laneNames[i], stats[i].dropped);
+	}
+	fputs("# HELP fetcher_lane_seconds Time packets spend in a lane of the packet queue.\n", file);
+	fputs("# TYPE fetcher_lane_seconds summary\n", file);
+	for (int i = 0; i < PACKET_LANES; i++) {
+		fprintf(file, "fetcher_lane_seconds{lane=\"%s\",quantile=\"0.5\"} %.9f\n", laneNames[i],
+			histogramPercentile(stats[i].latency, 50) / 1e9);
+		fprintf(file, "fetcher_lane_seconds{lane=\"%s\",quantile=\"0.99\"} %.9f\n", laneNames[i],
+			histogramPercentile(stats[i].latency, 99) / 1e9);
+		fprintf(file, "fetcher_lane_seconds_sum{lane=\"%s\"} %.9f\n", laneNames[i], histogramSum(stats[i].latency) / 1e9);
+		fprintf(file, "fetcher_lane_seconds_count{lane=\"%s\"} %llu\n", laneNames[i], histogramCount(stats[i].latency));
+	}
+}
+
+// releases what the packet owns so far and marks it as broken
+static void setProblem(packet_t* packet, const char* message) {
+	slabFree(packet->message, packet->messageLength);
+	packet->status = PROBLEM;
+	packet->message = (char*) message;
+	packet->messageLength = 0;
+}
+
+// everything but the value
+static packet_t initPacket(const agent_t* agent, uint32_t id, class_t class, const char* message) {
 	packet_t packet;
-	packet.agent = agent;
+	packet.agent = id;
 	packet.class = class;
-	packet.time = getRealTime() / (1*1000*1000); // we want ms
+	packet.time = getClockTimeMs(CLOCK_SOURCE_CACHED);
 	packet.message = NULL;
-	packet.data = NULL;
+	packet.value.string = NULL;
 	packet.status = CREATED;
 	packet.size = 0;
 	packet.messageLength = 0;
+	packet.data = NONE;
+	packet.type = VOID;
+	packet.queued = 0;
+
+	if (agent == NULL) {
+		setProblem(&packet, "Unknown agent.");
+		return packet;
+	}
+	packet.data = agent->data;
+	packet.type = agent->type;
+
 	if (message != NULL) {
-		packet.message = strdup(message);
+		size_t length = strlen(message) + 1;
+		packet.message = slabAlloc(length);
 		if (packet.message == NULL) {
-			packet.status = PROBLEM;
-			packet.message = strerror(errno);
+			setProblem(&packet, error);
+			return packet;
 		}
-		packet.messageLength = strlen(message) + 1;
+		memcpy(packet.message, message, length);
+		packet.messageLength = length;
 	}
-	packet.data = NULL;
+	return packet;
+}
+
+/*
+ * A META packet about the agent itself, not a sample: the value is an INT
+ * property whatever the type of the agent is.
+ */
+packet_t newMetaPacket(uint32_t id, int32_t value, const char* message) {
+	packet_t packet = initPacket(getAgent(id), id, META, message);
+	if (packet.status == PROBLEM)
+		return packet;
+	packet.data = PROPERTY;
+	packet.type = INT;
+	packet.size = sizeof(int32_t);
+	packet.value.integer = value;
+	return packet;
+}
+
+static packet_t createPacket(const agent_t* agent, uint32_t id, const void* data, class_t class, const char* message) {
+	packet_t packet = initPacket(agent, id, class, message);
+	if (packet.status == PROBLEM)
+		return packet;
 	if (data != NULL) {
-		switch(agent.type) {
+		switch(packet.type) {
 			case VOID:
-				packet.status = PROBLEM;
-				packet.message = "Void data type, but non-null given.";
+				setProblem(&packet, "Void data type, but non-null given.");
 				break;
 			case INT:
-				packet.size = sizeof(int);
+				packet.size = sizeof(int32_t);
+				memcpy(&(packet.value.integer), data, sizeof(int32_t));
 				break;
 			case DOUBLE:
 				packet.size = sizeof(double);
+				memcpy(&(packet.value.real), data, sizeof(double));
 				break;
 			case STRING:
 				packet.size = strlen(data) + 1;
+				packet.value.string = slabAlloc(packet.size);
+				if (packet.value.string == NULL) {
+					packet.size = 0;
+					setProblem(&packet, error);
+				} else
+					memcpy(packet.value.string, data, packet.size);
 				break;
 			default:
 				assert(false);
 		}
-		if (packet.size != 0) {
-			packet.data = malloc(packet.size);
-			if (packet.data == NULL) {
-				packet.status = PROBLEM;
-				packet.message = strerror(errno);
-			} else
-				memcpy(packet.data, data, packet.size);
-		}
 	} else {
-		if (agent.type != VOID) {
-			packet.status = PROBLEM;
-			packet.message = "Non-void data type, but NULL given.";
-		}
+		if (packet.type != VOID)
+			setProblem(&packet, "Non-void data type, but NULL given.");
 	}
 	return packet;
 }
 
-bool pushPacket(packet_t packet) {
-	switch(packet.status) {
+packet_t newPacket(uint32_t id, const void* data, class_t class, const char* message) {
+	return newAgentPacket(getAgent(id), id, data, class, message);
+}
+
+/*
+ * Takes data kind and type from the given agent instead of the registry,
+ * which may already point to a newer version with the same name.
+ */
+packet_t newAgentPacket(const agent_t* agent, uint32_t id, const void* data, class_t class, const char* message) {
+	unsigned long long start = getRelativeTime();
+	packet_t packet = createPacket(agent, id, data, class, message);
+	recordStage(STAGE_PACKET, getRelativeTime() - start);
+	return packet;
+}
+
+static void releasePacket(packet_t* packet) {
+	if (packet->messageLength > 0)
+		slabFree(packet->message, packet->messageLength);
+	if (packet->type == STRING && packet->size > 0)
+		slabFree(packet->value.string, packet->size);
+	packet->message = NULL;
+	packet->messageLength = 0;
+	packet->value.string = NULL;
+	packet->size = 0;
+}
+
+bool pushPacket(packet_t* packet) {
+	switch(packet->status) {
 		case PROBLEM:
-			fail("There was an error with the packet: %s", packet.message);
+			fail("There was an error with the packet: %s", packet->message);
 			return false;
 		case CREATED:
 			break;
 		case DELAYED:
-			break;
+			error = "Packet already spooled.";
+			return false;
 		case QUEUED:
 			error = "Packet already queued.";
 			return false;
@@ -119,63 +316,87 @@ bool pushPacket(packet_t packet) {
 		default:
 			assert(false);
 	}
-	if (getQueueLength() >= MAX_PACKET_QUEUE_LENGTH) {
-		error = "The queue is full.";
+	if (lanes.count == 0) {
+		error = "Packet queue not initialized.";
 		return false;
 	}
-	packet.status = QUEUED;
-	packets[endPointer] = packet;
-	NEXT_POINTER(endPointer);
-	return true;
+	size_t lane = getLane(packet->class);
+	packet->status = QUEUED;
+	packet->queued = getRelativeTime();
+	if (lanesTryPush(&lanes, lane, packet))
+		return true;
+	packet->status = CREATED;
+	if (laneConfig[lane].policy == LANE_SPOOL && spool != NULL) {
+		if (spoolAppend(spool, packet) == 0) {
+			releasePacket(packet);
+			packet->status = DELAYED;
+			atomic_fetch_add_explicit(&(laneMetrics[lane].spooled), 1, memory_order_relaxed);
+			return true;
+		}
+	} else
+		error = laneConfig[lane].policy == LANE_DROP ? "The lane is full." : "The queue is full.";
+	atomic_fetch_add_explicit(&(laneMetrics[lane].dropped), 1, memory_order_relaxed);
+	return false;
+}
+
+static inline void recordPopped(const packet_t* packet, unsigned long long now) {
+	recordStage(STAGE_QUEUE, now - packet->queued);
+	histogramRecordLocal(&(laneMetrics[getLane(packet->class)].latency), now - packet->queued);
 }
 
 bool peakPacket(packet_t* packet) {
-	if (getQueueLength() < 1) {
+	if (lanes.count == 0 || !lanesPeek(&lanes, packet)) {
 		error = "No packets on queue.";
 		return false;
 	}
-	packet = &(packets[startPointer]);
 	return true;
 }
 
 void shiftPacket() {
-	if (getQueueLength() >= 1) {
-		NEXT_POINTER(startPointer);
-	}
+	if (lanes.count != 0)
+		lanesShift(&lanes);
 }
 
 bool popPacket(packet_t* packet) {
-	if (!peakPacket(packet))
+	if (lanes.count == 0 || !lanesPop(&lanes, packet)) {
+		error = "No packets on queue.";
 		return false;
-	NEXT_POINTER(startPointer);
+	}
+	recordPopped(packet, getRelativeTime());
 	return true;
 }
 
-void destroyPacket(packet_t packet) {
-	if (packet.status == DESTROYED)
-		return;
-	if (packet.message != NULL)
-		free(packet.message);
-	if (packet.data != NULL)
-		free(packet.data);
-	packet.message = NULL;
-	packet.status = DESTROYED;
+// higher lanes first, see lanes_t
+size_t popPackets(packet_t* packets, size_t max) {
+	if (lanes.count == 0)
+		return 0;
+	size_t n = lanesPopMany(&lanes, packets, max);
+	if (n > 0) {
+		unsigned long long now = getRelativeTime();
+		for (size_t i = 0; i < n; i++)
+			recordPopped(&(packets[i]), now);
+	}
+	return n;
 }
 
-size_t getBufferFromPacket(packet_t packet, char** buffer) {
-	size_t size = 0;
+void destroyPacket(packet_t* packet) {
+	if (packet->status == DESTROYED || packet->status == SENT)
+		return;
+	releasePacket(packet);
+	packet->status = DESTROYED;
+}
 
-	size_t nameLength = strlen(packet.agent.name) + 1;
+// the buffers are recycled as soon as the packet is on the wire
+void markPacketSent(packet_t* packet) {
+	if (packet->status == DESTROYED || packet->status == SENT)
+		return;
+	releasePacket(packet);
+	packet->status = SENT;
+}
 
-	size += sizeof(size_t); // agent name
-	size += nameLength;
-	size += sizeof(data_t); // data
-	size += sizeof(type_t); // type
-	size += sizeof(uint64_t); // time
-	size += sizeof(uint64_t); // size of the data
-	size += sizeof(uint64_t); // size of the message
-	size += packet.size;
-	size += packet.messageLength;
+size_t getBufferFromPacket(const packet_t* packet, char** buffer) {
+	wireFrame_t frame;
+	size_t size = wireEncode(packet, &frame);
 
 	*buffer = malloc(size);
 	if (*buffer == NULL) {
@@ -183,35 +404,17 @@ size_t getBufferFromPacket(packet_t packet, char** buffer) {
 		return -1;
 	}
 
-	uint64_t tmp;
 	size_t position = 0;
-	tmp = htobe64(nameLength);
-	memcpy(buffer + position, &tmp, sizeof(uint64_t));
-	position += sizeof(size_t);
-	memcpy(buffer + position, packet.agent.name, nameLength);
-	position += nameLength;
-	// data and type should be 8 bit -> no endian convertion
-	memcpy(buffer + position, &(packet.agent.data), sizeof(data_t));
-	position += sizeof(data_t);
-	memcpy(buffer + position, &(packet.agent.type), sizeof(type_t));
-	position += sizeof(type_t);
-	tmp = htobe64(packet.time);
-	memcpy(buffer + position, &tmp, sizeof(uint64_t));
-	position += sizeof(unsigned long long);
-	tmp = htobe64(packet.size);
-	memcpy(buffer + position, &tmp, sizeof(uint64_t));
-	position += sizeof(size_t);
-	tmp = htobe64(packet.messageLength);
-	memcpy(buffer + position, &tmp, sizeof(uint64_t));
-	position += sizeof(size_t);
-	memcpy(buffer + position, packet.data, packet.size);
-	position += packet.size;
-	memcpy(buffer + position, packet.message, packet.messageLength);
-	position += packet.messageLength;
-
+	for (int i = 0; i < frame.count; i++) {
+		memcpy(*buffer + position, frame.iov[i].iov_base, frame.iov[i].iov_len);
+		position += frame.iov[i].iov_len;
+	}
 	return size;
 }
 
-void sendHeartbeat(int fd) {
-
+int sendHeartbeat(int fd) {
+	char payload[64];
+	int length = snprintf(payload, sizeof(payload), HEARTBEAT_PREAMBLE "%llu" HEARTBEAT_POSTAMBLE,
+		getRealTime() / (1*1000*1000));
+	return writeFrame(fd, FRAME_HEARTBEAT, payload, length);
 }
@@ -3,8 +3,16 @@
 
 #include "data.h"
 #include "conf.h"
+#include "queue.h"
+#include "histogram.h"
 
 #include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#define HEARTBEAT_PREAMBLE "hb:"
+#define HEARTBEAT_POSTAMBLE ":hb"
 
 typedef enum {
 	PROBLEM,
@@ -15,15 +23,95 @@ typedef enum {
 	DESTROYED
 } packetStatus_t;
 
+/*
+ * A packet refers to its agent by registry id and fits into a cache line.
+ * Data kind and type are copied from the agent, so the value can be read
+ * without the registry. INT and DOUBLE values are stored inline, strings
+ * and messages come from the slab allocator and go back to it once the
+ * packet is sent or destroyed. As the value moves with the packet, use
+ * getPacketData instead of keeping pointers into it.
+ */
 typedef struct packet {
-	packetStatus_t status;
-	agent_t agent;
-	unsigned long long time; // ms
+	uint32_t agent; // registry id
+	uint8_t status; // packetStatus_t
 	class_t class;
-	size_t size;
-	void* data;
+	data_t data;
+	type_t type;
+	uint32_t size;
+	uint32_t messageLength;
+	unsigned long long time; // ms
+	union {
+		int32_t integer;
+		double real;
+		char* string;
+	} value;
 	char* message;
-	size_t messageLength;
+	unsigned long long queued; // relative ns
 } packet_t;
 
+_Static_assert(sizeof(packet_t) <= CACHE_LINE, "packet_t must fit into a cache line");
+
+static inline void* getPacketData(const packet_t* packet) {
+	if (packet->size == 0)
+		return NULL;
+	if (packet->type == STRING)
+		return packet->value.string;
+	return (void*) &(packet->value);
+}
+
+/*
+ * The packet queue has a lane per class, META to EMERGENCY, so an alarm
+ * never waits behind a backlog of data values (see lanes_t). A packet that
+ * does not fit into its lane goes to the spool or, with LANE_DROP, is shed
+ * right away. Lanes are set up with setLane and setLaneMode before
+ * packetInit.
+ */
+
+#define LANE_WIDTH 5 // classes per lane
+#define PACKET_LANES (EMERGENCY / LANE_WIDTH + 1)
+
+typedef enum {
+	LANE_SPOOL,
+	LANE_DROP
+} lanePolicy_t;
+
+typedef struct {
+	queueStats_t queue;
+	unsigned long long spooled;
+	unsigned long long dropped;
+	histogram_t* latency; // ns from push to pop
+} laneStats_t;
+
+static inline size_t getLane(class_t class) {
+	return class >= EMERGENCY ? PACKET_LANES - 1 : class / LANE_WIDTH;
+}
+
+struct spool;
+
+int packetInit(void);
+int setLane(class_t, size_t, unsigned, lanePolicy_t);
+int setLaneMode(lanesMode_t);
+void setPacketSpool(struct spool*);
+
+packet_t newPacket(uint32_t, const void*, class_t, const char*);
+packet_t newAgentPacket(const agent_t*, uint32_t, const void*, class_t, const char*);
+packet_t newMetaPacket(uint32_t, int32_t, const char*);
+void destroyPacket(packet_t*);
+void markPacketSent(packet_t*);
+
+bool pushPacket(packet_t*);
+bool peakPacket(packet_t*);
+void shiftPacket(void);
+bool popPacket(packet_t*);
+size_t popPackets(packet_t*, size_t);
+
+int getQueueLength(void);
+void getQueueStats(queueStats_t*);
+const char* getLaneName(size_t);
+void getLaneStats(class_t, laneStats_t*);
+void printLaneStats(FILE*);
+
+size_t getBufferFromPacket(const packet_t*, char**);
+int sendHeartbeat(int);
+
 #endif
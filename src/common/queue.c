@@ -0,0 +1,240 @@
+#include "queue.h"
+#include "error.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdalign.h>
+
+/*
+ * Every slot carries a sequence number (Vyukov's bounded queue):
+ *   sequence == position          -> free, a producer may claim it
+ *   sequence == position + 1      -> filled, the consumer may read it
+ *   sequence == position + capacity -> read, free for the next lap
+ * Producers claim positions with a CAS on tail, the single consumer owns head.
+ */
+
+#define ALIGN_UP(x, a) (((x) + (a) - 1) & ~((a) - 1))
+#define ELEMENT_OFFSET ALIGN_UP(sizeof(atomic_size_t), alignof(max_align_t))
+
+static inline atomic_size_t* sequenceAt(queue_t* queue, size_t position) {
+	return (atomic_size_t*) (queue->slots + (position & queue->mask) * queue->stride);
+}
+
+static inline void* elementAt(queue_t* queue, size_t position) {
+	return queue->slots + (position & queue->mask) * queue->stride + ELEMENT_OFFSET;
+}
+
+int queueInit(queue_t* queue, size_t capacity, size_t elementSize) {
+	if (capacity < 2 || (capacity & (capacity - 1)) != 0) {
+		error = "Queue capacity has to be a power of two.";
+		return -1;
+	}
+
+	queue->capacity = capacity;
+	queue->mask = capacity - 1;
+	queue->elementSize = elementSize;
+	queue->stride = ALIGN_UP(ELEMENT_OFFSET + elementSize, alignof(max_align_t));
+	queue->slots = malloc(capacity * queue->stride);
+	if (queue->slots == NULL) {
+		libfail();
+		return -1;
+	}
+
+	for (size_t i = 0; i < capacity; i++)
+		atomic_init(sequenceAt(queue, i), i);
+
+	atomic_init(&(queue->tail), 0);
+	atomic_init(&(queue->head), 0);
+	atomic_init(&(queue->highWatermark), 0);
+	atomic_init(&(queue->rejected), 0);
+	return 0;
+}
+
+void queueDestroy(queue_t* queue) {
+	free(queue->slots);
+	queue->slots = NULL;
+}
+
+static inline void updateHighWatermark(queue_t* queue, size_t position) {
+	size_t depth = position + 1 - atomic_load_explicit(&(queue->head), memory_order_relaxed);
+	size_t high = atomic_load_explicit(&(queue->highWatermark), memory_order_relaxed);
+	while (depth > high) {
+		if (atomic_compare_exchange_weak_explicit(&(queue->highWatermark), &high, depth,
+				memory_order_relaxed, memory_order_relaxed))
+			break;
+	}
+}
+
+bool queueTryPush(queue_t* queue, const void* element) {
+	size_t position = atomic_load_explicit(&(queue->tail), memory_order_relaxed);
+	atomic_size_t* sequence;
+	for (;;) {
+		sequence = sequenceAt(queue, position);
+		size_t current = atomic_load_explicit(sequence, memory_order_acquire);
+		intptr_t diff = (intptr_t) current - (intptr_t) position;
+		if (diff == 0) {
+			if (atomic_compare_exchange_weak_explicit(&(queue->tail), &position, position + 1,
+					memory_order_relaxed, memory_order_relaxed))
+				break;
+		} else if (diff < 0) {
+			atomic_fetch_add_explicit(&(queue->rejected), 1, memory_order_relaxed);
+			return false;
+		} else {
+			position = atomic_load_explicit(&(queue->tail), memory_order_relaxed);
+		}
+	}
+
+	memcpy(elementAt(queue, position), element, queue->elementSize);
+	atomic_store_explicit(sequence, position + 1, memory_order_release);
+
+	updateHighWatermark(queue, position);
+	return true;
+}
+
+static inline bool isReadable(queue_t* queue, size_t position) {
+	return atomic_load_explicit(sequenceAt(queue, position), memory_order_acquire) == position + 1;
+}
+
+static inline void release(queue_t* queue, size_t position) {
+	atomic_store_explicit(sequenceAt(queue, position), position + queue->capacity, memory_order_release);
+}
+
+bool queuePop(queue_t* queue, void* element) {
+	size_t position = atomic_load_explicit(&(queue->head), memory_order_relaxed);
+	if (!isReadable(queue, position))
+		return false;
+	if (element != NULL)
+		memcpy(element, elementAt(queue, position), queue->elementSize);
+	release(queue, position);
+	atomic_store_explicit(&(queue->head), position + 1, memory_order_release);
+	return true;
+}
+
+size_t queuePopMany(queue_t* queue, void* elements, size_t max) {
+	size_t position = atomic_load_explicit(&(queue->head), memory_order_relaxed);
+	size_t count = 0;
+	while (count < max && isReadable(queue, position + count)) {
+		memcpy((char*) elements + count * queue->elementSize,
+			elementAt(queue, position + count), queue->elementSize);
+		release(queue, position + count);
+		count++;
+	}
+	if (count > 0)
+		atomic_store_explicit(&(queue->head), position + count, memory_order_release);
+	return count;
+}
+
+bool queuePeek(queue_t* queue, void* element) {
+	size_t position = atomic_load_explicit(&(queue->head), memory_order_relaxed);
+	if (!isReadable(queue, position))
+		return false;
+	memcpy(element, elementAt(queue, position), queue->elementSize);
+	return true;
+}
+
+size_t queueDepth(queue_t* queue) {
+	size_t head = atomic_load_explicit(&(queue->head), memory_order_acquire);
+	size_t tail = atomic_load_explicit(&(queue->tail), memory_order_acquire);
+	// tail counts claimed slots, which may still be in flight
+	if (tail < head)
+		return 0;
+	if (tail - head > queue->capacity)
+		return queue->capacity;
+	return tail - head;
+}
+
+void queueGetStats(queue_t* queue, queueStats_t* stats) {
+	stats->capacity = queue->capacity;
+	stats->popped = atomic_load_explicit(&(queue->head), memory_order_relaxed);
+	stats->pushed = atomic_load_explicit(&(queue->tail), memory_order_relaxed);
+	stats->depth = queueDepth(queue);
+	stats->highWatermark = atomic_load_explicit(&(queue->highWatermark), memory_order_relaxed);
+	stats->rejected = atomic_load_explicit(&(queue->rejected), memory_order_relaxed);
+}
+
+int lanesInit(lanes_t* lanes, size_t count, const size_t* capacities, const unsigned* weights, lanesMode_t mode,
+		size_t elementSize) {
+	if (count == 0 || count > MAX_LANES) {
+		error = "Invalid number of lanes.";
+		return -1;
+	}
+	for (size_t i = 0; i < count; i++) {
+		if (queueInit(&(lanes->queues[i]), capacities[i], elementSize) < 0) {
+			while (i-- > 0)
+				queueDestroy(&(lanes->queues[i]));
+			return -1;
+		}
+		lanes->weights[i] = weights[i] == 0 ? 1 : weights[i];
+	}
+	lanes->count = count;
+	lanes->mode = mode;
+	lanes->elementSize = elementSize;
+	lanes->peeked = count;
+	return 0;
+}
+
+void lanesDestroy(lanes_t* lanes) {
+	for (size_t i = 0; i < lanes->count; i++)
+		queueDestroy(&(lanes->queues[i]));
+	lanes->count = 0;
+}
+
+bool lanesTryPush(lanes_t* lanes, size_t lane, const void* element) {
+	return queueTryPush(&(lanes->queues[lane]), element);
+}
+
+bool lanesPop(lanes_t* lanes, void* element) {
+	for (size_t lane = lanes->count; lane-- > 0;) {
+		if (queuePop(&(lanes->queues[lane]), element))
+			return true;
+	}
+	return false;
+}
+
+size_t lanesPopMany(lanes_t* lanes, void* elements, size_t max) {
+	size_t count = 0;
+	unsigned drained = 0; // lanes that ran dry during this call
+	unsigned all = (1u << lanes->count) - 1;
+	while (count < max && drained != all) {
+		for (size_t lane = lanes->count; lane-- > 0 && count < max;) {
+			if (drained & (1u << lane))
+				continue;
+			size_t wanted = max - count;
+			if (lanes->mode == LANES_WEIGHTED && wanted > lanes->weights[lane])
+				wanted = lanes->weights[lane];
+			size_t n = queuePopMany(&(lanes->queues[lane]), (char*) elements + count * lanes->elementSize, wanted);
+			if (n < wanted)
+				drained |= 1u << lane;
+			count += n;
+		}
+	}
+	return count;
+}
+
+bool lanesPeek(lanes_t* lanes, void* element) {
+	for (size_t lane = lanes->count; lane-- > 0;) {
+		if (queuePeek(&(lanes->queues[lane]), element)) {
+			lanes->peeked = lane;
+			return true;
+		}
+	}
+	lanes->peeked = lanes->count;
+	return false;
+}
+
+// drops the element of the last peek, or the first one if there was none
+void lanesShift(lanes_t* lanes) {
+	if (lanes->peeked < lanes->count)
+		(void) queuePop(&(lanes->queues[lanes->peeked]), NULL);
+	else
+		(void) lanesPop(lanes, NULL);
+	lanes->peeked = lanes->count;
+}
+
+size_t lanesDepth(lanes_t* lanes) {
+	size_t depth = 0;
+	for (size_t i = 0; i < lanes->count; i++)
+		depth += queueDepth(&(lanes->queues[i]));
+	return depth;
+}
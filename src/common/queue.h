@@ -0,0 +1,88 @@
+#ifndef QUEUE_H
+#define QUEUE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+#define CACHE_LINE 64
+
+/*
+ * Bounded lock-free multi-producer/single-consumer queue.
+ *
+ * Any number of threads may push concurrently, but only one thread at a time
+ * may pop, peek or shift. Elements are copied in and out by value.
+ */
+
+typedef struct {
+	size_t capacity;
+	size_t depth;
+	size_t highWatermark;
+	unsigned long long pushed;
+	unsigned long long popped;
+	unsigned long long rejected; // pushes that found the queue full
+} queueStats_t;
+
+typedef struct {
+	size_t capacity; // power of two
+	size_t mask;
+	size_t elementSize;
+	size_t stride;
+	char* slots;
+
+	_Alignas(CACHE_LINE) atomic_size_t tail; // next slot claimed by a producer
+	atomic_size_t highWatermark;
+	atomic_ullong rejected;
+
+	_Alignas(CACHE_LINE) atomic_size_t head; // next slot read by the consumer
+} queue_t;
+
+int queueInit(queue_t*, size_t capacity, size_t elementSize);
+void queueDestroy(queue_t*);
+
+bool queueTryPush(queue_t*, const void*);
+bool queuePop(queue_t*, void*);
+size_t queuePopMany(queue_t*, void*, size_t);
+bool queuePeek(queue_t*, void*);
+
+size_t queueDepth(queue_t*);
+void queueGetStats(queue_t*, queueStats_t*);
+
+/*
+ * One queue per priority lane, the last lane has the highest priority.
+ * Every lane has a capacity of its own, so a backlog in a low lane never
+ * keeps a higher one from taking packets. Strict mode drains the higher
+ * lanes before a lower one is looked at; weighted mode takes up to the
+ * weight of each lane per round, so low lanes keep moving under load.
+ * Single pops and peeks always take the highest lane that is not empty.
+ * The same producer/consumer rules as for queue_t apply.
+ */
+
+#define MAX_LANES 8
+
+typedef enum {
+	LANES_STRICT,
+	LANES_WEIGHTED
+} lanesMode_t;
+
+typedef struct {
+	size_t count;
+	lanesMode_t mode;
+	size_t elementSize;
+	unsigned weights[MAX_LANES];
+	queue_t queues[MAX_LANES];
+	size_t peeked; // lane of the last peek, owned by the consumer
+} lanes_t;
+
+int lanesInit(lanes_t*, size_t count, const size_t* capacities, const unsigned* weights, lanesMode_t, size_t elementSize);
+void lanesDestroy(lanes_t*);
+
+bool lanesTryPush(lanes_t*, size_t, const void*);
+bool lanesPop(lanes_t*, void*);
+size_t lanesPopMany(lanes_t*, void*, size_t);
+bool lanesPeek(lanes_t*, void*);
+void lanesShift(lanes_t*);
+
+size_t lanesDepth(lanes_t*);
+
+#endif
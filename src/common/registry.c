@@ -0,0 +1,136 @@
+#include "registry.h"
+#include "error.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+typedef struct {
+	_Atomic(agent_t*) agent; // NULL once unregistered
+	char* name; // owned by the registry, never changes
+} entry_t;
+
+static _Atomic(entry_t*) chunks[REGISTRY_CHUNKS];
+static atomic_uint count = 0;
+
+// name index, open addressing over ids, only used with the lock held
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t* names = NULL;
+static size_t capacity = 0;
+
+static inline entry_t* entryOf(uint32_t id) {
+	entry_t* chunk = atomic_load_explicit(&(chunks[id / REGISTRY_CHUNK]), memory_order_acquire);
+	return &(chunk[id % REGISTRY_CHUNK]);
+}
+
+static uint32_t hashOf(const char* name) {
+	uint32_t hash = 2166136261u; // FNV-1a
+	for (; *name != '\0'; name++)
+		hash = (hash ^ (unsigned char) *name) * 16777619u;
+	return hash;
+}
+
+static size_t slotOf(const char* name) {
+	size_t slot = hashOf(name) & (capacity - 1);
+	while (names[slot] != NO_AGENT && strcmp(entryOf(names[slot])->name, name) != 0)
+		slot = (slot + 1) & (capacity - 1);
+	return slot;
+}
+
+static int growIndex() {
+	size_t oldCapacity = capacity;
+	uint32_t* old = names;
+	capacity = capacity == 0 ? 1024 : capacity * 2;
+	names = malloc(capacity * sizeof(uint32_t));
+	if (names == NULL) {
+		libfail();
+		names = old;
+		capacity = oldCapacity;
+		return -1;
+	}
+	memset(names, 0xff, capacity * sizeof(uint32_t)); // NO_AGENT
+	for (size_t i = 0; i < oldCapacity; i++) {
+		if (old[i] != NO_AGENT)
+			names[slotOf(entryOf(old[i])->name)] = old[i];
+	}
+	free(old);
+	return 0;
+}
+
+uint32_t registerAgent(agent_t* agent) {
+	if (agent->name == NULL) {
+		error = "Agent has no name.";
+		return NO_AGENT;
+	}
+	pthread_mutex_lock(&lock);
+	uint32_t id = atomic_load_explicit(&count, memory_order_relaxed);
+	if ((id + 1) * 2 > capacity && growIndex() < 0) {
+		pthread_mutex_unlock(&lock);
+		return NO_AGENT;
+	}
+	size_t slot = slotOf(agent->name);
+	if (names[slot] != NO_AGENT) {
+		id = names[slot];
+		atomic_store_explicit(&(entryOf(id)->agent), agent, memory_order_release);
+		pthread_mutex_unlock(&lock);
+		return id;
+	}
+
+	if (id >= REGISTRY_CHUNK * REGISTRY_CHUNKS) {
+		pthread_mutex_unlock(&lock);
+		error = "Too many agents.";
+		return NO_AGENT;
+	}
+	if (id % REGISTRY_CHUNK == 0 && atomic_load_explicit(&(chunks[id / REGISTRY_CHUNK]), memory_order_relaxed) == NULL) {
+		entry_t* chunk = calloc(REGISTRY_CHUNK, sizeof(entry_t));
+		if (chunk == NULL) {
+			libfail();
+			pthread_mutex_unlock(&lock);
+			return NO_AGENT;
+		}
+		atomic_store_explicit(&(chunks[id / REGISTRY_CHUNK]), chunk, memory_order_release);
+	}
+	entry_t* entry = entryOf(id);
+	entry->name = strdup(agent->name);
+	if (entry->name == NULL) {
+		libfail();
+		pthread_mutex_unlock(&lock);
+		return NO_AGENT;
+	}
+	atomic_store_explicit(&(entry->agent), agent, memory_order_relaxed);
+	names[slot] = id;
+	atomic_store_explicit(&count, id + 1, memory_order_release);
+	pthread_mutex_unlock(&lock);
+	return id;
+}
+
+void unregisterAgent(uint32_t id) {
+	if (id < atomic_load_explicit(&count, memory_order_acquire))
+		atomic_store_explicit(&(entryOf(id)->agent), NULL, memory_order_release);
+}
+
+agent_t* getAgent(uint32_t id) {
+	if (id >= atomic_load_explicit(&count, memory_order_acquire))
+		return NULL;
+	return atomic_load_explicit(&(entryOf(id)->agent), memory_order_acquire);
+}
+
+const char* getAgentName(uint32_t id) {
+	if (id >= atomic_load_explicit(&count, memory_order_acquire))
+		return NULL;
+	return entryOf(id)->name;
+}
+
+uint32_t findAgent(const char* name) {
+	uint32_t id = NO_AGENT;
+	pthread_mutex_lock(&lock);
+	if (capacity > 0)
+		id = names[slotOf(name)];
+	pthread_mutex_unlock(&lock);
+	return id;
+}
+
+size_t getAgentCount() {
+	return atomic_load_explicit(&count, memory_order_acquire);
+}
@@ -0,0 +1,30 @@
+#ifndef REGISTRY_H
+#define REGISTRY_H
+
+#include "conf.h"
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Gives every agent a dense id, so packets can refer to it with four bytes
+ * instead of a copy of the agent. Ids are never reused: registering a name
+ * again returns its old id, and the name of an unregistered agent can still
+ * be looked up for packets that were created before.
+ *
+ * Lookups by id are lock free, registering and lookups by name take a lock.
+ */
+
+#define NO_AGENT UINT32_MAX
+#define REGISTRY_CHUNK 1024
+#define REGISTRY_CHUNKS 1024 // at most a million agents
+
+uint32_t registerAgent(agent_t*);
+void unregisterAgent(uint32_t);
+
+agent_t* getAgent(uint32_t);
+const char* getAgentName(uint32_t);
+uint32_t findAgent(const char*);
+size_t getAgentCount(void);
+
+#endif
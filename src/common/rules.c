@@ -0,0 +1,86 @@
+#include "rules.h"
+#include "error.h"
+
+#include <stdlib.h>
+
+int addRule(rules_t* rules, ruleType_t type, double first, double second, uint8_t code) {
+	if (rules->count == MAX_RULES) {
+		fail("Too many rules (at most %d).", MAX_RULES);
+		return -1;
+	}
+	rule_t rule = {.low = -__builtin_inf(), .high = __builtin_inf(), .input = RULE_VALUE, .code = code};
+	switch (type) {
+		case RULE_ABOVE:
+			rule.low = first;
+			break;
+		case RULE_BELOW:
+			rule.high = first;
+			break;
+		case RULE_RANGE:
+			rule.low = first < second ? first : second;
+			rule.high = first < second ? second : first;
+			break;
+		case RULE_RISE:
+			rule.input = RULE_RATE;
+			rule.low = first;
+			break;
+		case RULE_FALL:
+			rule.input = RULE_RATE;
+			rule.high = -first;
+			break;
+	}
+	rules->list[rules->count++] = rule;
+	return 0;
+}
+
+static int compareRules(const void* a, const void* b) {
+	const rule_t* r1 = a;
+	const rule_t* r2 = b;
+	if (r1->class != r2->class)
+		return r1->class > r2->class ? -1 : 1;
+	return (int) r1->code - (int) r2->code;
+}
+
+// the classes of the rules have to be set
+void sortRules(rules_t* rules) {
+	qsort(rules->list, rules->count, sizeof(rule_t), compareRules);
+}
+
+/*
+ * The rate is NaN if there is no previous sample, then no rate rule
+ * matches.
+ */
+uint8_t evaluateRules(const rules_t* rules, double value, double rate) {
+	const double inputs[2] = {value, rate};
+	uint32_t matches = 0;
+	for (uint8_t i = 0; i < rules->count; i++) {
+		const rule_t* rule = &(rules->list[i]);
+		double x = inputs[rule->input];
+		matches |= (uint32_t) ((x >= rule->low) & (x <= rule->high)) << i;
+	}
+	return matches == 0 ? 0 : rules->list[__builtin_ctz(matches)].code;
+}
+
+// stores the new sample and returns the rate of change per second since the last one
+double updateReading(reading_t* last, double value, unsigned long long now) {
+	double rate = __builtin_nan("");
+	if (last->valid && now > last->time)
+		rate = (value - last->value) / ((now - last->time) / 1e9);
+	last->value = value;
+	last->time = now;
+	last->valid = true;
+	return rate;
+}
+
+// compared with the last sample sent
+bool isOutsideDeadband(const deadband_t* deadband, const reading_t* sent, double value) {
+	if (!sent->valid)
+		return true;
+	double delta = value - sent->value;
+	delta = delta < 0 ? -delta : delta;
+	double magnitude = sent->value < 0 ? -sent->value : sent->value;
+	if (deadband->absolute < 0 && deadband->relative < 0)
+		return delta > 0;
+	return (deadband->absolute >= 0 && delta > deadband->absolute)
+		|| (deadband->relative >= 0 && delta > deadband->relative * magnitude);
+}
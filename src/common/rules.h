@@ -0,0 +1,82 @@
+#ifndef RULES_H
+#define RULES_H
+
+#include "data.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Rules map a sample of an INT or DOUBLE agent to a message code:
+ *
+ *   rules.above.<code> = 80        value >= 80
+ *   rules.below.<code> = 5         value <= 5
+ *   rules.range.<code> = "80 90"   80 <= value <= 90
+ *   rules.rise.<code> = 10         grows by at least 10 per second
+ *   rules.fall.<code> = 10         shrinks by at least 10 per second
+ *
+ * Every rule is compiled to an inclusive interval on the value or on its
+ * rate of change. All rules are compared on every sample without branches,
+ * the matching rule with the most severe message class wins (the lowest
+ * code on a tie). Without a match the code is 0, so rules can not use it;
+ * the message with code 0 is the one for samples that match no rule.
+ *
+ * A deadband suppresses samples of agents without rules that stay close
+ * to the last value sent:
+ *
+ *   deadband.absolute = 0.5        send once the value moved by more than 0.5
+ *   deadband.relative = 0.02       or by more than 2% of the value sent
+ *   deadband.maxsilence = 300      but send at least every 300 seconds
+ *
+ * Any deadband key turns it on; without a threshold every change is sent.
+ * maxsilence also applies to agents with rules.
+ */
+
+#define MAX_RULES 32
+#define NO_STATE 0xff // no code yet, message codes end at 254
+
+typedef enum {
+	RULE_ABOVE,
+	RULE_BELOW,
+	RULE_RANGE,
+	RULE_RISE,
+	RULE_FALL
+} ruleType_t;
+
+#define RULE_VALUE 0
+#define RULE_RATE 1
+
+typedef struct {
+	double low;
+	double high;
+	uint8_t input; // RULE_VALUE or RULE_RATE
+	uint8_t code;
+	class_t class; // of the message, for the order
+} rule_t;
+
+typedef struct {
+	uint8_t count;
+	rule_t list[MAX_RULES];
+} rules_t;
+
+typedef struct {
+	bool enabled;
+	double absolute; // < 0 if not set
+	double relative;
+	unsigned long long maxSilence; // s, 0 if not set
+} deadband_t;
+
+typedef struct {
+	double value;
+	unsigned long long time; // relative, ns
+	bool valid;
+} reading_t;
+
+int addRule(rules_t*, ruleType_t, double, double, uint8_t);
+void sortRules(rules_t*);
+uint8_t evaluateRules(const rules_t*, double, double);
+
+double updateReading(reading_t*, double, unsigned long long);
+bool isOutsideDeadband(const deadband_t*, const reading_t*, double);
+
+#endif
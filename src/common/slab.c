@@ -0,0 +1,221 @@
+#include "slab.h"
+#include "error.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#define CACHE_BYTES (256 * 1024) // what a thread keeps per class before it shares
+#define CACHE_MIN 8
+#define CACHE_MAX 512
+
+typedef struct object {
+	struct object* next;
+} object_t;
+
+typedef struct {
+	object_t* head;
+	size_t length;
+} list_t;
+
+// counters are only written by the owning thread, the atomics make reading them from others safe
+typedef struct cache {
+	list_t lists[SLAB_CLASSES];
+	atomic_ullong hits;
+	atomic_ullong misses;
+	atomic_llong bytesInUse;
+	struct cache* next; // all caches ever created, for the stats
+} cache_t;
+
+static struct {
+	pthread_mutex_t lock;
+	list_t lists[SLAB_CLASSES];
+	cache_t* caches;
+	atomic_ullong slabs;
+} shared = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static pthread_key_t key;
+static _Thread_local cache_t* cache = NULL;
+
+static inline int classOf(size_t size) {
+	if (size <= (1 << SLAB_MIN_SHIFT))
+		return 0;
+	return 64 - __builtin_clzll(size - 1) - SLAB_MIN_SHIFT;
+}
+
+static inline size_t sizeOf(int class) {
+	return (size_t) 1 << (class + SLAB_MIN_SHIFT);
+}
+
+static inline size_t limitOf(int class) {
+	size_t limit = CACHE_BYTES / sizeOf(class);
+	return limit < CACHE_MIN ? CACHE_MIN : limit > CACHE_MAX ? CACHE_MAX : limit;
+}
+
+static inline void bump(atomic_ullong* counter) {
+	atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + 1, memory_order_relaxed);
+}
+
+static inline void account(cache_t* cache, long long bytes) {
+	atomic_store_explicit(&(cache->bytesInUse),
+		atomic_load_explicit(&(cache->bytesInUse), memory_order_relaxed) + bytes, memory_order_relaxed);
+}
+
+// moves up to count objects from the front of one list to another
+static void move(list_t* from, list_t* to, size_t count) {
+	while (count-- > 0 && from->head != NULL) {
+		object_t* object = from->head;
+		from->head = object->next;
+		from->length--;
+		object->next = to->head;
+		to->head = object;
+		to->length++;
+	}
+}
+
+// gives all free objects of an exiting thread to the shared lists
+static void retire(void* argument) {
+	cache_t* retired = argument;
+	pthread_mutex_lock(&(shared.lock));
+	for (int i = 0; i < SLAB_CLASSES; i++)
+		move(&(retired->lists[i]), &(shared.lists[i]), retired->lists[i].length);
+	pthread_mutex_unlock(&(shared.lock));
+	cache = NULL;
+}
+
+static void createKey() {
+	pthread_key_create(&key, retire);
+}
+
+static cache_t* getCache() {
+	if (cache != NULL)
+		return cache;
+	pthread_once(&once, createKey);
+	cache_t* tmp = calloc(1, sizeof(cache_t));
+	if (tmp == NULL)
+		return NULL;
+	pthread_mutex_lock(&(shared.lock));
+	tmp->next = shared.caches;
+	shared.caches = tmp;
+	pthread_mutex_unlock(&(shared.lock));
+	pthread_setspecific(key, tmp);
+	cache = tmp;
+	return cache;
+}
+
+static bool carveSlab(list_t* list, int class) {
+	char* slab = malloc(SLAB_SIZE);
+	if (slab == NULL)
+		return false;
+	atomic_fetch_add_explicit(&(shared.slabs), 1, memory_order_relaxed);
+	size_t size = sizeOf(class);
+	for (size_t offset = SLAB_SIZE; offset >= size; offset -= size) {
+		object_t* object = (object_t*) (slab + offset - size);
+		object->next = list->head;
+		list->head = object;
+		list->length++;
+	}
+	return true;
+}
+
+void* slabAlloc(size_t size) {
+	cache_t* local = getCache();
+	if (local == NULL) {
+		libfail();
+		return NULL;
+	}
+	if (size > SLAB_MAX_OBJECT) {
+		void* tmp = malloc(size);
+		if (tmp == NULL) {
+			libfail();
+			return NULL;
+		}
+		bump(&(local->misses));
+		account(local, size);
+		return tmp;
+	}
+
+	int class = classOf(size);
+	list_t* list = &(local->lists[class]);
+	if (list->head == NULL) {
+		pthread_mutex_lock(&(shared.lock));
+		move(&(shared.lists[class]), list, limitOf(class) / 2);
+		pthread_mutex_unlock(&(shared.lock));
+	}
+	if (list->head == NULL) {
+		if (!carveSlab(list, class)) {
+			libfail();
+			return NULL;
+		}
+		bump(&(local->misses));
+	} else
+		bump(&(local->hits));
+
+	object_t* object = list->head;
+	list->head = object->next;
+	list->length--;
+	account(local, sizeOf(class));
+	return object;
+}
+
+void slabFree(void* pointer, size_t size) {
+	if (pointer == NULL)
+		return;
+	cache_t* local = getCache();
+	if (size > SLAB_MAX_OBJECT) {
+		free(pointer);
+		if (local != NULL)
+			account(local, -(long long) size);
+		return;
+	}
+
+	int class = classOf(size);
+	object_t* object = pointer;
+	if (local == NULL) {
+		list_t* list = &(shared.lists[class]);
+		pthread_mutex_lock(&(shared.lock));
+		object->next = list->head;
+		list->head = object;
+		list->length++;
+		pthread_mutex_unlock(&(shared.lock));
+		return;
+	}
+
+	list_t* list = &(local->lists[class]);
+	object->next = list->head;
+	list->head = object;
+	list->length++;
+	account(local, -(long long) sizeOf(class));
+
+	size_t limit = limitOf(class);
+	if (list->length > limit) {
+		pthread_mutex_lock(&(shared.lock));
+		move(list, &(shared.lists[class]), limit / 2);
+		pthread_mutex_unlock(&(shared.lock));
+	}
+}
+
+void getSlabStats(slabStats_t* stats) {
+	stats->hits = 0;
+	stats->misses = 0;
+	stats->bytesInUse = 0;
+	pthread_mutex_lock(&(shared.lock));
+	for (cache_t* tmp = shared.caches; tmp != NULL; tmp = tmp->next) {
+		stats->hits += atomic_load_explicit(&(tmp->hits), memory_order_relaxed);
+		stats->misses += atomic_load_explicit(&(tmp->misses), memory_order_relaxed);
+		stats->bytesInUse += atomic_load_explicit(&(tmp->bytesInUse), memory_order_relaxed);
+	}
+	pthread_mutex_unlock(&(shared.lock));
+	stats->slabs = atomic_load_explicit(&(shared.slabs), memory_order_relaxed);
+}
+
+void printSlabStats(FILE* file) {
+	slabStats_t stats;
+	getSlabStats(&stats);
+	unsigned long long total = stats.hits + stats.misses;
+	fprintf(file, "packet memory: %llu hits, %llu misses (%.2f%% hit rate), %lld bytes in use, %llu slabs\n",
+		stats.hits, stats.misses, total > 0 ? stats.hits * 100.0 / total : 0.0,
+		stats.bytesInUse, stats.slabs);
+}
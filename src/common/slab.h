@@ -0,0 +1,37 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+/*
+ * Size-class allocator for packet strings and messages. Every thread keeps
+ * its own free list per class, so allocating and freeing is a pointer swap
+ * without locks. Lists that grow too long (the sender frees what the
+ * workers allocated) hand half of their objects to a shared list, where
+ * threads that run dry pick them up again. Empty classes are refilled from
+ * fresh SLAB_SIZE slabs; slab memory is never given back to the system.
+ *
+ * Objects carry no header, so the caller passes the size again on free.
+ * Objects above SLAB_MAX_OBJECT go to malloc and count as misses.
+ */
+
+#define SLAB_MIN_SHIFT 4
+#define SLAB_CLASSES 10 // 16 bytes to 8 KiB
+#define SLAB_MAX_OBJECT (1 << (SLAB_MIN_SHIFT + SLAB_CLASSES - 1))
+#define SLAB_SIZE (64 * 1024)
+
+typedef struct {
+	unsigned long long hits; // served from a free list
+	unsigned long long misses; // needed a new slab or malloc
+	long long bytesInUse; // rounded up to the size class
+	unsigned long long slabs;
+} slabStats_t;
+
+void* slabAlloc(size_t);
+void slabFree(void*, size_t);
+
+void getSlabStats(slabStats_t*);
+void printSlabStats(FILE*);
+
+#endif
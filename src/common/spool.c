@@ -0,0 +1,483 @@
+#include "spool.h"
+#include "wire.h"
+#include "timer.h"
+#include "error.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define CURSOR_FILE "cursor"
+#define CURSOR_MAGIC 0x53504f4f4c435552ull // "SPOOLCUR"
+#define SEGMENT_SUFFIX ".spool"
+
+typedef struct {
+	uint64_t magic;
+	uint64_t sequence;
+	uint64_t offset;
+	uint32_t crc;
+} cursor_t;
+
+static uint32_t crcTable[256];
+static pthread_once_t crcOnce = PTHREAD_ONCE_INIT;
+
+static void crcInit() {
+	for (uint32_t i = 0; i < 256; i++) {
+		uint32_t crc = i;
+		for (int j = 0; j < 8; j++)
+			crc = crc & 1 ? (crc >> 1) ^ 0xedb88320u : crc >> 1;
+		crcTable[i] = crc;
+	}
+}
+
+// CRC-32 (IEEE), the storage of the receiver uses it too
+uint32_t crc32(const void* data, size_t length) {
+	pthread_once(&crcOnce, crcInit);
+	const unsigned char* bytes = data;
+	uint32_t crc = 0xffffffffu;
+	for (size_t i = 0; i < length; i++)
+		crc = crcTable[(crc ^ bytes[i]) & 0xff] ^ (crc >> 8);
+	return crc ^ 0xffffffffu;
+}
+
+static void pathOf(spool_t* spool, char* path, const char* name) {
+	snprintf(path, PATH_MAX, "%s/%s", spool->directory, name);
+}
+
+static void segmentPath(spool_t* spool, char* path, uint64_t sequence) {
+	snprintf(path, PATH_MAX, "%s/%016llx" SEGMENT_SUFFIX, spool->directory, (unsigned long long) sequence);
+}
+
+// makes a new directory entry durable
+static void syncDirectory(spool_t* spool) {
+	int fd = open(spool->directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd >= 0) {
+		(void) fsync(fd);
+		close(fd);
+	}
+}
+
+static int openSegment(spool_t* spool, segment_t* segment, uint64_t sequence, bool create) {
+	char path[PATH_MAX];
+	segmentPath(spool, path, sequence);
+	segment->sequence = sequence;
+	segment->offset = 0;
+	segment->map = NULL;
+	segment->fd = open(path, O_RDWR | O_CLOEXEC | (create ? O_CREAT : 0), 0644);
+	if (segment->fd < 0) {
+		libfail();
+		return -1;
+	}
+	struct stat info;
+	if (fstat(segment->fd, &info) < 0) {
+		libfail();
+		close(segment->fd);
+		return -1;
+	}
+	segment->size = info.st_size;
+	if (create) {
+		/*
+		 * The file is all zeroes, which reads as an empty segment. Its blocks
+		 * are allocated up front: a store to a page the disk has no room for
+		 * would raise SIGBUS instead of failing the append.
+		 */
+		bool created = segment->size == 0;
+		if (created)
+			segment->size = spool->segmentSize;
+		int tmp = posix_fallocate(segment->fd, 0, segment->size);
+		if (tmp == 0 && fsync(segment->fd) < 0)
+			tmp = errno;
+		if (tmp != 0) {
+			if (tmp == ENOSPC || tmp == EDQUOT)
+				error = "Spool is full.";
+			else {
+				errno = tmp;
+				libfail();
+			}
+			close(segment->fd);
+			if (created)
+				unlink(path);
+			return -1;
+		}
+		if (created)
+			syncDirectory(spool);
+	}
+	segment->map = mmap(NULL, segment->size, PROT_READ | PROT_WRITE, MAP_SHARED, segment->fd, 0);
+	if (segment->map == MAP_FAILED) {
+		libfail();
+		segment->map = NULL;
+		close(segment->fd);
+		return -1;
+	}
+	return 0;
+}
+
+static void closeSegment(segment_t* segment) {
+	if (segment->map != NULL)
+		munmap(segment->map, segment->size);
+	if (segment->fd >= 0)
+		close(segment->fd);
+	segment->map = NULL;
+	segment->fd = -1;
+}
+
+// length of the valid record at offset, 0 at the end of the records
+static size_t recordAt(segment_t* segment, size_t offset) {
+	if (offset + SPOOL_RECORD_HEADER > segment->size)
+		return 0;
+	uint32_t length, crc;
+	memcpy(&length, segment->map + offset, sizeof(uint32_t));
+	memcpy(&crc, segment->map + offset + sizeof(uint32_t), sizeof(uint32_t));
+	if (length == 0 || length > segment->size - offset - SPOOL_RECORD_HEADER)
+		return 0;
+	if (crc32(segment->map + offset + SPOOL_RECORD_HEADER, length) != crc)
+		return 0;
+	return SPOOL_RECORD_HEADER + length;
+}
+
+static int writeCursor(spool_t* spool) {
+	char path[PATH_MAX], tmp[PATH_MAX];
+	pathOf(spool, path, CURSOR_FILE);
+	pathOf(spool, tmp, CURSOR_FILE ".tmp");
+	cursor_t cursor;
+	memset(&cursor, 0, sizeof(cursor_t));
+	cursor.magic = CURSOR_MAGIC;
+	cursor.sequence = spool->reader.sequence;
+	cursor.offset = spool->reader.offset;
+	cursor.crc = crc32(&cursor, offsetof(cursor_t, crc));
+
+	int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		libfail();
+		return -1;
+	}
+	if (write(fd, &cursor, sizeof(cursor_t)) != sizeof(cursor_t) || fsync(fd) < 0) {
+		libfail();
+		close(fd);
+		return -1;
+	}
+	close(fd);
+	if (rename(tmp, path) < 0) {
+		libfail();
+		return -1;
+	}
+	return 0;
+}
+
+static void readCursor(spool_t* spool, uint64_t* sequence, uint64_t* offset) {
+	char path[PATH_MAX];
+	pathOf(spool, path, CURSOR_FILE);
+	cursor_t cursor;
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	bool valid = fd >= 0 && read(fd, &cursor, sizeof(cursor_t)) == sizeof(cursor_t)
+		&& cursor.magic == CURSOR_MAGIC && cursor.crc == crc32(&cursor, offsetof(cursor_t, crc))
+		&& cursor.sequence >= spool->first && cursor.sequence <= spool->writer.sequence;
+	if (fd >= 0)
+		close(fd);
+	*sequence = valid ? cursor.sequence : spool->first;
+	*offset = valid ? cursor.offset : 0;
+}
+
+// finds the oldest and newest segment, returns false if there is none
+static bool findSegments(spool_t* spool, uint64_t* first, uint64_t* last) {
+	DIR* directory = opendir(spool->directory);
+	if (directory == NULL)
+		return false;
+	bool found = false;
+	struct dirent* entry;
+	while ((entry = readdir(directory)) != NULL) {
+		unsigned long long sequence;
+		int length = 0;
+		if (sscanf(entry->d_name, "%16llx" SEGMENT_SUFFIX "%n", &sequence, &length) != 1
+				|| length == 0 || entry->d_name[length] != '\0')
+			continue;
+		if (!found || sequence < *first)
+			*first = sequence;
+		if (!found || sequence > *last)
+			*last = sequence;
+		found = true;
+	}
+	closedir(directory);
+	return found;
+}
+
+// counts the records of a segment from offset and returns where they end
+static size_t scanSegment(segment_t* segment, size_t offset, unsigned long long* count) {
+	size_t length;
+	while ((length = recordAt(segment, offset)) > 0) {
+		offset += length;
+		(*count)++;
+	}
+	return offset;
+}
+
+/*
+ * Clears what a torn write left behind the last record, so it can never
+ * look like a record again. Pages that are still zero are only read, so
+ * they are not written back.
+ */
+static void clearTail(segment_t* segment) {
+	size_t page = sysconf(_SC_PAGESIZE);
+	bool cleared = false;
+	for (size_t start = segment->offset; start < segment->size;) {
+		size_t end = (start / page + 1) * page;
+		if (end > segment->size)
+			end = segment->size;
+		char* bytes = segment->map + start;
+		if (bytes[0] != 0 || memcmp(bytes, bytes + 1, end - start - 1) != 0) {
+			memset(bytes, 0, end - start);
+			cleared = true;
+		}
+		start = end;
+	}
+	if (cleared)
+		msync(segment->map, segment->size, MS_SYNC);
+}
+
+int spoolOpen(spool_t* spool, const char* directory, size_t segmentSize, size_t maxSegments) {
+	memset(spool, 0, sizeof(spool_t));
+	spool->writer.fd = -1;
+	spool->reader.fd = -1;
+	spool->segmentSize = segmentSize == 0 ? SPOOL_SEGMENT_SIZE : segmentSize;
+	spool->maxSegments = maxSegments < 2 ? 2 : maxSegments;
+	spool->syncBytes = SPOOL_SYNC_BYTES;
+	spool->syncInterval = SPOOL_SYNC_INTERVAL * 1000ull * 1000ull;
+	spool->lastSync = getRelativeTime();
+	pthread_mutex_init(&(spool->lock), NULL);
+
+	if (mkdir(directory, 0755) < 0 && errno != EEXIST) {
+		libfail();
+		return -1;
+	}
+	spool->directory = strdup(directory);
+	if (spool->directory == NULL) {
+		libfail();
+		return -1;
+	}
+
+	uint64_t first = 0, last = 0;
+	if (!findSegments(spool, &first, &last))
+		first = last = 0;
+	spool->first = first;
+	if (openSegment(spool, &(spool->writer), last, true) < 0) {
+		spoolClose(spool);
+		return -1;
+	}
+
+	// everything after the last valid record of the newest segment is a torn write
+	unsigned long long ignored = 0;
+	spool->writer.offset = scanSegment(&(spool->writer), 0, &ignored);
+	clearTail(&(spool->writer));
+	spool->synced = spool->writer.offset;
+
+	uint64_t sequence, offset;
+	readCursor(spool, &sequence, &offset);
+	for (uint64_t i = spool->first; i < sequence; i++) {
+		char path[PATH_MAX];
+		segmentPath(spool, path, i);
+		unlink(path); // read completely before the crash
+	}
+	spool->first = sequence;
+	if (openSegment(spool, &(spool->reader), sequence, false) < 0) {
+		spoolClose(spool);
+		return -1;
+	}
+	// records replayed from the page cache may not have survived a power loss
+	if (sequence == spool->writer.sequence && offset > spool->writer.offset)
+		offset = spool->writer.offset;
+	spool->reader.offset = offset;
+
+	for (uint64_t i = sequence; i <= spool->writer.sequence; i++) {
+		if (i == sequence)
+			scanSegment(&(spool->reader), offset, &(spool->stats.pending));
+		else if (i == spool->writer.sequence)
+			scanSegment(&(spool->writer), 0, &(spool->stats.pending));
+		else {
+			segment_t segment;
+			if (openSegment(spool, &segment, i, false) < 0)
+				continue;
+			scanSegment(&segment, 0, &(spool->stats.pending));
+			closeSegment(&segment);
+		}
+	}
+	spool->stats.recovered = spool->stats.pending;
+	return 0;
+}
+
+static int syncLocked(spool_t* spool) {
+	if (spool->writer.map == NULL || spool->synced == spool->writer.offset)
+		return 0;
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t start = spool->synced / page * page;
+	if (msync(spool->writer.map + start, spool->writer.offset - start, MS_SYNC) < 0) {
+		libfail();
+		return -1;
+	}
+	spool->synced = spool->writer.offset;
+	spool->lastSync = getRelativeTime();
+	spool->stats.syncs++;
+	return 0;
+}
+
+void spoolClose(spool_t* spool) {
+	pthread_mutex_lock(&(spool->lock));
+	if (spool->writer.map != NULL)
+		(void) syncLocked(spool);
+	if (spool->reader.map != NULL)
+		(void) writeCursor(spool);
+	closeSegment(&(spool->reader));
+	closeSegment(&(spool->writer));
+	free(spool->directory);
+	spool->directory = NULL;
+	pthread_mutex_unlock(&(spool->lock));
+	pthread_mutex_destroy(&(spool->lock));
+}
+
+static int roll(spool_t* spool) {
+	if (spool->writer.sequence + 2 - spool->first > spool->maxSegments) {
+		error = "Spool is full.";
+		return -1;
+	}
+	if (syncLocked(spool) < 0)
+		return -1;
+	segment_t next;
+	if (openSegment(spool, &next, spool->writer.sequence + 1, true) < 0)
+		return -1;
+	closeSegment(&(spool->writer));
+	spool->writer = next;
+	spool->synced = 0;
+	return 0;
+}
+
+int spoolAppend(spool_t* spool, const packet_t* packet) {
+	wireFrame_t frame;
+	size_t length = wireEncode(packet, &frame);
+
+	pthread_mutex_lock(&(spool->lock));
+	if (SPOOL_RECORD_HEADER + length > spool->segmentSize) {
+		spool->stats.rejected++;
+		pthread_mutex_unlock(&(spool->lock));
+		error = "Packet too long for the spool.";
+		return -1;
+	}
+	if (spool->writer.offset + SPOOL_RECORD_HEADER + length > spool->writer.size && roll(spool) < 0) {
+		spool->stats.rejected++;
+		pthread_mutex_unlock(&(spool->lock));
+		return -1;
+	}
+
+	char* record = spool->writer.map + spool->writer.offset;
+	size_t position = SPOOL_RECORD_HEADER;
+	for (int i = 0; i < frame.count; i++) {
+		memcpy(record + position, frame.iov[i].iov_base, frame.iov[i].iov_len);
+		position += frame.iov[i].iov_len;
+	}
+	uint32_t tmp = crc32(record + SPOOL_RECORD_HEADER, length);
+	memcpy(record + sizeof(uint32_t), &tmp, sizeof(uint32_t));
+	tmp = length;
+	memcpy(record, &tmp, sizeof(uint32_t));
+	spool->writer.offset += SPOOL_RECORD_HEADER + length;
+	spool->stats.appended++;
+	spool->stats.pending++;
+
+	int result = 0;
+	if (spool->writer.offset - spool->synced >= spool->syncBytes
+			|| getRelativeTime() - spool->lastSync >= spool->syncInterval)
+		result = syncLocked(spool);
+	pthread_mutex_unlock(&(spool->lock));
+	return result;
+}
+
+int spoolSync(spool_t* spool) {
+	pthread_mutex_lock(&(spool->lock));
+	int result = syncLocked(spool);
+	pthread_mutex_unlock(&(spool->lock));
+	return result;
+}
+
+// moves the reader to the next segment once the current one is done
+static int nextSegment(spool_t* spool) {
+	uint64_t done = spool->reader.sequence;
+	segment_t next;
+	if (openSegment(spool, &next, done + 1, false) < 0)
+		return -1;
+	closeSegment(&(spool->reader));
+	spool->reader = next;
+	if (writeCursor(spool) < 0)
+		return -1;
+	char path[PATH_MAX];
+	segmentPath(spool, path, done);
+	unlink(path);
+	spool->first = done + 1;
+	return 0;
+}
+
+/*
+ * Points up to max iovecs at the next records (without the record header),
+ * at most maxBytes together unless a single record is longer. The records
+ * stay where they are until they are committed.
+ */
+size_t spoolPeek(spool_t* spool, struct iovec* records, size_t max, size_t maxBytes) {
+	pthread_mutex_lock(&(spool->lock));
+	size_t count = 0, bytes = 0;
+	size_t offset = spool->reader.offset;
+	while (count < max) {
+		size_t end = spool->reader.sequence == spool->writer.sequence ? spool->writer.offset : spool->reader.size;
+		size_t length = offset < end ? recordAt(&(spool->reader), offset) : 0;
+		if (length == 0) {
+			if (count > 0 || spool->reader.sequence == spool->writer.sequence || nextSegment(spool) < 0)
+				break;
+			offset = 0;
+			continue;
+		}
+		if (count > 0 && bytes + length - SPOOL_RECORD_HEADER > maxBytes)
+			break;
+		records[count++] = (struct iovec) {spool->reader.map + offset + SPOOL_RECORD_HEADER, length - SPOOL_RECORD_HEADER};
+		bytes += length - SPOOL_RECORD_HEADER;
+		offset += length;
+	}
+	pthread_mutex_unlock(&(spool->lock));
+	return count;
+}
+
+// marks the next count records as replayed
+int spoolCommit(spool_t* spool, size_t count) {
+	pthread_mutex_lock(&(spool->lock));
+	for (size_t i = 0; i < count; i++) {
+		size_t length = recordAt(&(spool->reader), spool->reader.offset);
+		if (length == 0)
+			break;
+		spool->reader.offset += length;
+		spool->stats.replayed++;
+		spool->stats.pending--;
+	}
+	int result = writeCursor(spool);
+	pthread_mutex_unlock(&(spool->lock));
+	return result;
+}
+
+bool spoolIsEmpty(spool_t* spool) {
+	pthread_mutex_lock(&(spool->lock));
+	bool empty = spool->stats.pending == 0;
+	pthread_mutex_unlock(&(spool->lock));
+	return empty;
+}
+
+void getSpoolStats(spool_t* spool, spoolStats_t* stats) {
+	pthread_mutex_lock(&(spool->lock));
+	*stats = spool->stats;
+	pthread_mutex_unlock(&(spool->lock));
+}
+
+void printSpoolStats(spool_t* spool, FILE* file) {
+	spoolStats_t stats;
+	getSpoolStats(spool, &stats);
+	fprintf(file, "spool: %llu pending, %llu appended, %llu replayed, %llu rejected, %llu recovered, %llu syncs\n",
+		stats.pending, stats.appended, stats.replayed, stats.rejected, stats.recovered, stats.syncs);
+}
@@ -0,0 +1,86 @@
+#ifndef SPOOL_H
+#define SPOOL_H
+
+#include "packet.h"
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+/*
+ * Append-only disk spool for packets that cannot go out right now. Packets
+ * are stored in the wire format in fixed-size, mmap'd segment files:
+ *
+ *   [length u32][crc32 u32][length bytes of wire format]...
+ *
+ * A zero length ends a segment. Appends are synced in groups, after
+ * syncBytes or syncInterval. After a crash, recovery scans the last
+ * segment and stops at the first record with a bad length or checksum.
+ *
+ * The read position is kept in a cursor file that is replaced with
+ * rename(), so replay is at least once: records sent right before a crash
+ * can be sent again, but none are skipped. Segments are deleted once read
+ * completely. The spool never holds more than maxSegments segments; appends
+ * beyond that are rejected. Segments are allocated on disk when they are
+ * created, so a full disk rejects appends the same way.
+ */
+
+#define SPOOL_SEGMENT_SIZE (16 << 20)
+#define SPOOL_MAX_SEGMENTS 256 // 4 GiB with the default segment size
+#define SPOOL_SYNC_BYTES (1 << 20)
+#define SPOOL_SYNC_INTERVAL 100 // ms
+#define SPOOL_RECORD_HEADER 8
+
+typedef struct {
+	unsigned long long appended;
+	unsigned long long replayed;
+	unsigned long long rejected; // spool full or packet too long
+	unsigned long long recovered; // records found when the spool was opened
+	unsigned long long syncs;
+	unsigned long long pending; // records not replayed yet
+} spoolStats_t;
+
+typedef struct {
+	uint64_t sequence;
+	int fd;
+	char* map;
+	size_t size;
+	size_t offset; // end of the records for the writer, next record for the reader
+} segment_t;
+
+typedef struct spool {
+	char* directory;
+	size_t segmentSize;
+	size_t maxSegments;
+	size_t syncBytes;
+	unsigned long long syncInterval; // ns
+
+	pthread_mutex_t lock;
+	uint64_t first; // oldest segment on disk
+	segment_t writer;
+	segment_t reader;
+	size_t synced; // writer offset known to be on disk
+	unsigned long long lastSync;
+
+	spoolStats_t stats;
+} spool_t;
+
+int spoolOpen(spool_t*, const char*, size_t, size_t);
+void spoolClose(spool_t*);
+
+int spoolAppend(spool_t*, const packet_t*);
+int spoolSync(spool_t*);
+
+size_t spoolPeek(spool_t*, struct iovec*, size_t, size_t);
+int spoolCommit(spool_t*, size_t);
+bool spoolIsEmpty(spool_t*);
+
+void getSpoolStats(spool_t*, spoolStats_t*);
+void printSpoolStats(spool_t*, FILE*);
+
+uint32_t crc32(const void*, size_t);
+
+#endif
@@ -0,0 +1,206 @@
+#include "template.h"
+#include "error.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+
+#define MAX_LITERAL 0xffff
+#define STACK_PROGRAM 1024
+
+static const char pairs[201] =
+	"00010203040506070809"
+	"10111213141516171819"
+	"20212223242526272829"
+	"30313233343536373839"
+	"40414243444546474849"
+	"50515253545556575859"
+	"60616263646566676869"
+	"70717273747576777879"
+	"80818283848586878889"
+	"90919293949596979899";
+
+static char* emitLiteral(char* program, const char* text, size_t length) {
+	while (length > 0) {
+		uint16_t part = length > MAX_LITERAL ? MAX_LITERAL : length;
+		*(program++) = TEMPLATE_LITERAL;
+		memcpy(program, &part, sizeof(uint16_t));
+		program += sizeof(uint16_t);
+		memcpy(program, text, part);
+		program += part;
+		text += part;
+		length -= part;
+	}
+	return program;
+}
+
+/*
+ * Compiles the template text of length bytes. The result is NULL if the
+ * text has no placeholders, then it can be used as it is.
+ */
+int compileTemplate(const char* text, size_t length, arena_t* arena, const char** result) {
+	if (memchr(text, '%', length) == NULL) {
+		*result = NULL;
+		return 0;
+	}
+
+	// every part costs at most 3 bytes more than its text
+	size_t size = 4 * length + 1;
+	char stack[STACK_PROGRAM];
+	char* program = size <= STACK_PROGRAM ? stack : malloc(size);
+	if (program == NULL) {
+		libfail();
+		return -1;
+	}
+
+	char* position = program;
+	size_t literal = 0; // start of the pending literal
+	for (size_t i = 0; i < length; i++) {
+		if (text[i] != '%' || i + 1 == length)
+			continue;
+		char next = text[i + 1];
+		if (next != 'v' && next != 'm' && next != '%')
+			continue;
+		// %% keeps the first % as part of the literal
+		position = emitLiteral(position, text + literal, i - literal + (next == '%'));
+		if (next == 'v')
+			*(position++) = TEMPLATE_VALUE;
+		else if (next == 'm')
+			*(position++) = TEMPLATE_OUTPUT;
+		literal = i + 2;
+		i++;
+	}
+	position = emitLiteral(position, text + literal, length - literal);
+	*(position++) = TEMPLATE_END;
+
+	*result = arenaIntern(arena, program, position - program);
+	if (program != stack)
+		free(program);
+	return *result == NULL ? -1 : 0;
+}
+
+static inline char* append(char* position, char* end, const char* text, size_t length) {
+	if (length > (size_t) (end - position))
+		length = end - position;
+	memcpy(position, text, length);
+	return position + length;
+}
+
+/*
+ * Expands a compiled template into buffer (at most size - 1 bytes, always
+ * terminated). Returns the length of the message.
+ */
+size_t expandTemplate(const char* program, char* buffer, size_t size, type_t type, const void* value, const char* output) {
+	if (size == 0)
+		return 0;
+	char* position = buffer;
+	char* end = buffer + size - 1;
+	char number[MAX_NUMBER_LENGTH];
+	uint16_t length;
+
+	for (;;) {
+		switch (*(program++)) {
+			case TEMPLATE_LITERAL:
+				memcpy(&length, program, sizeof(uint16_t));
+				program += sizeof(uint16_t);
+				position = append(position, end, program, length);
+				program += length;
+				break;
+			case TEMPLATE_VALUE:
+				if (value == NULL)
+					break;
+				if (type == INT)
+					position = append(position, end, number, formatInt(number, *((const int32_t*) value)));
+				else if (type == DOUBLE)
+					position = append(position, end, number, formatDouble(number, *((const double*) value)));
+				else if (type == STRING)
+					position = append(position, end, value, strlen(value));
+				break;
+			case TEMPLATE_OUTPUT:
+				if (output != NULL)
+					position = append(position, end, output, strlen(output));
+				break;
+			default:
+				*position = '\0';
+				return position - buffer;
+		}
+	}
+}
+
+// writes the digits backwards, ending right before end
+static char* formatDigits(char* end, uint64_t value) {
+	while (value >= 100) {
+		size_t index = (value % 100) * 2;
+		value /= 100;
+		*(--end) = pairs[index + 1];
+		*(--end) = pairs[index];
+	}
+	if (value >= 10) {
+		*(--end) = pairs[value * 2 + 1];
+		*(--end) = pairs[value * 2];
+	} else {
+		*(--end) = '0' + value;
+	}
+	return end;
+}
+
+size_t formatInt(char* buffer, int32_t value) {
+	char tmp[12];
+	char* start = formatDigits(tmp + sizeof(tmp), value < 0 ? -((int64_t) value) : value);
+	if (value < 0)
+		*(--start) = '-';
+	size_t length = tmp + sizeof(tmp) - start;
+	memcpy(buffer, start, length);
+	buffer[length] = '\0';
+	return length;
+}
+
+/*
+ * Up to six decimals without trailing zeros. Values beyond 1e15 are rare
+ * enough to go through snprintf.
+ */
+size_t formatDouble(char* buffer, double value) {
+	if (isnan(value)) {
+		memcpy(buffer, "nan", 4);
+		return 3;
+	}
+	if (isinf(value)) {
+		memcpy(buffer, value < 0 ? "-inf" : "inf", value < 0 ? 5 : 4);
+		return value < 0 ? 4 : 3;
+	}
+	double magnitude = value < 0 ? -value : value;
+	if (magnitude >= 1e15)
+		return snprintf(buffer, MAX_NUMBER_LENGTH, "%.6g", value);
+
+	uint64_t integer = magnitude;
+	uint64_t fraction = (magnitude - integer) * 1e6 + 0.5;
+	if (fraction >= 1000000) {
+		integer++;
+		fraction -= 1000000;
+	}
+
+	char* position = buffer;
+	if (value < 0 && (integer > 0 || fraction > 0))
+		*(position++) = '-';
+	char tmp[20];
+	char* start = formatDigits(tmp + sizeof(tmp), integer);
+	memcpy(position, start, tmp + sizeof(tmp) - start);
+	position += tmp + sizeof(tmp) - start;
+
+	if (fraction > 0) {
+		int digits = 6;
+		while (fraction % 10 == 0) {
+			fraction /= 10;
+			digits--;
+		}
+		*(position++) = '.';
+		for (int i = digits - 1; i >= 0; i--) {
+			position[i] = '0' + fraction % 10;
+			fraction /= 10;
+		}
+		position += digits;
+	}
+	*position = '\0';
+	return position - buffer;
+}
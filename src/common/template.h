@@ -0,0 +1,39 @@
+#ifndef TEMPLATE_H
+#define TEMPLATE_H
+
+#include "data.h"
+#include "arena.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Message templates: %v is replaced by the data value, %m by the script
+ * output and %% by a single %. A template is compiled once, when the config
+ * is loaded, into a program of literal and placeholder parts:
+ *
+ *   TEMPLATE_LITERAL [length u16] [length bytes]
+ *   TEMPLATE_VALUE
+ *   TEMPLATE_OUTPUT
+ *
+ * terminated by TEMPLATE_END. Programs are interned in the arena of the
+ * agent set, so equal templates share one program.
+ */
+
+#define TEMPLATE_END 0
+#define TEMPLATE_LITERAL 1
+#define TEMPLATE_VALUE 2
+#define TEMPLATE_OUTPUT 3
+
+#define MAX_MESSAGE_LENGTH 4096
+
+// longest output of formatInt and formatDouble
+#define MAX_NUMBER_LENGTH 32
+
+int compileTemplate(const char*, size_t, arena_t*, const char**);
+size_t expandTemplate(const char*, char*, size_t, type_t, const void*, const char*);
+
+size_t formatInt(char*, int32_t);
+size_t formatDouble(char*, double);
+
+#endif
@@ -1,130 +1,465 @@
 #include "timer.h"
+#include "clock.h"
 #include "error.h"
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <errno.h>
 
 #include <time.h>
 
-#define MAX_TIMERS 128
-
 #ifdef __linux__
 
-static void timerHandler(union sigval target) {
-	((void (*)(void))(target.sival_ptr))();
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+/*
+ * All timers share one hierarchical timer wheel that is advanced by a single
+ * scheduler thread. The thread sleeps in epoll on a timerfd that ticks every
+ * TICK_NS while at least one timer is armed. Handlers run on the scheduler
+ * thread, so they have to be short (hand work off to a worker).
+ *
+ * Level 0 has 256 slots of one tick, every further level has 64 slots that
+ * each span a full turn of the level below. Insert and cancel are O(1).
+ */
+
+#define TICK_NS (1000*1000) // 1 ms
+
+#define ROOT_BITS 8
+#define LEVEL_BITS 6
+#define LEVELS 4 // above the root
+#define ROOT_SIZE (1 << ROOT_BITS)
+#define LEVEL_SIZE (1 << LEVEL_BITS)
+#define ROOT_MASK (ROOT_SIZE - 1)
+#define LEVEL_MASK (LEVEL_SIZE - 1)
+#define MAX_DELTA ((1ull << (ROOT_BITS + LEVELS * LEVEL_BITS)) - 1)
+
+#define CHUNK_BITS 10
+#define CHUNK_SIZE (1 << CHUNK_BITS)
+#define MAX_CHUNKS 1024 // ~1M timers
+
+typedef struct wheelTimer {
+	struct wheelTimer* next;
+	struct wheelTimer* prev;
+	uint64_t expires; // tick
+	uint64_t period; // ticks, 0 for single shot
+	void (*handler)(void*);
+	void* context;
+	void (*simpleHandler)(void);
+	bool used;
+} wheelTimer_t;
+
+typedef struct {
+	void (*handler)(void*);
+	void* context;
+} expired_t;
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t dispatched;
+	pthread_t thread;
+	int epoll;
+	int timerfd;
+
+	uint64_t epoch; // ns
+	uint64_t current; // next tick to process
+	size_t armed;
+	bool dispatching;
+
+	wheelTimer_t root[ROOT_SIZE];
+	wheelTimer_t levels[LEVELS][LEVEL_SIZE];
+
+	wheelTimer_t* chunks[MAX_CHUNKS];
+	size_t allocated;
+	wheelTimer_t* unused;
+
+	expired_t* expired;
+	size_t expiredCapacity;
+} wheel = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.dispatched = PTHREAD_COND_INITIALIZER,
+	.epoll = -1,
+	.timerfd = -1
+};
+
+static pthread_once_t schedulerOnce = PTHREAD_ONCE_INIT;
+static const char* schedulerError = NULL;
+
+static uint64_t getBootTime() {
+	struct timespec time;
+	clock_gettime(CLOCK_BOOTTIME, &time);
+	return time.tv_sec * 1000000000ull + time.tv_nsec;
+}
+
+static uint64_t getTick() {
+	return (getBootTime() - wheel.epoch) / TICK_NS;
+}
+
+static inline void listInit(wheelTimer_t* head) {
+	head->next = head;
+	head->prev = head;
 }
 
-timer_t timers[MAX_TIMERS] = {NO_TIMER};
+static inline void listAppend(wheelTimer_t* head, wheelTimer_t* timer) {
+	timer->prev = head->prev;
+	timer->next = head;
+	head->prev->next = timer;
+	head->prev = timer;
+}
+
+static inline void listRemove(wheelTimer_t* timer) {
+	timer->prev->next = timer->next;
+	timer->next->prev = timer->prev;
+	timer->next = NULL;
+	timer->prev = NULL;
+}
+
+static inline wheelTimer_t* getTimer(timerid_t id) {
+	if (id < 0 || (size_t) id >= wheel.allocated)
+		return NULL;
+	wheelTimer_t* timer = &(wheel.chunks[id >> CHUNK_BITS][id & (CHUNK_SIZE - 1)]);
+	return timer->used ? timer : NULL;
+}
 
-static timerid_t findUnusedTimerId() {
-	for (int i = 0; i < MAX_TIMERS; i++) {
-		if (timers[i] == NO_TIMER)
-			return i;
+static inline timerid_t getTimerId(wheelTimer_t* timer) {
+	for (size_t i = 0; i < wheel.allocated >> CHUNK_BITS; i++) {
+		if (timer >= wheel.chunks[i] && timer < wheel.chunks[i] + CHUNK_SIZE)
+			return (i << CHUNK_BITS) + (timer - wheel.chunks[i]);
 	}
-	error = "There is no free timer.";
 	return NO_TIMER;
 }
 
-timerid_t creatTimer(void (*handler)()) {
-	timerid_t id = findUnusedTimerId();
-	if (id == NO_TIMER)
-		return NO_TIMER;
+// lock has to be held
+static void setTicking(bool ticking) {
+	struct itimerspec time = {{0, 0}, {0, 0}};
+	if (ticking) {
+		time.it_value.tv_nsec = TICK_NS;
+		time.it_interval.tv_nsec = TICK_NS;
+	}
+	(void) timerfd_settime(wheel.timerfd, 0, &time, NULL);
+	// nothing keeps the cached clock up to date anymore
+	if (!ticking)
+		invalidateClockCache();
+}
 
-	struct sigevent sevp;
-	sevp.sigev_notify = SIGEV_THREAD;
-	sevp.sigev_notify_function = timerHandler;
-	sevp.sigev_value.sival_ptr = handler;
+// lock has to be held
+static void insert(wheelTimer_t* timer) {
+	if (timer->expires < wheel.current)
+		timer->expires = wheel.current;
+	uint64_t delta = timer->expires - wheel.current;
+	if (delta > MAX_DELTA) {
+		delta = MAX_DELTA;
+		timer->expires = wheel.current + delta;
+	}
 
-	timer_t timer;
+	if (delta < ROOT_SIZE) {
+		listAppend(&(wheel.root[timer->expires & ROOT_MASK]), timer);
+		return;
+	}
+	for (int level = 0; level < LEVELS; level++) {
+		int shift = ROOT_BITS + (level + 1) * LEVEL_BITS;
+		if (level == LEVELS - 1 || delta < (1ull << shift)) {
+			int slot = (timer->expires >> (shift - LEVEL_BITS)) & LEVEL_MASK;
+			listAppend(&(wheel.levels[level][slot]), timer);
+			return;
+		}
+	}
+}
 
-	if (timer_create(CLOCK_BOOTTIME, &sevp, &timer) < 0) {
-		error = strerror(errno);
-		return NO_TIMER;
+// lock has to be held
+static void arm(wheelTimer_t* timer, uint64_t expires, uint64_t period) {
+	if (timer->next != NULL)
+		listRemove(timer);
+	else {
+		if (wheel.armed++ == 0) {
+			// nothing is scheduled, so the wheel can jump to the present
+			wheel.current = getTick();
+			setTicking(true);
+		}
 	}
+	timer->expires = wheel.current + expires;
+	timer->period = period;
+	insert(timer);
+}
 
-	timers[id] = timer;
-	return id;
+// lock has to be held
+static void disarm(wheelTimer_t* timer) {
+	if (timer->next == NULL)
+		return;
+	listRemove(timer);
+	if (--wheel.armed == 0)
+		setTicking(false);
 }
 
-int startTimer(timerid_t id, unsigned long ms) {
-	timer_t timer = timers[id];
-	if (timer == NO_TIMER) {
-		error = "No such timer.";
-		return -1;
+// lock has to be held
+static void cascade(int level, int slot) {
+	wheelTimer_t* head = &(wheel.levels[level][slot]);
+	while (head->next != head) {
+		wheelTimer_t* timer = head->next;
+		listRemove(timer);
+		insert(timer);
 	}
+}
 
-	struct itimerspec time, old;
+// lock has to be held
+static bool collect(size_t count, wheelTimer_t* timer) {
+	if (count >= wheel.expiredCapacity) {
+		size_t capacity = wheel.expiredCapacity == 0 ? 64 : wheel.expiredCapacity * 2;
+		expired_t* tmp = realloc(wheel.expired, capacity * sizeof(expired_t));
+		if (tmp == NULL)
+			return false;
+		wheel.expired = tmp;
+		wheel.expiredCapacity = capacity;
+	}
+	wheel.expired[count].handler = timer->handler;
+	wheel.expired[count].context = timer->context;
+	return true;
+}
 
-	time.it_value.tv_sec = ms / 1000;
-	time.it_value.tv_nsec = ((ms % 1000) * 1000000);
-	time.it_interval.tv_sec = 0;
-	time.it_interval.tv_nsec = 0;
+// lock has to be held, returns the number of collected handlers
+static size_t advance(uint64_t target) {
+	size_t count = 0;
+	while (wheel.current <= target && wheel.armed > 0) {
+		int index = wheel.current & ROOT_MASK;
+		if (index == 0) {
+			for (int level = 0; level < LEVELS; level++) {
+				int slot = (wheel.current >> (ROOT_BITS + level * LEVEL_BITS)) & LEVEL_MASK;
+				cascade(level, slot);
+				if (slot != 0)
+					break;
+			}
+		}
 
-	if (timer_settime(timer, 0, &time, &old) < 0) {
-		error = strerror(errno);
-		return -1;
+		wheelTimer_t* head = &(wheel.root[index]);
+		while (head->next != head) {
+			wheelTimer_t* timer = head->next;
+			listRemove(timer);
+			if (collect(count, timer))
+				count++;
+			if (timer->period > 0) {
+				timer->expires += timer->period;
+				insert(timer);
+			} else if (--wheel.armed == 0) {
+				setTicking(false);
+			}
+		}
+		wheel.current++;
 	}
-	return 0;
+	if (wheel.armed == 0)
+		wheel.current = target + 1;
+	return count;
 }
 
-int startInterval(timerid_t id, unsigned long ms) {
-	timer_t timer = timers[id];
-	if (timer == NO_TIMER) {
-		error = "No such timer.";
-		return -1;
+static void* schedulerThread(void* unused) {
+	(void) unused;
+	for (;;) {
+		struct epoll_event event;
+		int n = epoll_wait(wheel.epoll, &event, 1, -1);
+		if (n < 0 && errno != EINTR)
+			break;
+		if (n <= 0)
+			continue;
+
+		uint64_t overruns;
+		if (read(wheel.timerfd, &overruns, sizeof(overruns)) < 0)
+			continue;
+
+		pthread_mutex_lock(&(wheel.lock));
+		// under the lock, so it cannot outlive an invalidation by setTicking
+		if (wheel.armed > 0)
+			updateClockCache();
+		size_t count = advance(getTick());
+		wheel.dispatching = true;
+		pthread_mutex_unlock(&(wheel.lock));
+
+		for (size_t i = 0; i < count; i++)
+			wheel.expired[i].handler(wheel.expired[i].context);
+
+		pthread_mutex_lock(&(wheel.lock));
+		wheel.dispatching = false;
+		pthread_cond_broadcast(&(wheel.dispatched));
+		pthread_mutex_unlock(&(wheel.lock));
 	}
+	return NULL;
+}
 
-	struct itimerspec time, old;
+static void startScheduler() {
+	for (int i = 0; i < ROOT_SIZE; i++)
+		listInit(&(wheel.root[i]));
+	for (int level = 0; level < LEVELS; level++)
+		for (int i = 0; i < LEVEL_SIZE; i++)
+			listInit(&(wheel.levels[level][i]));
+	wheel.epoch = getBootTime();
+
+	wheel.timerfd = timerfd_create(CLOCK_BOOTTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (wheel.timerfd < 0)
+		wheel.timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (wheel.timerfd < 0) {
+		schedulerError = strerror(errno);
+		return;
+	}
+	wheel.epoll = epoll_create1(EPOLL_CLOEXEC);
+	if (wheel.epoll < 0) {
+		schedulerError = strerror(errno);
+		return;
+	}
+	struct epoll_event event = {.events = EPOLLIN, .data.fd = wheel.timerfd};
+	if (epoll_ctl(wheel.epoll, EPOLL_CTL_ADD, wheel.timerfd, &event) < 0) {
+		schedulerError = strerror(errno);
+		return;
+	}
+	int tmp = pthread_create(&(wheel.thread), NULL, schedulerThread, NULL);
+	if (tmp != 0) {
+		schedulerError = strerror(tmp);
+		return;
+	}
+	pthread_detach(wheel.thread);
+}
+
+// the scheduler thread must not wait for its own dispatch round
+static void waitForDispatch() {
+	if (pthread_equal(pthread_self(), wheel.thread))
+		return;
+	while (wheel.dispatching)
+		pthread_cond_wait(&(wheel.dispatched), &(wheel.lock));
+}
 
-	time.it_value.tv_sec = ms / 1000;
-	time.it_value.tv_nsec = ((ms % 1000) * 1000000);
-	time.it_interval.tv_sec = ms / 1000;
-	time.it_interval.tv_nsec = ((ms % 1000) * 1000000);
+static void simpleHandler(void* context) {
+	((wheelTimer_t*) context)->simpleHandler();
+}
+
+timerid_t createTimerWithContext(void (*handler)(void*), void* context) {
+	pthread_once(&schedulerOnce, startScheduler);
+	if (schedulerError != NULL) {
+		error = schedulerError;
+		return NO_TIMER;
+	}
+
+	pthread_mutex_lock(&(wheel.lock));
+	if (wheel.unused == NULL) {
+		size_t chunk = wheel.allocated >> CHUNK_BITS;
+		if (chunk >= MAX_CHUNKS) {
+			pthread_mutex_unlock(&(wheel.lock));
+			error = "There is no free timer.";
+			return NO_TIMER;
+		}
+		wheelTimer_t* timers = calloc(CHUNK_SIZE, sizeof(wheelTimer_t));
+		if (timers == NULL) {
+			pthread_mutex_unlock(&(wheel.lock));
+			libfail();
+			return NO_TIMER;
+		}
+		wheel.chunks[chunk] = timers;
+		wheel.allocated += CHUNK_SIZE;
+		for (int i = CHUNK_SIZE - 1; i >= 0; i--) {
+			timers[i].prev = wheel.unused; // free list is linked through prev
+			wheel.unused = &(timers[i]);
+		}
+	}
+	wheelTimer_t* timer = wheel.unused;
+	wheel.unused = timer->prev;
+	timer->next = NULL;
+	timer->prev = NULL;
+	timer->used = true;
+	timer->handler = handler;
+	timer->context = context;
+	timer->simpleHandler = NULL;
+	timerid_t id = getTimerId(timer);
+	pthread_mutex_unlock(&(wheel.lock));
+	return id;
+}
+
+timerid_t createTimer(void (*handler)()) {
+	timerid_t id = createTimerWithContext(simpleHandler, NULL);
+	if (id == NO_TIMER)
+		return NO_TIMER;
+	pthread_mutex_lock(&(wheel.lock));
+	wheelTimer_t* timer = getTimer(id);
+	timer->simpleHandler = handler;
+	timer->context = timer;
+	pthread_mutex_unlock(&(wheel.lock));
+	return id;
+}
 
-	if (timer_settime(timer, 0, &time, &old) < 0) {
-		error = strerror(errno);
+static uint64_t toTicks(unsigned long ms) {
+	uint64_t ticks = (ms * 1000000ull) / TICK_NS;
+	return ticks == 0 ? 1 : ticks;
+}
+
+int startTimer(timerid_t id, unsigned long ms) {
+	pthread_mutex_lock(&(wheel.lock));
+	wheelTimer_t* timer = getTimer(id);
+	if (timer == NULL) {
+		pthread_mutex_unlock(&(wheel.lock));
+		error = "No such timer.";
 		return -1;
 	}
+	arm(timer, toTicks(ms), 0);
+	pthread_mutex_unlock(&(wheel.lock));
 	return 0;
 }
 
-int stopTimer(timerid_t id) {
-	timer_t timer = timers[id];
-	if (timer == NO_TIMER) {
+/*
+ * Timers that share a period are spread across it: the first expiry is
+ * shifted by a phase taken from the golden ratio sequence of the timer id,
+ * so consecutive agents land evenly apart instead of in the same tick.
+ */
+int startInterval(timerid_t id, unsigned long ms) {
+	pthread_mutex_lock(&(wheel.lock));
+	wheelTimer_t* timer = getTimer(id);
+	if (timer == NULL) {
+		pthread_mutex_unlock(&(wheel.lock));
 		error = "No such timer.";
 		return -1;
 	}
+	uint64_t period = toTicks(ms);
+	uint64_t fraction = ((uint64_t) id * 0x9E3779B97F4A7C15ull) >> 32;
+	uint64_t phase = (fraction * (period & 0xffffffff)) >> 32;
+	arm(timer, period - phase, period);
+	pthread_mutex_unlock(&(wheel.lock));
+	return 0;
+}
 
-	struct itimerspec time, old;
-
-	time.it_value.tv_sec = 0;
-	time.it_value.tv_nsec = 0;
-	time.it_interval.tv_sec = 0;
-	time.it_interval.tv_nsec = 0;
-
-	if (timer_settime(timer, 0, &time, &old) < 0) {
-		error = strerror(errno);
+int stopTimer(timerid_t id) {
+	pthread_mutex_lock(&(wheel.lock));
+	wheelTimer_t* timer = getTimer(id);
+	if (timer == NULL) {
+		pthread_mutex_unlock(&(wheel.lock));
+		error = "No such timer.";
 		return -1;
 	}
+	disarm(timer);
+	waitForDispatch();
+	pthread_mutex_unlock(&(wheel.lock));
 	return 0;
 }
 
 int deleteTimer(timerid_t id) {
-	timer_t timer = timers[id];
-	if (timer == NO_TIMER) {
+	pthread_mutex_lock(&(wheel.lock));
+	wheelTimer_t* timer = getTimer(id);
+	if (timer == NULL) {
+		pthread_mutex_unlock(&(wheel.lock));
 		error = "No such timer.";
 		return -1;
 	}
-	if (timer_delete(timer) < 0) {
-		error = strerror(errno);
-		return -1;
-	}
-	timers[id] = NO_TIMER;
+	disarm(timer);
+	waitForDispatch();
+	timer->used = false;
+	timer->prev = wheel.unused;
+	wheel.unused = timer;
+	pthread_mutex_unlock(&(wheel.lock));
 	return 0;
 }
 
 #endif
 #ifdef __MACH__
+	#define MAX_TIMERS 128
+
 	#include <dispatch/dispatch.h>
 
 	#define LEEWAY 20000000 // 20 ms
@@ -140,6 +475,14 @@ int deleteTimer(timerid_t id) {
 		return NO_TIMER;
 	}
 
+	timerid_t createTimerWithContext(void (*handler)(void*), void* context) {
+		timerid_t id = createTimer((void (*)(void)) handler);
+		if (id == NO_TIMER)
+			return NO_TIMER;
+		dispatch_set_context(timers[id], context);
+		return id;
+	}
+
 	timerid_t createTimer(void (*handler)()) {
 		timerid_t id = findUnusedTimerId();
 		if (id == NO_TIMER)
@@ -204,23 +547,23 @@ int deleteTimer(timerid_t id) {
 unsigned long long getRealTime() {
 	struct timespec time;
 	clock_gettime(CLOCK_REALTIME, &time);
-	return time.tv_sec * 1000000000 + time.tv_nsec;
+	return time.tv_sec * 1000000000ull + time.tv_nsec;
 }
 
 unsigned long long getRelativeTime() {
 	struct timespec time;
 	clock_gettime(CLOCK_MONOTONIC, &time);
-	return time.tv_sec * 1000000000 + time.tv_nsec;
+	return time.tv_sec * 1000000000ull + time.tv_nsec;
 }
 
 unsigned long long getProcessTime() {
 	struct timespec time;
 	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &time);
-	return time.tv_sec * 1000000000 + time.tv_nsec;
+	return time.tv_sec * 1000000000ull + time.tv_nsec;
 }
 
 unsigned long long getThreadTime() {
 	struct timespec time;
 	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time);
-	return time.tv_sec * 1000000000 + time.tv_nsec;
+	return time.tv_sec * 1000000000ull + time.tv_nsec;
 }
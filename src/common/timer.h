@@ -5,6 +5,7 @@ typedef int timerid_t;
 #define NO_TIMER (-1)
 
 timerid_t createTimer(void (*)(void));
+timerid_t createTimerWithContext(void (*)(void*), void*);
 int startTimer(timerid_t, unsigned long);
 int startInterval(timerid_t, unsigned long);
 int stopTimer(timerid_t);
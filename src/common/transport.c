@@ -0,0 +1,697 @@
+#define _GNU_SOURCE
+
+#include "transport.h"
+#include "timer.h"
+#include "error.h"
+#include "utils.h"
+#include "metrics.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+void transportInit(transport_t* transport, int fd, transportMode_t mode, size_t flushBytes, unsigned long flushLatency) {
+	transport->mode = mode;
+	transport->flushBytes = flushBytes;
+	transport->flushLatency = flushLatency * 1000ull * 1000ull;
+	transport->count = 0;
+	transport->bytes = 0;
+	transport->oldest = 0;
+	transport->plain = NULL;
+	transport->plainCapacity = 0;
+	transport->packed = NULL;
+	transport->packedCapacity = 0;
+	transportConnect(transport, fd);
+}
+
+// starts over on a new connection, packets still pending are kept
+void transportConnect(transport_t* transport, int fd) {
+	transport->fd = fd;
+	memset(&(transport->codec), 0, sizeof(codec_t));
+	transport->hello = NULL;
+	transport->answered = 0;
+	memset(&(transport->stats), 0, sizeof(transportStats_t));
+}
+
+// frees the compression state, the pending batch stays
+void transportDestroy(transport_t* transport) {
+	codecDestroy(&(transport->codec));
+	free(transport->hello);
+	transport->hello = NULL;
+	free(transport->plain);
+	free(transport->packed);
+	transport->plain = NULL;
+	transport->plainCapacity = 0;
+	transport->packed = NULL;
+	transport->packedCapacity = 0;
+}
+
+static int grow(char** buffer, size_t* capacity, size_t size) {
+	if (size <= *capacity)
+		return 0;
+	size_t tmp = *capacity == 0 ? 16384 : *capacity;
+	while (tmp < size)
+		tmp *= 2;
+	char* resized = realloc(*buffer, tmp);
+	if (resized == NULL) {
+		libfail();
+		return -1;
+	}
+	*buffer = resized;
+	*capacity = tmp;
+	return 0;
+}
+
+static void encodeFrameHeader(frameHeader_t* header, uint8_t type, uint8_t flags, size_t length, size_t count) {
+	header->length = htobe32(length);
+	header->type = type;
+	header->flags = flags;
+	header->count = htobe16(count);
+}
+
+/*
+ * Sends the payload in iov[1..] as one frame, iov[0] takes the header. If
+ * the link negotiated a compression, the payload is sent compressed unless
+ * that does not make it smaller.
+ */
+static int sendPayload(transport_t* transport, uint8_t flags, struct iovec* iov, int iovcnt, size_t length, size_t count) {
+	size_t payload = length;
+	struct iovec packed[2];
+	if (transport->codec.compression != COMPRESS_NONE) {
+		size_t bound = sizeof(uint32_t) + codecBound(&(transport->codec), length);
+		if (grow(&(transport->plain), &(transport->plainCapacity), length) < 0
+				|| grow(&(transport->packed), &(transport->packedCapacity), bound) < 0)
+			return -1;
+		size_t position = 0;
+		for (int i = 1; i < iovcnt; i++) {
+			memcpy(transport->plain + position, iov[i].iov_base, iov[i].iov_len);
+			position += iov[i].iov_len;
+		}
+		ssize_t tmp = codecCompress(&(transport->codec), transport->plain, length,
+			transport->packed + sizeof(uint32_t), bound - sizeof(uint32_t));
+		if (tmp < 0)
+			return -1;
+		if (sizeof(uint32_t) + tmp < length) {
+			uint32_t size = htobe32(length);
+			memcpy(transport->packed, &size, sizeof(uint32_t));
+			length = sizeof(uint32_t) + tmp;
+			packed[1] = (struct iovec) {transport->packed, length};
+			iov = packed;
+			iovcnt = 2;
+			flags |= FRAME_COMPRESSED;
+			transport->stats.compressed++;
+		}
+	}
+
+	frameHeader_t header;
+	encodeFrameHeader(&header, FRAME_PACKETS, flags, length, count);
+	iov[0] = (struct iovec) {&header, FRAME_HEADER_SIZE};
+	unsigned long long calls = (iovcnt + IOV_MAX - 1) / IOV_MAX;
+	if (sendIovecs(transport->fd, iov, iovcnt, FRAME_HEADER_SIZE + length) < 0)
+		return -1;
+
+	transport->stats.frames++;
+	transport->stats.packets += count;
+	transport->stats.bytes += FRAME_HEADER_SIZE + length;
+	transport->stats.payload += payload;
+	transport->stats.syscalls += calls;
+	return 0;
+}
+
+// drops a packet that could never be sent, so it does not block the ones behind it
+static void dropOversized(transport_t* transport) {
+	transport->stats.dropped++;
+	fail("Packet too long for a %s.", transport->mode == STREAM ? "frame" : "datagram");
+}
+
+/*
+ * One frame with as many of the packets as fit into it (count is at most
+ * TRANSPORT_BATCH). Returns the number of packets done with, or -1.
+ */
+static ssize_t sendFrame(transport_t* transport, packet_t* packets, size_t count) {
+	wireFrame_t frames[TRANSPORT_BATCH];
+	struct iovec iov[1 + TRANSPORT_BATCH * WIRE_IOVECS];
+
+	unsigned long long start = getRelativeTime();
+	int iovcnt = 1;
+	size_t length = 0;
+	size_t n = 0;
+	size_t done = 0;
+	for (; done < count; done++) {
+		size_t tmp = wireEncode(&(packets[done]), &(frames[n]));
+		if (tmp > FRAME_MAX_LENGTH) {
+			dropOversized(transport);
+			continue;
+		}
+		if (length + tmp > FRAME_MAX_LENGTH)
+			break;
+		length += tmp;
+		memcpy(iov + iovcnt, frames[n].iov, frames[n].count * sizeof(struct iovec));
+		iovcnt += frames[n].count;
+		n++;
+	}
+	unsigned long long encoded = getRelativeTime();
+	recordStage(STAGE_ENCODE, encoded - start);
+	if (n > 0 && sendPayload(transport, 0, iov, iovcnt, length, n) < 0)
+		return -1;
+	recordStage(STAGE_SEND, getRelativeTime() - encoded);
+	return done;
+}
+
+/*
+ * One datagram per packet, the whole batch with one sendmmsg. Returns the
+ * number of packets done with: if sendmmsg fails halfway, the ones it sent.
+ */
+static size_t sendDatagrams(transport_t* transport, packet_t* packets, size_t count) {
+	wireFrame_t frames[TRANSPORT_BATCH];
+	frameHeader_t headers[TRANSPORT_BATCH];
+	struct iovec iov[TRANSPORT_BATCH][1 + WIRE_IOVECS];
+	struct mmsghdr messages[TRANSPORT_BATCH];
+	size_t indices[TRANSPORT_BATCH]; // of the packet of a message
+
+	unsigned long long start = getRelativeTime();
+	size_t n = 0;
+	for (size_t i = 0; i < count; i++) {
+		size_t length = wireEncode(&(packets[i]), &(frames[n]));
+		if (length + FRAME_HEADER_SIZE > DATAGRAM_MAX_LENGTH) {
+			dropOversized(transport);
+			continue;
+		}
+		encodeFrameHeader(&(headers[n]), FRAME_PACKETS, 0, length, 1);
+		iov[n][0] = (struct iovec) {&(headers[n]), FRAME_HEADER_SIZE};
+		memcpy(&(iov[n][1]), frames[n].iov, frames[n].count * sizeof(struct iovec));
+		memset(&(messages[n]), 0, sizeof(struct mmsghdr));
+		messages[n].msg_hdr.msg_iov = iov[n];
+		messages[n].msg_hdr.msg_iovlen = 1 + frames[n].count;
+		indices[n] = i;
+		n++;
+	}
+	unsigned long long encoded = getRelativeTime();
+	recordStage(STAGE_ENCODE, encoded - start);
+
+	size_t sent = 0;
+	while (sent < n) {
+		int tmp = sendmmsg(transport->fd, messages + sent, n - sent, MSG_NOSIGNAL);
+		transport->stats.syscalls++;
+		if (tmp < 0) {
+			if (errno == EINTR)
+				continue;
+			libfail();
+			break;
+		}
+		for (int i = 0; i < tmp; i++) {
+			transport->stats.bytes += messages[sent + i].msg_len;
+			transport->stats.payload += messages[sent + i].msg_len - FRAME_HEADER_SIZE;
+		}
+		sent += tmp;
+	}
+	recordStage(STAGE_SEND, getRelativeTime() - encoded);
+	transport->stats.frames += sent;
+	transport->stats.packets += sent;
+	return sent < n ? indices[sent] : count;
+}
+
+/*
+ * Returns the number of packets done with: sent, or dropped because they
+ * are too long to ever be sent. Fewer than count means sending failed and
+ * the rest has to be sent again, error says why.
+ */
+size_t transportSendPackets(transport_t* transport, packet_t* packets, size_t count) {
+	size_t done = 0;
+	while (done < count) {
+		size_t chunk = count - done > TRANSPORT_BATCH ? TRANSPORT_BATCH : count - done;
+		ssize_t tmp;
+		if (transport->mode == STREAM)
+			tmp = sendFrame(transport, packets + done, chunk);
+		else
+			tmp = sendDatagrams(transport, packets + done, chunk);
+		if (tmp <= 0)
+			break;
+		done += tmp;
+		if ((size_t) tmp < chunk && transport->mode == DATAGRAM)
+			break;
+	}
+	return done;
+}
+
+// removes the first count packets from the pending batch
+static void shiftBatch(transport_t* transport, size_t count) {
+	transport->count -= count;
+	memmove(transport->batch, transport->batch + count, transport->count * sizeof(packet_t));
+	transport->bytes = 0;
+	for (size_t i = 0; i < transport->count; i++)
+		transport->bytes += wireLength(&(transport->batch[i]));
+}
+
+/*
+ * Sends the pending batch. On failure the packets that were not sent are
+ * kept, so they can be sent again once the connection is back.
+ */
+int transportFlush(transport_t* transport) {
+	if (transport->count == 0)
+		return 0;
+	size_t count = transport->count;
+	size_t done = transportSendPackets(transport, transport->batch, count);
+	for (size_t i = 0; i < done; i++)
+		markPacketSent(&(transport->batch[i]));
+	shiftBatch(transport, done);
+	return done < count ? -1 : (int) done;
+}
+
+/*
+ * Moves the pending batch into the spool, for when the receiver cannot be
+ * reached. Packets the spool does not take stay in the batch.
+ */
+int transportSpill(transport_t* transport, spool_t* spool) {
+	size_t spilled = 0;
+	int result = 0;
+	for (; spilled < transport->count; spilled++) {
+		if (spoolAppend(spool, &(transport->batch[spilled])) < 0) {
+			result = -1;
+			break;
+		}
+		markPacketSent(&(transport->batch[spilled]));
+	}
+	shiftBatch(transport, spilled);
+	return result;
+}
+
+// returns the number of records done with, like sendDatagrams
+static size_t replayDatagrams(transport_t* transport, struct iovec* records, size_t count) {
+	frameHeader_t headers[TRANSPORT_BATCH];
+	struct iovec iov[TRANSPORT_BATCH][2];
+	struct mmsghdr messages[TRANSPORT_BATCH];
+	size_t indices[TRANSPORT_BATCH];
+	size_t n = 0;
+	for (size_t i = 0; i < count; i++) {
+		if (FRAME_HEADER_SIZE + records[i].iov_len > DATAGRAM_MAX_LENGTH) {
+			// could never be sent, only dropping it gets the spool moving again
+			transport->stats.dropped++;
+			continue;
+		}
+		encodeFrameHeader(&(headers[n]), FRAME_PACKETS, FRAME_DELAYED, records[i].iov_len, 1);
+		iov[n][0] = (struct iovec) {&(headers[n]), FRAME_HEADER_SIZE};
+		iov[n][1] = records[i];
+		memset(&(messages[n]), 0, sizeof(struct mmsghdr));
+		messages[n].msg_hdr.msg_iov = iov[n];
+		messages[n].msg_hdr.msg_iovlen = 2;
+		indices[n] = i;
+		n++;
+	}
+	size_t sent = 0;
+	while (sent < n) {
+		int tmp = sendmmsg(transport->fd, messages + sent, n - sent, MSG_NOSIGNAL);
+		transport->stats.syscalls++;
+		if (tmp < 0) {
+			if (errno == EINTR)
+				continue;
+			libfail();
+			break;
+		}
+		for (int i = 0; i < tmp; i++) {
+			transport->stats.bytes += messages[sent + i].msg_len;
+			transport->stats.payload += messages[sent + i].msg_len - FRAME_HEADER_SIZE;
+		}
+		sent += tmp;
+	}
+	transport->stats.frames += sent;
+	transport->stats.packets += sent;
+	return sent < n ? indices[sent] : count;
+}
+
+/*
+ * Sends the oldest spooled packets, straight from the spool segment, in a
+ * frame flagged FRAME_DELAYED. Returns the number of packets replayed, 0 if
+ * the spool is empty.
+ */
+ssize_t transportReplay(transport_t* transport, spool_t* spool) {
+	struct iovec iov[1 + TRANSPORT_BATCH];
+	size_t count = spoolPeek(spool, iov + 1, TRANSPORT_BATCH, FRAME_MAX_LENGTH);
+	if (count == 0)
+		return 0;
+
+	if (transport->mode == STREAM) {
+		size_t length = 0;
+		for (size_t i = 1; i <= count; i++)
+			length += iov[i].iov_len;
+		if (sendPayload(transport, FRAME_DELAYED, iov, count + 1, length, count) < 0)
+			return -1;
+	} else {
+		// what was sent is committed, so it is not sent again
+		size_t done = replayDatagrams(transport, iov + 1, count);
+		if (done < count) {
+			if (done > 0)
+				(void) spoolCommit(spool, done);
+			return -1;
+		}
+	}
+
+	if (spoolCommit(spool, count) < 0)
+		return -1;
+	return count;
+}
+
+/*
+ * Moves queued packets into the pending batch and sends it once it is full,
+ * holds flushBytes or its oldest packet waited flushLatency. Packets of the
+ * highest lane do not wait. Returns the number of packets sent.
+ */
+ssize_t transportPump(transport_t* transport) {
+	size_t n = popPackets(transport->batch + transport->count, TRANSPORT_BATCH - transport->count);
+	unsigned long long now = getRelativeTime();
+	if (n > 0 && transport->count == 0)
+		transport->oldest = now;
+	bool urgent = false;
+	for (size_t i = 0; i < n; i++) {
+		packet_t* packet = &(transport->batch[transport->count + i]);
+		transport->bytes += wireLength(packet);
+		urgent |= getLane(packet->class) == PACKET_LANES - 1;
+	}
+	transport->count += n;
+
+	if (transport->count == 0)
+		return 0;
+	if (!urgent && transport->count < TRANSPORT_BATCH && transport->bytes < transport->flushBytes
+			&& now - transport->oldest < transport->flushLatency)
+		return 0;
+	return transportFlush(transport);
+}
+
+int writeFrame(int fd, uint8_t type, const void* payload, size_t length) {
+	frameHeader_t header;
+	encodeFrameHeader(&header, type, 0, length, 0);
+	struct iovec iov[2] = {
+		{&header, FRAME_HEADER_SIZE},
+		{(void*) payload, length}
+	};
+	return sendIovecs(fd, iov, length > 0 ? 2 : 1, FRAME_HEADER_SIZE + length) < 0 ? -1 : 0;
+}
+
+/*
+ * The transmitter side of the HELLO exchange: offers the compressions of
+ * this build (only none if preferred is none) with a dictionary built from
+ * the registered agents. transportAwaitHello takes the answer.
+ */
+int transportOfferHello(transport_t* transport, compression_t preferred) {
+	char* message = malloc(sizeof(hello_t) + COMPRESS_DICTIONARY_SIZE);
+	if (message == NULL) {
+		libfail();
+		return -1;
+	}
+	hello_t hello = {
+		.version = HELLO_VERSION,
+		.compressions = preferred == COMPRESS_NONE ? COMPRESS_MASK(COMPRESS_NONE) : getCompressions(),
+		.preferred = preferred
+	};
+	memcpy(message, &hello, sizeof(hello_t));
+	size_t size = hello.compressions == COMPRESS_MASK(COMPRESS_NONE) ? 0
+		: buildDictionary(message + sizeof(hello_t), COMPRESS_DICTIONARY_SIZE);
+	if (writeFrame(transport->fd, FRAME_HELLO, message, sizeof(hello_t) + size) < 0) {
+		free(message);
+		return -1;
+	}
+	free(transport->hello);
+	transport->hello = message;
+	transport->dictionarySize = size;
+	transport->answered = 0;
+	transport->helloDeadline = getRelativeTime() + HELLO_TIMEOUT * 1000ull * 1000;
+	return 0;
+}
+
+static int endHello(transport_t* transport, int result) {
+	free(transport->hello);
+	transport->hello = NULL;
+	return result;
+}
+
+/*
+ * Reads what there is of the answer, waiting at most timeout ms. 1 once the
+ * codec is set up, 0 while the answer is incomplete, -1 on errors and after
+ * HELLO_TIMEOUT.
+ */
+int transportAwaitHello(transport_t* transport, int timeout) {
+	while (transport->answered < sizeof(transport->answer)) {
+		struct pollfd watch = {.fd = transport->fd, .events = POLLIN};
+		int tmp = poll(&watch, 1, timeout);
+		if (tmp < 0 && errno == EINTR)
+			continue;
+		if (tmp < 0) {
+			libfail();
+			return endHello(transport, -1);
+		}
+		if (tmp == 0) {
+			if (getRelativeTime() < transport->helloDeadline)
+				return 0;
+			error = "Timed out.";
+			return endHello(transport, -1);
+		}
+		ssize_t n = read(transport->fd, transport->answer + transport->answered,
+			sizeof(transport->answer) - transport->answered);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			if (n == 0)
+				error = "Connection closed.";
+			else
+				libfail();
+			return endHello(transport, -1);
+		}
+		transport->answered += n;
+	}
+
+	frameHeader_t header;
+	hello_t hello;
+	if (frameDecodeHeader(transport->answer, sizeof(transport->answer), &header) < 0)
+		return endHello(transport, -1);
+	memcpy(&hello, transport->answer + FRAME_HEADER_SIZE, sizeof(hello_t));
+	if (header.type != FRAME_HELLO || header.length != sizeof(hello_t) || hello.version != HELLO_VERSION
+			|| hello.preferred > COMPRESS_ZSTD || hello.compressions != COMPRESS_MASK(hello.preferred)) {
+		error = "Invalid answer to the hello.";
+		return endHello(transport, -1);
+	}
+	codecDestroy(&(transport->codec));
+	int result = codecInit(&(transport->codec), hello.preferred, transport->hello + sizeof(hello_t),
+		transport->dictionarySize);
+	return endHello(transport, result < 0 ? -1 : 1);
+}
+
+// both steps of the exchange, blocking until the answer is there
+int transportHandshake(transport_t* transport, compression_t preferred) {
+	if (transportOfferHello(transport, preferred) < 0)
+		return -1;
+	int result;
+	while ((result = transportAwaitHello(transport, HELLO_TIMEOUT)) == 0);
+	return result < 0 ? -1 : 0;
+}
+
+/*
+ * The preferred compression if both sides support it, otherwise LZ4, then
+ * zstd, then none.
+ */
+compression_t negotiateCompression(int offered, compression_t preferred) {
+	int both = offered & getCompressions();
+	if (preferred <= COMPRESS_ZSTD && (both & COMPRESS_MASK(preferred)))
+		return preferred;
+	if (both & COMPRESS_MASK(COMPRESS_LZ4))
+		return COMPRESS_LZ4;
+	if (both & COMPRESS_MASK(COMPRESS_ZSTD))
+		return COMPRESS_ZSTD;
+	return COMPRESS_NONE;
+}
+
+// the receiver side: sets up the codec of the connection and answers
+int answerHello(int fd, const char* payload, size_t length, codec_t* codec) {
+	hello_t hello;
+	if (length < sizeof(hello_t)) {
+		error = "Invalid hello.";
+		return -1;
+	}
+	memcpy(&hello, payload, sizeof(hello_t));
+	if (hello.version != HELLO_VERSION) {
+		error = "Unsupported hello version.";
+		return -1;
+	}
+	compression_t chosen = negotiateCompression(hello.compressions, hello.preferred);
+	codecDestroy(codec);
+	if (codecInit(codec, chosen, payload + sizeof(hello_t), length - sizeof(hello_t)) < 0)
+		return -1;
+	hello_t answer = {.version = HELLO_VERSION, .compressions = COMPRESS_MASK(chosen), .preferred = chosen};
+	return writeFrame(fd, FRAME_HELLO, &answer, sizeof(hello_t));
+}
+
+/*
+ * Inflates the payload of a FRAME_COMPRESSED frame into the buffer, which
+ * grows as needed. Returns the length of the payload or -1.
+ */
+ssize_t frameDecompress(codec_t* codec, const char* payload, size_t length, char** buffer, size_t* capacity) {
+	uint32_t size;
+	if (codec->compression == COMPRESS_NONE || length < sizeof(uint32_t)) {
+		error = "Unexpected compressed frame.";
+		return -1;
+	}
+	memcpy(&size, payload, sizeof(uint32_t));
+	size = be32toh(size);
+	if (size == 0 || size > FRAME_MAX_LENGTH) {
+		error = "Invalid uncompressed length.";
+		return -1;
+	}
+	if (grow(buffer, capacity, size) < 0)
+		return -1;
+	ssize_t tmp = codecDecompress(codec, payload + sizeof(uint32_t), length - sizeof(uint32_t), *buffer, size);
+	if (tmp < 0)
+		return -1;
+	if ((size_t) tmp != size) {
+		error = "Compressed frame has the wrong length.";
+		return -1;
+	}
+	return size;
+}
+
+void printTransportStats(const transport_t* transport, FILE* file) {
+	const transportStats_t* stats = &(transport->stats);
+	fprintf(file, "link: %s compression, %llu frames (%llu compressed), %llu packets (%llu too long), %llu bytes for %llu bytes of payload",
+		getCompressionName(transport->codec.compression), stats->frames, stats->compressed, stats->packets,
+		stats->dropped, stats->bytes, stats->payload);
+	if (stats->payload > 0)
+		fprintf(file, " (%.1f%%)", 100.0 * stats->bytes / stats->payload);
+	fprintf(file, "\n");
+}
+
+/*
+ * Returns 1 if a valid header was decoded, 0 if the buffer is too short and
+ * -1 if the header is invalid.
+ */
+int frameDecodeHeader(const char* buffer, size_t length, frameHeader_t* header) {
+	if (length < FRAME_HEADER_SIZE)
+		return 0;
+	memcpy(header, buffer, FRAME_HEADER_SIZE);
+	header->length = be32toh(header->length);
+	header->count = be16toh(header->count);
+	if (header->length > FRAME_MAX_LENGTH) {
+		error = "Frame too long.";
+		return -1;
+	}
+	if (header->type != FRAME_PACKETS && header->type != FRAME_HEARTBEAT && header->type != FRAME_HELLO) {
+		error = "Unknown frame type.";
+		return -1;
+	}
+	return 1;
+}
+
+int frameReaderInit(frameReader_t* reader, size_t capacity) {
+	reader->buffer = malloc(capacity);
+	if (reader->buffer == NULL) {
+		libfail();
+		return -1;
+	}
+	reader->capacity = capacity;
+	reader->start = 0;
+	reader->end = 0;
+	return 0;
+}
+
+void frameReaderDestroy(frameReader_t* reader) {
+	free(reader->buffer);
+	reader->buffer = NULL;
+}
+
+static int reserve(frameReader_t* reader, size_t needed) {
+	if (reader->start > 0 && reader->capacity - reader->end < needed) {
+		memmove(reader->buffer, reader->buffer + reader->start, reader->end - reader->start);
+		reader->end -= reader->start;
+		reader->start = 0;
+	}
+	if (reader->capacity - reader->end >= needed)
+		return 0;
+	size_t capacity = reader->capacity * 2;
+	while (capacity - reader->end < needed)
+		capacity *= 2;
+	char* tmp = realloc(reader->buffer, capacity);
+	if (tmp == NULL) {
+		libfail();
+		return -1;
+	}
+	reader->buffer = tmp;
+	reader->capacity = capacity;
+	return 0;
+}
+
+/*
+ * Reads what is available. Returns the number of bytes read, 0 on end of
+ * file and -1 on errors (errno is EAGAIN if nothing was there).
+ */
+ssize_t frameReaderFill(frameReader_t* reader, int fd) {
+	if (reader->start == reader->end) {
+		reader->start = 0;
+		reader->end = 0;
+	}
+	if (reader->end == reader->capacity && reserve(reader, reader->capacity / 2) < 0)
+		return -1;
+	for (;;) {
+		ssize_t n = read(fd, reader->buffer + reader->end, reader->capacity - reader->end);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				libfail();
+			return -1;
+		}
+		reader->end += n;
+		return n;
+	}
+}
+
+/*
+ * Takes the next complete frame out of the reader. The payload stays valid
+ * until the next call to frameReaderFill or frameReaderNext. Returns 1 for
+ * a frame, 0 if more data is needed and -1 if the stream is corrupt.
+ */
+int frameReaderNext(frameReader_t* reader, frameHeader_t* header, const char** payload) {
+	size_t available = reader->end - reader->start;
+	int tmp = frameDecodeHeader(reader->buffer + reader->start, available, header);
+	if (tmp <= 0)
+		return tmp;
+	size_t total = FRAME_HEADER_SIZE + header->length;
+	if (available < total) {
+		if (reserve(reader, total - available) < 0)
+			return -1;
+		return 0;
+	}
+	*payload = reader->buffer + reader->start + FRAME_HEADER_SIZE;
+	reader->start += total;
+	return 1;
+}
+
+/*
+ * Receives up to max datagrams with one recvmmsg, each into its own slot of
+ * size bytes. Returns the number of datagrams and their lengths.
+ */
+ssize_t receiveDatagrams(int fd, char* buffer, size_t size, size_t* lengths, size_t max) {
+	if (max > TRANSPORT_BATCH)
+		max = TRANSPORT_BATCH;
+	struct mmsghdr messages[TRANSPORT_BATCH];
+	struct iovec iov[TRANSPORT_BATCH];
+	for (size_t i = 0; i < max; i++) {
+		iov[i] = (struct iovec) {buffer + i * size, size};
+		memset(&(messages[i]), 0, sizeof(struct mmsghdr));
+		messages[i].msg_hdr.msg_iov = &(iov[i]);
+		messages[i].msg_hdr.msg_iovlen = 1;
+	}
+	int n;
+	do {
+		n = recvmmsg(fd, messages, max, MSG_WAITFORONE, NULL);
+	} while (n < 0 && errno == EINTR);
+	if (n < 0) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			libfail();
+		return -1;
+	}
+	for (int i = 0; i < n; i++)
+		lengths[i] = messages[i].msg_len;
+	return n;
+}
@@ -0,0 +1,142 @@
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include "packet.h"
+#include "wire.h"
+#include "spool.h"
+#include "compress.h"
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+/*
+ * Framing between transmitter and receiver. Every frame starts with a fixed
+ * header (big endian) followed by length bytes of payload. A PACKETS frame
+ * carries count packets in the wire format back to back.
+ *
+ * In stream mode many packets are coalesced into one frame and written with
+ * as few writev calls as possible. In datagram mode every packet is its own
+ * one-packet frame and a whole batch goes out with one sendmmsg.
+ *
+ * A stream starts with a HELLO frame from the transmitter that offers the
+ * compressions it supports and carries the dictionary; the receiver picks
+ * one and answers with a HELLO of its own. Payloads of frames flagged
+ * FRAME_COMPRESSED start with their uncompressed length (32 bits).
+ */
+
+#define FRAME_PACKETS 1
+#define FRAME_HEARTBEAT 2
+#define FRAME_HELLO 3
+
+#define FRAME_DELAYED 0x01 // flag: the packets were replayed from the spool
+#define FRAME_COMPRESSED 0x02
+
+#define FRAME_MAX_LENGTH (16 << 20)
+#define FRAME_MAX_COUNT 0xffff
+#define DATAGRAM_MAX_LENGTH 65507
+
+typedef struct __attribute__((packed)) {
+	uint32_t length; // payload bytes
+	uint8_t type;
+	uint8_t flags;
+	uint16_t count;
+} frameHeader_t;
+
+#define FRAME_HEADER_SIZE sizeof(frameHeader_t)
+
+#define HELLO_VERSION 1
+#define HELLO_TIMEOUT 5000 // ms
+
+typedef struct __attribute__((packed)) {
+	uint8_t version;
+	uint8_t compressions; // COMPRESS_MASK bits; the answer has only the chosen one
+	uint8_t preferred;
+} hello_t; // followed by the dictionary
+
+typedef enum {
+	STREAM,
+	DATAGRAM
+} transportMode_t;
+
+#define TRANSPORT_BATCH 256
+#define TRANSPORT_FLUSH_BYTES (64 << 10)
+#define TRANSPORT_FLUSH_LATENCY 50 // ms
+
+typedef struct {
+	unsigned long long frames;
+	unsigned long long packets;
+	unsigned long long bytes;
+	unsigned long long syscalls;
+	unsigned long long compressed; // frames
+	unsigned long long payload; // bytes before compression
+	unsigned long long dropped; // packets too long to ever be sent
+} transportStats_t;
+
+typedef struct {
+	int fd;
+	transportMode_t mode;
+	size_t flushBytes; // flush once this many bytes are pending
+	unsigned long long flushLatency; // ns a packet may wait for more packets
+
+	packet_t batch[TRANSPORT_BATCH];
+	size_t count;
+	size_t bytes;
+	unsigned long long oldest; // relative time the first pending packet was taken
+
+	codec_t codec; // negotiated by the HELLO exchange
+	char* hello; // the HELLO while its answer is outstanding, NULL otherwise
+	size_t dictionarySize;
+	char answer[FRAME_HEADER_SIZE + sizeof(hello_t)];
+	size_t answered;
+	unsigned long long helloDeadline; // relative time
+	char* plain; // payload of the frame being compressed
+	size_t plainCapacity;
+	char* packed;
+	size_t packedCapacity;
+
+	transportStats_t stats;
+} transport_t;
+
+void transportInit(transport_t*, int, transportMode_t, size_t, unsigned long);
+void transportConnect(transport_t*, int);
+void transportDestroy(transport_t*);
+int transportHandshake(transport_t*, compression_t);
+int transportOfferHello(transport_t*, compression_t);
+int transportAwaitHello(transport_t*, int);
+void printTransportStats(const transport_t*, FILE*);
+
+size_t transportSendPackets(transport_t*, packet_t*, size_t);
+ssize_t transportPump(transport_t*);
+int transportFlush(transport_t*);
+
+int transportSpill(transport_t*, spool_t*);
+ssize_t transportReplay(transport_t*, spool_t*);
+
+int writeFrame(int, uint8_t, const void*, size_t);
+compression_t negotiateCompression(int, compression_t);
+int answerHello(int, const char*, size_t, codec_t*);
+ssize_t frameDecompress(codec_t*, const char*, size_t, char**, size_t*);
+
+/*
+ * Incremental reader for stream mode: feed it whatever arrived and take
+ * complete frames out of it.
+ */
+typedef struct {
+	char* buffer;
+	size_t capacity;
+	size_t start; // first unconsumed byte
+	size_t end; // end of the received data
+} frameReader_t;
+
+int frameReaderInit(frameReader_t*, size_t);
+void frameReaderDestroy(frameReader_t*);
+ssize_t frameReaderFill(frameReader_t*, int);
+int frameReaderNext(frameReader_t*, frameHeader_t*, const char**);
+
+int frameDecodeHeader(const char*, size_t, frameHeader_t*);
+ssize_t receiveDatagrams(int, char*, size_t, size_t*, size_t);
+
+#endif
@@ -3,4 +3,18 @@
 
 #define lambda(r, f) ({r __fn__ f __fn__; })
 
+#ifdef __linux__
+	#include <endian.h>
+#endif
+#ifdef __MACH__
+	#include <machine/endian.h>
+
+	#define htobe16(x) htons(x)
+	#define htobe32(x) htonl(x)
+	#define htobe64(x) htonll(x)
+	#define be16toh(x) ntohs(x)
+	#define be32toh(x) ntohl(x)
+	#define be64toh(x) ntohll(x)
+#endif
+
 #endif
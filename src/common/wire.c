@@ -0,0 +1,225 @@
+#define _GNU_SOURCE
+
+#include "wire.h"
+#include "error.h"
+#include "utils.h"
+#include "registry.h"
+
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/socket.h>
+
+// names of registered agents never go away, so in-flight packets always have one
+static inline const char* nameOf(const packet_t* packet) {
+	const char* name = getAgentName(packet->agent);
+	return name != NULL ? name : "";
+}
+
+size_t wireLength(const packet_t* packet) {
+	return WIRE_HEADER_SIZE + strlen(nameOf(packet)) + 1 + packet->size + packet->messageLength;
+}
+
+size_t wireEncode(const packet_t* packet, wireFrame_t* frame) {
+	const char* name = nameOf(packet);
+	size_t nameLength = strlen(name) + 1;
+
+	frame->header.version = WIRE_VERSION;
+	frame->header.data = packet->data;
+	frame->header.type = packet->type;
+	frame->header.class = packet->class;
+	frame->header.nameLength = htobe32(nameLength);
+	frame->header.time = htobe64(packet->time);
+	frame->header.size = htobe32(packet->size);
+	frame->header.messageLength = htobe32(packet->messageLength);
+
+	frame->count = 0;
+	frame->iov[frame->count++] = (struct iovec) {&(frame->header), WIRE_HEADER_SIZE};
+	frame->iov[frame->count++] = (struct iovec) {(void*) name, nameLength};
+
+	if (packet->size > 0) {
+		void* data = getPacketData(packet);
+		if (packet->type == INT) {
+			uint32_t tmp;
+			memcpy(&tmp, &(packet->value.integer), sizeof(uint32_t));
+			tmp = htobe32(tmp);
+			memcpy(&(frame->value), &tmp, sizeof(uint32_t));
+			data = &(frame->value);
+		} else if (packet->type == DOUBLE) {
+			memcpy(&(frame->value), &(packet->value.real), sizeof(uint64_t));
+			frame->value = htobe64(frame->value);
+			data = &(frame->value);
+		}
+		frame->iov[frame->count++] = (struct iovec) {data, packet->size};
+	}
+	if (packet->messageLength > 0)
+		frame->iov[frame->count++] = (struct iovec) {packet->message, packet->messageLength};
+
+	frame->length = WIRE_HEADER_SIZE + nameLength + packet->size + packet->messageLength;
+	return frame->length;
+}
+
+// writes the whole iovec array, continuing after short writes
+static ssize_t writeFully(int fd, struct iovec* iov, int count, size_t length, int flags, bool isSocket) {
+	size_t written = 0;
+	while (written < length) {
+		int chunk = count > IOV_MAX ? IOV_MAX : count;
+		ssize_t n;
+		if (isSocket) {
+			struct msghdr message = {.msg_iov = iov, .msg_iovlen = chunk};
+			n = sendmsg(fd, &message, flags);
+		} else {
+			n = writev(fd, iov, chunk);
+		}
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			libfail();
+			return -1;
+		}
+		written += n;
+		while (count > 0 && (size_t) n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			count--;
+		}
+		if (count > 0) {
+			iov->iov_base = (char*) iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	return written;
+}
+
+// the socket variant of writev, modifies the iovec array
+ssize_t sendIovecs(int fd, struct iovec* iov, int count, size_t length) {
+	return writeFully(fd, iov, count, length, MSG_NOSIGNAL, true);
+}
+
+ssize_t wireWrite(int fd, const packet_t* packet) {
+	wireFrame_t frame;
+	size_t length = wireEncode(packet, &frame);
+	return writeFully(fd, frame.iov, frame.count, length, 0, false);
+}
+
+ssize_t wireSend(int fd, const packet_t* packet, int flags) {
+	wireFrame_t frame;
+	size_t length = wireEncode(packet, &frame);
+	return writeFully(fd, frame.iov, frame.count, length, flags | MSG_NOSIGNAL, true);
+}
+
+// exactly one '\0', at the end
+bool isTerminated(const char* string, size_t length) {
+	return length > 0 && string[length - 1] == '\0' && memchr(string, '\0', length) == string + length - 1;
+}
+
+bool isValidClass(class_t class) {
+	switch (class) {
+		case META:
+		case INFO:
+		case WARNING:
+		case ALARM:
+		case ERROR:
+		case EMERGENCY:
+			return true;
+		default:
+			return false;
+	}
+}
+
+/*
+ * Returns the number of bytes consumed, 0 if the buffer does not yet hold
+ * the whole packet and -1 if it is malformed.
+ */
+ssize_t wireDecode(const char* buffer, size_t length, wirePacket_t* decoded) {
+	if (length < WIRE_HEADER_SIZE)
+		return 0;
+
+	wireHeader_t header;
+	memcpy(&header, buffer, WIRE_HEADER_SIZE);
+	if (header.version != WIRE_VERSION) {
+		error = "Unsupported wire version.";
+		return -1;
+	}
+	size_t nameLength = be32toh(header.nameLength);
+	size_t size = be32toh(header.size);
+	size_t messageLength = be32toh(header.messageLength);
+	if (nameLength > WIRE_MAX_FIELD || size > WIRE_MAX_FIELD || messageLength > WIRE_MAX_FIELD) {
+		error = "Wire field too long.";
+		return -1;
+	}
+	if (header.data > PROPERTY || header.type > STRING || !isValidClass(header.class)) {
+		error = "Invalid packet header.";
+		return -1;
+	}
+
+	size_t total = WIRE_HEADER_SIZE + nameLength + size + messageLength;
+	if (length < total)
+		return 0;
+
+	const char* name = buffer + WIRE_HEADER_SIZE;
+	const char* data = name + nameLength;
+	const char* message = data + size;
+	if (!isTerminated(name, nameLength)) {
+		error = "Invalid agent name.";
+		return -1;
+	}
+	if (messageLength > 0 && !isTerminated(message, messageLength)) {
+		error = "Invalid message.";
+		return -1;
+	}
+
+	packet_t* packet = &(decoded->packet);
+	decoded->name = name;
+	packet->agent = NO_AGENT;
+	packet->status = CREATED;
+	packet->data = header.data;
+	packet->type = header.type;
+	packet->class = header.class;
+	packet->time = be64toh(header.time);
+	packet->size = size;
+	packet->messageLength = messageLength;
+	packet->message = messageLength > 0 ? (char*) message : NULL;
+	packet->value.string = NULL;
+
+	switch (header.type) {
+		case VOID:
+			if (size != 0) {
+				error = "Void packet with data.";
+				return -1;
+			}
+			break;
+		case INT: {
+			if (size != sizeof(int32_t)) {
+				error = "Invalid int size.";
+				return -1;
+			}
+			uint32_t tmp;
+			memcpy(&tmp, data, sizeof(uint32_t));
+			tmp = be32toh(tmp);
+			memcpy(&(packet->value.integer), &tmp, sizeof(uint32_t));
+			break;
+		}
+		case DOUBLE: {
+			if (size != sizeof(double)) {
+				error = "Invalid double size.";
+				return -1;
+			}
+			uint64_t tmp;
+			memcpy(&tmp, data, sizeof(uint64_t));
+			tmp = be64toh(tmp);
+			memcpy(&(packet->value.real), &tmp, sizeof(uint64_t));
+			break;
+		}
+		case STRING:
+			if (!isTerminated(data, size)) {
+				error = "Invalid string data.";
+				return -1;
+			}
+			packet->value.string = (char*) data;
+			break;
+	}
+	return total;
+}
@@ -0,0 +1,72 @@
+#ifndef WIRE_H
+#define WIRE_H
+
+#include "packet.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/*
+ * Wire format of a packet (all integers big endian):
+ *
+ *   header (fixed, WIRE_HEADER_SIZE bytes)
+ *   agent name      (nameLength bytes, including '\0')
+ *   data            (size bytes, INT and DOUBLE in network byte order)
+ *   message         (messageLength bytes, including '\0', may be empty)
+ *
+ * The encoder only fills the header on the stack and points an iovec array
+ * at the buffers the packet already owns, so nothing is copied before the
+ * kernel does it.
+ */
+
+#define WIRE_VERSION 1
+#define WIRE_MAX_FIELD (1 << 20)
+
+typedef struct __attribute__((packed)) {
+	uint8_t version;
+	data_t data;
+	type_t type;
+	class_t class;
+	uint32_t nameLength;
+	uint64_t time; // ms
+	uint32_t size;
+	uint32_t messageLength;
+} wireHeader_t;
+
+#define WIRE_HEADER_SIZE sizeof(wireHeader_t)
+#define WIRE_IOVECS 4
+
+typedef struct {
+	wireHeader_t header;
+	uint64_t value; // INT and DOUBLE values converted to network byte order
+	struct iovec iov[WIRE_IOVECS];
+	int count;
+	size_t length;
+} wireFrame_t;
+
+/*
+ * A decoded packet. The receiver has no registry ids for the agents of a
+ * transmitter, so the packet has agent NO_AGENT and the name comes along.
+ * Name, string data and message point into the decoded buffer, which may
+ * not move while the packet is in use. The packet does not own them, so it
+ * must not be destroyed.
+ */
+typedef struct {
+	packet_t packet;
+	const char* name;
+} wirePacket_t;
+
+size_t wireLength(const packet_t*);
+size_t wireEncode(const packet_t*, wireFrame_t*);
+ssize_t wireWrite(int, const packet_t*);
+ssize_t wireSend(int, const packet_t*, int);
+ssize_t sendIovecs(int, struct iovec*, int, size_t);
+
+ssize_t wireDecode(const char*, size_t, wirePacket_t*);
+bool isTerminated(const char*, size_t);
+bool isValidClass(class_t);
+
+#endif
@@ -0,0 +1,190 @@
+#include "worker.h"
+#include "error.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define INITIAL_CAPACITY 64
+
+static _Thread_local worker_t* currentWorker = NULL;
+
+size_t getCoreCount() {
+	long cores = sysconf(_SC_NPROCESSORS_ONLN);
+	return cores < 1 ? 1 : cores;
+}
+
+// lock of the worker has to be held
+static bool pushJob(worker_t* worker, job_t job) {
+	if (worker->tail - worker->head == worker->capacity) {
+		size_t capacity = worker->capacity * 2;
+		job_t* jobs = malloc(capacity * sizeof(job_t));
+		if (jobs == NULL)
+			return false;
+		for (size_t i = worker->head; i != worker->tail; i++)
+			jobs[i & (capacity - 1)] = worker->jobs[i & (worker->capacity - 1)];
+		free(worker->jobs);
+		worker->jobs = jobs;
+		worker->capacity = capacity;
+	}
+	worker->jobs[worker->tail++ & (worker->capacity - 1)] = job;
+	return true;
+}
+
+static bool takeOwn(worker_t* worker, job_t* job) {
+	bool result = false;
+	pthread_mutex_lock(&(worker->lock));
+	if (worker->tail != worker->head) {
+		*job = worker->jobs[--worker->tail & (worker->capacity - 1)];
+		result = true;
+	}
+	pthread_mutex_unlock(&(worker->lock));
+	return result;
+}
+
+static bool steal(worker_t* victim, job_t* job) {
+	if (pthread_mutex_trylock(&(victim->lock)) != 0)
+		return false;
+	bool result = false;
+	if (victim->tail != victim->head) {
+		*job = victim->jobs[victim->head++ & (victim->capacity - 1)];
+		result = true;
+	}
+	pthread_mutex_unlock(&(victim->lock));
+	return result;
+}
+
+static bool findJob(worker_t* worker, job_t* job) {
+	if (takeOwn(worker, job))
+		return true;
+	pool_t* pool = worker->pool;
+	size_t self = worker - pool->workers;
+	for (size_t i = 1; i < pool->count; i++) {
+		if (steal(&(pool->workers[(self + i) % pool->count]), job)) {
+			worker->stolen++;
+			return true;
+		}
+	}
+	return false;
+}
+
+static void* workerThread(void* argument) {
+	worker_t* worker = argument;
+	pool_t* pool = worker->pool;
+	currentWorker = worker;
+
+	for (;;) {
+		job_t job;
+		if (findJob(worker, &job)) {
+			atomic_fetch_sub(&(pool->pending), 1);
+			job.function(job.argument);
+			worker->executed++;
+			continue;
+		}
+
+		pthread_mutex_lock(&(pool->sleepLock));
+		atomic_fetch_add(&(pool->sleeping), 1);
+		// a job may be pending in a deque that was locked while we looked
+		if (atomic_load(&(pool->pending)) == 0) {
+			if (atomic_load(&(pool->stop))) {
+				atomic_fetch_sub(&(pool->sleeping), 1);
+				pthread_mutex_unlock(&(pool->sleepLock));
+				break;
+			}
+			pthread_cond_wait(&(pool->wake), &(pool->sleepLock));
+		}
+		atomic_fetch_sub(&(pool->sleeping), 1);
+		pthread_mutex_unlock(&(pool->sleepLock));
+	}
+	currentWorker = NULL;
+	return NULL;
+}
+
+int poolInit(pool_t* pool, size_t count) {
+	if (count == 0)
+		count = getCoreCount();
+
+	pool->workers = calloc(count, sizeof(worker_t));
+	if (pool->workers == NULL) {
+		libfail();
+		return -1;
+	}
+	pool->count = count;
+	atomic_init(&(pool->next), 0);
+	atomic_init(&(pool->pending), 0);
+	atomic_init(&(pool->sleeping), 0);
+	atomic_init(&(pool->stop), false);
+	pthread_mutex_init(&(pool->sleepLock), NULL);
+	pthread_cond_init(&(pool->wake), NULL);
+
+	for (size_t i = 0; i < count; i++) {
+		worker_t* worker = &(pool->workers[i]);
+		worker->pool = pool;
+		worker->capacity = INITIAL_CAPACITY;
+		worker->jobs = malloc(INITIAL_CAPACITY * sizeof(job_t));
+		if (worker->jobs == NULL) {
+			libfail();
+			return -1;
+		}
+		pthread_mutex_init(&(worker->lock), NULL);
+	}
+	for (size_t i = 0; i < count; i++) {
+		int tmp = pthread_create(&(pool->workers[i].thread), NULL, workerThread, &(pool->workers[i]));
+		if (tmp != 0) {
+			error = strerror(tmp);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+void poolDestroy(pool_t* pool) {
+	pthread_mutex_lock(&(pool->sleepLock));
+	atomic_store(&(pool->stop), true);
+	pthread_cond_broadcast(&(pool->wake));
+	pthread_mutex_unlock(&(pool->sleepLock));
+
+	for (size_t i = 0; i < pool->count; i++)
+		pthread_join(pool->workers[i].thread, NULL);
+	for (size_t i = 0; i < pool->count; i++) {
+		pthread_mutex_destroy(&(pool->workers[i].lock));
+		free(pool->workers[i].jobs);
+	}
+	free(pool->workers);
+	pool->workers = NULL;
+	pthread_mutex_destroy(&(pool->sleepLock));
+	pthread_cond_destroy(&(pool->wake));
+}
+
+bool poolSubmit(pool_t* pool, void (*function)(void*), void* argument) {
+	if (atomic_load(&(pool->stop))) {
+		error = "Worker pool is stopped.";
+		return false;
+	}
+
+	worker_t* worker = currentWorker;
+	if (worker == NULL || worker->pool != pool)
+		worker = &(pool->workers[atomic_fetch_add_explicit(&(pool->next), 1, memory_order_relaxed) % pool->count]);
+
+	// counted first, so a worker never sees a job that is not pending
+	atomic_fetch_add(&(pool->pending), 1);
+	pthread_mutex_lock(&(worker->lock));
+	bool result = pushJob(worker, (job_t) {.function = function, .argument = argument});
+	pthread_mutex_unlock(&(worker->lock));
+	if (!result) {
+		atomic_fetch_sub(&(pool->pending), 1);
+		libfail();
+		return false;
+	}
+
+	if (atomic_load(&(pool->sleeping)) > 0) {
+		pthread_mutex_lock(&(pool->sleepLock));
+		pthread_cond_signal(&(pool->wake));
+		pthread_mutex_unlock(&(pool->sleepLock));
+	}
+	return true;
+}
+
+size_t poolPending(pool_t* pool) {
+	return atomic_load_explicit(&(pool->pending), memory_order_relaxed);
+}
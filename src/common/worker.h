@@ -0,0 +1,54 @@
+#ifndef WORKER_H
+#define WORKER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+/*
+ * Fixed pool of worker threads with one deque per worker. Jobs submitted
+ * from a worker go to its own deque (taken LIFO by the owner), other
+ * submissions are spread round robin. Idle workers steal the oldest job of
+ * another worker before they go to sleep.
+ */
+
+typedef struct {
+	void (*function)(void*);
+	void* argument;
+} job_t;
+
+struct pool;
+
+typedef struct {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	job_t* jobs;
+	size_t capacity; // power of two
+	size_t head; // oldest job, taken by thieves
+	size_t tail; // newest job, taken by the owner
+	struct pool* pool;
+	unsigned long long executed;
+	unsigned long long stolen;
+} worker_t;
+
+typedef struct pool {
+	worker_t* workers;
+	size_t count;
+	atomic_size_t next;
+	atomic_size_t pending;
+	atomic_size_t sleeping;
+	atomic_bool stop;
+	pthread_mutex_t sleepLock;
+	pthread_cond_t wake;
+} pool_t;
+
+int poolInit(pool_t*, size_t);
+void poolDestroy(pool_t*);
+
+bool poolSubmit(pool_t*, void (*)(void*), void*);
+size_t poolPending(pool_t*);
+
+size_t getCoreCount(void);
+
+#endif
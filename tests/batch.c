@@ -0,0 +1,170 @@
+#include "tests.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <batch.h>
+#include <registry.h>
+#include <error.h>
+
+#define AGENTS 8
+#define PACKETS 5000
+#define MUTATIONS 20000
+
+static uint64_t state = 0x9E3779B97F4A7C15ull;
+
+static uint64_t nextRandom() {
+	state ^= state << 13;
+	state ^= state >> 7;
+	state ^= state << 17;
+	return state;
+}
+
+static agent_t agents[AGENTS];
+static uint32_t ids[AGENTS];
+static char names[AGENTS][16];
+static char texts[PACKETS][16];
+static packet_t packets[PACKETS];
+static wirePacket_t decoded[PACKETS];
+
+static const class_t classes[] = {META, INFO, WARNING, ALARM, ERROR, EMERGENCY};
+
+/*
+ * Periodic samples with some jitter, slowly moving values, now and then a
+ * message, a class change or a random value, so every encoding path runs.
+ */
+static void makePackets() {
+	for (int i = 0; i < AGENTS; i++) {
+		snprintf(names[i], sizeof(names[i]), "batch-%d", i);
+		memset(&(agents[i]), 0, sizeof(agent_t));
+		agents[i].name = names[i];
+		agents[i].data = DATA_VALUE;
+		agents[i].type = i % (STRING + 1);
+		ids[i] = registerAgent(&(agents[i]));
+	}
+	for (int i = 0; i < PACKETS; i++) {
+		int index = nextRandom() % AGENTS;
+		packet_t* packet = &(packets[i]);
+		memset(packet, 0, sizeof(packet_t));
+		packet->agent = ids[index];
+		packet->data = agents[index].data;
+		packet->type = agents[index].type;
+		packet->class = nextRandom() % 8 == 0 ? classes[nextRandom() % 6] : INFO;
+		packet->time = 1700000000000ull + i * 1000ull + (nextRandom() % 4 == 0 ? nextRandom() % 50 : 0);
+		if (nextRandom() % 16 == 0)
+			packet->time = nextRandom();
+		snprintf(texts[i], sizeof(texts[i]), "%d", (int) (nextRandom() % 100000));
+		if (nextRandom() % 4 == 0) {
+			packet->message = texts[i];
+			packet->messageLength = strlen(texts[i]) + 1;
+		}
+		switch (packet->type) {
+			case INT:
+				packet->size = sizeof(int32_t);
+				packet->value.integer = nextRandom() % 8 == 0 ? (int32_t) nextRandom() : i / 10;
+				break;
+			case DOUBLE: {
+				packet->size = sizeof(double);
+				packet->value.real = i / 100 * 0.25;
+				if (nextRandom() % 8 == 0) {
+					uint64_t bits = nextRandom();
+					memcpy(&(packet->value.real), &bits, sizeof(double));
+				}
+				break;
+			}
+			case STRING:
+				packet->value.string = texts[i];
+				packet->size = strlen(texts[i]) + 1;
+				break;
+		}
+	}
+}
+
+static bool equals(const packet_t* a, const wirePacket_t* decoded) {
+	const packet_t* b = &(decoded->packet);
+	return strcmp(getAgentName(a->agent), decoded->name) == 0 && a->data == b->data && a->type == b->type
+		&& a->class == b->class && a->time == b->time && a->size == b->size
+		&& (a->size == 0 || memcmp(getPacketData(a), getPacketData(b), a->size) == 0)
+		&& a->messageLength == b->messageLength && (a->messageLength == 0 || strcmp(a->message, b->message) == 0);
+}
+
+static bool roundTrip(batch_t* batch) {
+	printf("%sRound trip of %d packets of %d agents.\n", SUBSPACING, PACKETS, AGENTS);
+	if (batchEncode(batch, packets, PACKETS) < 0) {
+		printf("%s%sError: %s\n", SUBSPACING, SUBSPACING, error);
+		return false;
+	}
+	ssize_t count = batchDecode(batch->buffer, batch->length, decoded, PACKETS);
+	if (count != PACKETS) {
+		printf("%s%sError: decoded %zd packets (%s).\n", SUBSPACING, SUBSPACING, count, count < 0 ? error : "");
+		return false;
+	}
+	// grouped by agent, but in order within an agent
+	int next[AGENTS] = {0};
+	for (int i = 0; i < PACKETS; i++) {
+		int index = 0;
+		while (index < AGENTS && strcmp(names[index], decoded[i].name) != 0)
+			index++;
+		if (index == AGENTS) {
+			printf("%s%sError: unknown agent '%s'.\n", SUBSPACING, SUBSPACING, decoded[i].name);
+			return false;
+		}
+		while (packets[next[index]].agent != ids[index])
+			next[index]++;
+		if (!equals(&(packets[next[index]]), &(decoded[i]))) {
+			printf("%s%sError: packet %d differs after round trip.\n", SUBSPACING, SUBSPACING, next[index]);
+			return false;
+		}
+		next[index]++;
+	}
+	if (batchDecode(batch->buffer, batch->length, decoded, PACKETS - 1) >= 0
+			|| batchDecode(batch->buffer, batch->length - 1, decoded, PACKETS) >= 0) {
+		printf("%s%sError: short space or buffer not detected.\n", SUBSPACING, SUBSPACING);
+		return false;
+	}
+	if (batchEncode(batch, packets, 0) < 0 || batchDecode(batch->buffer, batch->length, decoded, 0) != 0) {
+		printf("%s%sError: empty batch.\n", SUBSPACING, SUBSPACING);
+		return false;
+	}
+	return true;
+}
+
+// must never read outside the buffer, the sanitizers tell
+static bool mutations(batch_t* batch) {
+	printf("%sDecoding %d mutated batches.\n", SUBSPACING, MUTATIONS);
+	static char buffer[4096];
+	for (int i = 0; i < MUTATIONS; i++) {
+		size_t offset = nextRandom() % (PACKETS - 32);
+		if (batchEncode(batch, packets + offset, 1 + nextRandom() % 32) < 0 || batch->length > sizeof(buffer)) {
+			printf("%s%sError: batch not encoded.\n", SUBSPACING, SUBSPACING);
+			return false;
+		}
+		size_t length = batch->length;
+		memcpy(buffer, batch->buffer, length);
+		for (int j = 1 + nextRandom() % 4; j > 0; j--)
+			buffer[nextRandom() % length] ^= 1 << (nextRandom() % 8);
+		if (nextRandom() % 2)
+			length = nextRandom() % length;
+		ssize_t count = batchDecode(buffer, length, decoded, 32);
+		for (ssize_t j = 0; j < count; j++) {
+			const char* end = buffer + length;
+			if (decoded[j].name < buffer || decoded[j].name + strlen(decoded[j].name) >= end) {
+				printf("%s%sError: name outside the buffer.\n", SUBSPACING, SUBSPACING);
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+bool batch() {
+	batch_t batch;
+	batchInit(&batch);
+	makePackets();
+	bool result = roundTrip(&batch) && mutations(&batch);
+	batchDestroy(&batch);
+	return result;
+}
@@ -0,0 +1,62 @@
+#include "tests.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <clock.h>
+#include <timer.h>
+#include <error.h>
+
+#define TOLERANCE (20*1000*1000) // 20ms, a coarse tick is at most 10ms
+
+static void idle() {
+}
+
+static bool near(clockSource_t source) {
+	unsigned long long precise = getClockTime(CLOCK_SOURCE_PRECISE);
+	unsigned long long value = getClockTime(source);
+	long long diff = value - precise;
+	if (llabs(diff) > TOLERANCE) {
+		printf("%s%sError: %s is %lld ns off.\n", SUBSPACING, SUBSPACING, getClockSourceName(source), diff);
+		return false;
+	}
+	return true;
+}
+
+bool clockSources() {
+	printf("%sComparing the sources to the precise clock.\n", SUBSPACING);
+	for (clockSource_t source = 0; source < CLOCK_SOURCES; source++) {
+		printf("%s%s%s%s\n", SUBSPACING, SUBSPACING, getClockSourceName(source),
+			hasClockSource(source) ? "" : " (fallback)");
+		if (!near(source))
+			return false;
+	}
+	// the times were ns * 10^9 in 32 bits once
+	if (getClockTimeMs(CLOCK_SOURCE_PRECISE) < 1000000000000ull || getRealTime() < 1000000000000000000ull) {
+		printf("%s%sError: the time overflows.\n", SUBSPACING, SUBSPACING);
+		return false;
+	}
+
+	printf("%sTicking the cached clock.\n", SUBSPACING);
+	timerid_t timer = createTimer(idle);
+	if (timer == NO_TIMER || startInterval(timer, 1000) < 0) {
+		printf("%s%sError: %s\n", SUBSPACING, SUBSPACING, error);
+		return false;
+	}
+	usleep(10 * 1000);
+	bool result = hasClockSource(CLOCK_SOURCE_CACHED) && near(CLOCK_SOURCE_CACHED);
+	unsigned long long before = getClockTime(CLOCK_SOURCE_CACHED);
+	usleep(10 * 1000);
+	if (result && getClockTime(CLOCK_SOURCE_CACHED) <= before) {
+		printf("%s%sError: the cached clock does not advance.\n", SUBSPACING, SUBSPACING);
+		result = false;
+	}
+	(void) deleteTimer(timer);
+	if (result && hasClockSource(CLOCK_SOURCE_CACHED)) {
+		printf("%s%sError: the cache is still used without a timer.\n", SUBSPACING, SUBSPACING);
+		result = false;
+	}
+	return result;
+}
@@ -0,0 +1,262 @@
+#include "tests.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include <compress.h>
+#include <transport.h>
+#include <registry.h>
+#include <error.h>
+
+#define PACKETS 64
+
+static const char* text = "Value is too high (%v).";
+
+static agent_t agent;
+static uint32_t id;
+
+// several agents with the same template, like a batch of a real transmitter
+static char payload[] =
+	"disk.usage.root\0Value is too high (91).\0disk.usage.home\0Value is too high (93).\0"
+	"disk.usage.var\0Value is too high (97).\0disk.usage.tmp\0Value is too high (92).";
+
+// codecs missing from this build are named, so a build without them shows
+static bool skipped(compression_t compression) {
+	if (getCompressions() & COMPRESS_MASK(compression))
+		return false;
+	printf("%s%sSkipped %s, not in this build.\n", SUBSPACING, SUBSPACING, getCompressionName(compression));
+	return true;
+}
+
+static bool roundTrips() {
+	printf("%sCompressing with and without a dictionary.\n", SUBSPACING);
+	const char* dictionary = "disk.usage.rootdisk.usage.homedisk.usage.varValue is too high (%v).";
+	char packed[1024], unpacked[sizeof(payload)];
+	for (compression_t c = COMPRESS_NONE; c <= COMPRESS_ZSTD; c++) {
+		if (skipped(c))
+			continue;
+		ssize_t sizes[2];
+		for (int withDictionary = 0; withDictionary < 2; withDictionary++) {
+			codec_t codec;
+			if (codecInit(&codec, c, dictionary, withDictionary ? strlen(dictionary) : 0) < 0) {
+				printf("%s%sError: %s\n", SUBSPACING, SUBSPACING, error);
+				return false;
+			}
+			sizes[withDictionary] = codecCompress(&codec, payload, sizeof(payload), packed, sizeof(packed));
+			ssize_t tmp = sizes[withDictionary] < 0 ? -1
+				: codecDecompress(&codec, packed, sizes[withDictionary], unpacked, sizeof(unpacked));
+			bool ok = tmp == sizeof(payload) && memcmp(payload, unpacked, sizeof(payload)) == 0
+				&& (sizes[withDictionary] < 2 || codecDecompress(&codec, packed, sizes[withDictionary] / 2,
+					unpacked, sizeof(unpacked)) != sizeof(payload));
+			codecDestroy(&codec);
+			if (!ok) {
+				printf("%s%sError: %s round trip failed.\n", SUBSPACING, SUBSPACING, getCompressionName(c));
+				return false;
+			}
+		}
+		printf("%s%s%-4s %zu bytes, %zd without and %zd with the dictionary\n", SUBSPACING, SUBSPACING,
+			getCompressionName(c), sizeof(payload), sizes[0], sizes[1]);
+		if (c != COMPRESS_NONE && sizes[1] >= sizes[0]) {
+			printf("%s%sError: the dictionary does not help.\n", SUBSPACING, SUBSPACING);
+			return false;
+		}
+	}
+
+	compression_t compression;
+	if (parseCompression("none", &compression) < 0 || compression != COMPRESS_NONE
+			|| parseCompression("gzip", &compression) == 0) {
+		printf("%s%sError: compression names not parsed.\n", SUBSPACING, SUBSPACING);
+		return false;
+	}
+	return true;
+}
+
+static bool negotiation() {
+	printf("%sNegotiating compressions.\n", SUBSPACING);
+	int all = COMPRESS_MASK(COMPRESS_NONE) | COMPRESS_MASK(COMPRESS_LZ4) | COMPRESS_MASK(COMPRESS_ZSTD);
+	bool lz4 = getCompressions() & COMPRESS_MASK(COMPRESS_LZ4);
+	bool zstd = getCompressions() & COMPRESS_MASK(COMPRESS_ZSTD);
+	const struct {
+		int offered;
+		compression_t preferred;
+		compression_t expected;
+	} cases[] = {
+		{COMPRESS_MASK(COMPRESS_NONE), COMPRESS_NONE, COMPRESS_NONE},
+		{all, COMPRESS_NONE, COMPRESS_NONE},
+		{all, COMPRESS_ZSTD, zstd ? COMPRESS_ZSTD : lz4 ? COMPRESS_LZ4 : COMPRESS_NONE},
+		{all, COMPRESS_LZ4, lz4 ? COMPRESS_LZ4 : zstd ? COMPRESS_ZSTD : COMPRESS_NONE},
+		{COMPRESS_MASK(COMPRESS_ZSTD), COMPRESS_LZ4, zstd ? COMPRESS_ZSTD : COMPRESS_NONE},
+		{all, 77, lz4 ? COMPRESS_LZ4 : zstd ? COMPRESS_ZSTD : COMPRESS_NONE}
+	};
+	for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+		compression_t tmp = negotiateCompression(cases[i].offered, cases[i].preferred);
+		if (tmp != cases[i].expected) {
+			printf("%s%sError: case %zu gave %s instead of %s.\n", SUBSPACING, SUBSPACING, i,
+				getCompressionName(tmp), getCompressionName(cases[i].expected));
+			return false;
+		}
+	}
+	return true;
+}
+
+typedef struct {
+	int fd;
+	size_t received;
+	bool compressed;
+	bool result;
+} receiver_t;
+
+// answers the hello and decodes one frame of packets
+static void* receive(void* argument) {
+	receiver_t* receiver = argument;
+	frameReader_t reader;
+	codec_t codec;
+	memset(&codec, 0, sizeof(codec_t));
+	char* inflated = NULL;
+	size_t capacity = 0;
+	receiver->result = false;
+	if (frameReaderInit(&reader, 1024) < 0)
+		return NULL;
+	int frames = 0;
+	while (frames < 2 && frameReaderFill(&reader, receiver->fd) > 0) {
+		frameHeader_t header;
+		const char* payload;
+		int tmp;
+		while (frames < 2 && (tmp = frameReaderNext(&reader, &header, &payload)) > 0) {
+			frames++;
+			if (header.type == FRAME_HELLO) {
+				if (answerHello(receiver->fd, payload, header.length, &codec) < 0)
+					goto done;
+				continue;
+			}
+			size_t length = header.length;
+			receiver->compressed = header.flags & FRAME_COMPRESSED;
+			if (receiver->compressed) {
+				ssize_t n = frameDecompress(&codec, payload, length, &inflated, &capacity);
+				if (n < 0)
+					goto done;
+				payload = inflated;
+				length = n;
+			}
+			size_t position = 0;
+			for (int i = 0; i < header.count; i++) {
+				wirePacket_t decoded;
+				ssize_t n = wireDecode(payload + position, length - position, &decoded);
+				if (n <= 0 || strcmp(decoded.name, agent.name) != 0 || decoded.packet.value.integer != i
+						|| strcmp(decoded.packet.message, "Value is too high.") != 0)
+					goto done;
+				position += n;
+				receiver->received++;
+			}
+			receiver->result = position == length;
+		}
+		if (tmp < 0)
+			break;
+	}
+done:
+	frameReaderDestroy(&reader);
+	codecDestroy(&codec);
+	free(inflated);
+	return NULL;
+}
+
+static bool handshake() {
+	printf("%sSending compressed frames after the handshake.\n", SUBSPACING);
+	memset(&agent, 0, sizeof(agent_t));
+	agent.name = "compressed.agent";
+	agent.type = INT;
+	agent.data = DATA_VALUE;
+	agent.messages[1] = (message_t) {.text = (char*) text, .class = WARNING};
+	id = registerAgent(&agent);
+
+	static packet_t packets[PACKETS];
+	static char message[] = "Value is too high.";
+	for (int i = 0; i < PACKETS; i++) {
+		memset(&(packets[i]), 0, sizeof(packet_t));
+		packets[i].agent = id;
+		packets[i].data = DATA_VALUE;
+		packets[i].type = INT;
+		packets[i].class = WARNING;
+		packets[i].size = sizeof(int32_t);
+		packets[i].value.integer = i;
+		packets[i].message = message;
+		packets[i].messageLength = sizeof(message);
+	}
+
+	for (compression_t c = COMPRESS_NONE; c <= COMPRESS_ZSTD; c++) {
+		if (skipped(c))
+			continue;
+		int fds[2];
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+			printf("%s%sError: socketpair failed.\n", SUBSPACING, SUBSPACING);
+			return false;
+		}
+		receiver_t receiver = {.fd = fds[1]};
+		pthread_t thread;
+		pthread_create(&thread, NULL, receive, &receiver);
+
+		transport_t* transport = malloc(sizeof(transport_t));
+		transportInit(transport, fds[0], STREAM, 0, 0);
+		bool result = transportHandshake(transport, c) == 0 && transport->codec.compression == c
+			&& transportSendPackets(transport, packets, PACKETS) == PACKETS;
+		if (!result) {
+			printf("%s%sError: %s\n", SUBSPACING, SUBSPACING, error);
+			shutdown(fds[0], SHUT_RDWR);
+		}
+		pthread_join(thread, NULL);
+		close(fds[0]);
+		close(fds[1]);
+
+		if (result && (!receiver.result || receiver.received != PACKETS || receiver.compressed != (c != COMPRESS_NONE)
+				|| (c != COMPRESS_NONE && transport->stats.bytes >= transport->stats.payload / 4))) {
+			printf("%s%sError: %s link received %zu packets.\n", SUBSPACING, SUBSPACING,
+				getCompressionName(c), receiver.received);
+			result = false;
+		}
+		if (result) {
+			printf("%s%s", SUBSPACING, SUBSPACING);
+			printTransportStats(transport, stdout);
+		}
+		transportDestroy(transport);
+		free(transport);
+		if (!result)
+			return false;
+	}
+	return true;
+}
+
+static bool waiting() {
+	printf("%sWaiting for the answer to the hello without blocking.\n", SUBSPACING);
+	int fds[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+		printf("%s%sError: socketpair failed.\n", SUBSPACING, SUBSPACING);
+		return false;
+	}
+	transport_t* transport = malloc(sizeof(transport_t));
+	transportInit(transport, fds[0], STREAM, 0, 0);
+	bool result = transportOfferHello(transport, COMPRESS_NONE) == 0 && transportAwaitHello(transport, 0) == 0;
+	if (!result)
+		printf("%s%sError: the hello was not pending.\n", SUBSPACING, SUBSPACING);
+
+	hello_t answer = {.version = HELLO_VERSION, .compressions = COMPRESS_MASK(COMPRESS_NONE), .preferred = COMPRESS_NONE};
+	if (result && (writeFrame(fds[1], FRAME_HELLO, &answer, sizeof(hello_t)) < 0
+			|| transportAwaitHello(transport, 1000) != 1 || transport->hello != NULL)) {
+		printf("%s%sError: the answer was not taken.\n", SUBSPACING, SUBSPACING);
+		result = false;
+	}
+	transportDestroy(transport);
+	free(transport);
+	close(fds[0]);
+	close(fds[1]);
+	return result;
+}
+
+bool compress() {
+	return roundTrips() && negotiation() && handshake() && waiting();
+}
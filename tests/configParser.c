@@ -7,67 +7,88 @@
 #include <stdlib.h>
 #include <string.h>
 
-#define NUMBER_OF_TESTCASES 15
+#define NUMBER_OF_TESTCASES 21
 struct testcase {
 	const char* config;
 	int success;
 	agent_t result;
 } testcases[NUMBER_OF_TESTCASES];
 
-bool compare (agent_t a1, agent_t a2, char** error) {
+bool compare (agent_t a1, agent_t a2, char** reason) {
 	if ((a1.name == NULL) != (a2.name == NULL)) {
-		*error = "names null";
+		*reason = "names null";
 		return false;
 	}
 	if ((a1.name != a2.name) && strcmp(a1.name, a2.name) != 0) {
-		*error = "names";
+		*reason = "names";
 		return false;
 	}
 	if ((a1.script == NULL) != (a2.script == NULL)) {
-		*error = "scripts null";
+		*reason = "scripts null";
 		return false;
 	}
 	if ((a1.script != a2.script) && strcmp(a1.script, a2.script) != 0) {
-		*error = "scripts";
+		*reason = "scripts";
 		return false;
 	}
 	if (a1.data != a2.data) {
-		*error = "data";
+		*reason = "data";
 		return false;
 	}
 	//printf("%d vs %d\n", a1.type, a2.type);
 	if (a1.type != a2.type) {
-		*error = "types";
+		*reason = "types";
 		return false;
 	}
 	if (a1.lastValue != a2.lastValue) {
-		*error = "last value";
+		*reason = "last value";
 		return false;
 	}
 	if (a1.timing.type != a2.timing.type) {
-		*error = "timing type";
+		*reason = "timing type";
 		return false;
 	}
 	if (a1.timing.value != a2.timing.value) {
-		*error = "timing value";
+		*reason = "timing value";
 		return false;
 	}
 	if (a1.timing.last != a2.timing.last) {
-		*error = "timing last";
+		*reason = "timing last";
+		return false;
+	}
+	if (a1.ttl != a2.ttl) {
+		*reason = "ttl";
+		return false;
+	}
+	if (a1.timeout != a2.timeout) {
+		*reason = "timeout";
+		return false;
+	}
+	if (a1.field != a2.field) {
+		*reason = "field";
+		return false;
+	}
+	if ((a1.plugin == NULL) != (a2.plugin == NULL) || (a1.plugin != a2.plugin && strcmp(a1.plugin, a2.plugin) != 0)) {
+		*reason = "plugin";
+		return false;
+	}
+	if ((a1.argument == NULL) != (a2.argument == NULL)
+			|| (a1.argument != a2.argument && strcmp(a1.argument, a2.argument) != 0)) {
+		*reason = "plugin argument";
 		return false;
 	}
 	for (int i = 0; i < MAX_MESSAGES; i++) {
 		//printf("%s vs %s\n", a1.messages[i].text, a2.messages[i].text);
 		if ((a1.messages[i].text == NULL) != (a2.messages[i].text == NULL)) {
-			*error = "message text null";
+			*reason = "message text null";
 			return false;
 		}
 		if ((a1.messages[i].text != a2.messages[i].text) && strcmp(a1.messages[i].text, a2.messages[i].text) != 0) {
-			*error = "message text";
+			*reason = "message text";
 			return false;
 		}
 		if (a1.messages[i].class != a2.messages[i].class) {
-			*error = "message class";
+			*reason = "message class";
 			return false;
 		}
 	}
@@ -167,6 +188,55 @@ bool configParser() {
 		.success = -1,
 		.result = {}
 	};
+	testcases[15] = (struct testcase) {
+		.config = "name = a\\ b\r\ntype = double\r\n",
+		.success = 0,
+		.result = {
+			.name = "a b",
+			.type = DOUBLE
+		}
+	};
+	testcases[16] = (struct testcase) {
+		.config = "script = \"echo \\\"%m\\\"\" # quoted\nmessages.info.254 = \"x\"",
+		.success = 0,
+		.result = {
+			.script = "echo \"%m\"",
+			.messages = {
+				[254] = {
+					.class = INFO,
+					.text = "x"
+				}
+			}
+		}
+	};
+	testcases[17] = (struct testcase) {
+		.config = "messages.error.255 = hi",
+		.success = -1,
+		.result = {}
+	};
+	testcases[18] = (struct testcase) {
+		.config = "script = df\nscript.ttl = 30\nscript.timeout = 5\nfield = 4",
+		.success = 0,
+		.result = {
+			.script = "df",
+			.ttl = 30,
+			.timeout = 5,
+			.field = 4
+		}
+	};
+	testcases[19] = (struct testcase) {
+		.config = "field = -1",
+		.success = -1,
+		.result = {}
+	};
+	testcases[20] = (struct testcase) {
+		.config = "plugin = meminfo\nplugin.argument = MemFree",
+		.success = 0,
+		.result = {
+			.plugin = "meminfo",
+			.argument = "MemFree"
+		}
+	};
 
 
 	bool result = true;
@@ -189,5 +259,17 @@ bool configParser() {
 		if (tmp != 0)
 			printf("%s%sError: %s\n", SUBSPACING, SUBSPACING, error);
 	}
+
+	printf("%sInterning strings... ", SUBSPACING);
+	agent_t a1, a2;
+	memset(&a1, 0, sizeof(agent_t));
+	memset(&a2, 0, sizeof(agent_t));
+	if (parseAgent("name = shared\nscript = \"x\"", &a1) < 0 || parseAgent("script = \"x\"\nname = \"shared\"", &a2) < 0
+			|| a1.name != a2.name || a1.script != a2.script) {
+		result = false;
+		printf("failed.\n");
+	} else {
+		printf("okay.\n");
+	}
 	return result;
 }
@@ -0,0 +1,129 @@
+#include "tests.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include <error.h>
+
+#define THREADS 4
+#define FAILURES 10000
+
+static bool expect(const char* expected) {
+	if (strcmp(error, expected) == 0)
+		return true;
+	printf("%s%sError: '%s' instead of '%s'.\n", SUBSPACING, SUBSPACING, error, expected);
+	return false;
+}
+
+// the string argument is gone before the message is read
+static void failWithLocal() {
+	char name[16];
+	strcpy(name, "spool.d");
+	fail("%s: no space left", name);
+	memset(name, 'x', sizeof(name) - 1);
+}
+
+static bool formats() {
+	printf("%sFormatting failures when they are read.\n", SUBSPACING);
+	char expected[MAX_ERROR_LENGTH];
+	snprintf(expected, sizeof(expected), "%s: %d %5.2f %llu %zu %c %x|%-4s|%*d %.*s %p %Lg %hhu %%",
+		"path", -42, 3.14159, 123ull, (size_t) 7, 'x', 255, "ab", 6, 42, 3, "abcdef", (void*) expected,
+		(long double) 1.5, (unsigned char) 200);
+	fail("%s: %d %5.2f %llu %zu %c %x|%-4s|%*d %.*s %p %Lg %hhu %%",
+		"path", -42, 3.14159, 123ull, (size_t) 7, 'x', 255, "ab", 6, 42, 3, "abcdef", (void*) expected,
+		(long double) 1.5, (unsigned char) 200);
+	if (!expect(expected) || getErrorCode() != 0)
+		return false;
+
+	failWithLocal();
+	if (!expect("spool.d: no space left"))
+		return false;
+
+	// slices of a config are not terminated, only their precision may be read
+	char* slice = malloc(6);
+	memcpy(slice, "timer)", 6);
+	fail("Unknown key '%.*s' (%.1s", 5, slice, slice + 5);
+	free(slice);
+	if (!expect("Unknown key 'timer' ()"))
+		return false;
+
+	// more arguments than are kept are formatted right away
+	fail("%d %d %d %d %d %d %d %d %d %d", 1, 2, 3, 4, 5, 6, 7, 8, 9, 10);
+	if (!expect("1 2 3 4 5 6 7 8 9 10"))
+		return false;
+
+	error = "Static message.";
+	if (!expect("Static message."))
+		return false;
+
+	errno = ENOENT;
+	libfail();
+	if (!expect(strerror(ENOENT)) || getErrorCode() != ENOENT)
+		return false;
+	failCode(ENOSPC, "Lane %s is full.", "info");
+	return expect("Lane info is full.") && getErrorCode() == ENOSPC;
+}
+
+static void* failConcurrently(void* argument) {
+	uintptr_t thread = (uintptr_t) argument;
+	char expected[64];
+	for (int i = 0; i < FAILURES; i++) {
+		fail("thread %u, failure %d", (unsigned) thread, i);
+		snprintf(expected, sizeof(expected), "thread %u, failure %d", (unsigned) thread, i);
+		if (strcmp(error, expected) != 0)
+			return (void*) 1;
+	}
+	return NULL;
+}
+
+static bool threads() {
+	printf("%sFailing on %d threads at once.\n", SUBSPACING, THREADS);
+	pthread_t threads[THREADS];
+	for (uintptr_t i = 0; i < THREADS; i++)
+		pthread_create(&(threads[i]), NULL, failConcurrently, (void*) i);
+	bool result = true;
+	for (int i = 0; i < THREADS; i++) {
+		void* tmp;
+		pthread_join(threads[i], &tmp);
+		result &= tmp == NULL;
+	}
+	if (!result)
+		printf("%s%sError: a thread read another message.\n", SUBSPACING, SUBSPACING);
+	return result;
+}
+
+static bool recent() {
+	printf("%sListing recent failures.\n", SUBSPACING);
+	char* buffer = NULL;
+	size_t length = 0;
+	FILE* file = open_memstream(&buffer, &length);
+	if (file == NULL)
+		return false;
+	printRecentErrors(file);
+	fclose(file);
+	// the last failure of every thread, and only the last ERROR_RING of this one
+	bool result = strstr(buffer, "thread 3, failure 9999\n") != NULL
+		&& strstr(buffer, "Lane info is full. (code 28)\n") != NULL
+		&& strstr(buffer, "thread 3, failure 9983\n") == NULL;
+	free(buffer);
+
+	file = open_memstream(&buffer, &length);
+	if (file == NULL)
+		return false;
+	printRecentErrors(file);
+	fclose(file);
+	result = result && length == 0;
+	free(buffer);
+	if (!result)
+		printf("%s%sError: recent failures not listed.\n", SUBSPACING, SUBSPACING);
+	return result;
+}
+
+bool errors() {
+	return formats() && threads() && recent();
+}
@@ -0,0 +1,148 @@
+#include "tests.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <limits.h>
+
+#include <loader.h>
+#include <runner.h>
+#include <registry.h>
+#include <error.h>
+
+#define AGENT "name = %s\nscript = \"echo %d\"\ndata = datavalue\ntype = int\ntiming = interval\ntiming.value = 3600\n"
+
+static char directory[] = "/tmp/fetcher-loader-XXXXXX";
+
+static void removeDirectory() {
+	DIR* tmp = opendir(directory);
+	if (tmp == NULL)
+		return;
+	struct dirent* entry;
+	char path[PATH_MAX];
+	while ((entry = readdir(tmp)) != NULL) {
+		if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", directory, entry->d_name);
+		unlink(path);
+	}
+	closedir(tmp);
+	rmdir(directory);
+}
+
+// written next to the target and renamed, like most editors do
+static bool writeAgent(const char* file, const char* name, int value) {
+	char path[PATH_MAX], tmp[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/%s", directory, file);
+	snprintf(tmp, sizeof(tmp), "%s/.%s.tmp", directory, file);
+	FILE* stream = fopen(tmp, "w");
+	if (stream == NULL)
+		return false;
+	if (name != NULL)
+		fprintf(stream, AGENT, name, value);
+	else
+		fprintf(stream, "name = \"unterminated\n");
+	fclose(stream);
+	return rename(tmp, path) == 0;
+}
+
+static loadedAgent_t* find(loader_t* loader, const char* file) {
+	for (size_t i = 0; i < loader->count; i++)
+		if (strcmp(loader->agents[i].file, file) == 0)
+			return &(loader->agents[i]);
+	return NULL;
+}
+
+static bool expect(loader_t* loader, int changes, size_t count, const char* step) {
+	int tmp = loaderUpdate(loader);
+	if (tmp != changes || loader->count != count) {
+		printf("%s%sError: %s: %d changes and %zu agents instead of %d and %zu.\n", SUBSPACING, SUBSPACING,
+			step, tmp, loader->count, changes, count);
+		return false;
+	}
+	return true;
+}
+
+static bool run(loader_t* loader) {
+	printf("%sLoading the directory.\n", SUBSPACING);
+	if (loader->count != 3 || loader->stats.added != 3 || loader->stats.failed != 1) {
+		printf("%s%sError: loaded %zu agents, %llu failed.\n", SUBSPACING, SUBSPACING,
+			loader->count, loader->stats.failed);
+		return false;
+	}
+
+	printf("%sRescheduling a changed agent only.\n", SUBSPACING);
+	runtime_t* a = find(loader, "a")->runtime;
+	runtime_t* b = find(loader, "b")->runtime;
+	uint32_t id = findAgent("loader-a");
+	if (!writeAgent("a", "loader-a", 2) || !writeAgent("b", "loader-b", 1) || !expect(loader, 1, 3, "change"))
+		return false;
+	if (find(loader, "a")->runtime == a || find(loader, "b")->runtime != b
+			|| loader->stats.rescheduled != 1 || loader->stats.unchanged != 1) {
+		printf("%s%sError: wrong agents rescheduled.\n", SUBSPACING, SUBSPACING);
+		return false;
+	}
+	if (findAgent("loader-a") != id || getAgent(id) != find(loader, "a")->agent) {
+		printf("%s%sError: agent changed its id.\n", SUBSPACING, SUBSPACING);
+		return false;
+	}
+
+	printf("%sKeeping the old version of a broken agent.\n", SUBSPACING);
+	if (!writeAgent("b", NULL, 0) || !expect(loader, 0, 3, "broken"))
+		return false;
+	if (find(loader, "b")->runtime != b || loader->stats.failed != 2) {
+		printf("%s%sError: broken agent replaced the running one.\n", SUBSPACING, SUBSPACING);
+		return false;
+	}
+
+	printf("%sAdding and removing agents.\n", SUBSPACING);
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/c", directory);
+	if (unlink(path) < 0 || !writeAgent("d", "loader-d", 4) || !expect(loader, 2, 3, "add and remove"))
+		return false;
+	if (find(loader, "c") != NULL || find(loader, "d") == NULL || getAgent(findAgent("loader-c")) != NULL) {
+		printf("%s%sError: agents not added or removed.\n", SUBSPACING, SUBSPACING);
+		return false;
+	}
+
+	printf("%sRejecting a name defined by another file.\n", SUBSPACING);
+	if (!writeAgent("e", "loader-d", 5) || !expect(loader, 0, 3, "duplicate"))
+		return false;
+	if (find(loader, "e") != NULL || loader->stats.failed != 3 || getAgent(findAgent("loader-d")) != find(loader, "d")->agent) {
+		printf("%s%sError: duplicate name was not rejected.\n", SUBSPACING, SUBSPACING);
+		return false;
+	}
+
+	printf("%sMoving an agent to another file.\n", SUBSPACING);
+	snprintf(path, sizeof(path), "%s/d", directory);
+	if (!writeAgent("e", "loader-d", 6) || unlink(path) < 0 || !expect(loader, 2, 3, "move"))
+		return false;
+	if (find(loader, "d") != NULL || find(loader, "e") == NULL || getAgent(findAgent("loader-d")) != find(loader, "e")->agent) {
+		printf("%s%sError: agent was not moved.\n", SUBSPACING, SUBSPACING);
+		return false;
+	}
+	return expect(loader, 0, 3, "no events");
+}
+
+bool loader() {
+	if (runnerInit(0, 0) < 0 || mkdtemp(directory) == NULL) {
+		printf("%s%sError: %s\n", SUBSPACING, SUBSPACING, error);
+		return false;
+	}
+	bool result = writeAgent("a", "loader-a", 1) && writeAgent("b", "loader-b", 1)
+		&& writeAgent("c", "loader-c", 1) && writeAgent("broken", NULL, 0) && writeAgent("a~", "backup", 0);
+	loader_t tmp;
+	if (!result || loaderInit(&tmp, directory, 2) < 0) {
+		printf("%s%sError: %s\n", SUBSPACING, SUBSPACING, error);
+		removeDirectory();
+		return false;
+	}
+	result = run(&tmp);
+	loaderDestroy(&tmp);
+	removeDirectory();
+	return result;
+}
@@ -21,6 +21,21 @@ int main(int argc, char** argv) {
 
 	test("config parser", configParser);
 	test("timer", timer);
+	test("packet queue", packetQueue);
+	test("runner", runner);
+	test("wire format", wire);
+	test("packet memory", slab);
+	test("spool", spool);
+	test("agent loader", loader);
+	test("message templates", template);
+	test("rules", rules);
+	test("batch format", batch);
+	test("compression", compress);
+	test("storage", storage);
+	test("metrics", metrics);
+	test("errors", errors);
+	test("clock sources", clockSources);
+	test("plugins", plugins);
 
 	return 0;
 }
@@ -0,0 +1,144 @@
+#include "tests.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <metrics.h>
+#include <error.h>
+
+#define THREADS 4
+#define VALUES 1000
+
+// no receiver in the tests, so nothing else records this stage
+#define STAGE STAGE_INGEST
+
+static void* record(void* argument) {
+	uint64_t value = (uintptr_t) argument;
+	for (int i = 0; i < VALUES; i++)
+		recordStage(STAGE, value);
+	return NULL;
+}
+
+// thread t records (t + 1) us
+static bool threads() {
+	printf("%sRecording from %d threads.\n", SUBSPACING, THREADS);
+	pthread_t threads[THREADS];
+	for (uintptr_t t = 0; t < THREADS; t++) {
+		if (pthread_create(&(threads[t]), NULL, record, (void*) ((t + 1) * 1000)) != 0) {
+			printf("%s%sError: could not start a thread.\n", SUBSPACING, SUBSPACING);
+			return false;
+		}
+	}
+	for (int t = 0; t < THREADS; t++)
+		pthread_join(threads[t], NULL);
+	// a new thread takes over the histograms of an ended one
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, record, (void*) 1000) != 0) {
+		printf("%s%sError: could not start a thread.\n", SUBSPACING, SUBSPACING);
+		return false;
+	}
+	pthread_join(thread, NULL);
+
+	histogram_t merged;
+	histogramReset(&merged);
+	mergeStage(STAGE, &merged);
+	if (histogramCount(&merged) != (THREADS + 1) * VALUES || histogramSum(&merged) != 11000ull * VALUES
+			|| histogramPercentile(&merged, 40) < 1000 || histogramPercentile(&merged, 40) > 1000 * 17 / 16
+			|| histogramMax(&merged) != 4000) {
+		printf("%s%sError: merged %llu values, sum %llu, p40 %llu, max %llu.\n", SUBSPACING, SUBSPACING,
+			histogramCount(&merged), histogramSum(&merged), histogramPercentile(&merged, 40), histogramMax(&merged));
+		return false;
+	}
+	return true;
+}
+
+static void collect(FILE* file, void* context) {
+	fputs("test_label{value=", file);
+	writeLabel(file, context);
+	fputs("} 1\n", file);
+}
+
+static bool contains(const char* dump, const char* line) {
+	if (strstr(dump, line) != NULL)
+		return true;
+	printf("%s%sError: no '%s' in the dump.\n", SUBSPACING, SUBSPACING, line);
+	return false;
+}
+
+static bool checkDump(const char* dump) {
+	return contains(dump, "# TYPE fetcher_stage_seconds histogram\n")
+		&& contains(dump, "\nfetcher_stage_seconds_bucket{stage=\"ingest\",le=\"1e-06\"} 2000\n")
+		&& contains(dump, "\nfetcher_stage_seconds_bucket{stage=\"ingest\",le=\"2.5e-06\"} 3000\n")
+		&& contains(dump, "\nfetcher_stage_seconds_bucket{stage=\"ingest\",le=\"5e-06\"} 5000\n")
+		&& contains(dump, "\nfetcher_stage_seconds_bucket{stage=\"ingest\",le=\"+Inf\"} 5000\n")
+		&& contains(dump, "\nfetcher_stage_seconds_sum{stage=\"ingest\"} 0.011000000\n")
+		&& contains(dump, "\nfetcher_stage_seconds_count{stage=\"ingest\"} 5000\n")
+		&& contains(dump, "\ntest_label{value=\"a\\\"b\\\\c\\nd\"} 1\n");
+}
+
+static bool dump() {
+	printf("%sWriting a dump.\n", SUBSPACING);
+	static char label[] = "a\"b\\c\nd";
+	if (addCollector(collect, label) < 0) {
+		printf("%s%sError: %s\n", SUBSPACING, SUBSPACING, error);
+		return false;
+	}
+	char* buffer = NULL;
+	size_t length = 0;
+	FILE* file = open_memstream(&buffer, &length);
+	if (file == NULL) {
+		printf("%s%sError: could not open a memory stream.\n", SUBSPACING, SUBSPACING);
+		return false;
+	}
+	writeMetrics(file);
+	fclose(file);
+	bool result = checkDump(buffer);
+	free(buffer);
+	return result;
+}
+
+static bool serve() {
+	printf("%sServing the dump on a socket.\n", SUBSPACING);
+	struct sockaddr_un address = {.sun_family = AF_UNIX};
+	snprintf(address.sun_path, sizeof(address.sun_path), "/tmp/fetcher-metrics-%d.sock", (int) getpid());
+	if (metricsServe(address.sun_path) < 0) {
+		printf("%s%sError: %s\n", SUBSPACING, SUBSPACING, error);
+		return false;
+	}
+	bool result = true;
+	static char buffer[256 * 1024];
+	for (int i = 0; i < 2 && result; i++) {
+		int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd < 0 || connect(fd, (struct sockaddr*) &address, sizeof(address)) < 0) {
+			printf("%s%sError: could not connect.\n", SUBSPACING, SUBSPACING);
+			if (fd >= 0)
+				close(fd);
+			result = false;
+			break;
+		}
+		size_t length = 0;
+		ssize_t n;
+		while ((n = read(fd, buffer + length, sizeof(buffer) - 1 - length)) > 0)
+			length += n;
+		close(fd);
+		buffer[length] = '\0';
+		result = checkDump(buffer);
+	}
+	metricsStop();
+	if (result && access(address.sun_path, F_OK) == 0) {
+		printf("%s%sError: the socket was not removed.\n", SUBSPACING, SUBSPACING);
+		result = false;
+	}
+	return result;
+}
+
+bool metrics() {
+	return threads() && dump() && serve();
+}
@@ -0,0 +1,143 @@
+#define _GNU_SOURCE
+
+#include "tests.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+
+#include <runner.h>
+#include <packet.h>
+#include <plugin.h>
+#include <timer.h>
+#include <error.h>
+
+typedef struct {
+	const char* plugin;
+	const char* argument;
+	double min;
+	double max;
+	bool busy; // the second sample follows some busy time of the test
+} sample_t;
+
+static int cpuIndex;
+static char cpu[32]; // its line in /proc/stat
+
+static const sample_t samples[] = {
+	{"loadavg", NULL, 0, 1e6, false},
+	{"loadavg", "15", 0, 1e6, false},
+	{"meminfo", NULL, 1, 1e12, false},
+	{"meminfo", "MemTotal", 1, 1e12, false},
+	{"procstat", NULL, 0, 100, true},
+	{"procstat", cpu, 0, 100, true}
+};
+
+// keeps the cpu busy for 200 ms
+static void spin() {
+	cpu_set_t all, one;
+	bool pinned = sched_getaffinity(0, sizeof(cpu_set_t), &all) == 0;
+	if (pinned) {
+		CPU_ZERO(&one);
+		CPU_SET(cpuIndex, &one);
+		pinned = sched_setaffinity(0, sizeof(cpu_set_t), &one) == 0;
+	}
+	unsigned long long start = getRelativeTime();
+	for (volatile unsigned long i = 0; getRelativeTime() - start < 200ull * 1000 * 1000; i++);
+	if (pinned)
+		(void) sched_setaffinity(0, sizeof(cpu_set_t), &all);
+}
+
+static bool takeSample(runtime_t* runtime, packet_t* packet) {
+	triggerAgent(runtime);
+	for (int i = 0; i < 2000; i++) {
+		if (popPacket(packet))
+			return true;
+		usleep(1000);
+	}
+	return false;
+}
+
+static bool builtins() {
+	printf("%sSampling built-in plugins.\n", SUBSPACING);
+	cpuIndex = sched_getcpu() < 0 ? 0 : sched_getcpu();
+	snprintf(cpu, sizeof(cpu), "cpu%d", cpuIndex);
+	for (size_t i = 0; i < sizeof(samples) / sizeof(samples[0]); i++) {
+		agent_t agent;
+		memset(&agent, 0, sizeof(agent_t));
+		agent.name = samples[i].plugin;
+		agent.plugin = samples[i].plugin;
+		agent.argument = samples[i].argument;
+		agent.data = DATA_VALUE;
+		agent.type = DOUBLE;
+		runtime_t* runtime = scheduleAgent(&agent);
+		if (runtime == NULL) {
+			printf("%s%sError: %s\n", SUBSPACING, SUBSPACING, error);
+			return false;
+		}
+		bool result = true;
+		// twice, the second sample of procstat is relative to the first
+		for (int j = 0; j < 2 && result; j++) {
+			packet_t packet;
+			if (j == 1 && samples[i].busy)
+				spin();
+			result = takeSample(runtime, &packet);
+			if (!result) {
+				printf("%s%sError: no sample from %s.\n", SUBSPACING, SUBSPACING, samples[i].plugin);
+				break;
+			}
+			if (packet.value.real < samples[i].min || packet.value.real > samples[i].max
+					|| (j == 1 && samples[i].busy && packet.value.real <= 0)) {
+				printf("%s%sError: %s gave %f.\n", SUBSPACING, SUBSPACING, samples[i].plugin, packet.value.real);
+				result = false;
+			} else if (j == 1)
+				printf("%s%s%s %s: %g\n", SUBSPACING, SUBSPACING, samples[i].plugin,
+					samples[i].argument != NULL ? samples[i].argument : "", packet.value.real);
+			destroyPacket(&packet);
+		}
+		(void) unscheduleAgent(runtime);
+		if (!result)
+			return false;
+	}
+	return true;
+}
+
+static bool failures() {
+	printf("%sRejecting unknown plugins and arguments.\n", SUBSPACING);
+	agent_t agent;
+	memset(&agent, 0, sizeof(agent_t));
+	agent.name = "broken";
+	agent.plugin = "/nonexistent/fetcher-plugin.so";
+	agent.data = DATA_VALUE;
+	agent.type = INT;
+	if (scheduleAgent(&agent) != NULL) {
+		printf("%s%sError: a missing shared object was loaded.\n", SUBSPACING, SUBSPACING);
+		return false;
+	}
+	printf("%s%s%s\n", SUBSPACING, SUBSPACING, error);
+
+	agent.plugin = "meminfo";
+	agent.argument = "NoSuchValue";
+	runtime_t* runtime = scheduleAgent(&agent);
+	if (runtime == NULL) {
+		printf("%s%sError: %s\n", SUBSPACING, SUBSPACING, error);
+		return false;
+	}
+	triggerAgent(runtime);
+	for (int i = 0; i < 2000 && atomic_load(&(runtime->running)); i++)
+		usleep(1000);
+	bool result = atomic_load(&(runtime->failures)) == 1 && getQueueLength() == 0;
+	if (!result)
+		printf("%s%sError: an unknown value was sampled.\n", SUBSPACING, SUBSPACING);
+	(void) unscheduleAgent(runtime);
+	return result;
+}
+
+bool plugins() {
+	if (packetInit() < 0 || runnerInit(2, 2) < 0) {
+		printf("%s%sError: %s\n", SUBSPACING, SUBSPACING, error);
+		return false;
+	}
+	return builtins() && failures();
+}
@@ -0,0 +1,252 @@
+#include "tests.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include <queue.h>
+#include <packet.h>
+#include <registry.h>
+#include <error.h>
+
+#define PRODUCERS 8
+#define ITEMS_PER_PRODUCER 50000
+#define SMALL_CAPACITY 64
+#define BATCH 32
+
+#define PACKETS_PER_PRODUCER 5000
+
+typedef struct {
+	uint32_t producer;
+	uint32_t sequence;
+} item_t;
+
+static queue_t small;
+static agent_t agent;
+static uint32_t agentId;
+
+static void* produceItems(void* argument) {
+	uint32_t producer = (uint32_t) (uintptr_t) argument;
+	for (uint32_t i = 0; i < ITEMS_PER_PRODUCER; i++) {
+		item_t item = {.producer = producer, .sequence = i};
+		while (!queueTryPush(&small, &item))
+			sched_yield();
+	}
+	return NULL;
+}
+
+static void* producePackets(void* argument) {
+	uint32_t producer = (uint32_t) (uintptr_t) argument;
+	for (uint32_t i = 0; i < PACKETS_PER_PRODUCER; i++) {
+		packet_t packet = newPacket(agentId, NULL, INFO, NULL);
+		packet.time = ((unsigned long long) producer << 32) | i; // tag instead of a timestamp
+		while (!pushPacket(&packet))
+			sched_yield();
+	}
+	return NULL;
+}
+
+static bool check(uint32_t* next, uint32_t producer, uint32_t sequence) {
+	if (producer >= PRODUCERS) {
+		printf("%s%sError: unknown producer %u.\n", SUBSPACING, SUBSPACING, producer);
+		return false;
+	}
+	if (sequence != next[producer]) {
+		printf("%s%sError: producer %u expected %u, got %u (%s).\n", SUBSPACING, SUBSPACING,
+			producer, next[producer], sequence, sequence < next[producer] ? "duplicate" : "lost");
+		return false;
+	}
+	next[producer]++;
+	return true;
+}
+
+static bool stressQueue() {
+	printf("%sRunning %d producers with %d items each (capacity %d).\n",
+		SUBSPACING, PRODUCERS, ITEMS_PER_PRODUCER, SMALL_CAPACITY);
+	if (queueInit(&small, SMALL_CAPACITY, sizeof(item_t)) < 0) {
+		printf("%s%sError: %s\n", SUBSPACING, SUBSPACING, error);
+		return false;
+	}
+
+	pthread_t threads[PRODUCERS];
+	for (uintptr_t i = 0; i < PRODUCERS; i++)
+		pthread_create(&threads[i], NULL, produceItems, (void*) i);
+
+	uint32_t next[PRODUCERS] = {0};
+	size_t total = 0;
+	bool result = true;
+	item_t batch[BATCH];
+	while (total < PRODUCERS * ITEMS_PER_PRODUCER && result) {
+		size_t count = queuePopMany(&small, batch, BATCH);
+		if (count == 0)
+			sched_yield();
+		for (size_t i = 0; i < count && result; i++)
+			result = check(next, batch[i].producer, batch[i].sequence);
+		total += count;
+	}
+
+	for (int i = 0; i < PRODUCERS; i++)
+		pthread_join(threads[i], NULL);
+
+	queueStats_t stats;
+	queueGetStats(&small, &stats);
+	printf("%s%spushed %llu, popped %llu, rejected %llu, high watermark %zu.\n", SUBSPACING, SUBSPACING,
+		stats.pushed, stats.popped, stats.rejected, stats.highWatermark);
+
+	if (result && (queuePop(&small, batch) || stats.depth != 0)) {
+		printf("%s%sError: queue not empty after draining.\n", SUBSPACING, SUBSPACING);
+		result = false;
+	}
+	if (result && stats.pushed != PRODUCERS * ITEMS_PER_PRODUCER) {
+		printf("%s%sError: push counter mismatch.\n", SUBSPACING, SUBSPACING);
+		result = false;
+	}
+
+	queueDestroy(&small);
+	return result;
+}
+
+static bool stressPackets() {
+	printf("%sRunning %d producers with %d packets each through pushPacket.\n",
+		SUBSPACING, PRODUCERS, PACKETS_PER_PRODUCER);
+	memset(&agent, 0, sizeof(agent_t));
+	agent.name = "queue";
+	agent.type = VOID;
+	agentId = registerAgent(&agent);
+	if (packetInit() < 0 || agentId == NO_AGENT) {
+		printf("%s%sError: %s\n", SUBSPACING, SUBSPACING, error);
+		return false;
+	}
+
+	pthread_t threads[PRODUCERS];
+	for (uintptr_t i = 0; i < PRODUCERS; i++)
+		pthread_create(&threads[i], NULL, producePackets, (void*) i);
+
+	uint32_t next[PRODUCERS] = {0};
+	size_t total = 0;
+	bool result = true;
+	static packet_t batch[BATCH];
+	while (total < PRODUCERS * PACKETS_PER_PRODUCER && result) {
+		size_t count = popPackets(batch, BATCH);
+		if (count == 0)
+			sched_yield();
+		for (size_t i = 0; i < count && result; i++) {
+			if (batch[i].status != QUEUED) {
+				printf("%s%sError: popped packet is not queued.\n", SUBSPACING, SUBSPACING);
+				result = false;
+			}
+			result = result && check(next, batch[i].time >> 32, batch[i].time & 0xffffffff);
+		}
+		total += count;
+	}
+
+	for (int i = 0; i < PRODUCERS; i++)
+		pthread_join(threads[i], NULL);
+
+	if (result && getQueueLength() != 0) {
+		printf("%s%sError: queue not empty after draining.\n", SUBSPACING, SUBSPACING);
+		result = false;
+	}
+	return result;
+}
+
+static bool expectLanes(lanes_t* lanes, const char* expected) {
+	item_t items[16];
+	size_t n = lanesPopMany(lanes, items, strlen(expected));
+	for (size_t i = 0; i < n; i++) {
+		if (items[i].producer != (uint32_t) (expected[i] - '0')) {
+			printf("%s%sError: item %zu from lane %u instead of %c.\n", SUBSPACING, SUBSPACING, i,
+				items[i].producer, expected[i]);
+			return false;
+		}
+	}
+	if (n != strlen(expected)) {
+		printf("%s%sError: %zu items instead of %zu.\n", SUBSPACING, SUBSPACING, n, strlen(expected));
+		return false;
+	}
+	return true;
+}
+
+static bool fillLanes(lanes_t* lanes, const int* counts) {
+	for (uint32_t lane = 0; lane < 3; lane++) {
+		for (int i = 0; i < counts[lane]; i++) {
+			item_t item = {.producer = lane, .sequence = i};
+			if (!lanesTryPush(lanes, lane, &item)) {
+				printf("%s%sError: lane %u full after %d items.\n", SUBSPACING, SUBSPACING, lane, i);
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+static bool priorityLanes() {
+	printf("%sDequeuing three lanes strictly and by weight.\n", SUBSPACING);
+	const size_t capacities[] = {4, 4, 4};
+	const unsigned weights[] = {1, 2, 4};
+	lanes_t lanes;
+	bool result = true;
+	for (lanesMode_t mode = LANES_STRICT; mode <= LANES_WEIGHTED && result; mode++) {
+		if (lanesInit(&lanes, 3, capacities, weights, mode, sizeof(item_t)) < 0) {
+			printf("%s%sError: %s\n", SUBSPACING, SUBSPACING, error);
+			return false;
+		}
+		item_t item = {0};
+		result = fillLanes(&lanes, (int[]) {4, 4, 4});
+		if (result && lanesTryPush(&lanes, 0, &item)) {
+			printf("%s%sError: a full lane took another item.\n", SUBSPACING, SUBSPACING);
+			result = false;
+		}
+		if (mode == LANES_STRICT)
+			result = result && expectLanes(&lanes, "2222111") && expectLanes(&lanes, "10000");
+		else
+			result = result && expectLanes(&lanes, "2222110") && expectLanes(&lanes, "11000");
+		result = result && fillLanes(&lanes, (int[]) {1, 1, 0}) && lanesPeek(&lanes, &item) && item.producer == 1;
+		lanesShift(&lanes);
+		result = result && lanesPop(&lanes, &item) && item.producer == 0 && lanesDepth(&lanes) == 0;
+		if (!result)
+			printf("%s%sError: lanes failed in %s mode.\n", SUBSPACING, SUBSPACING,
+				mode == LANES_STRICT ? "strict" : "weighted");
+		lanesDestroy(&lanes);
+	}
+	return result;
+}
+
+// a full INFO lane does not keep an EMERGENCY packet out, and it goes first
+static bool packetLanes() {
+	printf("%sPushing an emergency into a queue full of data values.\n", SUBSPACING);
+	laneStats_t before, after;
+	getLaneStats(INFO, &before);
+	packet_t packet;
+	for (size_t i = 0; i <= before.queue.capacity; i++) {
+		packet = newPacket(agentId, NULL, INFO, NULL);
+		if (!pushPacket(&packet))
+			break;
+	}
+	getLaneStats(INFO, &after);
+	bool result = after.queue.depth == after.queue.capacity && after.dropped == before.dropped + 1;
+	packet = newPacket(agentId, NULL, EMERGENCY, NULL);
+	result = result && pushPacket(&packet) && popPacket(&packet) && packet.class == EMERGENCY;
+	while (popPacket(&packet))
+		destroyPacket(&packet);
+	if (!result)
+		printf("%s%sError: the emergency did not overtake the data values.\n", SUBSPACING, SUBSPACING);
+	return result;
+}
+
+bool packetQueue() {
+	if (!stressQueue())
+		return false;
+	printf("%sOkay.\n", SUBSPACING);
+	if (!stressPackets())
+		return false;
+	printf("%sOkay.\n", SUBSPACING);
+	if (!priorityLanes() || !packetLanes())
+		return false;
+	printf("%sOkay.\n", SUBSPACING);
+	return true;
+}
@@ -0,0 +1,313 @@
+#include "tests.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdatomic.h>
+
+#include <conf.h>
+#include <rules.h>
+#include <runner.h>
+#include <packet.h>
+#include <error.h>
+
+#define SECOND (1000ull * 1000 * 1000)
+
+#define THRESHOLDS \
+	"name = rules\n" \
+	"type = double\n" \
+	"data = datavalue\n" \
+	"messages.info.0 = \"back to normal (%v)\"\n" \
+	"messages.warning.1 = \"high (%v)\"\n" \
+	"messages.alarm.2 = \"very high (%v)\"\n" \
+	"messages.warning.3 = \"low\"\n" \
+	"messages.alarm.4 = \"rising fast\"\n" \
+	"rules.above.1 = 80\n" \
+	"rules.range.2 = \"100 90\"\n" \
+	"rules.below.3 = 5\n"
+
+static const char* thresholds = THRESHOLDS;
+static const char* config = THRESHOLDS "rules.rise.4 = 10\n";
+
+static bool evaluate() {
+	printf("%sEvaluating thresholds, ranges and rates.\n", SUBSPACING);
+	agent_t agent;
+	memset(&agent, 0, sizeof(agent_t));
+	if (parseAgent(config, &agent) < 0) {
+		printf("%s%sError: %s\n", SUBSPACING, SUBSPACING, error);
+		return false;
+	}
+	const struct {
+		double value;
+		unsigned long long time;
+		int code;
+	} samples[] = {
+		{50, 0, 0},
+		{85, 10 * SECOND, 1}, // +3.5/s
+		{95, 11 * SECOND, 2}, // range beats above, both alarm and warning match
+		{101, 12 * SECOND, 1},
+		{4, 13 * SECOND, 3},
+		{30, 14 * SECOND, 4}, // +26/s
+		{30, 15 * SECOND, 0}
+	};
+	reading_t last = {0};
+	for (size_t i = 0; i < sizeof(samples) / sizeof(samples[0]); i++) {
+		double rate = updateReading(&last, samples[i].value, samples[i].time);
+		int code = evaluateRules(&(agent.rules), samples[i].value, rate);
+		if (code != samples[i].code) {
+			printf("%s%sError: sample %zu (%g) gave code %d instead of %d.\n", SUBSPACING, SUBSPACING,
+				i, samples[i].value, code, samples[i].code);
+			return false;
+		}
+	}
+
+	printf("%sRejecting invalid rules.\n", SUBSPACING);
+	const char* invalid[] = {
+		"type = string\nmessages.info.1 = x\nrules.above.1 = 3",
+		"type = int\nrules.above.1 = 3",
+		"type = int\nmessages.info.1 = x\nrules.above.1 = high",
+		"type = int\nmessages.info.1 = x\nrules.range.1 = 3",
+		"type = int\nmessages.info.1 = x\nrules.between.1 = 3",
+		"type = int\nmessages.info.0 = x\nrules.above.0 = 3",
+		"type = double\nmessages.info.1 = x\nrules.range.1 = \"nan 3\""
+	};
+	for (size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); i++) {
+		memset(&agent, 0, sizeof(agent_t));
+		if (parseAgent(invalid[i], &agent) == 0) {
+			printf("%s%sError: invalid config %zu accepted.\n", SUBSPACING, SUBSPACING, i);
+			return false;
+		}
+	}
+	return true;
+}
+
+// runs the agent once on the value
+static void feed(runtime_t* runtime, const char* file, const char* value) {
+	FILE* tmp = fopen(file, "w");
+	fputs(value, tmp);
+	fclose(tmp);
+	unsigned long long runs = atomic_load(&(runtime->runs));
+	triggerAgent(runtime);
+	for (int j = 0; j < 2000 && (atomic_load(&(runtime->runs)) == runs || atomic_load(&(runtime->running))); j++)
+		usleep(1000);
+}
+
+// the sample, and the suppressed count (META) that comes in a lower lane, 0 for none
+static bool popSample(packet_t* packet, int* suppressed) {
+	bool sent = false;
+	packet_t tmp;
+	*suppressed = 0;
+	while (popPacket(&tmp)) {
+		if (tmp.class == META) {
+			*suppressed = tmp.value.integer;
+			destroyPacket(&tmp);
+			continue;
+		}
+		if (sent)
+			destroyPacket(packet);
+		*packet = tmp;
+		sent = true;
+	}
+	return sent;
+}
+
+static bool transitions() {
+	printf("%sSending only state changes.\n", SUBSPACING);
+	char file[] = "/tmp/fetcher-rules-XXXXXX";
+	int fd = mkstemp(file);
+	if (fd < 0 || packetInit() < 0 || runnerInit(2, 2) < 0) {
+		printf("%s%sError: %s\n", SUBSPACING, SUBSPACING, error);
+		return false;
+	}
+	close(fd);
+	packet_t packet;
+	while (popPacket(&packet))
+		destroyPacket(&packet);
+
+	static agent_t agent;
+	memset(&agent, 0, sizeof(agent_t));
+	char script[64];
+	snprintf(script, sizeof(script), "cat %s", file);
+	// real samples come milliseconds apart, so no rate rules here
+	if (parseAgent(thresholds, &agent) < 0) {
+		printf("%s%sError: %s\n", SUBSPACING, SUBSPACING, error);
+		return false;
+	}
+	agent.script = script;
+	runtime_t* runtime = scheduleAgent(&agent);
+	if (runtime == NULL) {
+		printf("%s%sError: %s\n", SUBSPACING, SUBSPACING, error);
+		unlink(file);
+		return false;
+	}
+
+	const char* values[] = {"50", "51", "85", "86", "87", "52"};
+	const char* expected[] = {"back to normal (50)", NULL, "high (85)", NULL, NULL, "back to normal (52)"};
+	bool result = true;
+	for (size_t i = 0; i < sizeof(values) / sizeof(values[0]) && result; i++) {
+		feed(runtime, file, values[i]);
+		int suppressed; // checked with the deadband
+		bool sent = popSample(&packet, &suppressed);
+		if (sent != (expected[i] != NULL) || (sent && strcmp(packet.message, expected[i]) != 0)) {
+			printf("%s%sError: sample %s: got '%s'.\n", SUBSPACING, SUBSPACING, values[i],
+				sent ? packet.message : "nothing");
+			result = false;
+		}
+		if (sent)
+			destroyPacket(&packet);
+	}
+	if (result && atomic_load(&(runtime->suppressed)) != 3) {
+		printf("%s%sError: %llu samples suppressed instead of 3.\n", SUBSPACING, SUBSPACING,
+			atomic_load(&(runtime->suppressed)));
+		result = false;
+	}
+
+	if (result) {
+		printf("%sSending a transition again after the queue was full.\n", SUBSPACING);
+		size_t filled = 0;
+		for (;;) {
+			packet_t tmp = newPacket(0, NULL, WARNING, "filler");
+			if (!pushPacket(&tmp)) {
+				destroyPacket(&tmp);
+				break;
+			}
+			filled++;
+		}
+		feed(runtime, file, "85");
+		for (size_t i = 0; i < filled; i++) {
+			if (popPacket(&packet))
+				destroyPacket(&packet);
+		}
+		feed(runtime, file, "86");
+		int suppressed;
+		bool sent = popSample(&packet, &suppressed);
+		if (atomic_load(&(runtime->dropped)) != 1 || !sent || strcmp(packet.message, "high (86)") != 0) {
+			printf("%s%sError: the dropped transition was not sent again.\n", SUBSPACING, SUBSPACING);
+			result = false;
+		}
+		if (sent)
+			destroyPacket(&packet);
+	}
+	unscheduleAgent(runtime);
+	unlink(file);
+	return result;
+}
+
+static bool deadband() {
+	printf("%sSuppressing samples inside the deadband.\n", SUBSPACING);
+	const deadband_t relative = {.enabled = true, .absolute = -1, .relative = 0.1};
+	const reading_t sent = {.value = -50, .valid = true};
+	if (isOutsideDeadband(&relative, &sent, -54) || !isOutsideDeadband(&relative, &sent, -56)) {
+		printf("%s%sError: relative threshold not applied.\n", SUBSPACING, SUBSPACING);
+		return false;
+	}
+	const char* invalid[] = {
+		"type = string\ndeadband.absolute = 1",
+		"type = int\ndeadband.relative = -0.1",
+		"type = double\ndeadband.absolute = nan",
+		"type = int\ndeadband.maxsilence = soon"
+	};
+	for (size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); i++) {
+		agent_t agent;
+		memset(&agent, 0, sizeof(agent_t));
+		if (parseAgent(invalid[i], &agent) == 0) {
+			printf("%s%sError: invalid deadband %zu accepted.\n", SUBSPACING, SUBSPACING, i);
+			return false;
+		}
+	}
+
+	char file[] = "/tmp/fetcher-deadband-XXXXXX";
+	int fd = mkstemp(file);
+	if (fd < 0) {
+		printf("%s%sError: %s\n", SUBSPACING, SUBSPACING, error);
+		return false;
+	}
+	close(fd);
+	static agent_t agent;
+	memset(&agent, 0, sizeof(agent_t));
+	char script[64];
+	snprintf(script, sizeof(script), "cat %s", file);
+	if (parseAgent("name = deadband\ntype = double\ndata = datavalue\ndeadband.absolute = 2\ndeadband.maxsilence = 300", &agent) < 0
+			|| agent.deadband.maxSilence != 300) {
+		printf("%s%sError: %s\n", SUBSPACING, SUBSPACING, error);
+		unlink(file);
+		return false;
+	}
+	agent.script = script;
+	runtime_t* runtime = scheduleAgent(&agent);
+	if (runtime == NULL) {
+		printf("%s%sError: %s\n", SUBSPACING, SUBSPACING, error);
+		unlink(file);
+		return false;
+	}
+
+	// a suppressed count (META) with a sample, 0 for none
+	const struct {
+		const char* value;
+		int suppressed;
+		bool sent;
+	} samples[] = {
+		{"50", 0, true},
+		{"51", 0, false},
+		{"52.5", 1, true},
+		{"53", 0, false},
+		{"51", 0, false},
+		{"60", 2, true}
+	};
+	bool result = true;
+	packet_t packet;
+	for (size_t i = 0; i < sizeof(samples) / sizeof(samples[0]) && result; i++) {
+		feed(runtime, file, samples[i].value);
+		int suppressed;
+		bool sent = popSample(&packet, &suppressed);
+		if (sent != samples[i].sent || suppressed != samples[i].suppressed
+				|| (sent && packet.value.real != strtod(samples[i].value, NULL))) {
+			printf("%s%sError: sample %s: %s after %d suppressed.\n", SUBSPACING, SUBSPACING, samples[i].value,
+				sent ? "sent" : "nothing", suppressed);
+			result = false;
+		}
+		if (sent)
+			destroyPacket(&packet);
+	}
+	if (result && atomic_load(&(runtime->suppressed)) != 3) {
+		printf("%s%sError: %llu samples suppressed instead of 3.\n", SUBSPACING, SUBSPACING,
+			atomic_load(&(runtime->suppressed)));
+		result = false;
+	}
+
+	if (result) {
+		printf("%sComparing with the last reading that was queued.\n", SUBSPACING);
+		size_t filled = 0;
+		for (;;) {
+			packet_t tmp = newPacket(0, NULL, INFO, "filler");
+			if (!pushPacket(&tmp)) {
+				destroyPacket(&tmp);
+				break;
+			}
+			filled++;
+		}
+		feed(runtime, file, "65");
+		for (size_t i = 0; i < filled; i++) {
+			if (popPacket(&packet))
+				destroyPacket(&packet);
+		}
+		feed(runtime, file, "64.5");
+		int suppressed;
+		bool sent = popSample(&packet, &suppressed);
+		if (atomic_load(&(runtime->dropped)) != 1 || !sent || packet.value.real != 64.5) {
+			printf("%s%sError: the dropped reading became the reference.\n", SUBSPACING, SUBSPACING);
+			result = false;
+		}
+		if (sent)
+			destroyPacket(&packet);
+	}
+	unscheduleAgent(runtime);
+	unlink(file);
+	return result;
+}
+
+bool rules() {
+	return evaluate() && transitions() && deadband();
+}
@@ -0,0 +1,281 @@
+#include "tests.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <runner.h>
+#include <packet.h>
+#include <error.h>
+
+static bool waitForPacket(packet_t* packet) {
+	for (int i = 0; i < 2000; i++) {
+		if (popPacket(packet))
+			return true;
+		usleep(1000);
+	}
+	return false;
+}
+
+// every run of the script adds a line to the file
+static void setRetired(agent_t* agent, void* context) {
+	(void) agent;
+	atomic_store((atomic_bool*) context, true);
+}
+
+static char runs[] = "/tmp/fetcher-runs-XXXXXX";
+static char script[128];
+
+static int countRuns() {
+	FILE* file = fopen(runs, "r");
+	if (file == NULL)
+		return -1;
+	int count = 0;
+	for (int c; (c = fgetc(file)) != EOF;)
+		count += c == '\n';
+	fclose(file);
+	return count;
+}
+
+static bool coalesce() {
+	printf("%sSharing one run between agents with the same script.\n", SUBSPACING);
+	agent_t agents[3];
+	runtime_t* runtimes[3];
+	for (int i = 0; i < 3; i++) {
+		memset(&(agents[i]), 0, sizeof(agent_t));
+		agents[i].name = "field";
+		agents[i].script = script;
+		agents[i].data = DATA_VALUE;
+		agents[i].type = INT;
+		agents[i].field = i + 1;
+		agents[i].timing = (timing_t) {.type = Interval, .value = 1};
+		runtimes[i] = scheduleAgent(&(agents[i]));
+		if (runtimes[i] == NULL) {
+			printf("%s%sError: %s\n", SUBSPACING, SUBSPACING, error);
+			return false;
+		}
+	}
+	bool result = runtimes[0]->group == runtimes[1]->group && runtimes[1]->group == runtimes[2]->group;
+	int sum = 0;
+	packet_t packet;
+	for (int i = 0; i < 3 && result; i++) {
+		result = waitForPacket(&packet);
+		if (result) {
+			sum += packet.value.integer;
+			destroyPacket(&packet);
+		}
+	}
+	for (int i = 0; i < 3; i++)
+		(void) unscheduleAgent(runtimes[i]);
+	if (!result || sum != 5 + 6 + 7 || countRuns() != 1) {
+		printf("%s%sError: %d runs, values add up to %d.\n", SUBSPACING, SUBSPACING, countRuns(), sum);
+		return false;
+	}
+	return true;
+}
+
+static bool cache() {
+	printf("%sReusing cached output.\n", SUBSPACING);
+	agent_t agent;
+	memset(&agent, 0, sizeof(agent_t));
+	agent.name = "cached";
+	agent.script = script;
+	agent.data = DATA_VALUE;
+	agent.type = INT;
+	agent.field = 2;
+	agent.ttl = 60;
+	runtime_t* runtime = scheduleAgent(&agent);
+	if (runtime == NULL) {
+		printf("%s%sError: %s\n", SUBSPACING, SUBSPACING, error);
+		return false;
+	}
+	bool result = true;
+	packet_t packet;
+	for (int i = 0; i < 2 && result; i++) {
+		triggerAgent(runtime);
+		result = waitForPacket(&packet) && packet.value.integer == 6;
+		if (result)
+			destroyPacket(&packet);
+		for (int j = 0; j < 2000 && atomic_load(&(runtime->running)); j++)
+			usleep(1000);
+	}
+	if (!result || countRuns() != 2 || atomic_load(&(runtime->shared)) != 1) {
+		printf("%s%sError: %d runs, %llu shared.\n", SUBSPACING, SUBSPACING, countRuns(),
+			atomic_load(&(runtime->shared)));
+		result = false;
+	}
+	(void) unscheduleAgent(runtime);
+	return result;
+}
+
+// the last member leaves while the group runs, the job frees the group
+static bool retireGroup() {
+	printf("%sRetiring the last agent of a running group.\n", SUBSPACING);
+	static agent_t agent;
+	memset(&agent, 0, sizeof(agent_t));
+	agent.name = "slow";
+	agent.script = "sleep 0.5; echo 3";
+	agent.data = DATA_VALUE;
+	agent.type = INT;
+	agent.timing = (timing_t) {.type = Interval, .value = 1};
+	runtime_t* runtime = scheduleAgent(&agent);
+	if (runtime == NULL) {
+		printf("%s%sError: %s\n", SUBSPACING, SUBSPACING, error);
+		return false;
+	}
+	for (int i = 0; i < 2000 && !atomic_load(&(runtime->running)); i++)
+		usleep(1000);
+	atomic_bool retired = false;
+	unsigned long long start = getRelativeTime();
+	if (retireAgent(runtime, setRetired, &retired) < 0) {
+		printf("%s%sError: %s\n", SUBSPACING, SUBSPACING, error);
+		return false;
+	}
+	if (atomic_load(&retired) || getRelativeTime() - start > 100ull * 1000 * 1000) {
+		printf("%s%sError: leaving the group waited for the job.\n", SUBSPACING, SUBSPACING);
+		return false;
+	}
+	packet_t packet;
+	bool result = waitForPacket(&packet) && packet.value.integer == 3;
+	if (result)
+		destroyPacket(&packet);
+	waitForRetired();
+	if (!result || !atomic_load(&retired)) {
+		printf("%s%sError: the job of the group did not finish.\n", SUBSPACING, SUBSPACING);
+		return false;
+	}
+	return true;
+}
+
+bool runner() {
+	if (packetInit() < 0 || runnerInit(2, 2) < 0) {
+		printf("%s%sError: %s\n", SUBSPACING, SUBSPACING, error);
+		return false;
+	}
+	while (popPacket(&(packet_t) {}));
+
+	printf("%sRunning an int agent.\n", SUBSPACING);
+	agent_t agent;
+	memset(&agent, 0, sizeof(agent_t));
+	agent.name = "echo";
+	agent.script = "echo 42";
+	agent.data = DATA_VALUE;
+	agent.type = INT;
+	runtime_t* runtime = scheduleAgent(&agent);
+	if (runtime == NULL) {
+		printf("%s%sError: %s\n", SUBSPACING, SUBSPACING, error);
+		return false;
+	}
+	triggerAgent(runtime);
+	packet_t packet;
+	if (!waitForPacket(&packet)) {
+		printf("%s%sError: no packet.\n", SUBSPACING, SUBSPACING);
+		return false;
+	}
+	if (packet.size != sizeof(int) || packet.value.integer != 42) {
+		printf("%s%sError: wrong value.\n", SUBSPACING, SUBSPACING);
+		return false;
+	}
+	destroyPacket(&packet);
+
+	printf("%sRunning an agent with a message.\n", SUBSPACING);
+	agent.script = "echo 7; exit 3";
+	agent.messages[3] = (message_t) {.text = "three", .class = ALARM};
+	triggerAgent(runtime);
+	if (!waitForPacket(&packet)) {
+		printf("%s%sError: no packet.\n", SUBSPACING, SUBSPACING);
+		return false;
+	}
+	if (packet.class != ALARM || strcmp(packet.message, "three") != 0 || packet.value.integer != 7) {
+		printf("%s%sError: wrong message.\n", SUBSPACING, SUBSPACING);
+		return false;
+	}
+	destroyPacket(&packet);
+
+	printf("%sRunning an agent with invalid output.\n", SUBSPACING);
+	agent.script = "echo broken";
+	triggerAgent(runtime);
+	for (int i = 0; i < 2000 && atomic_load(&(runtime->running)); i++)
+		usleep(1000);
+	if (atomic_load(&(runtime->failures)) != 1 || getQueueLength() != 0) {
+		printf("%s%sError: output should not parse as int.\n", SUBSPACING, SUBSPACING);
+		return false;
+	}
+
+	printf("%sTesting single flight.\n", SUBSPACING);
+	agent.script = "sleep 0.2; echo 1";
+	triggerAgent(runtime);
+	triggerAgent(runtime);
+	if (!waitForPacket(&packet)) {
+		printf("%s%sError: no packet.\n", SUBSPACING, SUBSPACING);
+		return false;
+	}
+	destroyPacket(&packet);
+	if (atomic_load(&(runtime->skipped)) != 1) {
+		printf("%s%sError: agent was entered twice.\n", SUBSPACING, SUBSPACING);
+		return false;
+	}
+
+	printf("%sRunning an agent with an out of range int.\n", SUBSPACING);
+	agent.script = "echo 99999999999";
+	triggerAgent(runtime);
+	for (int i = 0; i < 2000 && atomic_load(&(runtime->running)); i++)
+		usleep(1000);
+	if (atomic_load(&(runtime->failures)) != 2 || getQueueLength() != 0) {
+		printf("%s%sError: output should not fit an int.\n", SUBSPACING, SUBSPACING);
+		return false;
+	}
+
+	printf("%sKilling a script that hangs.\n", SUBSPACING);
+	agent.script = "sleep 30 & sleep 30; echo 1";
+	agent.timeout = 1;
+	unsigned long long start = getRelativeTime();
+	triggerAgent(runtime);
+	usleep(1000);
+	for (int i = 0; i < 3000 && atomic_load(&(runtime->running)); i++)
+		usleep(1000);
+	agent.timeout = 0;
+	if (atomic_load(&(runtime->running)) || atomic_load(&(runtime->failures)) != 3 || getQueueLength() != 0
+			|| getRelativeTime() - start > 2000ull * 1000 * 1000) {
+		printf("%s%sError: the script was not killed.\n", SUBSPACING, SUBSPACING);
+		return false;
+	}
+
+	printRunnerStats(stdout);
+	printf("%sRetiring an agent while it runs.\n", SUBSPACING);
+	agent.script = "sleep 0.3; echo 1";
+	atomic_bool retired = false;
+	start = getRelativeTime();
+	triggerAgent(runtime);
+	if (retireAgent(runtime, setRetired, &retired) < 0) {
+		printf("%s%sError: %s\n", SUBSPACING, SUBSPACING, error);
+		return false;
+	}
+	if (atomic_load(&retired) || getRelativeTime() - start > 100ull * 1000 * 1000) {
+		printf("%s%sError: retiring waited for the job.\n", SUBSPACING, SUBSPACING);
+		return false;
+	}
+	if (!waitForPacket(&packet)) {
+		printf("%s%sError: no packet.\n", SUBSPACING, SUBSPACING);
+		return false;
+	}
+	destroyPacket(&packet);
+	waitForRetired();
+	if (!atomic_load(&retired)) {
+		printf("%s%sError: the agent was not handed back.\n", SUBSPACING, SUBSPACING);
+		return false;
+	}
+
+	int fd = mkstemp(runs);
+	if (fd < 0) {
+		printf("%s%sError: could not create a file.\n", SUBSPACING, SUBSPACING);
+		return false;
+	}
+	close(fd);
+	snprintf(script, sizeof(script), "echo >> %s; echo 5 6 7", runs);
+	bool result = coalesce() && cache() && retireGroup();
+	unlink(runs);
+	return result;
+}
@@ -0,0 +1,145 @@
+#include "tests.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include <slab.h>
+#include <packet.h>
+#include <registry.h>
+#include <error.h>
+
+#define PRODUCERS 4
+#define PACKETS_PER_PRODUCER 20000
+
+static agent_t doubles;
+static agent_t strings;
+static uint32_t stringsId;
+
+static void* produceStrings(void* argument) {
+	uint32_t producer = (uint32_t) (uintptr_t) argument;
+	char value[64];
+	char message[300];
+	for (uint32_t i = 0; i < PACKETS_PER_PRODUCER; i++) {
+		snprintf(value, sizeof(value), "%u:%u", producer, i);
+		memset(message, 'm', i % sizeof(message));
+		message[i % sizeof(message)] = '\0';
+		packet_t packet = newPacket(stringsId, value, INFO, i % 3 == 0 ? message : NULL);
+		packet.time = ((unsigned long long) producer << 32) | i;
+		while (!pushPacket(&packet))
+			sched_yield();
+	}
+	return NULL;
+}
+
+static bool checkPacket(packet_t* packet) {
+	char expected[64];
+	uint32_t producer = packet->time >> 32;
+	uint32_t sequence = packet->time & 0xffffffff;
+	snprintf(expected, sizeof(expected), "%u:%u", producer, sequence);
+	if (strcmp(getPacketData(packet), expected) != 0) {
+		printf("%s%sError: expected '%s', got '%s'.\n", SUBSPACING, SUBSPACING,
+			expected, (char*) getPacketData(packet));
+		return false;
+	}
+	size_t length = sequence % 3 == 0 ? sequence % 300 + 1 : 0;
+	if (packet->messageLength != length || (length > 0 && strspn(packet->message, "m") != length - 1)) {
+		printf("%s%sError: message of %s damaged.\n", SUBSPACING, SUBSPACING, expected);
+		return false;
+	}
+	return true;
+}
+
+bool slab() {
+	memset(&doubles, 0, sizeof(agent_t));
+	doubles.name = "doubles";
+	doubles.type = DOUBLE;
+	memset(&strings, 0, sizeof(agent_t));
+	strings.name = "strings";
+	strings.type = STRING;
+	uint32_t id = registerAgent(&doubles);
+	stringsId = registerAgent(&strings);
+	if (packetInit() < 0 || id == NO_AGENT || stringsId == NO_AGENT) {
+		printf("%s%sError: %s\n", SUBSPACING, SUBSPACING, error);
+		return false;
+	}
+	slabStats_t before, after;
+	getSlabStats(&before);
+
+	printf("%sInline values.\n", SUBSPACING);
+	double real = 2.5;
+	packet_t packet = newPacket(id, &real, INFO, NULL);
+	getSlabStats(&after);
+	if (packet.status != CREATED || *((double*) getPacketData(&packet)) != 2.5
+			|| after.hits + after.misses != before.hits + before.misses) {
+		printf("%s%sError: double not stored inline.\n", SUBSPACING, SUBSPACING);
+		return false;
+	}
+	destroyPacket(&packet);
+
+	printf("%sType of the agent that read the value.\n", SUBSPACING);
+	packet = newAgentPacket(&doubles, stringsId, &real, INFO, NULL); // a replaced version of the agent
+	if (packet.status != CREATED || packet.agent != stringsId || packet.type != DOUBLE
+			|| *((double*) getPacketData(&packet)) != 2.5) {
+		printf("%s%sError: type taken from the registry.\n", SUBSPACING, SUBSPACING);
+		return false;
+	}
+	destroyPacket(&packet);
+
+	printf("%sObjects above the largest size class.\n", SUBSPACING);
+	size_t size = SLAB_MAX_OBJECT * 2;
+	char* large = malloc(size);
+	memset(large, 'l', size - 1);
+	large[size - 1] = '\0';
+	packet = newPacket(stringsId, large, INFO, large);
+	if (packet.status != CREATED || strcmp(getPacketData(&packet), large) != 0 || strcmp(packet.message, large) != 0) {
+		printf("%s%sError: large string damaged.\n", SUBSPACING, SUBSPACING);
+		free(large);
+		return false;
+	}
+	destroyPacket(&packet);
+	free(large);
+
+	printf("%sStrings allocated by %d threads, sent by another.\n", SUBSPACING, PRODUCERS);
+	pthread_t threads[PRODUCERS];
+	for (uintptr_t i = 0; i < PRODUCERS; i++)
+		pthread_create(&threads[i], NULL, produceStrings, (void*) i);
+	bool result = true;
+	for (size_t received = 0; received < PRODUCERS * PACKETS_PER_PRODUCER;) {
+		if (!popPacket(&packet)) {
+			sched_yield();
+			continue;
+		}
+		received++;
+		result = result && checkPacket(&packet);
+		markPacketSent(&packet);
+		if (packet.status != SENT || packet.message != NULL) {
+			printf("%s%sError: buffers not released when sent.\n", SUBSPACING, SUBSPACING);
+			result = false;
+		}
+		destroyPacket(&packet); // no-op for sent packets
+	}
+	for (int i = 0; i < PRODUCERS; i++)
+		pthread_join(threads[i], NULL);
+	if (!result)
+		return false;
+
+	getSlabStats(&after);
+	if (after.bytesInUse != before.bytesInUse) {
+		printf("%s%sError: %lld bytes still in use.\n", SUBSPACING, SUBSPACING,
+			after.bytesInUse - before.bytesInUse);
+		return false;
+	}
+	if (after.hits - before.hits < after.misses - before.misses) {
+		printf("%s%sError: only %llu hits for %llu misses.\n", SUBSPACING, SUBSPACING,
+			after.hits - before.hits, after.misses - before.misses);
+		return false;
+	}
+	printf("%s", SUBSPACING);
+	printSlabStats(stdout);
+	return true;
+}
@@ -0,0 +1,371 @@
+#include "tests.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include <spool.h>
+#include <transport.h>
+#include <registry.h>
+#include <packet.h>
+#include <error.h>
+
+#define SEGMENT_SIZE 4096
+#define PACKETS 500
+#define PEEK 37
+#define OVERFLOW 10
+
+static agent_t agent;
+static uint32_t id;
+static char directory[] = "/tmp/fetcher-spool-XXXXXX";
+
+static void removeDirectory() {
+	DIR* tmp = opendir(directory);
+	if (tmp == NULL)
+		return;
+	struct dirent* entry;
+	char path[PATH_MAX];
+	while ((entry = readdir(tmp)) != NULL) {
+		if (entry->d_name[0] == '.')
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", directory, entry->d_name);
+		unlink(path);
+	}
+	closedir(tmp);
+	rmdir(directory);
+}
+
+static size_t countSegments() {
+	DIR* tmp = opendir(directory);
+	size_t count = 0;
+	struct dirent* entry;
+	while (tmp != NULL && (entry = readdir(tmp)) != NULL)
+		count += strstr(entry->d_name, ".spool") != NULL;
+	if (tmp != NULL)
+		closedir(tmp);
+	return count;
+}
+
+static bool append(spool_t* spool, int value) {
+	packet_t packet = newPacket(id, &value, INFO, NULL);
+	int tmp = spoolAppend(spool, &packet);
+	destroyPacket(&packet);
+	if (tmp < 0) {
+		printf("%s%sError: %s\n", SUBSPACING, SUBSPACING, error);
+		return false;
+	}
+	return true;
+}
+
+// reads count records and checks them against the expected values
+static bool expect(spool_t* spool, const int* values, size_t count) {
+	struct iovec records[PEEK];
+	size_t position = 0;
+	while (position < count) {
+		size_t n = spoolPeek(spool, records, PEEK, SIZE_MAX);
+		if (n == 0) {
+			printf("%s%sError: spool ended after %zu of %zu records.\n", SUBSPACING, SUBSPACING, position, count);
+			return false;
+		}
+		if (position + n > count)
+			n = count - position;
+		for (size_t i = 0; i < n; i++, position++) {
+			wirePacket_t decoded;
+			if (wireDecode(records[i].iov_base, records[i].iov_len, &decoded) != (ssize_t) records[i].iov_len
+					|| decoded.packet.value.integer != values[position] || strcmp(decoded.name, "spool") != 0) {
+				printf("%s%sError: record %zu is not %d.\n", SUBSPACING, SUBSPACING, position, values[position]);
+				return false;
+			}
+		}
+		if (spoolCommit(spool, n) < 0) {
+			printf("%s%sError: %s\n", SUBSPACING, SUBSPACING, error);
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool order() {
+	printf("%sReading %d packets across segments in order.\n", SUBSPACING, PACKETS);
+	spool_t spool;
+	if (spoolOpen(&spool, directory, SEGMENT_SIZE, 64) < 0) {
+		printf("%s%sError: %s\n", SUBSPACING, SUBSPACING, error);
+		return false;
+	}
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/%016x.spool", directory, 0);
+	struct stat info;
+	if (stat(path, &info) < 0 || info.st_blocks * 512 < SEGMENT_SIZE) {
+		printf("%s%sError: segment not allocated on disk.\n", SUBSPACING, SUBSPACING);
+		spoolClose(&spool);
+		return false;
+	}
+	static int values[PACKETS];
+	bool result = true;
+	for (int i = 0; i < PACKETS && result; i++) {
+		values[i] = i;
+		result = append(&spool, i);
+	}
+	if (result && countSegments() < 3) {
+		printf("%s%sError: expected several segments, got %zu.\n", SUBSPACING, SUBSPACING, countSegments());
+		result = false;
+	}
+	result = result && expect(&spool, values, PACKETS);
+	if (result && (!spoolIsEmpty(&spool) || countSegments() != 1)) {
+		printf("%s%sError: read segments not removed (%zu left).\n", SUBSPACING, SUBSPACING, countSegments());
+		result = false;
+	}
+	spoolClose(&spool);
+	return result;
+}
+
+static bool recovery() {
+	printf("%sRecovering from a torn write.\n", SUBSPACING);
+	spool_t spool;
+	if (spoolOpen(&spool, directory, SEGMENT_SIZE, 64) < 0) {
+		printf("%s%sError: %s\n", SUBSPACING, SUBSPACING, error);
+		return false;
+	}
+	bool result = true;
+	size_t last = 0;
+	for (int i = 0; i < 60 && result; i++) {
+		last = spool.writer.offset;
+		result = append(&spool, i);
+	}
+	uint64_t sequence = spool.writer.sequence;
+	spoolClose(&spool);
+	if (!result)
+		return false;
+
+	// damage the last record as if the crash hit it half written
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/%016llx.spool", directory, (unsigned long long) sequence);
+	int fd = open(path, O_RDWR);
+	char byte = 0x5a;
+	if (fd < 0 || pwrite(fd, &byte, 1, last + SPOOL_RECORD_HEADER + 2) != 1) {
+		printf("%s%sError: could not damage the segment.\n", SUBSPACING, SUBSPACING);
+		return false;
+	}
+	close(fd);
+
+	if (spoolOpen(&spool, directory, SEGMENT_SIZE, 64) < 0) {
+		printf("%s%sError: %s\n", SUBSPACING, SUBSPACING, error);
+		return false;
+	}
+	if (spool.stats.recovered != 59) {
+		printf("%s%sError: recovered %llu records instead of 59.\n", SUBSPACING, SUBSPACING, spool.stats.recovered);
+		spoolClose(&spool);
+		return false;
+	}
+	int values[60];
+	for (int i = 0; i < 59; i++)
+		values[i] = i;
+	values[59] = 1000;
+	result = append(&spool, 1000) && expect(&spool, values, 30);
+	spoolClose(&spool);
+
+	printf("%sContinuing after the cursor.\n", SUBSPACING);
+	if (!result || spoolOpen(&spool, directory, SEGMENT_SIZE, 64) < 0)
+		return false;
+	result = spool.stats.pending == 30 && expect(&spool, values + 30, 30) && spoolIsEmpty(&spool);
+	if (!result)
+		printf("%s%sError: replay did not continue at the cursor.\n", SUBSPACING, SUBSPACING);
+	spoolClose(&spool);
+	return result;
+}
+
+static bool full() {
+	printf("%sRejecting packets when all segments are used.\n", SUBSPACING);
+	spool_t spool;
+	if (spoolOpen(&spool, directory, SEGMENT_SIZE, 2) < 0) {
+		printf("%s%sError: %s\n", SUBSPACING, SUBSPACING, error);
+		return false;
+	}
+	int i = 0;
+	packet_t packet;
+	for (; i < 1000; i++) {
+		packet = newPacket(id, &i, INFO, NULL);
+		int tmp = spoolAppend(&spool, &packet);
+		destroyPacket(&packet);
+		if (tmp < 0)
+			break;
+	}
+	bool result = i < 1000 && spool.stats.rejected == 1 && countSegments() == 2;
+	if (!result)
+		printf("%s%sError: spool not bounded (%d packets, %zu segments).\n", SUBSPACING, SUBSPACING, i, countSegments());
+	// make room again for the following tests
+	struct iovec records[PEEK];
+	size_t n;
+	while ((n = spoolPeek(&spool, records, PEEK, SIZE_MAX)) > 0)
+		spoolCommit(&spool, n);
+	spoolClose(&spool);
+	return result;
+}
+
+static bool overflow() {
+	printf("%sSpilling a full queue and replaying it.\n", SUBSPACING);
+	spool_t spool;
+	if (packetInit() < 0 || spoolOpen(&spool, directory, SEGMENT_SIZE, 64) < 0) {
+		printf("%s%sError: %s\n", SUBSPACING, SUBSPACING, error);
+		return false;
+	}
+	packet_t packet;
+	while (popPacket(&packet))
+		destroyPacket(&packet);
+
+	setPacketSpool(&spool);
+	laneStats_t lane;
+	getLaneStats(INFO, &lane);
+	queueStats_t stats = lane.queue;
+	size_t delayed = 0;
+	for (int i = 0; i < (int) stats.capacity + OVERFLOW; i++) {
+		packet = newPacket(id, &i, INFO, NULL);
+		if (!pushPacket(&packet)) {
+			printf("%s%sError: %s\n", SUBSPACING, SUBSPACING, error);
+			break;
+		}
+		delayed += packet.status == DELAYED;
+	}
+	setPacketSpool(NULL);
+	while (popPacket(&packet))
+		destroyPacket(&packet);
+	if (delayed != OVERFLOW) {
+		printf("%s%sError: %zu packets spooled instead of %d.\n", SUBSPACING, SUBSPACING, delayed, OVERFLOW);
+		spoolClose(&spool);
+		return false;
+	}
+
+	int fds[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+		spoolClose(&spool);
+		return false;
+	}
+	transport_t* transport = malloc(sizeof(transport_t));
+	transportInit(transport, fds[0], STREAM, 0, 0);
+	ssize_t replayed = 0, tmp;
+	while ((tmp = transportReplay(transport, &spool)) > 0)
+		replayed += tmp;
+	free(transport);
+
+	frameReader_t reader;
+	frameReaderInit(&reader, 4096);
+	frameHeader_t header;
+	const char* payload;
+	bool result = replayed == OVERFLOW && frameReaderFill(&reader, fds[1]) > 0
+		&& frameReaderNext(&reader, &header, &payload) > 0
+		&& (header.flags & FRAME_DELAYED) && header.count == OVERFLOW;
+	if (result) {
+		wirePacket_t decoded;
+		result = wireDecode(payload, header.length, &decoded) > 0
+			&& decoded.packet.value.integer == (int) stats.capacity;
+	}
+	if (!result)
+		printf("%s%sError: spooled packets not replayed as a delayed frame.\n", SUBSPACING, SUBSPACING);
+	frameReaderDestroy(&reader);
+	close(fds[0]);
+	close(fds[1]);
+	spoolClose(&spool);
+	return result;
+}
+
+// a packet too long for a datagram is dropped, the rest of the batch goes out once
+static bool oversized() {
+	printf("%sDropping a packet too long for a datagram.\n", SUBSPACING);
+	agent_t text;
+	memset(&text, 0, sizeof(agent_t));
+	text.name = "oversized";
+	text.data = DATA_VALUE;
+	text.type = STRING;
+	uint32_t textId = registerAgent(&text);
+	char* string = malloc(DATAGRAM_MAX_LENGTH + 1);
+	int fds[2];
+	if (textId == NO_AGENT || string == NULL || socketpair(AF_UNIX, SOCK_DGRAM, 0, fds) < 0) {
+		printf("%s%sError: setup failed.\n", SUBSPACING, SUBSPACING);
+		free(string);
+		return false;
+	}
+	memset(string, 'x', DATAGRAM_MAX_LENGTH);
+	string[DATAGRAM_MAX_LENGTH] = '\0';
+	int values[2] = {1, 2};
+
+	transport_t* transport = malloc(sizeof(transport_t));
+	transportInit(transport, fds[0], DATAGRAM, 0, 0);
+	transport->batch[0] = newPacket(id, &(values[0]), INFO, NULL);
+	transport->batch[1] = newPacket(textId, string, INFO, NULL);
+	transport->batch[2] = newPacket(id, &(values[1]), INFO, NULL);
+	transport->count = 3;
+	free(string);
+
+	int flushed = transportFlush(transport);
+	char buffer[256];
+	ssize_t first = recv(fds[1], buffer, sizeof(buffer), MSG_DONTWAIT);
+	ssize_t second = recv(fds[1], buffer, sizeof(buffer), MSG_DONTWAIT);
+	ssize_t third = recv(fds[1], buffer, sizeof(buffer), MSG_DONTWAIT);
+	bool result = flushed == 3 && transport->count == 0 && transport->stats.dropped == 1
+		&& first > 0 && second > 0 && third < 0;
+	if (!result)
+		printf("%s%sError: flushed %d, %zu left, %llu dropped.\n", SUBSPACING, SUBSPACING, flushed,
+			transport->count, transport->stats.dropped);
+
+	// nothing was sent, so everything is kept
+	transport->batch[0] = newPacket(id, &(values[0]), INFO, NULL);
+	transport->count = 1;
+	close(fds[1]);
+	if (result && (transportFlush(transport) >= 0 || transport->count != 1)) {
+		printf("%s%sError: an unsent packet was not kept.\n", SUBSPACING, SUBSPACING);
+		result = false;
+	}
+	for (size_t i = 0; i < transport->count; i++)
+		destroyPacket(&(transport->batch[i]));
+	free(transport);
+	close(fds[0]);
+	unregisterAgent(textId);
+	return result;
+}
+
+// packets wait for the flush window, across a reconnect, unless one is an alarm
+static bool window() {
+	printf("%sHolding packets for the flush window.\n", SUBSPACING);
+	int fds[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+		return false;
+	transport_t* transport = malloc(sizeof(transport_t));
+	transportInit(transport, fds[0], STREAM, 1 << 20, 60000);
+	int value = 1;
+	packet_t packet = newPacket(id, &value, INFO, NULL);
+	bool result = pushPacket(&packet) && transportPump(transport) == 0 && transport->count == 1;
+	transportConnect(transport, fds[0]);
+	result = result && transport->count == 1;
+	packet = newPacket(id, &value, EMERGENCY, NULL);
+	result = result && pushPacket(&packet) && transportPump(transport) == 2 && transport->count == 0;
+	if (!result)
+		printf("%s%sError: flush window not kept (%zu pending).\n", SUBSPACING, SUBSPACING, transport->count);
+	transportDestroy(transport);
+	free(transport);
+	close(fds[0]);
+	close(fds[1]);
+	return result;
+}
+
+bool spool() {
+	memset(&agent, 0, sizeof(agent_t));
+	agent.name = "spool";
+	agent.data = DATA_VALUE;
+	agent.type = INT;
+	id = registerAgent(&agent);
+	if (id == NO_AGENT || mkdtemp(directory) == NULL) {
+		printf("%s%sError: %s\n", SUBSPACING, SUBSPACING, error);
+		return false;
+	}
+	bool result = order() && recovery() && full() && overflow() && oversized() && window();
+	removeDirectory();
+	return result;
+}
@@ -0,0 +1,463 @@
+#include "tests.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#include <storage.h>
+#include <error.h>
+
+#define POINTS 1000
+#define START (20000ull * STORAGE_PARTITION - 2 * 60 * 60 * 1000) // two hours before midnight
+#define STEP 10000 // ms, 1000 points cover the midnight
+
+static char directory[] = "/tmp/fetcher-storage-XXXXXX";
+static point_t expected[2][POINTS];
+static point_t points[2 * POINTS];
+
+static void removeDirectory(const char* directory) {
+	DIR* tmp = opendir(directory);
+	if (tmp == NULL)
+		return;
+	struct dirent* entry;
+	char path[PATH_MAX];
+	while ((entry = readdir(tmp)) != NULL) {
+		if (entry->d_name[0] == '.')
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", directory, entry->d_name);
+		unlink(path);
+	}
+	closedir(tmp);
+	rmdir(directory);
+}
+
+static bool append(storage_t* storage, const char* name, data_t data, type_t type, const point_t* point) {
+	wirePacket_t decoded;
+	memset(&decoded, 0, sizeof(wirePacket_t));
+	decoded.name = name;
+	decoded.packet.class = INFO;
+	decoded.packet.data = data;
+	decoded.packet.type = type;
+	decoded.packet.time = point->time;
+	if (type == INT)
+		decoded.packet.value.integer = point->value;
+	else
+		decoded.packet.value.real = point->value;
+	if (storageAppend(storage, &decoded) < 0) {
+		printf("%s%sError: %s\n", SUBSPACING, SUBSPACING, error);
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Appends the points [first, last) of both series, every tenth pair in
+ * reverse order like late samples.
+ */
+static bool appendRange(storage_t* storage, size_t first, size_t last) {
+	for (size_t i = first; i < last; i++) {
+		size_t j = i % 10 == 0 && i + 1 < last ? i + 1 : i % 10 == 1 && i > first ? i - 1 : i;
+		if (!append(storage, "cpu.load", PROPERTY, DOUBLE, &(expected[0][j]))
+				|| !append(storage, "disk.free", PROPERTY, INT, &(expected[1][j])))
+			return false;
+	}
+	return true;
+}
+
+// the points of [from, to] of a series, count is the number expected
+static bool expect(storage_t* storage, int series, uint64_t from, uint64_t to, size_t count) {
+	const char* name = series == 0 ? "cpu.load" : "disk.free";
+	ssize_t n = storageQuery(storage, name, from, to, points, 2 * POINTS);
+	if (n < 0) {
+		printf("%s%sError: %s\n", SUBSPACING, SUBSPACING, error);
+		return false;
+	}
+	size_t first = 0;
+	while (first < POINTS && expected[series][first].time < from)
+		first++;
+	if ((size_t) n != count) {
+		printf("%s%sError: %zd points of %s instead of %zu.\n", SUBSPACING, SUBSPACING, n, name, count);
+		return false;
+	}
+	for (size_t i = 0; i < count; i++) {
+		if (points[i].time != expected[series][first + i].time || points[i].value != expected[series][first + i].value) {
+			printf("%s%sError: point %zu of %s differs.\n", SUBSPACING, SUBSPACING, i, name);
+			return false;
+		}
+	}
+	return true;
+}
+
+// both series over everything, the first count points of them
+static bool expectAll(storage_t* storage, size_t count) {
+	return expect(storage, 0, 0, UINT64_MAX, count) && expect(storage, 1, 0, UINT64_MAX, count);
+}
+
+static bool appendAndQuery(storage_t* storage) {
+	printf("%sQuerying before and after flushing.\n", SUBSPACING);
+	if (!appendRange(storage, 0, POINTS / 2) || !expectAll(storage, POINTS / 2))
+		return false;
+	if (storageFlush(storage) < 0) {
+		printf("%s%sError: %s\n", SUBSPACING, SUBSPACING, error);
+		return false;
+	}
+	if (storage->segmentCount != 1 || !expectAll(storage, POINTS / 2))
+		return false;
+	// these cross the midnight, so the flush writes two segments
+	if (!appendRange(storage, POINTS / 2, POINTS) || !expectAll(storage, POINTS))
+		return false;
+
+	printf("%sKeeping the samples of a failed flush.\n", SUBSPACING);
+	char blocked[PATH_MAX], first[PATH_MAX];
+	uint64_t midnight = 20000ull * STORAGE_PARTITION;
+	snprintf(first, sizeof(first), "%s/%016llx-%016llx.segment", directory,
+		midnight - STORAGE_PARTITION, (unsigned long long) storage->sequence);
+	snprintf(blocked, sizeof(blocked), "%s/%016llx-%016llx.segment", directory,
+		midnight, (unsigned long long) storage->sequence + 1);
+	if (mkdir(blocked, 0755) < 0 || storageFlush(storage) == 0) {
+		printf("%s%sError: flush did not fail.\n", SUBSPACING, SUBSPACING);
+		return false;
+	}
+	rmdir(blocked);
+	if (storage->segmentCount != 1 || access(first, F_OK) == 0 || !expectAll(storage, POINTS)) {
+		printf("%s%sError: samples of the failed flush lost.\n", SUBSPACING, SUBSPACING);
+		return false;
+	}
+	if (storageFlush(storage) < 0) {
+		printf("%s%sError: %s\n", SUBSPACING, SUBSPACING, error);
+		return false;
+	}
+	if (storage->segmentCount != 3) {
+		printf("%s%sError: %zu segments instead of 3.\n", SUBSPACING, SUBSPACING, storage->segmentCount);
+		return false;
+	}
+	// a range inside one block, one across blocks and partitions, and nothing
+	if (!expectAll(storage, POINTS) || !expect(storage, 0, START + 5 * STEP, START + 9 * STEP, 4)
+			|| !expect(storage, 1, midnight - 3600000, midnight + 3600000, 640)
+			|| !expect(storage, 0, START + POINTS * STEP, UINT64_MAX, 0)
+			|| storageQuery(storage, "no.such.agent", 0, UINT64_MAX, points, 1) != 0)
+		return false;
+	if (storageQuery(storage, "cpu.load", 0, UINT64_MAX, points, 10) >= 0) {
+		printf("%s%sError: query did not fail without space.\n", SUBSPACING, SUBSPACING);
+		return false;
+	}
+
+	wirePacket_t decoded;
+	memset(&decoded, 0, sizeof(wirePacket_t));
+	decoded.name = "os.name";
+	decoded.packet.class = INFO;
+	decoded.packet.type = STRING;
+	storageStats_t stats;
+	getStorageStats(storage, &stats);
+	if (storageAppend(storage, &decoded) < 0 || stats.appended != 2 * POINTS || stats.flushed != 2 * POINTS) {
+		printf("%s%sError: %llu appended and %llu flushed.\n", SUBSPACING, SUBSPACING, stats.appended, stats.flushed);
+		return false;
+	}
+	printf("%s%s", SUBSPACING, SUBSPACING);
+	printStorageStats(storage, stdout);
+	return true;
+}
+
+static bool reopen() {
+	printf("%sReopening and skipping invalid segments.\n", SUBSPACING);
+	char path[PATH_MAX];
+	// a flush that did not finish and a segment that is not one
+	snprintf(path, sizeof(path), "%s/%016llx-%016llx.segment.tmp", directory, START, 7ull);
+	int fd = open(path, O_WRONLY | O_CREAT, 0644);
+	if (fd < 0 || write(fd, "partial", 7) != 7) {
+		printf("%s%sError: could not write %s.\n", SUBSPACING, SUBSPACING, path);
+		return false;
+	}
+	close(fd);
+	snprintf(path, sizeof(path), "%s/%016llx-%016llx.segment", directory, START, 8ull);
+	fd = open(path, O_WRONLY | O_CREAT, 0644);
+	char garbage[256];
+	memset(garbage, 0x5a, sizeof(garbage));
+	if (fd < 0 || write(fd, garbage, sizeof(garbage)) != sizeof(garbage)) {
+		printf("%s%sError: could not write %s.\n", SUBSPACING, SUBSPACING, path);
+		return false;
+	}
+	close(fd);
+
+	storage_t storage;
+	if (storageOpen(&storage, directory) < 0) {
+		printf("%s%sError: %s\n", SUBSPACING, SUBSPACING, error);
+		return false;
+	}
+	storageStats_t stats;
+	getStorageStats(&storage, &stats);
+	snprintf(path, sizeof(path), "%s/%016llx-%016llx.segment.tmp", directory, START, 7ull);
+	bool result = storage.segmentCount == 3 && storage.seriesCount == 2 && stats.invalid == 1
+		&& access(path, F_OK) < 0 && storage.sequence == 9;
+	if (!result)
+		printf("%s%sError: %zu segments, %zu series, %llu invalid.\n", SUBSPACING, SUBSPACING,
+			storage.segmentCount, storage.seriesCount, stats.invalid);
+	result = result && expectAll(&storage, POINTS);
+
+	// a damaged block is left out, the rest of the series stays readable
+	if (result) {
+		const storageSegment_t* segment = &(storage.segments[0]);
+		const storageEntry_t* entry = &(segment->index[0]);
+		snprintf(path, sizeof(path), "%s/%016llx-%016llx.segment", directory,
+			(unsigned long long) segment->partition, (unsigned long long) segment->sequence);
+		fd = open(path, O_WRONLY);
+		result = fd >= 0 && pwrite(fd, garbage, 4, entry->offset + entry->length / 2) == 4;
+		if (fd >= 0)
+			close(fd);
+		ssize_t n = storageQuery(&storage, "cpu.load", 0, UINT64_MAX, points, 2 * POINTS);
+		if (!result || entry->series != 0 || n != POINTS - (ssize_t) entry->count) {
+			printf("%s%sError: %zd points with a damaged block.\n", SUBSPACING, SUBSPACING, n);
+			result = false;
+		}
+	}
+	storageClose(&storage);
+	return result;
+}
+
+#define FLUSHES 16
+#define FLUSHED 10 // points per flush
+
+static char mergeDirectory[] = "/tmp/fetcher-merges-XXXXXX";
+
+// links every segment to a backup, or puts back the backups of deleted ones
+static void backUpSegments(bool restore) {
+	DIR* tmp = opendir(mergeDirectory);
+	if (tmp == NULL)
+		return;
+	struct dirent* entry;
+	char path[PATH_MAX], backup[PATH_MAX + 4];
+	while ((entry = readdir(tmp)) != NULL) {
+		size_t length = strlen(entry->d_name);
+		snprintf(path, sizeof(path), "%s/%s", mergeDirectory, entry->d_name);
+		if (!restore && ((length > 8 && strcmp(entry->d_name + length - 8, ".segment") == 0)
+				|| (length > 7 && strcmp(entry->d_name + length - 7, ".rollup") == 0))) {
+			snprintf(backup, sizeof(backup), "%s.bak", path);
+			(void) link(path, backup);
+		} else if (restore && length > 4 && strcmp(entry->d_name + length - 4, ".bak") == 0) {
+			snprintf(backup, sizeof(backup), "%s", path);
+			path[strlen(path) - 4] = '\0';
+			if (access(path, F_OK) < 0)
+				(void) rename(backup, path);
+			else
+				unlink(backup);
+		}
+	}
+	closedir(tmp);
+}
+
+// the points, and the buckets of them once each
+static bool expectMerged(storage_t* storage) {
+	ssize_t n = storageQuery(storage, "net.rx", 0, UINT64_MAX, points, 2 * POINTS);
+	bool result = n == FLUSHES * FLUSHED;
+	for (ssize_t i = 0; result && i < n; i++)
+		result = points[i].time == START + i * STEP && points[i].value == i;
+	if (!result)
+		printf("%s%sError: %zd points after merging.\n", SUBSPACING, SUBSPACING, n);
+	rollup_t buckets[FLUSHES * FLUSHED];
+	ssize_t count = storageRollups(storage, "net.rx", ROLLUP_1M, 0, UINT64_MAX, buckets, FLUSHES * FLUSHED);
+	size_t total = 0;
+	for (ssize_t i = 0; i < count; i++)
+		total += buckets[i].count;
+	if (result && (count != FLUSHES * FLUSHED * STEP / 60000 + 1 || total != FLUSHES * FLUSHED)) {
+		printf("%s%sError: %zd buckets of %zu points after merging.\n", SUBSPACING, SUBSPACING, count, total);
+		result = false;
+	}
+	return result;
+}
+
+static bool merging() {
+	printf("%sMerging the segments of a partition.\n", SUBSPACING);
+	if (mkdtemp(mergeDirectory) == NULL) {
+		printf("%s%sError: could not create %s.\n", SUBSPACING, SUBSPACING, mergeDirectory);
+		return false;
+	}
+	storage_t storage;
+	if (storageOpen(&storage, mergeDirectory) < 0) {
+		printf("%s%sError: %s\n", SUBSPACING, SUBSPACING, error);
+		return false;
+	}
+	bool result = true;
+	for (size_t i = 0; result && i < FLUSHES * FLUSHED; i++) {
+		point_t point = {START + i * STEP, i};
+		result = append(&storage, "net.rx", DATA_VALUE, INT, &point);
+		// as if crashes left the merged segments behind
+		if (result && i % FLUSHED == FLUSHED - 1)
+			backUpSegments(false);
+		if (result && i % FLUSHED == FLUSHED - 1 && storageFlush(&storage) < 0) {
+			printf("%s%sError: %s\n", SUBSPACING, SUBSPACING, error);
+			result = false;
+		}
+	}
+	storageStats_t stats;
+	getStorageStats(&storage, &stats);
+	// every merge replaces some segments with one, a few of samples and rollups stay
+	size_t segments = storage.segmentCount;
+	if (result && (segments > 8 || stats.merges == 0 || segments != stats.segments - stats.merged + stats.merges)) {
+		printf("%s%sError: %zu segments after %llu merges.\n", SUBSPACING, SUBSPACING, storage.segmentCount,
+			stats.merges);
+		result = false;
+	}
+	result = result && expectMerged(&storage);
+	storageClose(&storage);
+
+	backUpSegments(true);
+	if (result && storageOpen(&storage, mergeDirectory) < 0) {
+		printf("%s%sError: %s\n", SUBSPACING, SUBSPACING, error);
+		result = false;
+	} else if (result) {
+		// closing flushed the open buckets
+		if (storage.segmentCount > segments + 1) {
+			printf("%s%sError: %zu segments left over.\n", SUBSPACING, SUBSPACING, storage.segmentCount);
+			result = false;
+		}
+		result = result && expectMerged(&storage);
+		storageClose(&storage);
+	}
+	removeDirectory(mergeDirectory);
+	return result;
+}
+
+#define SAMPLES 1080 // 3 h
+#define SAMPLES_START (20000ull * STORAGE_PARTITION + 30 * 60 * 1000 + 5000)
+
+static char rollupDirectory[] = "/tmp/fetcher-rollups-XXXXXX";
+static point_t samples[SAMPLES + 1];
+static size_t sampleCount;
+static rollup_t buckets[SAMPLES + 1];
+
+static bool appendSample(storage_t* storage, point_t point) {
+	samples[sampleCount++] = point;
+	return append(storage, "room.temperature", DATA_VALUE, DOUBLE, &point);
+}
+
+// the buckets of every level against the ones computed from all samples
+static bool expectBuckets(storage_t* storage) {
+	for (rollupLevel_t level = ROLLUP_1M; level < ROLLUP_LEVELS; level++) {
+		uint64_t width = getRollupWidth(level);
+		ssize_t n = storageRollups(storage, "room.temperature", level, 0, UINT64_MAX, buckets, SAMPLES + 1);
+		size_t total = 0;
+		for (ssize_t i = 0; i < n; i++) {
+			rollup_t bucket = {.start = buckets[i].start, .min = 1e9, .max = -1e9};
+			for (size_t j = 0; j < sampleCount; j++) {
+				if (samples[j].time / width * width != bucket.start)
+					continue;
+				bucket.count++;
+				bucket.sum += samples[j].value;
+				bucket.min = samples[j].value < bucket.min ? samples[j].value : bucket.min;
+				bucket.max = samples[j].value > bucket.max ? samples[j].value : bucket.max;
+				if (samples[j].time >= bucket.time) {
+					bucket.time = samples[j].time;
+					bucket.last = samples[j].value;
+				}
+			}
+			total += bucket.count;
+			if ((i > 0 && buckets[i].start <= buckets[i - 1].start) || bucket.count != buckets[i].count
+					|| bucket.min != buckets[i].min || bucket.max != buckets[i].max || bucket.sum != buckets[i].sum
+					|| bucket.time != buckets[i].time || bucket.last != buckets[i].last) {
+				printf("%s%sError: bucket %zd of level %d differs.\n", SUBSPACING, SUBSPACING, i, level);
+				return false;
+			}
+		}
+		if (n < 0 || total != sampleCount) {
+			printf("%s%sError: %zd buckets of level %d with %zu of %zu samples.\n", SUBSPACING, SUBSPACING,
+				n, level, total, sampleCount);
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool flushAndExpect(storage_t* storage) {
+	if (storageFlush(storage) < 0) {
+		printf("%s%sError: %s\n", SUBSPACING, SUBSPACING, error);
+		return false;
+	}
+	return expectBuckets(storage);
+}
+
+static bool rollups() {
+	printf("%sRolling up samples into buckets.\n", SUBSPACING);
+	if (mkdtemp(rollupDirectory) == NULL) {
+		printf("%s%sError: could not create %s.\n", SUBSPACING, SUBSPACING, rollupDirectory);
+		return false;
+	}
+	storage_t storage;
+	if (storageOpen(&storage, rollupDirectory) < 0) {
+		printf("%s%sError: %s\n", SUBSPACING, SUBSPACING, error);
+		return false;
+	}
+	bool result = true;
+	for (size_t i = 0; result && i < SAMPLES / 2; i++)
+		result = appendSample(&storage, (point_t) {SAMPLES_START + i * 10000, (i * 13 % 40) / 4.0 - 3});
+	point_t property = {SAMPLES_START, 42};
+	result = result && append(&storage, "room.name", PROPERTY, INT, &property);
+	// from memory, then from segments and the open buckets
+	result = result && expectBuckets(&storage) && flushAndExpect(&storage);
+
+	// a late sample in closed buckets of every level
+	result = result && appendSample(&storage, (point_t) {SAMPLES_START + 50001, -7.5});
+	for (size_t i = SAMPLES / 2; result && i < SAMPLES; i++)
+		result = appendSample(&storage, (point_t) {SAMPLES_START + i * 10000, (i * 13 % 40) / 4.0 - 3});
+	result = result && expectBuckets(&storage) && flushAndExpect(&storage);
+	storageClose(&storage);
+
+	// the open buckets were written when closing
+	if (result && storageOpen(&storage, rollupDirectory) < 0) {
+		printf("%s%sError: %s\n", SUBSPACING, SUBSPACING, error);
+		result = false;
+	} else if (result) {
+		result = expectBuckets(&storage) && storageRollups(&storage, "room.name", ROLLUP_1M, 0, UINT64_MAX, buckets, 1) == 0;
+		if (result && storageRollups(&storage, "room.temperature", ROLLUP_1M, 0, UINT64_MAX, buckets, 10) >= 0) {
+			printf("%s%sError: rollups did not fail without space.\n", SUBSPACING, SUBSPACING);
+			result = false;
+		}
+
+		// the samples expire, the rollups stay
+		storageStats_t stats;
+		int expired = storageExpire(&storage, SAMPLES_START + STORAGE_PARTITION);
+		getStorageStats(&storage, &stats);
+		if (result && (expired < 1 || stats.expired != (unsigned long long) expired
+				|| storageQuery(&storage, "room.temperature", 0, UINT64_MAX, points, 2 * POINTS) != 0
+				|| !expectBuckets(&storage))) {
+			printf("%s%sError: %d segments expired.\n", SUBSPACING, SUBSPACING, expired);
+			result = false;
+		}
+		if (result) {
+			printf("%s%s", SUBSPACING, SUBSPACING);
+			printStorageStats(&storage, stdout);
+		}
+		storageClose(&storage);
+	}
+	removeDirectory(rollupDirectory);
+	return result;
+}
+
+bool storage() {
+	if (mkdtemp(directory) == NULL) {
+		printf("%sError: could not create %s.\n", SUBSPACING, directory);
+		return false;
+	}
+	for (size_t i = 0; i < POINTS; i++) {
+		expected[0][i] = (point_t) {START + i * STEP + i % 7, (i * 37 % 400) / 100.0};
+		expected[1][i] = (point_t) {START + i * STEP + i % 7, 100000 - (int) i * 3};
+	}
+
+	storage_t storage;
+	if (storageOpen(&storage, directory) < 0) {
+		printf("%sError: %s\n", SUBSPACING, error);
+		removeDirectory(directory);
+		return false;
+	}
+	bool result = appendAndQuery(&storage);
+	storageClose(&storage);
+	result = result && reopen();
+	removeDirectory(directory);
+	return result && merging() && rollups();
+}
@@ -0,0 +1,78 @@
+#include "tests.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <template.h>
+#include <arena.h>
+#include <error.h>
+
+typedef struct {
+	const char* text;
+	type_t type;
+	int32_t integer;
+	double real;
+	const char* output;
+	const char* expected;
+} case_t;
+
+static const case_t cases[] = {
+	{"Value is %v.", INT, 42, 0, NULL, "Value is 42."},
+	{"%v", INT, INT32_MIN, 0, NULL, "-2147483648"},
+	{"%v/%v", INT, 100, 0, NULL, "100/100"},
+	{"%v", DOUBLE, 0, 3.14159265, NULL, "3.141593"},
+	{"%v", DOUBLE, 0, -0.25, NULL, "-0.25"},
+	{"%v", DOUBLE, 0, 1.9999999, NULL, "2"},
+	{"%v", DOUBLE, 0, -0.0000001, NULL, "0"},
+	{"%v", DOUBLE, 0, 1e20, NULL, "1e+20"},
+	{"%m (%v)", STRING, 0, 0, "eth0 down", "eth0 down (eth0 down)"},
+	{"100%% of %m", VOID, 0, 0, "disk", "100% of disk"},
+	{"%x %", VOID, 0, 0, NULL, "%x %"},
+	{"%m", VOID, 0, 0, NULL, ""}
+};
+
+bool template() {
+	arena_t arena;
+	if (arenaInit(&arena) < 0) {
+		printf("%s%sError: %s\n", SUBSPACING, SUBSPACING, error);
+		return false;
+	}
+	bool result = true;
+	char buffer[64];
+
+	printf("%sExpanding %zu templates.\n", SUBSPACING, sizeof(cases) / sizeof(case_t));
+	for (size_t i = 0; i < sizeof(cases) / sizeof(case_t) && result; i++) {
+		const case_t* test = &(cases[i]);
+		const char* compiled;
+		if (compileTemplate(test->text, strlen(test->text), &arena, &compiled) < 0 || compiled == NULL) {
+			printf("%s%sError: '%s' not compiled.\n", SUBSPACING, SUBSPACING, test->text);
+			result = false;
+			break;
+		}
+		const void* value = test->type == INT ? (const void*) &(test->integer)
+			: test->type == DOUBLE ? (const void*) &(test->real) : test->output;
+		size_t length = expandTemplate(compiled, buffer, sizeof(buffer), test->type, value, test->output);
+		if (length != strlen(test->expected) || strcmp(buffer, test->expected) != 0) {
+			printf("%s%sError: '%s' expanded to '%s' instead of '%s'.\n", SUBSPACING, SUBSPACING,
+				test->text, buffer, test->expected);
+			result = false;
+		}
+	}
+
+	printf("%sSharing programs and truncating.\n", SUBSPACING);
+	const char *plain, *first, *second;
+	if (result && (compileTemplate("plain text", 10, &arena, &plain) < 0 || plain != NULL
+			|| compileTemplate("%m and %m", 9, &arena, &first) < 0
+			|| compileTemplate("%m and %m", 9, &arena, &second) < 0 || first != second)) {
+		printf("%s%sError: programs not shared.\n", SUBSPACING, SUBSPACING);
+		result = false;
+	}
+	if (result && (expandTemplate(first, buffer, 8, VOID, NULL, "abcdef") != 7 || strcmp(buffer, "abcdef ") != 0)) {
+		printf("%s%sError: not truncated: '%s'.\n", SUBSPACING, SUBSPACING, buffer);
+		result = false;
+	}
+	arenaDestroy(&arena);
+	return result;
+}
@@ -7,5 +7,20 @@
 
 bool configParser(void);
 bool timer(void);
+bool packetQueue(void);
+bool runner(void);
+bool wire(void);
+bool slab(void);
+bool spool(void);
+bool loader(void);
+bool template(void);
+bool rules(void);
+bool batch(void);
+bool compress(void);
+bool storage(void);
+bool metrics(void);
+bool errors(void);
+bool clockSources(void);
+bool plugins(void);
 
 #endif
@@ -0,0 +1,235 @@
+#include "tests.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <wire.h>
+#include <packet.h>
+#include <registry.h>
+#include <error.h>
+
+#define ROUND_TRIPS 10000
+#define MUTATIONS 200000
+#define MAX_TEXT 64
+#define AGENTS 64
+
+static uint64_t state = 0x2545F4914F6CDD1Dull;
+
+static uint64_t nextRandom() {
+	state ^= state << 13;
+	state ^= state >> 7;
+	state ^= state << 17;
+	return state;
+}
+
+static void randomText(char* text, size_t max) {
+	size_t length = nextRandom() % max;
+	for (size_t i = 0; i < length; i++)
+		text[i] = 1 + nextRandom() % 255;
+	text[length] = '\0';
+}
+
+static const class_t classes[] = {META, INFO, WARNING, ALARM, ERROR, EMERGENCY};
+
+static agent_t agents[AGENTS];
+static uint32_t ids[AGENTS];
+static char names[AGENTS][MAX_TEXT + 8];
+
+// random names, kinds and types; the index keeps the names unique
+static bool registerAgents() {
+	for (int i = 0; i < AGENTS; i++) {
+		int length = snprintf(names[i], sizeof(names[i]), "%d:", i);
+		randomText(names[i] + length, MAX_TEXT - length);
+		memset(&(agents[i]), 0, sizeof(agent_t));
+		agents[i].name = names[i];
+		agents[i].data = nextRandom() % (PROPERTY + 1);
+		agents[i].type = i % (STRING + 1);
+		ids[i] = registerAgent(&(agents[i]));
+		if (ids[i] == NO_AGENT) {
+			printf("%s%sError: %s\n", SUBSPACING, SUBSPACING, error);
+			return false;
+		}
+	}
+	return true;
+}
+
+typedef struct {
+	agent_t* agent;
+	char message[MAX_TEXT + 1];
+	char string[MAX_TEXT + 1];
+	int integer;
+	double real;
+	packet_t packet;
+} sample_t;
+
+static void randomPacket(sample_t* sample) {
+	int index = nextRandom() % AGENTS;
+	sample->agent = &(agents[index]);
+
+	void* data = NULL;
+	switch (sample->agent->type) {
+		case INT:
+			sample->integer = (int) nextRandom();
+			data = &(sample->integer);
+			break;
+		case DOUBLE: {
+			uint64_t bits = nextRandom();
+			memcpy(&(sample->real), &bits, sizeof(double));
+			data = &(sample->real);
+			break;
+		}
+		case STRING:
+			randomText(sample->string, MAX_TEXT);
+			data = sample->string;
+			break;
+	}
+	const char* message = NULL;
+	if (nextRandom() % 2) {
+		randomText(sample->message, MAX_TEXT);
+		message = sample->message;
+	}
+	sample->packet = newPacket(ids[index], data, classes[nextRandom() % 6], message);
+	sample->packet.time = nextRandom() >> 16;
+}
+
+static size_t flatten(wireFrame_t* frame, char* buffer) {
+	size_t position = 0;
+	for (int i = 0; i < frame->count; i++) {
+		memcpy(buffer + position, frame->iov[i].iov_base, frame->iov[i].iov_len);
+		position += frame->iov[i].iov_len;
+	}
+	return position;
+}
+
+static bool equals(packet_t* a, wirePacket_t* decoded) {
+	packet_t* b = &(decoded->packet);
+	if (strcmp(getAgentName(a->agent), decoded->name) != 0)
+		return false;
+	if (a->data != b->data || a->type != b->type)
+		return false;
+	if (a->class != b->class || a->time != b->time || a->size != b->size)
+		return false;
+	if (a->size > 0 && memcmp(getPacketData(a), getPacketData(b), a->size) != 0)
+		return false;
+	if (a->messageLength != b->messageLength)
+		return false;
+	if (a->messageLength > 0 && strcmp(a->message, b->message) != 0)
+		return false;
+	return true;
+}
+
+static bool roundTrips() {
+	printf("%sRound trip of %d random packets.\n", SUBSPACING, ROUND_TRIPS);
+	static char buffer[WIRE_HEADER_SIZE + 4 * (MAX_TEXT + 1) + 16];
+	for (int i = 0; i < ROUND_TRIPS; i++) {
+		sample_t sample;
+		randomPacket(&sample);
+
+		wireFrame_t frame;
+		size_t length = wireEncode(&(sample.packet), &frame);
+		if (flatten(&frame, buffer) != length) {
+			printf("%s%sError: iovecs do not add up to the length.\n", SUBSPACING, SUBSPACING);
+			return false;
+		}
+
+		wirePacket_t decoded;
+		if (wireDecode(buffer, length - 1, &decoded) != 0) {
+			printf("%s%sError: truncated packet not detected.\n", SUBSPACING, SUBSPACING);
+			return false;
+		}
+		ssize_t tmp = wireDecode(buffer, length, &decoded);
+		if (tmp != (ssize_t) length) {
+			printf("%s%sError: decode failed (%s).\n", SUBSPACING, SUBSPACING, tmp < 0 ? error : "short");
+			return false;
+		}
+		if (!equals(&(sample.packet), &decoded)) {
+			printf("%s%sError: packet %d differs after round trip.\n", SUBSPACING, SUBSPACING, i);
+			return false;
+		}
+		destroyPacket(&(sample.packet));
+	}
+	return true;
+}
+
+static bool throughPipe() {
+	printf("%sWriting packets with writev.\n", SUBSPACING);
+	int fds[2];
+	if (pipe(fds) < 0) {
+		printf("%s%sError: pipe failed.\n", SUBSPACING, SUBSPACING);
+		return false;
+	}
+	sample_t sample;
+	randomPacket(&sample);
+	ssize_t written = wireWrite(fds[1], &(sample.packet));
+	static char buffer[WIRE_HEADER_SIZE + 4 * (MAX_TEXT + 1) + 16];
+	ssize_t n = read(fds[0], buffer, sizeof(buffer));
+	close(fds[0]);
+	close(fds[1]);
+
+	wirePacket_t decoded;
+	bool result = written > 0 && n == written && wireDecode(buffer, n, &decoded) == n
+		&& equals(&(sample.packet), &decoded);
+	destroyPacket(&(sample.packet));
+	if (!result)
+		printf("%s%sError: packet differs after writev.\n", SUBSPACING, SUBSPACING);
+	return result;
+}
+
+static bool mutations() {
+	printf("%sDecoding %d mutated buffers.\n", SUBSPACING, MUTATIONS);
+	static char buffer[WIRE_HEADER_SIZE + 4 * (MAX_TEXT + 1) + 16];
+	unsigned long accepted = 0;
+	for (int i = 0; i < MUTATIONS; i++) {
+		sample_t sample;
+		randomPacket(&sample);
+		wireFrame_t frame;
+		size_t length = wireEncode(&(sample.packet), &frame);
+		flatten(&frame, buffer);
+		destroyPacket(&(sample.packet));
+
+		switch (nextRandom() % 4) {
+			case 0: // flip bits
+				for (int j = 1 + nextRandom() % 4; j > 0; j--)
+					buffer[nextRandom() % length] ^= 1 << (nextRandom() % 8);
+				break;
+			case 1: // random bytes in the header
+				for (int j = 1 + nextRandom() % 4; j > 0; j--)
+					buffer[nextRandom() % WIRE_HEADER_SIZE] = nextRandom();
+				break;
+			case 2: // truncate
+				length = nextRandom() % length;
+				break;
+			case 3: // garbage
+				for (size_t j = 0; j < length; j++)
+					buffer[j] = nextRandom();
+				break;
+		}
+
+		wirePacket_t decoded;
+		ssize_t tmp = wireDecode(buffer, length, &decoded);
+		if (tmp > (ssize_t) length) {
+			printf("%s%sError: decoder consumed more than it got.\n", SUBSPACING, SUBSPACING);
+			return false;
+		}
+		if (tmp > 0) {
+			accepted++;
+			packet_t* packet = &(decoded.packet);
+			const char* end = buffer + tmp;
+			if (decoded.name < buffer || decoded.name + strlen(decoded.name) >= end
+					|| (packet->message != NULL && packet->message + strlen(packet->message) >= end)) {
+				printf("%s%sError: decoded string outside of the buffer.\n", SUBSPACING, SUBSPACING);
+				return false;
+			}
+		}
+	}
+	printf("%s%s%lu mutated buffers still decoded.\n", SUBSPACING, SUBSPACING, accepted);
+	return true;
+}
+
+bool wire() {
+	return registerAgents() && roundTrips() && throughPipe() && mutations();
+}